@@ -0,0 +1,85 @@
+#include "BarrierBatcher.h"
+
+void BarrierBatcher::Transition(ID3D12Resource* resource, D3D12_RESOURCE_STATES before,
+	D3D12_RESOURCE_STATES after, UINT subresource)
+{
+	if (before == after)
+		return;
+
+	for (auto it = mBarriers.begin(); it != mBarriers.end(); ++it)
+	{
+		if (it->Type != D3D12_RESOURCE_BARRIER_TYPE_TRANSITION ||
+			it->Flags != D3D12_RESOURCE_BARRIER_FLAG_NONE)
+			continue;
+
+		auto& t = it->Transition;
+		if (t.pResource != resource || t.Subresource != subresource || t.StateAfter != before)
+			continue;
+
+		// A -> B followed by B -> C is the same as A -> C.
+		if (t.StateBefore == after)
+			mBarriers.erase(it);
+		else
+			t.StateAfter = after;
+		return;
+	}
+
+	mBarriers.push_back(CD3DX12_RESOURCE_BARRIER::Transition(resource, before, after, subresource));
+}
+
+void BarrierBatcher::BeginTransition(ID3D12Resource* resource, D3D12_RESOURCE_STATES before,
+	D3D12_RESOURCE_STATES after, UINT subresource)
+{
+	mBarriers.push_back(CD3DX12_RESOURCE_BARRIER::Transition(resource, before, after, subresource,
+		D3D12_RESOURCE_BARRIER_FLAG_BEGIN_ONLY));
+}
+
+void BarrierBatcher::EndTransition(ID3D12Resource* resource, D3D12_RESOURCE_STATES before,
+	D3D12_RESOURCE_STATES after, UINT subresource)
+{
+	mBarriers.push_back(CD3DX12_RESOURCE_BARRIER::Transition(resource, before, after, subresource,
+		D3D12_RESOURCE_BARRIER_FLAG_END_ONLY));
+}
+
+void BarrierBatcher::Aliasing(ID3D12Resource* before, ID3D12Resource* after)
+{
+	mBarriers.push_back(CD3DX12_RESOURCE_BARRIER::Aliasing(before, after));
+}
+
+void BarrierBatcher::UAV(ID3D12Resource* resource)
+{
+	mBarriers.push_back(CD3DX12_RESOURCE_BARRIER::UAV(resource));
+}
+
+void BarrierBatcher::Flush(ID3D12GraphicsCommandList* cmdList)
+{
+	if (mBarriers.empty())
+		return;
+
+	cmdList->ResourceBarrier((UINT)mBarriers.size(), mBarriers.data());
+
+	mCallCount++;
+	mBarrierCount += (UINT)mBarriers.size();
+	mBarriers.clear();
+}
+
+bool BarrierBatcher::Empty()const
+{
+	return mBarriers.empty();
+}
+
+UINT BarrierBatcher::CallCount()const
+{
+	return mCallCount;
+}
+
+UINT BarrierBatcher::BarrierCount()const
+{
+	return mBarrierCount;
+}
+
+void BarrierBatcher::ResetCounters()
+{
+	mCallCount = 0;
+	mBarrierCount = 0;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+// Collects resource barriers and submits them with a single ResourceBarrier call.
+class BarrierBatcher
+{
+public:
+	BarrierBatcher() = default;
+	BarrierBatcher(const BarrierBatcher& rhs) = delete;
+	BarrierBatcher& operator=(const BarrierBatcher& rhs) = delete;
+	~BarrierBatcher() = default;
+
+	///<summary>
+	/// Queues a transition.  A transition that continues a pending one on the same
+	/// subresource is folded into it, and a pair that cancels out is dropped.
+	///</summary>
+	void Transition(ID3D12Resource* resource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after,
+		UINT subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES);
+
+	///<summary>
+	/// Split barrier halves.  The resource must not be used between the begin and
+	/// the end, which gives the driver that much work to hide the transition behind.
+	///</summary>
+	void BeginTransition(ID3D12Resource* resource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after,
+		UINT subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES);
+	void EndTransition(ID3D12Resource* resource, D3D12_RESOURCE_STATES before, D3D12_RESOURCE_STATES after,
+		UINT subresource = D3D12_RESOURCE_BARRIER_ALL_SUBRESOURCES);
+
+	void Aliasing(ID3D12Resource* before, ID3D12Resource* after);
+	void UAV(ID3D12Resource* resource);
+
+	// Records all pending barriers in one call.  Does nothing if none are pending.
+	void Flush(ID3D12GraphicsCommandList* cmdList);
+
+	bool Empty()const;
+
+	// Counters since the last ResetCounters(), used to show the cost per frame.
+	UINT CallCount()const;
+	UINT BarrierCount()const;
+	void ResetCounters();
+
+private:
+	std::vector<D3D12_RESOURCE_BARRIER> mBarriers;
+
+	UINT mCallCount = 0;
+	UINT mBarrierCount = 0;
+};
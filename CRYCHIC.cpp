@@ -27,6 +27,10 @@ CRYCHIC::CRYCHIC(HINSTANCE hInstance) : D3DApp(hInstance)
 {
 	mSceneBounds.Center = XMFLOAT3(0.0f, 0.0f, 0.0f);
 	mSceneBounds.Radius = sqrtf(30.0f * 30.0f + 45.0f * 45.0f);
+
+	// Deliver frames at a steady 60 Hz and simulate at the same rate.
+	mFramePacer.SetTargetFrameRate(60.0);
+	mFramePacer.SetFixedTimestep(1.0 / 60.0);
 }
 
 CRYCHIC::~CRYCHIC()
@@ -46,20 +50,46 @@ bool CRYCHIC::Initialize()
     mCamera.SetPosition(0.0f, 2.0f, -15.0f);
 
     mShadowMap = std::make_unique<ShadowMap>(md3dDevice.Get(),
-        4096, 4096);
+        ShadowAtlasBudget, 256);
+    mEvsmMap = std::make_unique<EvsmMap>(md3dDevice.Get(), mShadowMap->Width());
+    BuildSpotLights();
+
+    // Single pass cascades only pay off when the vertex shader can pick the viewport
+    // itself; where the driver emulates that with a geometry shader, draw per cascade.
+    D3D12_FEATURE_DATA_D3D12_OPTIONS options = {};
+    ThrowIfFailed(md3dDevice->CheckFeatureSupport(D3D12_FEATURE_D3D12_OPTIONS, &options, sizeof(options)));
+    mSinglePassCascadesSupported = options.VPAndRTArrayIndexFromAnyShaderFeedingRasterizerSupportedWithoutGSEmulation != FALSE;
+
+    if (!SetCascadeSettings(mCascadeSettings))
+    {
+        MessageBox(0, L"The shadow atlas cannot fit the shadow cascades.", 0, 0);
+        return false;
+    }
 
     mSsao = std::make_unique<Ssao>(
         md3dDevice.Get(),
         mCommandList.Get(),
         mClientWidth, mClientHeight);
 
+    mSampleDistribution = std::make_unique<SampleDistribution>(md3dDevice.Get(), gNumFrameResources);
+    mVirtualShadowMap = std::make_unique<VirtualShadowMap>(md3dDevice.Get(), gNumFrameResources);
+
     mDeferred = std::make_unique<DeferredShading>(
         md3dDevice.Get(),
-        mClientWidth, mClientHeight, DXGI_FORMAT_R32G32B32A32_FLOAT);
+        mClientWidth, mClientHeight);
+
+    mShaderPermutations = std::make_unique<ShaderPermutations>(md3dDevice.Get());
+
+    mRenderGraph = std::make_unique<RenderGraph>(md3dDevice.Get(), gNumFrameResources);
 
     LoadTextures();
+    LoadSkyAmbient();
     BuildRootSignature();
     BuildSsaoRootSignature();
+    BuildSsaoComputeRootSignature();
+    BuildShadowCacheRootSignature();
+    BuildDepthReduceRootSignature();
+    BuildEvsmRootSignature();
     BuildDescriptorHeaps();
     BuildShadersAndInputLayout();
     BuildShapeGeometry();
@@ -69,10 +99,13 @@ bool CRYCHIC::Initialize()
     BuildRenderItemsWithShadow();*/
     BuildCascadeShadowRenderItems();
     BuildCascadeShadowRenderItemsWithShadow();
+    AssignInstanceIds();
     BuildFrameResources();
     BuildPSOs();
 
     mSsao->SetPSOs(mPSOs["ssao"].Get(), mPSOs["ssaoBlur"].Get());
+    mSsao->SetComputePSOs(mPSOs["ssaoBlurCompute"].Get(), mPSOs["ssaoTemporal"].Get());
+    mEvsmMap->SetPSOs(mPSOs["evsmConvert"].Get(), mPSOs["evsmBlurHorz"].Get(), mPSOs["evsmBlurVert"].Get());
 
     // Execute the initialization commands.
     ThrowIfFailed(mCommandList->Close());
@@ -88,18 +121,19 @@ bool CRYCHIC::Initialize()
 void CRYCHIC::CreateRtvAndDsvDescriptorHeaps()
 {
     // Add +1 for screen normal map, +2 for ambient maps. ssao
-    // Add +4 for GBuffer. deferred shading
+    // Add +GBufferCount for GBuffer. deferred shading
     D3D12_DESCRIPTOR_HEAP_DESC rtvHeapDesc;
-    rtvHeapDesc.NumDescriptors = SwapChainBufferCount + 3 + 4;
+    rtvHeapDesc.NumDescriptors = SwapChainBufferCount + 3 + DeferredShading::GBufferCount + 2;
     rtvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_RTV;
     rtvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
     rtvHeapDesc.NodeMask = 0;
     ThrowIfFailed(md3dDevice->CreateDescriptorHeap(
         &rtvHeapDesc, IID_PPV_ARGS(mRtvHeap.GetAddressOf())));
 
-    // Add +1 DSV for shadow map.
+    // Add +2 DSV for the shadow atlas and its static caster cache.
+    // Add +1 DSV for the read-only view of the depth buffer.
     D3D12_DESCRIPTOR_HEAP_DESC dsvHeapDesc;
-    dsvHeapDesc.NumDescriptors = 1 + 12;
+    dsvHeapDesc.NumDescriptors = 1 + 2 + 1;
     dsvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_DSV;
     dsvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_NONE;
     dsvHeapDesc.NodeMask = 0;
@@ -111,8 +145,23 @@ void CRYCHIC::OnResize()
 {
     D3DApp::OnResize();
 
+    // The deferred lighting pass tests against the depth the geometry pass wrote while it
+    // samples the same depth to rebuild positions, which needs a read-only view.
+    D3D12_DEPTH_STENCIL_VIEW_DESC readOnlyDsvDesc;
+    readOnlyDsvDesc.Flags = D3D12_DSV_FLAG_READ_ONLY_DEPTH | D3D12_DSV_FLAG_READ_ONLY_STENCIL;
+    readOnlyDsvDesc.ViewDimension = D3D12_DSV_DIMENSION_TEXTURE2D;
+    readOnlyDsvDesc.Format = mDepthStencilFormat;
+    readOnlyDsvDesc.Texture2D.MipSlice = 0;
+    md3dDevice->CreateDepthStencilView(mDepthStencilBuffer.Get(), &readOnlyDsvDesc, GetDsv(3));
+
     mCamera.SetLens(0.25f * MathHelper::Pi, AspectRatio(), 1.0f, 100.0f);
     BoundingFrustum::CreateFromMatrix(mCamFrustum, mCamera.GetProj());
+    // The G-buffer and the SSAO normal map are the render graph's, which replaces them
+    // at their new size when it next executes.
+    if (mDeferred != nullptr)
+    {
+        mDeferred->OnResize(mClientWidth, mClientHeight);
+    }
     if (mSsao != nullptr)
     {
         mSsao->OnResize(mClientWidth, mClientHeight);
@@ -120,10 +169,9 @@ void CRYCHIC::OnResize()
         // Resources changed, so need to rebuild descriptors.
         mSsao->RebuildDescriptors(mDepthStencilBuffer.Get());
     }
-    if (mDeferred != nullptr)
+    if (mSampleDistribution != nullptr)
     {
-        mDeferred->OnResize(mClientWidth, mClientHeight);
-        mDeferred->BuildDescriptors();
+        mSampleDistribution->RebuildDescriptors(mDepthStencilBuffer.Get());
     }
 }
 
@@ -149,9 +197,12 @@ void CRYCHIC::Update(const GameTimer& gt)
     // Animate the lights (and hence shadows).
     //
 
-    mLightRotationAngle += 0.0f * gt.DeltaTime();
+    // The rotation itself is simulated in FixedUpdate; blend the last two steps so
+    // the shadows move smoothly at any frame rate.
+    float lightAngle = MathHelper::Lerp(mPrevLightRotationAngle, mLightRotationAngle,
+        mFramePacer.InterpolationAlpha());
 
-    XMMATRIX R = XMMatrixRotationY(mLightRotationAngle);
+    XMMATRIX R = XMMatrixRotationY(lightAngle);
     for (int i = 0; i < 3; ++i)
     {
         XMVECTOR lightDir = XMLoadFloat3(&mBaseLightDirections[i]);
@@ -159,280 +210,650 @@ void CRYCHIC::Update(const GameTimer& gt)
         XMStoreFloat3(&mRotatedLightDirections[i], lightDir);
     }
 
+    // Edits pushed by other threads since the last frame.
+    ApplySceneEdits();
+
     AnimateMaterials(gt);
     //UpdateObjectCBs(gt);
     UpdateInstanceData(gt);
+    UpdateBundles();
     UpdateMaterialBuffer(gt);
+    UpdateSampleBounds();
     UpdateCascadeShadowTransform(gt);
+    UpdateCascadeMasks();
+    UpdateVirtualShadowPages();
+    UpdateLightShadows();
+    UpdateClusteredLights();
+    UpdateFrameCB(gt);
     UpdateMainPassCB(gt);
     UpdateShadowPassCB(gt);
     UpdateSsaoCB(gt);
+    UpdateDepthReduceCB(gt);
 }
 
-void CRYCHIC::Draw(const GameTimer& gt)
+void CRYCHIC::FixedUpdate(float dt)
 {
-    if (isDeferred)
+    mPrevLightRotationAngle = mLightRotationAngle;
+    mLightRotationAngle += 0.0f * dt;
+}
+
+SceneEditQueue& CRYCHIC::SceneEdits()
+{
+    return mSceneEdits;
+}
+
+UINT CRYCHIC::InstanceId(UINT itemIndex, UINT instanceIndex)const
+{
+    return mFirstInstanceIds[itemIndex] + instanceIndex;
+}
+
+const CascadeSettings& CRYCHIC::GetCascadeSettings()const
+{
+    return mCascadeSettings;
+}
+
+bool CRYCHIC::SetCascadeSettings(const CascadeSettings& settings)
+{
+    assert(settings.Count >= 1 && settings.Count <= MaxShadowCascades);
+
+    // Frames in flight keep the transforms they were built with, so the atlas can be
+    // re-carved at any time.  Cascades that do not fit give way to the old ones again.
+    bool fits = CarveShadowAtlas(settings);
+    if (fits)
+    {
+        mCascadeSettings = settings;
+        mCascadeSettings.SinglePass = settings.SinglePass && mSinglePassCascadesSupported;
+
+        // The EVSM targets are made the first time that filter is picked, and kept.
+        // Frames in flight filtered with PCF, so they never read the new views.
+        if (mCascadeSettings.Filter == ShadowFilter::Evsm)
+            mEvsmMap->Create();
+    }
+    else
+    {
+        CarveShadowAtlas(mCascadeSettings);
+    }
+
+    // The lights' tiles went with the cleared atlas; they get new ones from what the
+    // cascades left on the next schedule.
+    mShadowScheduler.Reset();
+
+    // Tiles may have moved, so no cached cascade can be sampled until it is re-rendered.
+    for (auto& cache : mCascadeCaches)
+        cache.Valid = false;
+    mEvsmStale = true;
+    return fits;
+}
+
+bool CRYCHIC::CarveShadowAtlas(const CascadeSettings& settings)
+{
+    // Biggest tiles go first so the buddy allocator packs them.
+    UINT order[MaxShadowCascades];
+    for (UINT i = 0; i < settings.Count; ++i)
+        order[i] = i;
+    std::sort(order, order + settings.Count, [&settings](UINT a, UINT b)
     {
-        auto cmdListAlloc = mCurrFrameResource->CmdListAlloc;
+        return settings.Resolution[a] > settings.Resolution[b];
+    });
 
-        // Reuse the memory associated with command recording.
-        // We can only reset when the associated command lists have finished execution on the GPU.
-        ThrowIfFailed(cmdListAlloc->Reset());
+    // A tight budget hands back smaller tiles rather than failing; allocation only
+    // fails once not even the smallest tile is left.
+    mShadowMap->ClearTiles();
+    if (settings.Virtual)
+    {
+        // The page pool takes the cascades' place in the atlas.
+        for (auto& tile : mCascadeTiles)
+            tile = ShadowAtlasTile();
+        if (!mShadowMap->AllocateTile(settings.VirtualPoolSize, mVirtualPoolTile))
+            return false;
+        mVirtualPages.Reset(mVirtualPoolTile.Size / VirtualShadowPages::PageSize);
+    }
+    else
+    {
+        for (UINT k = 0; k < settings.Count; ++k)
+        {
+            UINT i = order[k];
+            if (!mShadowMap->AllocateTile(settings.Resolution[i], mCascadeTiles[i]))
+                return false;
+        }
+        mVirtualPoolTile = ShadowAtlasTile();
+        mVirtualPages.Reset(0);
+    }
+    return true;
+}
 
-        // A command list can be reset after it has been added to the command queue via ExecuteCommandList.
-        // Reusing the command list reuses memory.
-        ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), mPSOs["opaque"].Get()));
+const SsaoSettings& CRYCHIC::GetSsaoSettings()const
+{
+    return mSsaoSettings;
+}
 
-        ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
-        mCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
+void CRYCHIC::SetSsaoSettings(const SsaoSettings& settings)
+{
+    assert(settings.BlurCount >= 0);
+    assert(settings.TemporalSampleCount >= 1 && settings.TemporalSampleCount <= 14);
+    mSsaoSettings = settings;
+}
 
-        mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+const std::vector<Light>& CRYCHIC::GetPointLights()const
+{
+    return mPointLights;
+}
 
-        //
-        // Shadow map pass.
-        //
+void CRYCHIC::SetPointLights(const std::vector<Light>& lights)
+{
+    mPointLights = lights;
+}
 
-        // Bind all the materials used in this scene.  For structured buffers, we can bypass the heap and 
-        // set as a root descriptor.
-        auto matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
-        mCommandList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
+void CRYCHIC::InvalidateShadowCaches(const RenderItem* ri, const XMFLOAT4X4& world)
+{
+    // Dynamic casters are drawn every frame anyway.
+    const auto& casters = mRitemLayer[(int)RenderLayer::OpaqueShadow];
+    if (ri->DynamicCaster || std::find(casters.begin(), casters.end(), ri) == casters.end())
+        return;
 
-        // Bind null SRV for shadow map pass.
-        mCommandList->SetGraphicsRootDescriptorTable(3, mNullSrv);
+    BoundingBox worldBounds;
+    ri->Bounds.Transform(worldBounds, XMLoadFloat4x4(&world));
+    mShadowScheduler.Invalidate(worldBounds);
 
-        // Bind all the textures used in this scene.  Observe
-        // that we only have to specify the first descriptor in the table.  
-        // The root signature knows how many descriptors are expected in the table.
-        mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+    BoundingBox virtualBounds;
+    worldBounds.Transform(virtualBounds, XMLoadFloat4x4(&mVirtualLightView));
+    mVirtualPages.Invalidate(virtualBounds);
 
-        DrawSceneToShadowMap();
+    for (UINT i = 0; i < CascadeCount(); ++i)
+    {
+        // Bring the caster into the light view space the cascade was rendered in.
+        XMMATRIX toLight = XMMatrixMultiply(XMLoadFloat4x4(&world), XMLoadFloat4x4(&mLightViews[i]));
+        BoundingBox lightSpaceBounds;
+        ri->Bounds.Transform(lightSpaceBounds, toLight);
+        if (mCascadeBounds[i].Intersects(lightSpaceBounds))
+            mCascadeCaches[i].Dirty = true;
+    }
+}
 
-        //
-        // Normal/depth pass.
-        //
+void CRYCHIC::ApplySceneEdits()
+{
+    mDrainedEdits.clear();
+    mSceneEdits.Drain(mDrainedEdits, MaxSceneEditsPerFrame);
 
-        DrawNormalsAndDepth();
+    for (const auto& edit : mDrainedEdits)
+    {
+        if (edit.Type == SceneEditType::SetMaterial)
+        {
+            for (auto& e : mMaterials)
+            {
+                Material* mat = e.second.get();
+                if (mat->MatCBIndex != (int)edit.MaterialIndex)
+                    continue;
+
+                mat->DiffuseAlbedo = edit.DiffuseAlbedo;
+                mat->FresnelR0 = edit.FresnelR0;
+                mat->Roughness = edit.Roughness;
+                mat->NumFramesDirty = gNumFrameResources;
+            }
+            continue;
+        }
 
-        //
-        // Compute SSAO.
-        // 
+        // Producers cannot see the scene, so edits naming something that does not
+        // exist (e.g. an instance removed meanwhile) are dropped.
+        if (edit.ItemIndex >= mAllRitems.size())
+            continue;
+        RenderItem* ri = mAllRitems[edit.ItemIndex].get();
+        auto& instances = ri->Instances;
+        bool inScene = edit.ItemIndex < mSceneItemCount;
+        auto slot = ri->InstanceSlots.find(edit.InstanceId);
+        bool found = slot != ri->InstanceSlots.end();
+
+        switch (edit.Type)
+        {
+        case SceneEditType::SetInstanceTransform:
+            if (found)
+            {
+                // The caster leaves one spot and shows up in another.
+                InvalidateShadowCaches(ri, instances[slot->second].World);
+                instances[slot->second].World = edit.World;
+                InvalidateShadowCaches(ri, edit.World);
+            }
+            break;
 
-        mCommandList->SetGraphicsRootSignature(mSsaoRootSignature.Get());
-        mSsao->ComputeSsao(mCommandList.Get(), mCurrFrameResource, 3);
+        case SceneEditType::SetInstanceMaterial:
+            if (found && edit.MaterialIndex < mMaterials.size())
+                instances[slot->second].MaterialIndex = edit.MaterialIndex;
+            break;
 
-        //
-        // Main rendering pass.
-        //
+        case SceneEditType::SpawnInstance:
+        {
+            if (edit.MaterialIndex >= mMaterials.size())
+                break;
+
+            InstanceData data;
+            data.World = edit.World;
+            data.TexTransform = edit.TexTransform;
+            data.MaterialIndex = edit.MaterialIndex;
+            instances.push_back(data);
+            ri->InstanceIds.push_back(edit.InstanceId);
+            ri->InstanceSlots[edit.InstanceId] = (UINT)instances.size() - 1;
+            InvalidateShadowCaches(ri, data.World);
+
+            // Instance buffers grow geometrically; UpdateInstanceData reallocates
+            // each frame resource's buffer when it comes around.
+            if (instances.size() > (size_t)mInstanceCounts[ri->itemIndex])
+                mInstanceCounts[ri->itemIndex] = (int)std::max<size_t>(instances.size(), 2 * mInstanceCounts[ri->itemIndex]);
+
+            if (inScene)
+                mSceneInstancesCount++;
+            break;
+        }
 
-        mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+        case SceneEditType::RemoveInstance:
+            if (found)
+            {
+                // Instances are unordered, so the last one fills the gap and its id
+                // follows it there.
+                UINT index = slot->second;
+                InvalidateShadowCaches(ri, instances[index].World);
+                instances[index] = instances.back();
+                ri->InstanceIds[index] = ri->InstanceIds.back();
+                ri->InstanceSlots[ri->InstanceIds[index]] = index;
+                ri->InstanceSlots.erase(edit.InstanceId);
+                instances.pop_back();
+                ri->InstanceIds.pop_back();
+
+                if (inScene)
+                    mSceneInstancesCount--;
+            }
+            break;
 
-        // Rebind state whenever graphics root signature changes.
+        default:
+            break;
+        }
+    }
+}
 
-        // Bind all the materials used in this scene.  For structured buffers, we can bypass the heap and 
-        // set as a root descriptor.
-        matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
-        mCommandList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
-        mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
-        DrawGBuffer();
-
-        mCommandList->SetPipelineState(mPSOs["deferredShading"].Get());
-        mCommandList->RSSetViewports(1, &mScreenViewport);
-        mCommandList->RSSetScissorRects(1, &mScissorRect);
-        
-        // Indicate a state transition on the resource usage.
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
-            D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_RENDER_TARGET));
+void CRYCHIC::AssignInstanceIds()
+{
+    mFirstInstanceIds.resize(mAllRitems.size());
+    for (UINT i = 0; i < (UINT)mAllRitems.size(); ++i)
+    {
+        RenderItem* ri = mAllRitems[i].get();
+        UINT count = (UINT)ri->Instances.size();
+        mFirstInstanceIds[i] = mSceneEdits.ReserveInstanceIds(count);
 
-        // Clear the back buffer.
-        mCommandList->ClearRenderTargetView(CurrentBackBufferView(), Colors::LightSteelBlue, 0, nullptr);
-        mCommandList->ClearDepthStencilView(DepthStencilView(), D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 0, nullptr);
-        // WE ALREADY WROTE THE DEPTH INFO TO THE DEPTH BUFFER IN DrawNormalsAndDepth,
-        // SO DO NOT CLEAR DEPTH.
+        ri->InstanceIds.resize(count);
+        ri->InstanceSlots.clear();
+        for (UINT j = 0; j < count; ++j)
+        {
+            ri->InstanceIds[j] = mFirstInstanceIds[i] + j;
+            ri->InstanceSlots[ri->InstanceIds[j]] = j;
+        }
+    }
+}
 
-        // Specify the buffers we are going to render to.
-        mCommandList->OMSetRenderTargets(1, &CurrentBackBufferView(), true, &DepthStencilView());
+void CRYCHIC::Draw(const GameTimer& gt)
+{
+    auto cmdListAlloc = mCurrFrameResource->CmdListAlloc;
 
-        // Bind all the textures used in this scene.  Observe
-        // that we only have to specify the first descriptor in the table.  
-        // The root signature knows how many descriptors are expected in the table.
-        mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+    // Reuse the memory associated with command recording.
+    // We can only reset when the associated command lists have finished execution on the GPU.
+    ThrowIfFailed(cmdListAlloc->Reset());
 
-        auto passCB = mCurrFrameResource->PassCB->Resource();
-        mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress());
+    // A command list can be reset after it has been added to the command queue via ExecuteCommandList.
+    // Reusing the command list reuses memory.
+    ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), mPSOs["opaque"].Get()));
 
-        // Bind the sky cube map.  For our demos, we just use one "world" cube map representing the environment
-        // from far away, so all objects will use the same cube map and we only need to set it once per-frame.  
-        // If we wanted to use "local" cube maps, we would have to change them per-object, or dynamically
-        // index into an array of cube maps.
+    ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
+    mCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
 
-        CD3DX12_GPU_DESCRIPTOR_HANDLE skyTexDescriptor(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
-        skyTexDescriptor.Offset(mSkyTexHeapIndex, mCbvSrvUavDescriptorSize);
-        mCommandList->SetGraphicsRootDescriptorTable(3, skyTexDescriptor);
+    mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+
+    // Bind all the materials used in this scene.  For structured buffers, we can bypass the heap and
+    // set as a root descriptor.
+    auto matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
+    mCommandList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootShaderResourceView(6, mCurrFrameResource->VirtualPageTable->Resource()->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootConstantBufferView(10, mCurrFrameResource->FrameCB->Resource()->GetGPUVirtualAddress());
+
+    // Bind null SRV for shadow map pass.
+    mCommandList->SetGraphicsRootDescriptorTable(3, mNullSrv);
+
+    // Bind all the textures used in this scene.  Observe
+    // that we only have to specify the first descriptor in the table.
+    // The root signature knows how many descriptors are expected in the table.
+    mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+
+    // The render graph records every pass and the resource transitions between them.
+    BuildRenderGraph();
+    mRenderGraph->Execute(mCommandList.Get());
+
+    // Done recording commands.
+    ThrowIfFailed(mCommandList->Close());
+
+    // Add the command list to the queue for execution.
+    ID3D12CommandList* cmdsLists[] = { mCommandList.Get() };
+    mCommandQueue->ExecuteCommandLists(_countof(cmdsLists), cmdsLists);
 
-        //mCommandList->SetPipelineState(mPSOs["opaque"].Get());
-        DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
+    // Swap the back and front buffers
+    UINT presentFlags = m_tearingSupport ? DXGI_PRESENT_ALLOW_TEARING : 0;
 
-        /*mCommandList->SetPipelineState(mPSOs["debug"].Get());
-        DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Debug]);*/
+    ThrowIfFailed(mSwapChain->Present(0, presentFlags));
+    mCurrBackBuffer = (mCurrBackBuffer + 1) % SwapChainBufferCount;
 
-        mCommandList->SetPipelineState(mPSOs["sky"].Get());
-        DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Sky]);
+    // Advance the fence value to mark commands up to this fence point.
+    mCurrFrameResource->Fence = ++mCurrentFence;
 
-        // Indicate a state transition on the resource usage.
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
-            D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT));
+    // Add an instruction to the command queue to set a new fence point.
+    // Because we are on the GPU timeline, the new fence point won't be
+    // set until the GPU finishes processing all the commands prior to this Signal().
+    mCommandQueue->Signal(mFence.Get(), mCurrentFence);
+}
+
+void CRYCHIC::BuildRenderGraph()
+{
+    RenderGraph& graph = *mRenderGraph;
+    graph.Reset();
+
+    //
+    // Resources owned outside of the graph, with the state they are in between frames.
+    //
 
-        // Done recording commands.
-        ThrowIfFailed(mCommandList->Close());
+    RGResourceHandle backBuffer = graph.ImportResource("backBuffer", CurrentBackBuffer(),
+        D3D12_RESOURCE_STATE_PRESENT);
+    graph.MarkOutput(backBuffer);
 
-        // Add the command list to the queue for execution.
-        ID3D12CommandList* cmdsLists[] = { mCommandList.Get() };
-        mCommandQueue->ExecuteCommandLists(_countof(cmdsLists), cmdsLists);
+    RGResourceHandle depthBuffer = graph.ImportResource("depthBuffer", mDepthStencilBuffer.Get(),
+        D3D12_RESOURCE_STATE_DEPTH_WRITE);
 
-        // Swap the back and front buffers
+    RGResourceHandle shadowAtlas = graph.ImportResource("shadowAtlas", mShadowMap->Resource(),
+        D3D12_RESOURCE_STATE_GENERIC_READ);
 
-        UINT presentFlags = m_tearingSupport ? DXGI_PRESENT_ALLOW_TEARING : 0;
+    RGResourceHandle shadowCache = graph.ImportResource("shadowCache", mShadowMap->CacheResource(),
+        D3D12_RESOURCE_STATE_GENERIC_READ);
+
+    // EvsmMap blurs through its own temp map and hands the moments back in GENERIC_READ.
+    // Its targets only exist once the filter has been picked.
+    bool useEvsm = mCascadeSettings.Filter == ShadowFilter::Evsm;
+    RGResourceHandle evsmMap = RGInvalidHandle;
+    if (useEvsm)
+    {
+        evsmMap = graph.ImportResource("evsmMap", mEvsmMap->Resource(),
+            D3D12_RESOURCE_STATE_GENERIC_READ);
+    }
 
-        ThrowIfFailed(mSwapChain->Present(0, presentFlags));
-        mCurrBackBuffer = (mCurrBackBuffer + 1) % SwapChainBufferCount;
+    // Ssao ping-pongs its ambient maps internally and always hands them back in GENERIC_READ,
+    // so the graph only sees the final ambient map.
+    RGResourceHandle ambientMap = graph.ImportResource("ssaoAmbientMap", mSsao->AmbientMap(),
+        D3D12_RESOURCE_STATE_GENERIC_READ);
 
-        // Advance the fence value to mark commands up to this fence point.
-        mCurrFrameResource->Fence = ++mCurrentFence;
+    //
+    // Targets that only live within the frame, placed by the graph in its transient heap.
+    // Only the path in use gets memory, and targets of passes that never overlap share it.
+    // The owners get the placed textures, and rebuild their views, whenever the graph
+    // creates them.
+    //
 
-        // Add an instruction to the command queue to set a new fence point. 
-        // Because we are on the GPU timeline, the new fence point won't be 
-        // set until the GPU finishes processing all the commands prior to this Signal().
-        mCommandQueue->Signal(mFence.Get(), mCurrentFence);
+    RGResourceHandle gBuffer[DeferredShading::GBufferCount];
+    RGResourceHandle normalMap = RGInvalidHandle;
+    if (isDeferred)
+    {
+        for (int i = 0; i < DeferredShading::GBufferCount; ++i)
+        {
+            RGTextureDesc desc;
+            desc.Width = mDeferred->Width();
+            desc.Height = mDeferred->Height();
+            desc.Format = DeferredShading::Format(i);
+            desc.ClearValue = DeferredShading::ClearValue(i);
+            gBuffer[i] = graph.CreateTexture("gBuffer" + std::to_string(i), desc, [this, i](ID3D12Resource* resource)
+            {
+                mDeferred->SetResource(i, resource);
+                if (i == 1)
+                {
+                    mSsao->SetNormalMap(resource, DeferredShading::Format(1), true);
+                    mSsao->RebuildDescriptors(mDepthStencilBuffer.Get());
+                }
+            });
+        }
     }
     else
     {
-        auto cmdListAlloc = mCurrFrameResource->CmdListAlloc;
+        RGTextureDesc desc;
+        desc.Width = mClientWidth;
+        desc.Height = mClientHeight;
+        desc.Format = Ssao::NormalMapFormat;
+        float normalClearColor[] = { 0.0f, 0.0f, 1.0f, 0.0f };
+        desc.ClearValue = CD3DX12_CLEAR_VALUE(Ssao::NormalMapFormat, normalClearColor);
+        normalMap = graph.CreateTexture("ssaoNormalMap", desc, [this](ID3D12Resource* resource)
+        {
+            mSsao->SetNormalMap(resource, Ssao::NormalMapFormat, false);
+            mSsao->RebuildDescriptors(mDepthStencilBuffer.Get());
+        });
+    }
 
-        // Reuse the memory associated with command recording.
-        // We can only reset when the associated command lists have finished execution on the GPU.
-        ThrowIfFailed(cmdListAlloc->Reset());
+    //
+    // Shadow map pass.
+    //
 
-        // A command list can be reset after it has been added to the command queue via ExecuteCommandList.
-        // Reusing the command list reuses memory.
-        ThrowIfFailed(mCommandList->Reset(cmdListAlloc.Get(), mPSOs["opaque"].Get()));
+    bool refreshCache = false;
+    for (UINT i = 0; i < CascadeCount(); ++i)
+        refreshCache = refreshCache || mCascadeCaches[i].Refresh;
 
-        ID3D12DescriptorHeap* descriptorHeaps[] = { mSrvDescriptorHeap.Get() };
-        mCommandList->SetDescriptorHeaps(_countof(descriptorHeaps), descriptorHeaps);
+    // Spot lights draw all their casters into the cache, so the blit below carries them
+    // into the atlas along with the cascades.
+    bool refreshLights = mShadowScheduler.RefreshCount() > 0;
+    // So do the virtual shadow map pages.
+    bool refreshPages = mCascadeSettings.Virtual && !mVirtualPages.PagesToRender().empty();
 
-        mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+    if (refreshCache || refreshLights || refreshPages)
+    {
+        graph.AddPass("shadowCache", [this, refreshCache, refreshLights, refreshPages](ID3D12GraphicsCommandList* cmdList)
+        {
+            if (refreshCache)
+                DrawStaticCastersToShadowCache();
+            if (refreshLights)
+                DrawLightShadowsToCache();
+            if (refreshPages)
+                DrawVirtualPagesToCache();
+        })
+            .Write(shadowCache, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+    }
 
-        //
-        // Shadow map pass.
-        //
+    // The atlas keeps its contents between frames, so it only needs rebuilding when a
+    // cache was refreshed or dynamic casters were or are drawn over it.
+    bool rebuildAtlas = refreshCache || refreshLights || refreshPages ||
+        !mDynamicCasters.empty() || mAtlasHasDynamicCasters;
+    if (rebuildAtlas)
+    {
+        graph.AddPass("shadowMap", [this](ID3D12GraphicsCommandList* cmdList)
+        {
+            DrawSceneToShadowMap();
+        })
+            .Read(shadowCache, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+            .Write(shadowAtlas, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+        mAtlasHasDynamicCasters = !mDynamicCasters.empty();
+    }
 
-        // Bind all the materials used in this scene.  For structured buffers, we can bypass the heap and 
-        // set as a root descriptor.
-        auto matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
-        mCommandList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
+    // The moments follow the atlas, so they are only prefiltered when it changed.
+    if (useEvsm && (rebuildAtlas || mEvsmStale))
+    {
+        graph.AddPass("evsmPrefilter", [this](ID3D12GraphicsCommandList* cmdList)
+        {
+            PrefilterEvsm();
+        })
+            .Read(shadowAtlas, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+            .Write(evsmMap, D3D12_RESOURCE_STATE_GENERIC_READ);
+        mEvsmStale = false;
+    }
+    else if (!useEvsm)
+    {
+        mEvsmStale = true;
+    }
+
+    //
+    // Geometry pass: the G-buffer in the deferred path, normals and depth in the forward one.
+    // Either is the only pass that clears depth, and SSAO reads its normals.
+    //
+
+    if (isDeferred)
+    {
+        auto gBufferPass = graph.AddPass("gBuffer", [this](ID3D12GraphicsCommandList* cmdList)
+        {
+            DrawGBuffer();
+        });
+        for (int i = 0; i < DeferredShading::GBufferCount; ++i)
+            gBufferPass.Write(gBuffer[i], D3D12_RESOURCE_STATE_RENDER_TARGET);
+        gBufferPass.Write(depthBuffer, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+    }
+    else
+    {
+        graph.AddPass("normalsAndDepth", [this](ID3D12GraphicsCommandList* cmdList)
+        {
+            DrawNormalsAndDepth();
+        })
+            .Write(normalMap, D3D12_RESOURCE_STATE_RENDER_TARGET)
+            .Write(depthBuffer, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+    }
+    RGResourceHandle ssaoNormals = isDeferred ? gBuffer[1] : normalMap;
+
+    // Both the reduction and SSAO read the depth buffer, so one state serves them both.
+    const D3D12_RESOURCE_STATES depthReadState =
+        D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE | D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE;
 
-        // Bind null SRV for shadow map pass.
-        mCommandList->SetGraphicsRootDescriptorTable(3, mNullSrv);
+    //
+    // Depth reduction for fitting the cascades to the visible samples.
+    //
 
-        // Bind all the textures used in this scene.  Observe
-        // that we only have to specify the first descriptor in the table.  
-        // The root signature knows how many descriptors are expected in the table.
-        mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+    if (mCascadeSettings.FitToSamples)
+    {
+        // The result goes to a readback buffer outside the graph, so keep the pass alive.
+        graph.AddPass("depthReduce", [this](ID3D12GraphicsCommandList* cmdList)
+        {
+            ReduceDepth();
+        })
+            .Read(depthBuffer, depthReadState)
+            .SideEffect();
+    }
 
-        DrawSceneToShadowMap();
+    //
+    // Page requests of the virtual shadow map.
+    //
 
-        //
-        // Normal/depth pass.
-        //
+    if (mCascadeSettings.Virtual)
+    {
+        // The requests go to a readback buffer outside the graph, so keep the pass alive.
+        graph.AddPass("virtualShadowMark", [this](ID3D12GraphicsCommandList* cmdList)
+        {
+            MarkVirtualShadowPages();
+        })
+            .Read(depthBuffer, depthReadState)
+            .SideEffect();
+    }
 
-        DrawNormalsAndDepth();
+    //
+    // Compute SSAO.
+    //
 
-        //
-        // Compute SSAO.
-        // 
+    graph.AddPass("ssao", [this](ID3D12GraphicsCommandList* cmdList)
+    {
+        if (mSsaoSettings.Compute)
+        {
+            auto aoPso = mSsaoSettings.GroundTruth ?
+                mPSOs["gtao" + std::to_string((int)mSsaoSettings.Tier)].Get() : mPSOs["ssaoCompute"].Get();
 
-        mCommandList->SetGraphicsRootSignature(mSsaoRootSignature.Get());
-        mSsao->ComputeSsao(mCommandList.Get(), mCurrFrameResource, 3);
+            cmdList->SetComputeRootSignature(mSsaoComputeRootSignature.Get());
+            mSsao->DispatchSsao(cmdList, mCurrFrameResource, aoPso, mSsaoSettings.BlurCount, mSsaoSettings.Temporal);
 
-        //
-        // Main rendering pass.
-        //
+            // The graphics root signature and its bindings are left alone.
+            return;
+        }
 
-        mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+        cmdList->SetGraphicsRootSignature(mSsaoRootSignature.Get());
+        mSsao->ComputeSsao(cmdList, mCurrFrameResource, mSsaoSettings.BlurCount);
 
         // Rebind state whenever graphics root signature changes.
+        cmdList->SetGraphicsRootSignature(mRootSignature.Get());
 
-        // Bind all the materials used in this scene.  For structured buffers, we can bypass the heap and 
+        // Bind all the materials used in this scene.  For structured buffers, we can bypass the heap and
         // set as a root descriptor.
-        matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
-        mCommandList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
-
+        auto matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
+        cmdList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
+        cmdList->SetGraphicsRootShaderResourceView(6, mCurrFrameResource->VirtualPageTable->Resource()->GetGPUVirtualAddress());
+        cmdList->SetGraphicsRootConstantBufferView(10, mCurrFrameResource->FrameCB->Resource()->GetGPUVirtualAddress());
+        cmdList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+    })
+        .Read(ssaoNormals, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE | D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE)
+        .Read(depthBuffer, depthReadState)
+        .Write(ambientMap, D3D12_RESOURCE_STATE_GENERIC_READ);
 
-        mCommandList->RSSetViewports(1, &mScreenViewport);
-        mCommandList->RSSetScissorRects(1, &mScissorRect);
+    //
+    // Main rendering pass.
+    //
 
-        // Indicate a state transition on the resource usage.
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
-            D3D12_RESOURCE_STATE_PRESENT, D3D12_RESOURCE_STATE_RENDER_TARGET));
+    auto mainPass = graph.AddPass("main", [this](ID3D12GraphicsCommandList* cmdList)
+    {
+        cmdList->RSSetViewports(1, &mScreenViewport);
+        cmdList->RSSetScissorRects(1, &mScissorRect);
 
         // Clear the back buffer.
-        mCommandList->ClearRenderTargetView(CurrentBackBufferView(), Colors::LightSteelBlue, 0, nullptr);
+        cmdList->ClearRenderTargetView(CurrentBackBufferView(), Colors::LightSteelBlue, 0, nullptr);
 
-        // WE ALREADY WROTE THE DEPTH INFO TO THE DEPTH BUFFER IN DrawNormalsAndDepth,
-        // SO DO NOT CLEAR DEPTH.
+        // Both paths draw over depth already written: the forward path tests for EQUAL against
+        // DrawNormalsAndDepth, the deferred path tests the G-buffer pass stencil through a
+        // read-only view, as it also rebuilds positions from that depth.
+        D3D12_CPU_DESCRIPTOR_HANDLE dsv = isDeferred ? GetDsv(3) : DepthStencilView();
 
         // Specify the buffers we are going to render to.
-        mCommandList->OMSetRenderTargets(1, &CurrentBackBufferView(), true, &DepthStencilView());
-
-        // Bind all the textures used in this scene.  Observe
-        // that we only have to specify the first descriptor in the table.  
-        // The root signature knows how many descriptors are expected in the table.
-        mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+        cmdList->OMSetRenderTargets(1, &CurrentBackBufferView(), true, &dsv);
 
         auto passCB = mCurrFrameResource->PassCB->Resource();
-        mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress());
+        cmdList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress());
+
+        // Only the lighting shaders read the clustered lights.
+        cmdList->SetGraphicsRootShaderResourceView(7, mCurrFrameResource->ClusterLights->Resource()->GetGPUVirtualAddress());
+        cmdList->SetGraphicsRootShaderResourceView(8, mCurrFrameResource->Clusters->Resource()->GetGPUVirtualAddress());
+        cmdList->SetGraphicsRootShaderResourceView(9, mCurrFrameResource->ClusterLightIndices->Resource()->GetGPUVirtualAddress());
 
         // Bind the sky cube map.  For our demos, we just use one "world" cube map representing the environment
-        // from far away, so all objects will use the same cube map and we only need to set it once per-frame.  
+        // from far away, so all objects will use the same cube map and we only need to set it once per-frame.
         // If we wanted to use "local" cube maps, we would have to change them per-object, or dynamically
         // index into an array of cube maps.
 
         CD3DX12_GPU_DESCRIPTOR_HANDLE skyTexDescriptor(mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
         skyTexDescriptor.Offset(mSkyTexHeapIndex, mCbvSrvUavDescriptorSize);
-        mCommandList->SetGraphicsRootDescriptorTable(3, skyTexDescriptor);
-
-        mCommandList->SetPipelineState(mPSOs["opaque"].Get());
-        DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
-
-        mCommandList->SetPipelineState(mPSOs["debug"].Get());
-        DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Debug]);
-
-        mCommandList->SetPipelineState(mPSOs["sky"].Get());
-        DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Sky]);
-
-        // Indicate a state transition on the resource usage.
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(CurrentBackBuffer(),
-            D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_PRESENT));
+        cmdList->SetGraphicsRootDescriptorTable(3, skyTexDescriptor);
 
-        // Done recording commands.
-        ThrowIfFailed(mCommandList->Close());
-
-        // Add the command list to the queue for execution.
-        ID3D12CommandList* cmdsLists[] = { mCommandList.Get() };
-        mCommandQueue->ExecuteCommandLists(_countof(cmdsLists), cmdsLists);
-
-        // Swap the back and front buffers
-        ThrowIfFailed(mSwapChain->Present(0, 0));
-        mCurrBackBuffer = (mCurrBackBuffer + 1) % SwapChainBufferCount;
+        if (isDeferred)
+        {
+            // One fullscreen triangle; the stencil DrawGBuffer set rejects the background.
+            cmdList->SetPipelineState(mShaderPermutations->Pso("deferredShading", FrameFeatures()));
+            cmdList->OMSetStencilRef(1);
+            cmdList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+            cmdList->DrawInstanced(3, 1, 0, 0);
+        }
+        else
+        {
+            DrawSpecializedRenderItems(cmdList, mRitemLayer[(int)RenderLayer::Opaque], "opaque");
 
-        // Advance the fence value to mark commands up to this fence point.
-        mCurrFrameResource->Fence = ++mCurrentFence;
+            cmdList->SetPipelineState(mPSOs["debug"].Get());
+            DrawRenderItems(cmdList, mRitemLayer[(int)RenderLayer::Debug]);
+        }
 
-        // Add an instruction to the command queue to set a new fence point. 
-        // Because we are on the GPU timeline, the new fence point won't be 
-        // set until the GPU finishes processing all the commands prior to this Signal().
-        mCommandQueue->Signal(mFence.Get(), mCurrentFence);
+        mCurrFrameResource->SkyBundle->Execute(cmdList);
+    });
+    mainPass.Write(backBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+    mainPass.Read(shadowAtlas, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+    if (useEvsm)
+        mainPass.Read(evsmMap, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+    mainPass.Read(ambientMap, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+    if (isDeferred)
+    {
+        for (int i = 0; i < DeferredShading::GBufferCount; ++i)
+            mainPass.Read(gBuffer[i], D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
+        mainPass.Read(depthBuffer, D3D12_RESOURCE_STATE_DEPTH_READ | D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE);
     }
-    
+    else
+    {
+        mainPass.ReadWrite(depthBuffer, D3D12_RESOURCE_STATE_DEPTH_WRITE);
+    }
+
+    graph.Compile();
 }
 
 void CRYCHIC::OnMouseDown(WPARAM btnState, int x, int y)
@@ -522,9 +943,30 @@ void CRYCHIC::UpdateInstanceData(const GameTimer& gt)
 
     for (size_t i = 0; i < mAllRitems.size(); i++)
     {
-        auto currInstanceBuffer = mCurrFrameResource->InstanceBuffers[mAllRitems[i]->itemIndex].get();
         const auto& instanceData = mAllRitems[i]->Instances;
+
+        // Spawned instances may have outgrown this frame resource's buffer.  The GPU is
+        // done with it, so it can be replaced here.
+        UINT itemIndex = mAllRitems[i]->itemIndex;
+        if (mCurrFrameResource->InstanceCapacities[itemIndex] < (UINT)mInstanceCounts[itemIndex])
+        {
+            mCurrFrameResource->InstanceBuffers[itemIndex] = std::make_unique<UploadBuffer<InstanceData>>(
+                md3dDevice.Get(), mInstanceCounts[itemIndex], false);
+            mCurrFrameResource->ShadowLodInstanceBuffers[itemIndex] = std::make_unique<UploadBuffer<InstanceData>>(
+                md3dDevice.Get(), mInstanceCounts[itemIndex] * MaxCasterLods, false);
+            mCurrFrameResource->InstanceCapacities[itemIndex] = mInstanceCounts[itemIndex];
+        }
+        auto currInstanceBuffer = mCurrFrameResource->InstanceBuffers[itemIndex].get();
+
+        // Shadow casters keep every instance, so the cached cascades, light tiles and
+        // virtual pages never depend on what the camera sees.  The cascade masks cull
+        // them against each cascade's box; the tiles and pages clip them to their own.
+        const auto& casters = mRitemLayer[(int)RenderLayer::OpaqueShadow];
+        bool shadowCaster = std::find(casters.begin(), casters.end(), mAllRitems[i].get()) != casters.end();
+
         int visibleInstanceCount = 0;
+        mAllRitems[i]->VisibleInstances.clear();
+        mAllRitems[i]->Features = ShaderFeatures();
         for (size_t j = 0; j < instanceData.size(); j++)
         {
             XMMATRIX world = XMLoadFloat4x4(&instanceData[j].World);
@@ -540,7 +982,7 @@ void CRYCHIC::UpdateInstanceData(const GameTimer& gt)
             // ر׶üֱӼ뻺
             // mSceneItemCount ĿǱɶ̬cubemapʱе屻üɵcubemap
             // еҲ
-            if ((i >= mSceneItemCount) || (localSpaceFrustum.Contains(mAllRitems[i]->Bounds) !=
+            if (shadowCaster || (i >= mSceneItemCount) || (localSpaceFrustum.Contains(mAllRitems[i]->Bounds) !=
                 DISJOINT) || (mFrustumCullingEnabled == false))
             {
                 InstanceData data;
@@ -549,6 +991,9 @@ void CRYCHIC::UpdateInstanceData(const GameTimer& gt)
                 data.MaterialIndex = instanceData[j].MaterialIndex;
                 // visibleInstanceCount ¼ÿȾӦʵ
                 currInstanceBuffer->CopyData(visibleInstanceCount++, data);
+                mAllRitems[i]->VisibleInstances.push_back((UINT)j);
+                if (data.MaterialIndex < mMaterialFeatures.size())
+                    mAllRitems[i]->Features.Merge(mMaterialFeatures[data.MaterialIndex]);
             }
         }
         mAllRitems[i]->InstanceCount = visibleInstanceCount;
@@ -559,7 +1004,9 @@ void CRYCHIC::UpdateInstanceData(const GameTimer& gt)
     outs.precision(6);
     outs << L"Instancing and Culling Demo" <<
         L"    " << totalVisibleInstanceCount <<
-        L" objects visible out of " << mSceneInstancesCount;
+        L" objects visible out of " << mSceneInstancesCount <<
+        L"    " << mRenderGraph->GetStats().BarrierCallCount + mSsao->BarrierCallCount() <<
+        L" barrier calls";
     mMainWndCaption = outs.str();
 }
 
@@ -631,17 +1078,78 @@ void CRYCHIC::UpdateShadowTransform(const GameTimer& gt)
     //XMStoreFloat4x4(&mShadowTransform, S);
 }
 
+void CRYCHIC::UpdateSampleBounds()
+{
+    // The fence wait above means this frame resource's last reduction has landed.
+    DepthBounds bounds;
+    bool read = mSampleDistribution->ReadBounds(mCurrFrameResourceIndex, bounds);
+    if (!mCascadeSettings.FitToSamples)
+    {
+        mSampleBoundsValid = false;
+        return;
+    }
+
+    // Keep the last bounds while none came back, but drop them if only sky is visible.
+    if (read)
+    {
+        mSampleBounds = bounds;
+        mSampleBoundsInputs = mDepthReduceInputs[mCurrFrameResourceIndex];
+        mSampleBoundsValid = !bounds.Empty();
+    }
+}
+
 void CRYCHIC::UpdateCascadeShadowTransform(const GameTimer& gt)
 {
     XMMATRIX mCameraView = mCamera.GetView();
     XMMATRIX mInvCameraView = XMMatrixInverse(&XMMatrixDeterminant(mCameraView), mCameraView);
 
 
-    float zNear[] = { mCamera.GetNearZ(), 30.0f, 50.0f, 80.0f };
-    float zFar[] = { 30.0f, 50.0f, 80.0f, mCamera.GetFarZ() };
+    // Practical split scheme: blend the logarithmic and uniform split distances, over
+    // the whole view range or just the range the visible samples cover.
+    UINT cascadeCount = CascadeCount();
+    float splitNear = mCamera.GetNearZ();
+    float splitFar = mCamera.GetFarZ();
+    bool fitToSamples = mCascadeSettings.FitToSamples && mSampleBoundsValid;
+    if (fitToSamples)
+    {
+        // The reduction is a few frames old; pad it for what the camera moved onto since.
+        splitNear = std::max<float>(splitNear, 0.9f * mSampleBounds.MinDepth);
+        splitFar = std::min<float>(splitFar, 1.1f * mSampleBounds.MaxDistance);
+        splitFar = std::max<float>(splitFar, splitNear + 1.0f);
+    }
+    SampleDistribution::FitSplits(splitNear, splitFar, cascadeCount, mCascadeSettings.SplitLambda, mCascadeSplits);
+
+    float zNear[MaxShadowCascades];
+    float zFar[MaxShadowCascades];
+    for (UINT i = 0; i < cascadeCount; i++)
+    {
+        zNear[i] = i == 0 ? splitNear : zFar[i - 1];
+        zFar[i] = mCascadeSplits[i];
+    }
 
+    // construct a light view matrix
+    // Anchored at the origin, it only changes with the light direction; camera motion
+    // just slides the texel-snapped bounds below, which keeps cached cascades valid.
+    XMFLOAT3 lightDir = mBaseLightDirections[0];
+    XMFLOAT4 up = XMFLOAT4(0.0f, 1.0f, 0.0f, 0.0f);
+    XMMATRIX lightView = XMMatrixLookToLH(XMVectorZero(), XMLoadFloat3(&lightDir),
+        XMLoadFloat4(&up));
+    XMStoreFloat4x4(&mCascadeLightView, lightView);
+
+    // The light space boxes of the samples only fit cascades laid out like the ones
+    // they were binned into, seen from the same place.
+    bool fitLightSpaceBounds = fitToSamples && mCascadeSettings.FitLightSpaceBounds &&
+        MathHelper::NearEqual(mSampleBoundsInputs.LightView, mCascadeLightView);
+    if (fitLightSpaceBounds)
+    {
+        XMFLOAT4X4 view;
+        XMStoreFloat4x4(&view, mCameraView);
+        fitLightSpaceBounds = MathHelper::NearEqual(mSampleBoundsInputs.View, view);
+        for (UINT i = 0; i < cascadeCount; i++)
+            fitLightSpaceBounds = fitLightSpaceBounds && fabsf(mSampleBoundsInputs.Splits[i] - mCascadeSplits[i]) < 1e-3f;
+    }
 
-    for (size_t i = 0; i < 4; i++)
+    for (size_t i = 0; i < cascadeCount; i++)
     {
         XMMATRIX mCameraProj = XMMatrixPerspectiveFovLH(mCamera.GetFovY(), mCamera.GetAspect(),
             zNear[i], zFar[i]);
@@ -719,21 +1227,6 @@ void CRYCHIC::UpdateCascadeShadowTransform(const GameTimer& gt)
         targetPos.z = 0.5f * (corners[3].z + corners[5].z);
         targetPos.w = 1.0f;
 
-        // construct a light view matrix
-        // light position , target position, up
-        //float distance = 0.5f * (zFar[i] - zNear[i]);
-        float distance = boundingBoxLength;
-        XMFLOAT3 lightDir = mBaseLightDirections[0];
-        XMFLOAT4 lightPos;
-        lightPos.x = -distance * lightDir.x + targetPos.x;
-        lightPos.y = -distance * lightDir.y + targetPos.y;
-        lightPos.z = -distance * lightDir.z + targetPos.z;
-        lightPos.w = 1.0f;
-        //XMFLOAT4 targetPos = corners[0];
-        XMFLOAT4 up = XMFLOAT4(0.0f, 1.0f, 0.0f, 0.0f);
-        XMMATRIX lightView = XMMatrixLookAtLH(XMLoadFloat4(&lightPos), XMLoadFloat4(&targetPos),
-            XMLoadFloat4(&up));
-
         // transform world to light view space
         for (int i = 0; i < 8; i++)
         {
@@ -755,7 +1248,7 @@ void CRYCHIC::UpdateCascadeShadowTransform(const GameTimer& gt)
         XMStoreFloat3(&vertexMax, vMax);
         XMStoreFloat3(&vertexMin, vMin);
 
-        float fWorldUnitsPerTexel = boundingBoxLength / mShadowMap->Width();
+        float fWorldUnitsPerTexel = boundingBoxLength / mCascadeTiles[i].Size;
         XMVECTOR center = 0.5 * (vMin + vMax);
         XMFLOAT3 fCenter;
         XMStoreFloat3(&fCenter, center);
@@ -793,6 +1286,21 @@ void CRYCHIC::UpdateCascadeShadowTransform(const GameTimer& gt)
         float t = fCenter.y + 0.5 * boundingBoxLength;
         float f = fCenter.z + 0.5 * boundingBoxLength;
 
+        // Shrink the box to the samples that sample this cascade.
+        if (fitLightSpaceBounds)
+        {
+            XMFLOAT3 boxMin(l, b, n);
+            XMFLOAT3 boxMax(r, t, f);
+            if (SampleDistribution::FitCascadeBox(mSampleBounds, (UINT)i, mCascadeTiles[i].Size, boxMin, boxMax))
+            {
+                l = boxMin.x;
+                b = boxMin.y;
+                r = boxMax.x;
+                t = boxMax.y;
+                f = boxMax.z;
+            }
+        }
+
         /*float l = vertexMin.x;
         float b = vertexMin.y;
         float n = vertexMin.z;
@@ -807,61 +1315,438 @@ void CRYCHIC::UpdateCascadeShadowTransform(const GameTimer& gt)
             0.0f, -0.5f, 0.0f, 0.0f,
             0.0f, 0.0f, 1.0f, 0.0f,
             0.5f, 0.5f, 0.0f, 1.0f);
-        XMMATRIX shadowTransform = lightView * lightProj * T;
-        XMStoreFloat4x4(&mLightViews[i], lightView);
-        XMStoreFloat4x4(&mLightProjs[i], lightProj);
+        // Re-render the static casters when the snapped projection moved or a caster inside
+        // was dirtied.  Far cascades may lag for a few frames, so they keep sampling with the
+        // transform their cached depth was rendered with until then.
+        XMFLOAT4X4 newView, newProj;
+        XMStoreFloat4x4(&newView, lightView);
+        XMStoreFloat4x4(&newProj, lightProj);
+        auto& cache = mCascadeCaches[i];
+        bool moved = !MathHelper::NearEqual(newView, mLightViews[i]) || !MathHelper::NearEqual(newProj, mLightProjs[i]);
+        cache.Refresh = !cache.Valid ||
+            ((moved || cache.Dirty) && cache.Age + 1 >= mCascadeSettings.RefreshInterval[i]);
+        if (cache.Refresh)
+        {
+            mLightViews[i] = newView;
+            mLightProjs[i] = newProj;
+            BoundingBox::CreateFromPoints(mCascadeBounds[i], XMVectorSet(l, b, n, 1.0f), XMVectorSet(r, t, f, 1.0f));
+            cache.Valid = true;
+            cache.Dirty = false;
+            cache.Age = 0;
+        }
+        else
+        {
+            cache.Age++;
+        }
+
+        // Texture space of the cascade is its tile of the atlas.
+        XMMATRIX shadowTransform = XMLoadFloat4x4(&mLightViews[i]) * XMLoadFloat4x4(&mLightProjs[i]) *
+            T * mShadowMap->TileTransform(mCascadeTiles[i]);
         XMStoreFloat4x4(&mShadowTransforms[i], shadowTransform);
     }
 }
 
-void CRYCHIC::UpdateMainPassCB(const GameTimer& gt)
+void CRYCHIC::UpdateCascadeMasks()
 {
-    XMMATRIX view = mCamera.GetView();
-    XMMATRIX proj = mCamera.GetProj();
-
-    XMMATRIX viewProj = XMMatrixMultiply(view, proj);
-    XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
-    XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
-    XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
-
-    // Transform NDC space [-1,+1]^2 to texture space [0,1]^2
-    XMMATRIX T(
-        0.5f, 0.0f, 0.0f, 0.0f,
-        0.0f, -0.5f, 0.0f, 0.0f,
-        0.0f, 0.0f, 1.0f, 0.0f,
-        0.5f, 0.5f, 0.0f, 1.0f);
-
-    XMMATRIX viewProjTex = XMMatrixMultiply(viewProj, T);
-    
+    // Only the single pass shadow shader reads the masks; with one pass per cascade
+    // the rasterizer clips casters outside the cascade anyway.
+    if (!mCascadeSettings.SinglePass)
+        return;
 
-    for (size_t i = 0; i < 12; i++)
+    // A caster only shadows what lies behind it along the light, so each cascade keeps
+    // the light space box of the visible receivers inside it.  Light view space looks
+    // down +z: a caster reaches the box when it overlaps it in xy and starts before
+    // the box ends in z.
+    BoundingBox receivers[MaxShadowCascades];
+    bool hasReceivers[MaxShadowCascades] = {};
+    for (UINT i = 0; mCascadeSettings.CullCasters && i < CascadeCount(); i++)
     {
-        XMMATRIX shadowTransform = XMLoadFloat4x4(&mShadowTransforms[i]);
-        XMStoreFloat4x4(&mMainPassCB.ShadowTransforms[i], XMMatrixTranspose(shadowTransform));
-    }
-
-    XMStoreFloat4x4(&mMainPassCB.View, XMMatrixTranspose(view));
-    XMStoreFloat4x4(&mMainPassCB.InvView, XMMatrixTranspose(invView));
-    XMStoreFloat4x4(&mMainPassCB.Proj, XMMatrixTranspose(proj));
+        XMMATRIX lightView = XMLoadFloat4x4(&mLightViews[i]);
+        XMVECTOR cascadeMin = XMLoadFloat3(&mCascadeBounds[i].Center) - XMLoadFloat3(&mCascadeBounds[i].Extents);
+        XMVECTOR cascadeMax = XMLoadFloat3(&mCascadeBounds[i].Center) + XMLoadFloat3(&mCascadeBounds[i].Extents);
+        XMVECTOR receiverMin = XMVectorReplicate(+MathHelper::Infinity);
+        XMVECTOR receiverMax = XMVectorReplicate(-MathHelper::Infinity);
+        for (auto ri : mRitemLayer[(int)RenderLayer::Opaque])
+        {
+            for (UINT index : ri->VisibleInstances)
+            {
+                BoundingBox boundsL;
+                ri->Bounds.Transform(boundsL, XMLoadFloat4x4(&ri->Instances[index].World) * lightView);
+                XMVECTOR boundsMin = XMVectorMax(XMLoadFloat3(&boundsL.Center) - XMLoadFloat3(&boundsL.Extents), cascadeMin);
+                XMVECTOR boundsMax = XMVectorMin(XMLoadFloat3(&boundsL.Center) + XMLoadFloat3(&boundsL.Extents), cascadeMax);
+                if (!XMVector3LessOrEqual(boundsMin, boundsMax))
+                    continue;
+
+                receiverMin = XMVectorMin(receiverMin, boundsMin);
+                receiverMax = XMVectorMax(receiverMax, boundsMax);
+                hasReceivers[i] = true;
+            }
+        }
+        if (hasReceivers[i])
+            BoundingBox::CreateFromPoints(receivers[i], receiverMin, receiverMax);
+
+        // The cached static casters were culled against the receivers of their last
+        // render; newly covered receivers may miss shadows, so render them again.
+        auto& cache = mCascadeCaches[i];
+        if (!cache.Refresh && hasReceivers[i] &&
+            (!cache.HasReceivers || cache.Receivers.Contains(receivers[i]) != CONTAINS))
+        {
+            cache.Refresh = true;
+            cache.Age = 0;
+        }
+        if (cache.Refresh)
+        {
+            cache.HasReceivers = hasReceivers[i];
+            cache.Receivers = receivers[i];
+        }
+    }
+
+    // Runs after the cascades are settled for this frame, so the casters are tested
+    // against the boxes the cascades are actually drawn with.
+    for (auto ri : mRitemLayer[(int)RenderLayer::OpaqueShadow])
+    {
+        mCasterLodScratch.resize(ri->VisibleInstances.size());
+        for (size_t k = 0; k < ri->VisibleInstances.size(); k++)
+        {
+            const auto& instance = ri->Instances[ri->VisibleInstances[k]];
+            XMMATRIX world = XMLoadFloat4x4(&instance.World);
+            XMMATRIX texTransform = XMLoadFloat4x4(&instance.TexTransform);
+
+            InstanceData data;
+            XMStoreFloat4x4(&data.World, XMMatrixTranspose(world));
+            XMStoreFloat4x4(&data.TexTransform, XMMatrixTranspose(texTransform));
+            data.MaterialIndex = instance.MaterialIndex;
+            data.CascadeMask = 0;
+            for (UINT i = 0; i < CascadeCount(); i++)
+            {
+                XMMATRIX toLight = XMMatrixMultiply(world, XMLoadFloat4x4(&mLightViews[i]));
+                BoundingBox lightSpaceBounds;
+                ri->Bounds.Transform(lightSpaceBounds, toLight);
+                if (!mCascadeBounds[i].Intersects(lightSpaceBounds))
+                    continue;
+
+                if (mCascadeSettings.CullCasters)
+                {
+                    if (!hasReceivers[i])
+                        continue;
+                    const BoundingBox& r = receivers[i];
+                    const BoundingBox& c = lightSpaceBounds;
+                    bool overlapsX = fabsf(c.Center.x - r.Center.x) <= c.Extents.x + r.Extents.x;
+                    bool overlapsY = fabsf(c.Center.y - r.Center.y) <= c.Extents.y + r.Extents.y;
+                    bool beforeEnd = c.Center.z - c.Extents.z <= r.Center.z + r.Extents.z;
+                    if (!overlapsX || !overlapsY || !beforeEnd)
+                        continue;
+                }
+
+                // Footprint across the light in texels of the cascade.
+                float texelSize = 2.0f * mCascadeBounds[i].Extents.x / mCascadeTiles[i].Size;
+                float texels = 2.0f * std::max<float>(lightSpaceBounds.Extents.x, lightSpaceBounds.Extents.y) / texelSize;
+                if (texels < mCascadeSettings.MinCasterTexels[i])
+                    continue;
+
+                UINT lod = mCascadeSettings.CasterLodBias[i];
+                for (float t = texels; t < mCascadeSettings.CasterLodTexels && lod < MaxCasterLods - 1; t *= 2.0f)
+                    lod++;
+                lod = std::min<UINT>(lod, std::min<UINT>((UINT)ri->ShadowLods.size(), MaxCasterLods - 1));
+                data.CascadeMask |= 1u << (lod * MaxShadowCascades + i);
+            }
+            mCasterLodScratch[k] = data;
+        }
+
+        // Regroup the instances into one run per LOD; an instance drawn at two LODs in
+        // different cascades goes into both runs.
+        auto lodInstanceBuffer = mCurrFrameResource->ShadowLodInstanceBuffers[ri->itemIndex].get();
+        const UINT lodBits = (1u << MaxShadowCascades) - 1;
+        UINT written = 0;
+        for (UINT lod = 0; lod < MaxCasterLods; ++lod)
+        {
+            ri->ShadowLodStart[lod] = written;
+            for (const auto& data : mCasterLodScratch)
+            {
+                if ((data.CascadeMask >> (lod * MaxShadowCascades)) & lodBits)
+                    lodInstanceBuffer->CopyData((int)written++, data);
+            }
+            ri->ShadowLodCount[lod] = written - ri->ShadowLodStart[lod];
+        }
+    }
+}
+
+void CRYCHIC::UpdateVirtualShadowPages()
+{
+    if (!mCascadeSettings.Virtual)
+        return;
+
+    // The pages share the cascades' light view, with a depth range over the whole
+    // scene so a rendered page stays valid however the camera moves.
+    XMMATRIX lightView = XMLoadFloat4x4(&mCascadeLightView);
+    XMFLOAT3 sceneCenterL;
+    XMStoreFloat3(&sceneCenterL, XMVector3TransformCoord(XMLoadFloat3(&mSceneBounds.Center), lightView));
+    float depthNear = sceneCenterL.z - mSceneBounds.Radius;
+    float depthFar = sceneCenterL.z + mSceneBounds.Radius;
+    if (!MathHelper::NearEqual(mCascadeLightView, mVirtualLightView) ||
+        depthNear != mVirtualDepthNear || depthFar != mVirtualDepthFar)
+    {
+        mVirtualLightView = mCascadeLightView;
+        mVirtualDepthNear = depthNear;
+        mVirtualDepthFar = depthFar;
+        mVirtualPages.InvalidateAll();
+    }
+
+    // The fence wait in Update means the marking recorded with this frame resource
+    // has finished; it was marked against the windows of that frame.
+    std::vector<UINT> requests(VirtualShadowPages::RequestWordCount);
+    if (mVirtualShadowMap->ReadRequests(mCurrFrameResourceIndex, requests.data()))
+        mVirtualPages.Request(requests.data(), mVirtualMarkLevels[mCurrFrameResourceIndex]);
+
+    // Dynamic casters are drawn into the pages with the static ones, so the pages
+    // under them are redrawn as the per-frame budget allows: those under where they
+    // are now, and those still holding them where they were before.
+    for (const auto& boundsL : mPrevDynamicCasterBoundsL)
+        mVirtualPages.Invalidate(boundsL);
+    mPrevDynamicCasterBoundsL.clear();
+    for (auto ri : mDynamicCasters)
+    {
+        for (UINT index : ri->VisibleInstances)
+        {
+            BoundingBox boundsL;
+            ri->Bounds.Transform(boundsL, XMLoadFloat4x4(&ri->Instances[index].World) * lightView);
+            mVirtualPages.Invalidate(boundsL);
+            mPrevDynamicCasterBoundsL.push_back(boundsL);
+        }
+    }
+
+    XMFLOAT3 eyePosL;
+    XMStoreFloat3(&eyePosL, XMVector3TransformCoord(mCamera.GetPosition(), lightView));
+    mVirtualPages.SetClipmap(mCascadeSettings.VirtualExtent, eyePosL);
+    mVirtualPages.Update(mCascadeSettings.VirtualPagesPerFrame);
+
+    // Pixel footprint per unit distance over the texel size of level 0.
+    float texelWorldSize = mCascadeSettings.VirtualExtent /
+        (VirtualShadowPages::PagesPerLevel * VirtualShadowPages::PageSize);
+    mVirtualLodScale = 2.0f * tanf(0.5f * mCamera.GetFovY()) / mClientHeight / texelWorldSize;
+
+    std::vector<UINT> pageTable(VirtualShadowPages::PageTableSize);
+    XMUINT2 poolOrigin(mVirtualPoolTile.X / VirtualShadowPages::PageSize, mVirtualPoolTile.Y / VirtualShadowPages::PageSize);
+    mVirtualPages.BuildPageTable(poolOrigin, pageTable.data());
+    auto currPageTable = mCurrFrameResource->VirtualPageTable.get();
+    for (UINT i = 0; i < VirtualShadowPages::PageTableSize; ++i)
+        currPageTable->CopyData(i, pageTable[i]);
+
+    XMMATRIX viewProj = XMMatrixMultiply(mCamera.GetView(), mCamera.GetProj());
+    XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
+
+    VirtualShadowMarkConstants markCB;
+    XMStoreFloat4x4(&markCB.InvViewProj, XMMatrixTranspose(invViewProj));
+    XMStoreFloat4x4(&markCB.LightView, XMMatrixTranspose(lightView));
+    const VirtualShadowLevel* levels = mVirtualPages.Levels();
+    for (UINT i = 0; i < VirtualShadowLevels; ++i)
+    {
+        markCB.Levels[i] = XMFLOAT4((float)levels[i].Origin.x, (float)levels[i].Origin.y,
+            1.0f / levels[i].PageWorldSize, 0.0f);
+    }
+    markCB.EyePosW = mCamera.GetPosition3f();
+    markCB.LodScale = mVirtualLodScale;
+    markCB.DepthMapSize = XMUINT2(mClientWidth, mClientHeight);
+    mCurrFrameResource->VirtualShadowMarkCB->CopyData(0, markCB);
+
+    // Remembered until the requests are read back, to map their bits to pages.
+    std::copy(levels, levels + VirtualShadowLevels, mVirtualMarkLevels[mCurrFrameResourceIndex]);
+}
+
+void CRYCHIC::UpdateLightShadows()
+{
+    // Dynamic casters are not cached by the cascades, but the spot lights keep theirs
+    // between refreshes, so lights they reach have to be redrawn.
+    for (auto ri : mDynamicCasters)
+    {
+        for (UINT index : ri->VisibleInstances)
+        {
+            BoundingBox worldBounds;
+            ri->Bounds.Transform(worldBounds, XMLoadFloat4x4(&ri->Instances[index].World));
+            mShadowScheduler.Invalidate(worldBounds);
+        }
+    }
+
+    std::vector<ShadowCandidate> candidates;
+    for (UINT i = 0; i < (UINT)mSpotLights.size(); ++i)
+    {
+        const Light& light = mSpotLights[i];
+
+        ShadowCandidate c;
+        c.LightIndex = DirLightCount + i;
+        c.Bounds = BoundingSphere(light.Position, light.FalloffEnd);
+        c.Intensity = std::max<float>(light.Strength.x, std::max<float>(light.Strength.y, light.Strength.z));
+
+        XMVECTOR up = fabsf(light.Direction.y) > 0.99f ? XMVectorSet(0.0f, 0.0f, 1.0f, 0.0f) : XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f);
+        XMMATRIX view = XMMatrixLookToLH(XMLoadFloat3(&light.Position), XMLoadFloat3(&light.Direction), up);
+
+        // The cone ends where the cos^SpotPower falloff drops to 5% of its peak.
+        float halfAngle = acosf(powf(0.05f, 1.0f / light.SpotPower));
+        halfAngle = MathHelper::Clamp(halfAngle, 0.05f * MathHelper::Pi, 0.4f * MathHelper::Pi);
+        XMMATRIX proj = XMMatrixPerspectiveFovLH(2.0f * halfAngle, 1.0f, SpotShadowNearZ, light.FalloffEnd);
+
+        XMStoreFloat4x4(&c.View, view);
+        XMStoreFloat4x4(&c.Proj, proj);
+        candidates.push_back(c);
+    }
+
+    XMMATRIX view = mCamera.GetView();
+    XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+
+    ShadowSchedulerView schedulerView;
+    mCamFrustum.Transform(schedulerView.Frustum, invView);
+    schedulerView.EyePosW = mCamera.GetPosition3f();
+    schedulerView.TanHalfFovY = tanf(0.5f * mCamera.GetFovY());
+    schedulerView.ScreenHeight = (UINT)mClientHeight;
+
+    mShadowScheduler.Schedule(candidates, schedulerView, *mShadowMap);
+}
+
+void CRYCHIC::UpdateClusteredLights()
+{
+    // Spot lights first, so their indices line up with the ShadowScheduler's.
+    std::vector<Light> lights = mSpotLights;
+    lights.insert(lights.end(), mPointLights.begin(), mPointLights.end());
+
+    mClusteredLights.SetProjection(mCamera.GetProj4x4f(), mCamera.GetNearZ(), mCamera.GetFarZ());
+    mClusteredLights.Build(lights, mCamera.GetView4x4f());
+
+    auto currLights = mCurrFrameResource->ClusterLights.get();
+    for (UINT i = 0; i < mClusteredLights.LightCount(); ++i)
+        currLights->CopyData(i, lights[i]);
+
+    auto currClusters = mCurrFrameResource->Clusters.get();
+    const auto& clusters = mClusteredLights.Clusters();
+    for (UINT i = 0; i < ClusteredLights::ClusterCount; ++i)
+        currClusters->CopyData(i, XMUINT2(clusters[i].Offset, clusters[i].Count));
+
+    auto currIndices = mCurrFrameResource->ClusterLightIndices.get();
+    const auto& indices = mClusteredLights.LightIndices();
+    for (size_t i = 0; i < indices.size(); ++i)
+        currIndices->CopyData((int)i, indices[i]);
+}
+
+void CRYCHIC::UpdateFrameCB(const GameTimer& gt)
+{
+    // Transform NDC space [-1,+1]^2 to texture space [0,1]^2
+    XMMATRIX T(
+        0.5f, 0.0f, 0.0f, 0.0f,
+        0.0f, -0.5f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+        0.5f, 0.5f, 0.0f, 1.0f);
+
+    for (size_t i = 0; i < CascadeCount(); i++)
+    {
+        XMMATRIX shadowTransform = XMLoadFloat4x4(&mShadowTransforms[i]);
+        XMStoreFloat4x4(&mFrameCB.ShadowTransforms[i], XMMatrixTranspose(shadowTransform));
+        mFrameCB.ShadowTileBounds[i] = mShadowMap->TileUvBounds(mCascadeTiles[i]);
+    }
+    float splits[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    std::copy(mCascadeSplits, mCascadeSplits + CascadeCount(), splits);
+    mFrameCB.CascadeSplits = XMFLOAT4(splits);
+    mFrameCB.CascadeCount = CascadeCount();
+    mFrameCB.CascadeBlendBand = mCascadeSettings.BlendBand;
+    mFrameCB.ShadowFilter = (UINT)mCascadeSettings.Filter;
+
+    // Every cascade's transform, for the single pass shader.
+    for (size_t i = 0; i < CascadeCount(); i++)
+    {
+        XMMATRIX viewProj = XMMatrixMultiply(XMLoadFloat4x4(&mLightViews[i]), XMLoadFloat4x4(&mLightProjs[i]));
+        XMStoreFloat4x4(&mFrameCB.CascadeViewProj[i], XMMatrixTranspose(viewProj));
+    }
+
+    mFrameCB.TotalTime = gt.TotalTime();
+    mFrameCB.DeltaTime = gt.DeltaTime();
+    mFrameCB.AmbientLight = { 1.0f, 1.0f, 1.0f, 1.0f };
+    std::copy(std::begin(mSkyAmbient.C), std::end(mSkyAmbient.C), mFrameCB.AmbientSH);
+    mFrameCB.Lights[0].Direction = mRotatedLightDirections[0];
+    mFrameCB.Lights[0].Strength = { 2.4f, 2.4f, 2.5f };
+    mFrameCB.Lights[1].Direction = mRotatedLightDirections[1];
+    mFrameCB.Lights[1].Strength = { 0.1f, 0.1f, 0.1f };
+    mFrameCB.Lights[2].Direction = mRotatedLightDirections[2];
+    mFrameCB.Lights[2].Strength = { 0.0f, 0.0f, 0.0f };
+
+    // Dark lights at the end are left out of the specialized shading loops.
+    mActiveDirLightCount = 0;
+    for (UINT i = 0; i < DirLightCount; ++i)
+    {
+        const XMFLOAT3& strength = mFrameCB.Lights[i].Strength;
+        if (strength.x != 0.0f || strength.y != 0.0f || strength.z != 0.0f)
+            mActiveDirLightCount = i + 1;
+    }
+    mFrameCB.ClusterZScale = mClusteredLights.ZScale();
+    mFrameCB.ClusterZBias = mClusteredLights.ZBias();
+    mFrameCB.ClusterLightCount = mClusteredLights.LightCount();
+
+    // Lights sample their slot with the transform their tile was last rendered with.
+    UINT lightSlots[MaxLights] = {};
+    const auto& shadowSlots = mShadowScheduler.Slots();
+    for (size_t k = 0; k < shadowSlots.size(); ++k)
+    {
+        const auto& slot = shadowSlots[k];
+        if (!slot.Valid)
+            continue;
+
+        XMMATRIX shadowTransform = XMLoadFloat4x4(&slot.View) * XMLoadFloat4x4(&slot.Proj) *
+            T * mShadowMap->TileTransform(slot.Tile);
+        XMStoreFloat4x4(&mFrameCB.LightShadowTransforms[k], XMMatrixTranspose(shadowTransform));
+        mFrameCB.LightShadowTileBounds[k] = mShadowMap->TileUvBounds(slot.Tile);
+        lightSlots[slot.LightIndex] = (UINT)k + 1;
+    }
+    for (UINT i = 0; i < MaxLights / 4; ++i)
+        mFrameCB.LightShadowSlots[i] = XMUINT4(&lightSlots[4 * i]);
+
+    mFrameCB.VirtualShadows = mCascadeSettings.Virtual ? 1 : 0;
+    if (mCascadeSettings.Virtual)
+    {
+        XMStoreFloat4x4(&mFrameCB.VirtualShadowView, XMMatrixTranspose(XMLoadFloat4x4(&mVirtualLightView)));
+        const VirtualShadowLevel* levels = mVirtualPages.Levels();
+        for (UINT i = 0; i < VirtualShadowLevels; ++i)
+        {
+            mFrameCB.VirtualLevels[i] = XMFLOAT4((float)levels[i].Origin.x, (float)levels[i].Origin.y,
+                1.0f / levels[i].PageWorldSize, 0.0f);
+        }
+        mFrameCB.VirtualLodScale = mVirtualLodScale;
+        mFrameCB.VirtualDepthNear = mVirtualDepthNear;
+        mFrameCB.VirtualInvDepthRange = 1.0f / (mVirtualDepthFar - mVirtualDepthNear);
+        mFrameCB.VirtualPageSize = (float)VirtualShadowPages::PageSize;
+    }
+
+    auto currFrameCB = mCurrFrameResource->FrameCB.get();
+    currFrameCB->CopyData(0, mFrameCB);
+}
+
+void CRYCHIC::UpdateMainPassCB(const GameTimer& gt)
+{
+    XMMATRIX view = mCamera.GetView();
+    XMMATRIX proj = mCamera.GetProj();
+
+    XMMATRIX viewProj = XMMatrixMultiply(view, proj);
+    XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+    XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
+    XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
+
+    // Transform NDC space [-1,+1]^2 to texture space [0,1]^2
+    XMMATRIX T(
+        0.5f, 0.0f, 0.0f, 0.0f,
+        0.0f, -0.5f, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+        0.5f, 0.5f, 0.0f, 1.0f);
+
+    XMMATRIX viewProjTex = XMMatrixMultiply(viewProj, T);
+
+    XMStoreFloat4x4(&mMainPassCB.View, XMMatrixTranspose(view));
+    XMStoreFloat4x4(&mMainPassCB.InvView, XMMatrixTranspose(invView));
+    XMStoreFloat4x4(&mMainPassCB.Proj, XMMatrixTranspose(proj));
     XMStoreFloat4x4(&mMainPassCB.InvProj, XMMatrixTranspose(invProj));
     XMStoreFloat4x4(&mMainPassCB.ViewProj, XMMatrixTranspose(viewProj));
     XMStoreFloat4x4(&mMainPassCB.InvViewProj, XMMatrixTranspose(invViewProj));
     XMStoreFloat4x4(&mMainPassCB.ViewProjTex, XMMatrixTranspose(viewProjTex));
-    
     mMainPassCB.EyePosW = mCamera.GetPosition3f();
     mMainPassCB.RenderTargetSize = XMFLOAT2((float)mClientWidth, (float)mClientHeight);
     mMainPassCB.InvRenderTargetSize = XMFLOAT2(1.0f / mClientWidth, 1.0f / mClientHeight);
     mMainPassCB.NearZ = 1.0f;
     mMainPassCB.FarZ = 1000.0f;
-    mMainPassCB.TotalTime = gt.TotalTime();
-    mMainPassCB.DeltaTime = gt.DeltaTime();
-    mMainPassCB.AmbientLight = { 0.4f, 0.4f, 0.6f, 1.0f };
-    mMainPassCB.Lights[0].Direction = mRotatedLightDirections[0];
-    mMainPassCB.Lights[0].Strength = { 2.4f, 2.4f, 2.5f };
-    mMainPassCB.Lights[1].Direction = mRotatedLightDirections[1];
-    mMainPassCB.Lights[1].Strength = { 0.1f, 0.1f, 0.1f };
-    mMainPassCB.Lights[2].Direction = mRotatedLightDirections[2];
-    mMainPassCB.Lights[2].Strength = { 0.0f, 0.0f, 0.0f };
 
     auto currPassCB = mCurrFrameResource->PassCB.get();
     currPassCB->CopyData(0, mMainPassCB);
@@ -869,7 +1754,7 @@ void CRYCHIC::UpdateMainPassCB(const GameTimer& gt)
 
 void CRYCHIC::UpdateShadowPassCB(const GameTimer& gt)
 {
-    for (size_t i = 0; i < 12; i++)
+    for (size_t i = 0; i < CascadeCount(); i++)
     {
         XMMATRIX view = XMLoadFloat4x4(&mLightViews[i]);
         XMMATRIX proj = XMLoadFloat4x4(&mLightProjs[i]);
@@ -879,8 +1764,8 @@ void CRYCHIC::UpdateShadowPassCB(const GameTimer& gt)
         XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
         XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
 
-        UINT w = mShadowMap->Width();
-        UINT h = mShadowMap->Height();
+        UINT w = mCascadeTiles[i].Size;
+        UINT h = mCascadeTiles[i].Size;
 
         XMStoreFloat4x4(&mShadowPassCB.View, XMMatrixTranspose(view));
         XMStoreFloat4x4(&mShadowPassCB.InvView, XMMatrixTranspose(invView));
@@ -897,7 +1782,80 @@ void CRYCHIC::UpdateShadowPassCB(const GameTimer& gt)
         auto currPassCB = mCurrFrameResource->PassCB.get();
         currPassCB->CopyData(1 + i, mShadowPassCB);
     }
-    
+
+    // The spot lights redrawn this frame follow the cascades.
+    const auto& shadowSlots = mShadowScheduler.Slots();
+    for (size_t k = 0; k < shadowSlots.size(); ++k)
+    {
+        const auto& slot = shadowSlots[k];
+        if (!slot.Refresh)
+            continue;
+
+        const Light& light = mSpotLights[slot.LightIndex - DirLightCount];
+        XMMATRIX view = XMLoadFloat4x4(&slot.View);
+        XMMATRIX proj = XMLoadFloat4x4(&slot.Proj);
+
+        XMMATRIX viewProj = XMMatrixMultiply(view, proj);
+        XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+        XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
+        XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
+
+        UINT size = slot.Tile.Size;
+
+        XMStoreFloat4x4(&mShadowPassCB.View, XMMatrixTranspose(view));
+        XMStoreFloat4x4(&mShadowPassCB.InvView, XMMatrixTranspose(invView));
+        XMStoreFloat4x4(&mShadowPassCB.Proj, XMMatrixTranspose(proj));
+        XMStoreFloat4x4(&mShadowPassCB.InvProj, XMMatrixTranspose(invProj));
+        XMStoreFloat4x4(&mShadowPassCB.ViewProj, XMMatrixTranspose(viewProj));
+        XMStoreFloat4x4(&mShadowPassCB.InvViewProj, XMMatrixTranspose(invViewProj));
+        mShadowPassCB.EyePosW = light.Position;
+        mShadowPassCB.RenderTargetSize = XMFLOAT2((float)size, (float)size);
+        mShadowPassCB.InvRenderTargetSize = XMFLOAT2(1.0f / size, 1.0f / size);
+        mShadowPassCB.NearZ = SpotShadowNearZ;
+        mShadowPassCB.FarZ = light.FalloffEnd;
+
+        auto currPassCB = mCurrFrameResource->PassCB.get();
+        currPassCB->CopyData(1 + MaxShadowCascades + (UINT)k, mShadowPassCB);
+    }
+
+    if (!mCascadeSettings.Virtual)
+        return;
+
+    // One projection per virtual shadow map level, spanning its whole window; each page
+    // is drawn with a viewport that puts just that page on its physical page.
+    UINT levelSize = VirtualShadowPages::PagesPerLevel * VirtualShadowPages::PageSize;
+    const VirtualShadowLevel* levels = mVirtualPages.Levels();
+    for (UINT i = 0; i < VirtualShadowLevels; ++i)
+    {
+        float pageWorldSize = levels[i].PageWorldSize;
+        float l = levels[i].Origin.x * pageWorldSize;
+        float r = (levels[i].Origin.x + (int)VirtualShadowPages::PagesPerLevel) * pageWorldSize;
+        float t = -levels[i].Origin.y * pageWorldSize;
+        float b = -(levels[i].Origin.y + (int)VirtualShadowPages::PagesPerLevel) * pageWorldSize;
+
+        XMMATRIX view = XMLoadFloat4x4(&mVirtualLightView);
+        XMMATRIX proj = XMMatrixOrthographicOffCenterLH(l, r, b, t, mVirtualDepthNear, mVirtualDepthFar);
+
+        XMMATRIX viewProj = XMMatrixMultiply(view, proj);
+        XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+        XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
+        XMMATRIX invViewProj = XMMatrixInverse(&XMMatrixDeterminant(viewProj), viewProj);
+
+        XMStoreFloat4x4(&mShadowPassCB.View, XMMatrixTranspose(view));
+        XMStoreFloat4x4(&mShadowPassCB.InvView, XMMatrixTranspose(invView));
+        XMStoreFloat4x4(&mShadowPassCB.Proj, XMMatrixTranspose(proj));
+        XMStoreFloat4x4(&mShadowPassCB.InvProj, XMMatrixTranspose(invProj));
+        XMStoreFloat4x4(&mShadowPassCB.ViewProj, XMMatrixTranspose(viewProj));
+        XMStoreFloat4x4(&mShadowPassCB.InvViewProj, XMMatrixTranspose(invViewProj));
+        mShadowPassCB.EyePosW = mLightPosW;
+        mShadowPassCB.RenderTargetSize = XMFLOAT2((float)levelSize, (float)levelSize);
+        mShadowPassCB.InvRenderTargetSize = XMFLOAT2(1.0f / levelSize, 1.0f / levelSize);
+        mShadowPassCB.NearZ = mVirtualDepthNear;
+        mShadowPassCB.FarZ = mVirtualDepthFar;
+
+        auto currPassCB = mCurrFrameResource->PassCB.get();
+        currPassCB->CopyData(1 + MaxShadowCascades + MaxShadowedLights + i, mShadowPassCB);
+    }
 }
 
 void CRYCHIC::UpdateSsaoCB(const GameTimer& gt)
@@ -924,6 +1882,7 @@ void CRYCHIC::UpdateSsaoCB(const GameTimer& gt)
     ssaoCB.BlurWeights[1] = XMFLOAT4(&blurWeights[4]);
     ssaoCB.BlurWeights[2] = XMFLOAT4(&blurWeights[8]);
 
+    ssaoCB.RenderTargetSize = XMFLOAT2((float)mSsao->SsaoMapWidth(), (float)mSsao->SsaoMapHeight());
     ssaoCB.InvRenderTargetSize = XMFLOAT2(1.0f / mSsao->SsaoMapWidth(), 1.0f / mSsao->SsaoMapHeight());
 
     // Coordinates given in view space.
@@ -931,11 +1890,59 @@ void CRYCHIC::UpdateSsaoCB(const GameTimer& gt)
     ssaoCB.OcclusionFadeStart = 0.2f;
     ssaoCB.OcclusionFadeEnd = 1.0f;
     ssaoCB.SurfaceEpsilon = 0.05f;
+    ssaoCB.NormalsFromGBuffer = mSsao->NormalsFromGBuffer() ? 1 : 0;
+
+    XMMATRIX view = mCamera.GetView();
+    XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+    XMStoreFloat4x4(&ssaoCB.InvView, XMMatrixTranspose(invView));
+    XMStoreFloat4x4(&ssaoCB.PrevViewProjTex, XMMatrixTranspose(XMLoadFloat4x4(&mSsaoPrevViewProj) * T));
+    XMStoreFloat4x4(&mSsaoPrevViewProj, view * P);
+
+    if (mSsaoSettings.Compute && mSsaoSettings.Temporal)
+    {
+        // A different run of the offset vectors and a different noise tile every frame.
+        ssaoCB.SampleCount = mSsaoSettings.TemporalSampleCount;
+        ssaoCB.SampleOffset = mSsaoFrame * mSsaoSettings.TemporalSampleCount % 14;
+        ssaoCB.NoiseOffset = MathHelper::RandF();
+        ssaoCB.TemporalAlpha = mSsao->HistoryValid() ? mSsaoSettings.TemporalAlpha : 1.0f;
+        mSsaoFrame++;
+    }
 
     auto currSsaoCB = mCurrFrameResource->SsaoCB.get();
     currSsaoCB->CopyData(0, ssaoCB);
 }
 
+void CRYCHIC::UpdateDepthReduceCB(const GameTimer& gt)
+{
+    if (!mCascadeSettings.FitToSamples)
+        return;
+
+    XMMATRIX view = mCamera.GetView();
+    XMMATRIX proj = mCamera.GetProj();
+    XMMATRIX invView = XMMatrixInverse(&XMMatrixDeterminant(view), view);
+    XMMATRIX invProj = XMMatrixInverse(&XMMatrixDeterminant(proj), proj);
+    XMMATRIX viewToLight = XMMatrixMultiply(invView, XMLoadFloat4x4(&mCascadeLightView));
+
+    DepthReduceConstants reduceCB;
+    XMStoreFloat4x4(&reduceCB.InvProj, XMMatrixTranspose(invProj));
+    XMStoreFloat4x4(&reduceCB.ViewToLight, XMMatrixTranspose(viewToLight));
+    float splits[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    std::copy(mCascadeSplits, mCascadeSplits + CascadeCount(), splits);
+    reduceCB.CascadeSplits = XMFLOAT4(splits);
+    reduceCB.CascadeCount = CascadeCount();
+    reduceCB.CascadeBlendBand = mCascadeSettings.BlendBand;
+    reduceCB.DepthMapSize = XMUINT2(mClientWidth, mClientHeight);
+
+    auto currDepthReduceCB = mCurrFrameResource->DepthReduceCB.get();
+    currDepthReduceCB->CopyData(0, reduceCB);
+
+    // Remembered until the result is read back, to tell whether its boxes still fit.
+    auto& inputs = mDepthReduceInputs[mCurrFrameResourceIndex];
+    XMStoreFloat4x4(&inputs.View, view);
+    inputs.LightView = mCascadeLightView;
+    std::copy(mCascadeSplits, mCascadeSplits + CascadeCount(), inputs.Splits);
+}
+
 void CRYCHIC::LoadTextures()
 {
     std::vector<std::string> texNames =
@@ -973,18 +1980,30 @@ void CRYCHIC::LoadTextures()
     }
 }
 
+void CRYCHIC::LoadSkyAmbient()
+{
+    const std::wstring& skyFile = mTextures["skyCubeMap"]->Filename;
+    std::wstring cacheFile = skyFile.substr(0, skyFile.find_last_of(L'.')) + L".sh9";
+    if (!SphericalHarmonics::LoadSkyIrradiance(skyFile, cacheFile, mSkyAmbient))
+    {
+        // Keep the old flat ambient when the sky cannot be projected.
+        ::OutputDebugStringA("LoadSkyAmbient: unsupported sky cube map, using a constant ambient.\n");
+        mSkyAmbient = SphericalHarmonics::Constant(XMFLOAT3(0.4f, 0.4f, 0.6f));
+    }
+}
+
 void CRYCHIC::BuildRootSignature()
 {
-    // cubemap, shadowmap, ssao
+    // cubemap, shadowmap, ssao, gbuffer, evsm
     CD3DX12_DESCRIPTOR_RANGE texTable0;
-    texTable0.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1 + 12 + 5 + 4, 0, 0);
+    texTable0.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1 + 1 + 5 + DeferredShading::GBufferCount + 1, 0, 0);
 
     // textures
     CD3DX12_DESCRIPTOR_RANGE texTable1;
-    texTable1.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 10, 22, 0);
+    texTable1.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 10, 10, 0);
 
     // Root parameter can be a table, root descriptor or root constants.
-    CD3DX12_ROOT_PARAMETER slotRootParameter[5];
+    CD3DX12_ROOT_PARAMETER slotRootParameter[11];
 
     // Perfomance TIP: Order from most frequent to least frequent.
     // structuredbuffer instanceData
@@ -995,12 +2014,21 @@ void CRYCHIC::BuildRootSignature()
     slotRootParameter[2].InitAsConstantBufferView(0);
     slotRootParameter[3].InitAsDescriptorTable(1, &texTable0, D3D12_SHADER_VISIBILITY_PIXEL);
     slotRootParameter[4].InitAsDescriptorTable(1, &texTable1, D3D12_SHADER_VISIBILITY_PIXEL);
-
+    // cascade draw mask and caster LOD of the single pass shadow shader
+    slotRootParameter[5].InitAsConstants(2, 1, 0, D3D12_SHADER_VISIBILITY_VERTEX);
+    // structuredbuffer virtual shadow map page table
+    slotRootParameter[6].InitAsShaderResourceView(2, 1, D3D12_SHADER_VISIBILITY_PIXEL);
+    // structuredbuffers clustered lights, froxel runs and light indices
+    slotRootParameter[7].InitAsShaderResourceView(3, 1, D3D12_SHADER_VISIBILITY_PIXEL);
+    slotRootParameter[8].InitAsShaderResourceView(4, 1, D3D12_SHADER_VISIBILITY_PIXEL);
+    slotRootParameter[9].InitAsShaderResourceView(5, 1, D3D12_SHADER_VISIBILITY_PIXEL);
+    // frameCB, bound once per frame; passCB above changes per view
+    slotRootParameter[10].InitAsConstantBufferView(2);
 
     auto staticSamplers = GetStaticSamplers();
 
     // A root signature is an array of root parameters.
-    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(5, slotRootParameter,
+    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(11, slotRootParameter,
         (UINT)staticSamplers.size(), staticSamplers.data(),
         D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
 
@@ -1065,24 +2093,210 @@ void CRYCHIC::BuildSsaoRootSignature()
         D3D12_COMPARISON_FUNC_LESS_EQUAL,
         D3D12_STATIC_BORDER_COLOR_OPAQUE_WHITE);
 
-    const CD3DX12_STATIC_SAMPLER_DESC linearWrap(
-        3, // shaderRegister
-        D3D12_FILTER_MIN_MAG_MIP_LINEAR, // filter
-        D3D12_TEXTURE_ADDRESS_MODE_WRAP,  // addressU
-        D3D12_TEXTURE_ADDRESS_MODE_WRAP,  // addressV
-        D3D12_TEXTURE_ADDRESS_MODE_WRAP); // addressW
+    const CD3DX12_STATIC_SAMPLER_DESC linearWrap(
+        3, // shaderRegister
+        D3D12_FILTER_MIN_MAG_MIP_LINEAR, // filter
+        D3D12_TEXTURE_ADDRESS_MODE_WRAP,  // addressU
+        D3D12_TEXTURE_ADDRESS_MODE_WRAP,  // addressV
+        D3D12_TEXTURE_ADDRESS_MODE_WRAP); // addressW
+
+    std::array<CD3DX12_STATIC_SAMPLER_DESC, 4> staticSamplers =
+    {
+        pointClamp, linearClamp, depthMapSam, linearWrap
+    };
+
+    // A root signature is an array of root parameters.
+    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(4, slotRootParameter,
+        (UINT)staticSamplers.size(), staticSamplers.data(),
+        D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
+
+    // create a root signature with a single slot which points to a descriptor range consisting of a single constant buffer
+    ComPtr<ID3DBlob> serializedRootSig = nullptr;
+    ComPtr<ID3DBlob> errorBlob = nullptr;
+    HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+        serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
+
+    if (errorBlob != nullptr)
+    {
+        ::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+    }
+    ThrowIfFailed(hr);
+
+    ThrowIfFailed(md3dDevice->CreateRootSignature(
+        0,
+        serializedRootSig->GetBufferPointer(),
+        serializedRootSig->GetBufferSize(),
+        IID_PPV_ARGS(mSsaoRootSignature.GetAddressOf())));
+}
+
+void CRYCHIC::BuildSsaoComputeRootSignature()
+{
+    // Normal, depth and random vector maps, which sit next to each other in the heap.
+    CD3DX12_DESCRIPTOR_RANGE texTable0;
+    texTable0.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 3, 0, 0);
+
+    // Blur or temporal input.
+    CD3DX12_DESCRIPTOR_RANGE texTable1;
+    texTable1.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 3, 0);
+
+    CD3DX12_DESCRIPTOR_RANGE uavTable0;
+    uavTable0.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 0, 0);
+
+    // Last and next history of the temporal pass.
+    CD3DX12_DESCRIPTOR_RANGE texTable2;
+    texTable2.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 4, 0);
+
+    CD3DX12_DESCRIPTOR_RANGE uavTable1;
+    uavTable1.Init(D3D12_DESCRIPTOR_RANGE_TYPE_UAV, 1, 1, 0);
+
+    CD3DX12_ROOT_PARAMETER slotRootParameter[6];
+    slotRootParameter[0].InitAsConstantBufferView(0);
+    slotRootParameter[1].InitAsDescriptorTable(1, &texTable0);
+    slotRootParameter[2].InitAsDescriptorTable(1, &texTable1);
+    slotRootParameter[3].InitAsDescriptorTable(1, &uavTable0);
+    slotRootParameter[4].InitAsDescriptorTable(1, &texTable2);
+    slotRootParameter[5].InitAsDescriptorTable(1, &uavTable1);
+
+    // Same samplers as the pixel shader path, Ssao.hlsl is shared.
+    const CD3DX12_STATIC_SAMPLER_DESC pointClamp(
+        0, // shaderRegister
+        D3D12_FILTER_MIN_MAG_MIP_POINT, // filter
+        D3D12_TEXTURE_ADDRESS_MODE_CLAMP,  // addressU
+        D3D12_TEXTURE_ADDRESS_MODE_CLAMP,  // addressV
+        D3D12_TEXTURE_ADDRESS_MODE_CLAMP); // addressW
+
+    const CD3DX12_STATIC_SAMPLER_DESC linearClamp(
+        1, // shaderRegister
+        D3D12_FILTER_MIN_MAG_MIP_LINEAR, // filter
+        D3D12_TEXTURE_ADDRESS_MODE_CLAMP,  // addressU
+        D3D12_TEXTURE_ADDRESS_MODE_CLAMP,  // addressV
+        D3D12_TEXTURE_ADDRESS_MODE_CLAMP); // addressW
+
+    const CD3DX12_STATIC_SAMPLER_DESC depthMapSam(
+        2, // shaderRegister
+        D3D12_FILTER_MIN_MAG_MIP_LINEAR, // filter
+        D3D12_TEXTURE_ADDRESS_MODE_BORDER,  // addressU
+        D3D12_TEXTURE_ADDRESS_MODE_BORDER,  // addressV
+        D3D12_TEXTURE_ADDRESS_MODE_BORDER,  // addressW
+        0.0f,
+        0,
+        D3D12_COMPARISON_FUNC_LESS_EQUAL,
+        D3D12_STATIC_BORDER_COLOR_OPAQUE_WHITE);
+
+    const CD3DX12_STATIC_SAMPLER_DESC linearWrap(
+        3, // shaderRegister
+        D3D12_FILTER_MIN_MAG_MIP_LINEAR, // filter
+        D3D12_TEXTURE_ADDRESS_MODE_WRAP,  // addressU
+        D3D12_TEXTURE_ADDRESS_MODE_WRAP,  // addressV
+        D3D12_TEXTURE_ADDRESS_MODE_WRAP); // addressW
+
+    std::array<CD3DX12_STATIC_SAMPLER_DESC, 4> staticSamplers =
+    {
+        pointClamp, linearClamp, depthMapSam, linearWrap
+    };
+
+    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(6, slotRootParameter,
+        (UINT)staticSamplers.size(), staticSamplers.data(),
+        D3D12_ROOT_SIGNATURE_FLAG_NONE);
+
+    ComPtr<ID3DBlob> serializedRootSig = nullptr;
+    ComPtr<ID3DBlob> errorBlob = nullptr;
+    HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+        serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
+
+    if (errorBlob != nullptr)
+    {
+        ::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+    }
+    ThrowIfFailed(hr);
+
+    ThrowIfFailed(md3dDevice->CreateRootSignature(
+        0,
+        serializedRootSig->GetBufferPointer(),
+        serializedRootSig->GetBufferSize(),
+        IID_PPV_ARGS(mSsaoComputeRootSignature.GetAddressOf())));
+}
+
+void CRYCHIC::BuildShadowCacheRootSignature()
+{
+    CD3DX12_DESCRIPTOR_RANGE texTable;
+    texTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0, 0);
+
+    CD3DX12_ROOT_PARAMETER slotRootParameter[1];
+    slotRootParameter[0].InitAsDescriptorTable(1, &texTable, D3D12_SHADER_VISIBILITY_PIXEL);
+
+    // The blit reads texels with Load, so no samplers.
+    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(1, slotRootParameter, 0, nullptr,
+        D3D12_ROOT_SIGNATURE_FLAG_NONE);
+
+    ComPtr<ID3DBlob> serializedRootSig = nullptr;
+    ComPtr<ID3DBlob> errorBlob = nullptr;
+    HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+        serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
+
+    if (errorBlob != nullptr)
+    {
+        ::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+    }
+    ThrowIfFailed(hr);
+
+    ThrowIfFailed(md3dDevice->CreateRootSignature(
+        0,
+        serializedRootSig->GetBufferPointer(),
+        serializedRootSig->GetBufferSize(),
+        IID_PPV_ARGS(mShadowCacheRootSignature.GetAddressOf())));
+}
+
+void CRYCHIC::BuildDepthReduceRootSignature()
+{
+    CD3DX12_DESCRIPTOR_RANGE texTable;
+    texTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0, 0);
+
+    CD3DX12_ROOT_PARAMETER slotRootParameter[3];
+    // reduce constants
+    slotRootParameter[0].InitAsConstantBufferView(0);
+    // depth map
+    slotRootParameter[1].InitAsDescriptorTable(1, &texTable);
+    // bounds buffer
+    slotRootParameter[2].InitAsUnorderedAccessView(0);
+
+    // The reduction reads texels with Load, so no samplers.
+    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(3, slotRootParameter, 0, nullptr,
+        D3D12_ROOT_SIGNATURE_FLAG_NONE);
+
+    ComPtr<ID3DBlob> serializedRootSig = nullptr;
+    ComPtr<ID3DBlob> errorBlob = nullptr;
+    HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
+        serializedRootSig.GetAddressOf(), errorBlob.GetAddressOf());
+
+    if (errorBlob != nullptr)
+    {
+        ::OutputDebugStringA((char*)errorBlob->GetBufferPointer());
+    }
+    ThrowIfFailed(hr);
+
+    ThrowIfFailed(md3dDevice->CreateRootSignature(
+        0,
+        serializedRootSig->GetBufferPointer(),
+        serializedRootSig->GetBufferSize(),
+        IID_PPV_ARGS(mDepthReduceRootSignature.GetAddressOf())));
+}
+
+void CRYCHIC::BuildEvsmRootSignature()
+{
+    CD3DX12_DESCRIPTOR_RANGE texTable;
+    texTable.Init(D3D12_DESCRIPTOR_RANGE_TYPE_SRV, 1, 0, 0);
 
-    std::array<CD3DX12_STATIC_SAMPLER_DESC, 4> staticSamplers =
-    {
-        pointClamp, linearClamp, depthMapSam, linearWrap
-    };
+    CD3DX12_ROOT_PARAMETER slotRootParameter[2];
+    // atlas or moments being filtered
+    slotRootParameter[0].InitAsDescriptorTable(1, &texTable, D3D12_SHADER_VISIBILITY_PIXEL);
+    // tile rectangle
+    slotRootParameter[1].InitAsConstants(4, 0, 0, D3D12_SHADER_VISIBILITY_PIXEL);
 
-    // A root signature is an array of root parameters.
-    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(4, slotRootParameter,
-        (UINT)staticSamplers.size(), staticSamplers.data(),
-        D3D12_ROOT_SIGNATURE_FLAG_ALLOW_INPUT_ASSEMBLER_INPUT_LAYOUT);
+    // The filters read texels with Load, so no samplers.
+    CD3DX12_ROOT_SIGNATURE_DESC rootSigDesc(2, slotRootParameter, 0, nullptr,
+        D3D12_ROOT_SIGNATURE_FLAG_NONE);
 
-    // create a root signature with a single slot which points to a descriptor range consisting of a single constant buffer
     ComPtr<ID3DBlob> serializedRootSig = nullptr;
     ComPtr<ID3DBlob> errorBlob = nullptr;
     HRESULT hr = D3D12SerializeRootSignature(&rootSigDesc, D3D_ROOT_SIGNATURE_VERSION_1,
@@ -1098,7 +2312,7 @@ void CRYCHIC::BuildSsaoRootSignature()
         0,
         serializedRootSig->GetBufferPointer(),
         serializedRootSig->GetBufferSize(),
-        IID_PPV_ARGS(mSsaoRootSignature.GetAddressOf())));
+        IID_PPV_ARGS(mEvsmRootSignature.GetAddressOf())));
 }
 
 void CRYCHIC::BuildDescriptorHeaps()
@@ -1107,7 +2321,7 @@ void CRYCHIC::BuildDescriptorHeaps()
     // Create the SRV heap.
     //
     D3D12_DESCRIPTOR_HEAP_DESC srvHeapDesc = {};
-    srvHeapDesc.NumDescriptors = 18 + 10 + 4 + 2;
+    srvHeapDesc.NumDescriptors = 7 + 10 + DeferredShading::GBufferCount + 2 + 1 + 1 + 2 + 6;
     srvHeapDesc.Type = D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV;
     srvHeapDesc.Flags = D3D12_DESCRIPTOR_HEAP_FLAG_SHADER_VISIBLE;
     ThrowIfFailed(md3dDevice->CreateDescriptorHeap(&srvHeapDesc, IID_PPV_ARGS(&mSrvDescriptorHeap)));
@@ -1158,12 +2372,18 @@ void CRYCHIC::BuildDescriptorHeaps()
     mSkyTexHeapIndex = (UINT)tex2DList.size();
     //mSkyTexHeapIndex = mDeferredIndex + 4;
     mShadowMapHeapIndex = mSkyTexHeapIndex + 1;
-    mSsaoHeapIndexStart = mShadowMapHeapIndex + 12;
+    mSsaoHeapIndexStart = mShadowMapHeapIndex + 1;
     mSsaoAmbientMapIndex = mSsaoHeapIndexStart + 3;
     mDeferredIndex = mSsaoHeapIndexStart + 5;
-    mNullCubeSrvIndex = mDeferredIndex + 4;
+    // The EVSM moments end texTable0; their blur target sits right after them.
+    mEvsmHeapIndex = mDeferredIndex + DeferredShading::GBufferCount;
+    mNullCubeSrvIndex = mEvsmHeapIndex + 2;
     mNullTexSrvIndex1 = mNullCubeSrvIndex + 1;
     mNullTexSrvIndex2 = mNullTexSrvIndex1 + 1;
+    mShadowCacheHeapIndex = mNullTexSrvIndex2 + 1;
+    mDepthReduceHeapIndex = mShadowCacheHeapIndex + 1;
+    // Ambient map UAVs and history maps of the compute SSAO.
+    mSsaoUavHeapIndex = mDepthReduceHeapIndex + 1;
 
     auto nullSrv = GetCpuSrv(mNullCubeSrvIndex);
     mNullSrv = GetGpuSrv(mNullCubeSrvIndex);
@@ -1191,13 +2411,36 @@ void CRYCHIC::BuildDescriptorHeaps()
     mShadowMap->BuildDescriptors(
         GetCpuSrv(mShadowMapHeapIndex),
         GetGpuSrv(mShadowMapHeapIndex),
-        GetDsv(1));
+        GetDsv(1),
+        GetCpuSrv(mShadowCacheHeapIndex),
+        GetGpuSrv(mShadowCacheHeapIndex),
+        GetDsv(2));
 
+    // The deferred path has no normal/depth pass; SSAO takes the G-buffer's normals.
+    // The render graph supplies either once it has placed them.
+    if (isDeferred)
+        mSsao->SetNormalMap(nullptr, DeferredShading::Format(1), true);
+    else
+        mSsao->SetNormalMap(nullptr, Ssao::NormalMapFormat, false);
     mSsao->BuildDescriptors(
         mDepthStencilBuffer.Get(),
         GetCpuSrv(mSsaoHeapIndexStart),
         GetGpuSrv(mSsaoHeapIndexStart),
         GetRtv(SwapChainBufferCount),
+        GetCpuSrv(mSsaoUavHeapIndex),
+        GetGpuSrv(mSsaoUavHeapIndex),
+        mCbvSrvUavDescriptorSize,
+        mRtvDescriptorSize);
+
+    mSampleDistribution->BuildDescriptors(
+        mDepthStencilBuffer.Get(),
+        GetCpuSrv(mDepthReduceHeapIndex),
+        GetGpuSrv(mDepthReduceHeapIndex));
+
+    mEvsmMap->BuildDescriptors(
+        GetCpuSrv(mEvsmHeapIndex),
+        GetGpuSrv(mEvsmHeapIndex),
+        GetRtv(SwapChainBufferCount + 3 + DeferredShading::GBufferCount),
         mCbvSrvUavDescriptorSize,
         mRtvDescriptorSize);
 }
@@ -1210,12 +2453,38 @@ void CRYCHIC::BuildShadersAndInputLayout()
         NULL, NULL
     };
 
+    const D3D_SHADER_MACRO singlePassCascadesDefines[] =
+    {
+        "SINGLE_PASS_CASCADES", "1",
+        NULL, NULL
+    };
+
+    const D3D_SHADER_MACRO depthOnlyDefines[] =
+    {
+        "DEPTH_ONLY", "1",
+        NULL, NULL
+    };
+
+    const D3D_SHADER_MACRO singlePassCascadesDepthOnlyDefines[] =
+    {
+        "SINGLE_PASS_CASCADES", "1",
+        "DEPTH_ONLY", "1",
+        NULL, NULL
+    };
+
+    const D3D_SHADER_MACRO horizontalBlurDefines[] =
+    {
+        "HORIZONTAL_BLUR", "1",
+        NULL, NULL
+    };
+
     mShaders["standardVS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", nullptr, "VS", "vs_5_1");
     mShaders["opaquePS"] = d3dUtil::CompileShader(L"Shaders\\Default.hlsl", nullptr, "PS", "ps_5_1");
 
-    mShaders["shadowVS"] = d3dUtil::CompileShader(L"Shaders\\Shadows.hlsl", nullptr, "VS", "vs_5_1");
-    mShaders["shadowOpaquePS"] = d3dUtil::CompileShader(L"Shaders\\Shadows.hlsl", nullptr, "PS", "ps_5_1");
+    // Opaque casters only write depth: position-only vertices and no pixel shader.
+    mShaders["shadowVS"] = d3dUtil::CompileShader(L"Shaders\\Shadows.hlsl", depthOnlyDefines, "VS", "vs_5_1");
     mShaders["shadowAlphaTestedPS"] = d3dUtil::CompileShader(L"Shaders\\Shadows.hlsl", alphaTestDefines, "PS", "ps_5_1");
+    mShaders["shadowCascadesVS"] = d3dUtil::CompileShader(L"Shaders\\Shadows.hlsl", singlePassCascadesDepthOnlyDefines, "VS", "vs_5_1");
 
     mShaders["debugVS"] = d3dUtil::CompileShader(L"Shaders\\ShadowDebug.hlsl", nullptr, "VS", "vs_5_1");
     mShaders["debugPS"] = d3dUtil::CompileShader(L"Shaders\\ShadowDebug.hlsl", nullptr, "PS", "ps_5_1");
@@ -1226,9 +2495,38 @@ void CRYCHIC::BuildShadersAndInputLayout()
     mShaders["ssaoVS"] = d3dUtil::CompileShader(L"Shaders\\Ssao.hlsl", nullptr, "VS", "vs_5_1");
     mShaders["ssaoPS"] = d3dUtil::CompileShader(L"Shaders\\Ssao.hlsl", nullptr, "PS", "ps_5_1");
 
+    mShaders["shadowCacheBlitVS"] = d3dUtil::CompileShader(L"Shaders\\ShadowCacheBlit.hlsl", nullptr, "VS", "vs_5_1");
+    mShaders["shadowCacheBlitPS"] = d3dUtil::CompileShader(L"Shaders\\ShadowCacheBlit.hlsl", nullptr, "PS", "ps_5_1");
+
+    mShaders["depthReduceCS"] = d3dUtil::CompileShader(L"Shaders\\DepthReduce.hlsl", nullptr, "CS", "cs_5_1");
+    mShaders["virtualShadowMarkCS"] = d3dUtil::CompileShader(L"Shaders\\VirtualShadowMark.hlsl", nullptr, "CS", "cs_5_1");
+
+    mShaders["evsmVS"] = d3dUtil::CompileShader(L"Shaders\\Evsm.hlsl", nullptr, "VS", "vs_5_1");
+    mShaders["evsmConvertPS"] = d3dUtil::CompileShader(L"Shaders\\Evsm.hlsl", nullptr, "ConvertPS", "ps_5_1");
+    mShaders["evsmBlurHorzPS"] = d3dUtil::CompileShader(L"Shaders\\Evsm.hlsl", horizontalBlurDefines, "BlurPS", "ps_5_1");
+    mShaders["evsmBlurVertPS"] = d3dUtil::CompileShader(L"Shaders\\Evsm.hlsl", nullptr, "BlurPS", "ps_5_1");
+
     mShaders["ssaoBlurVS"] = d3dUtil::CompileShader(L"Shaders\\SsaoBlur.hlsl", nullptr, "VS", "vs_5_1");
     mShaders["ssaoBlurPS"] = d3dUtil::CompileShader(L"Shaders\\SsaoBlur.hlsl", nullptr, "PS", "ps_5_1");
 
+    mShaders["ssaoCS"] = d3dUtil::CompileShader(L"Shaders\\SsaoCompute.hlsl", nullptr, "SsaoCS", "cs_5_1");
+    mShaders["ssaoBlurCS"] = d3dUtil::CompileShader(L"Shaders\\SsaoCompute.hlsl", nullptr, "BlurCS", "cs_5_1");
+    mShaders["ssaoTemporalCS"] = d3dUtil::CompileShader(L"Shaders\\SsaoCompute.hlsl", nullptr, "TemporalCS", "cs_5_1");
+
+    for (int i = 0; i < (int)GtaoTier::Count; ++i)
+    {
+        GtaoTierDesc tier = Gtao::TierDesc((GtaoTier)i);
+        std::string slices = std::to_string(tier.Slices);
+        std::string steps = std::to_string(tier.StepsPerSide);
+        const D3D_SHADER_MACRO gtaoDefines[] =
+        {
+            "GTAO_SLICES", slices.c_str(),
+            "GTAO_STEPS", steps.c_str(),
+            NULL, NULL
+        };
+        mShaders["gtaoCS" + std::to_string(i)] = d3dUtil::CompileShader(L"Shaders\\SsaoCompute.hlsl", gtaoDefines, "GtaoCS", "cs_5_1");
+    }
+
     mShaders["skyVS"] = d3dUtil::CompileShader(L"Shaders\\Sky.hlsl", nullptr, "VS", "vs_5_1");
     mShaders["skyPS"] = d3dUtil::CompileShader(L"Shaders\\Sky.hlsl", nullptr, "PS", "ps_5_1");
 
@@ -1245,8 +2543,14 @@ void CRYCHIC::BuildShadersAndInputLayout()
         { "TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT, 0, 24, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
         { "TANGENT", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 32, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
     };
+
+    mPositionInputLayout =
+    {
+        { "POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0, D3D12_INPUT_CLASSIFICATION_PER_VERTEX_DATA, 0 },
+    };
 }
 
+
 void CRYCHIC::BuildShapeGeometry()
 {
     GeometryGenerator geoGen;
@@ -1412,6 +2716,37 @@ void CRYCHIC::BuildShapeGeometry()
     indices.insert(indices.end(), std::begin(cylinder.GetIndices16()), std::end(cylinder.GetIndices16()));
     indices.insert(indices.end(), std::begin(quad.GetIndices16()), std::end(quad.GetIndices16()));
 
+    // Coarser boxes and grids for far shadow cascades, appended after the full meshes.
+    // Shadows only need the silhouette, so fewer subdivisions cast the same depth.
+    auto appendShadowLod = [&vertices, &indices](GeometryGenerator::MeshData& mesh, const SubmeshGeometry& full)
+    {
+        SubmeshGeometry submesh;
+        submesh.IndexCount = (UINT)mesh.Indices32.size();
+        submesh.StartIndexLocation = (UINT)indices.size();
+        submesh.BaseVertexLocation = (INT)vertices.size();
+        submesh.Bounds = full.Bounds;
+
+        for (const auto& v : mesh.Vertices)
+        {
+            Vertex vertex;
+            vertex.Pos = v.Position;
+            vertex.Normal = v.Normal;
+            vertex.TexC = v.TexC;
+            vertex.TangentU = v.TangentU;
+            vertices.push_back(vertex);
+        }
+        indices.insert(indices.end(), std::begin(mesh.GetIndices16()), std::end(mesh.GetIndices16()));
+        return submesh;
+    };
+    GeometryGenerator::MeshData boxLod1 = geoGen.CreateBox(1.0f, 1.0f, 1.0f, 1);
+    GeometryGenerator::MeshData boxLod2 = geoGen.CreateBox(1.0f, 1.0f, 1.0f, 0);
+    GeometryGenerator::MeshData gridLod1 = geoGen.CreateGrid(20.0f, 30.0f, 15, 10);
+    GeometryGenerator::MeshData gridLod2 = geoGen.CreateGrid(20.0f, 30.0f, 2, 2);
+    SubmeshGeometry boxLod1Submesh = appendShadowLod(boxLod1, boxSubmesh);
+    SubmeshGeometry boxLod2Submesh = appendShadowLod(boxLod2, boxSubmesh);
+    SubmeshGeometry gridLod1Submesh = appendShadowLod(gridLod1, gridSubmesh);
+    SubmeshGeometry gridLod2Submesh = appendShadowLod(gridLod2, gridSubmesh);
+
     const UINT vbByteSize = (UINT)vertices.size() * sizeof(Vertex);
     const UINT ibByteSize = (UINT)indices.size() * sizeof(std::uint16_t);
 
@@ -1435,11 +2770,17 @@ void CRYCHIC::BuildShapeGeometry()
     geo->IndexFormat = DXGI_FORMAT_R16_UINT;
     geo->IndexBufferByteSize = ibByteSize;
 
+    BuildPositionStream(geo.get(), vertices);
+
     geo->DrawArgs["box"] = boxSubmesh;
     geo->DrawArgs["grid"] = gridSubmesh;
     geo->DrawArgs["sphere"] = sphereSubmesh;
     geo->DrawArgs["cylinder"] = cylinderSubmesh;
     geo->DrawArgs["quad"] = quadSubmesh;
+    geo->DrawArgs["boxLod1"] = boxLod1Submesh;
+    geo->DrawArgs["boxLod2"] = boxLod2Submesh;
+    geo->DrawArgs["gridLod1"] = gridLod1Submesh;
+    geo->DrawArgs["gridLod2"] = gridLod2Submesh;
 
     mGeometries[geo->Name] = std::move(geo);
 }
@@ -1545,6 +2886,8 @@ void CRYCHIC::BuildSkullGeometry()
     geo->IndexFormat = DXGI_FORMAT_R32_UINT;
     geo->IndexBufferByteSize = ibByteSize;
 
+    BuildPositionStream(geo.get(), vertices);
+
     SubmeshGeometry submesh;
     submesh.IndexCount = (UINT)indices.size();
     submesh.StartIndexLocation = 0;
@@ -1556,6 +2899,23 @@ void CRYCHIC::BuildSkullGeometry()
     mGeometries[geo->Name] = std::move(geo);
 }
 
+void CRYCHIC::BuildPositionStream(MeshGeometry* geo, const std::vector<Vertex>& vertices)
+{
+    std::vector<XMFLOAT3> positions(vertices.size());
+    for (size_t i = 0; i < vertices.size(); ++i)
+        positions[i] = vertices[i].Pos;
+
+    const UINT pbByteSize = (UINT)positions.size() * sizeof(XMFLOAT3);
+
+    ThrowIfFailed(D3DCreateBlob(pbByteSize, &geo->PositionBufferCPU));
+    CopyMemory(geo->PositionBufferCPU->GetBufferPointer(), positions.data(), pbByteSize);
+
+    geo->PositionBufferGPU = d3dUtil::CreateDefaultBuffer(md3dDevice.Get(),
+        mCommandList.Get(), positions.data(), pbByteSize, geo->PositionBufferUploader);
+
+    geo->PositionBufferByteSize = pbByteSize;
+}
+
 void CRYCHIC::BuildPSOs()
 {
     D3D12_GRAPHICS_PIPELINE_STATE_DESC basePsoDesc;
@@ -1593,6 +2953,7 @@ void CRYCHIC::BuildPSOs()
     opaquePsoDesc.DepthStencilState.DepthFunc = D3D12_COMPARISON_FUNC_EQUAL;
     opaquePsoDesc.DepthStencilState.DepthWriteMask = D3D12_DEPTH_WRITE_MASK_ZERO;
     ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&opaquePsoDesc, IID_PPV_ARGS(&mPSOs["opaque"])));
+    mShaderPermutations->AddPipeline("opaque", opaquePsoDesc, L"Shaders\\Default.hlsl", "PS", ShaderFeatureAll);
 
     //
     // PSO for shadow map pass.
@@ -1602,22 +2963,54 @@ void CRYCHIC::BuildPSOs()
     smapPsoDesc.RasterizerState.DepthBiasClamp = 0.0f;
     smapPsoDesc.RasterizerState.SlopeScaledDepthBias = 2.0f;
     smapPsoDesc.pRootSignature = mRootSignature.Get();
+    smapPsoDesc.InputLayout = { mPositionInputLayout.data(), (UINT)mPositionInputLayout.size() };
     smapPsoDesc.VS =
     {
         reinterpret_cast<BYTE*>(mShaders["shadowVS"]->GetBufferPointer()),
         mShaders["shadowVS"]->GetBufferSize()
     };
-    smapPsoDesc.PS =
-    {
-        reinterpret_cast<BYTE*>(mShaders["shadowOpaquePS"]->GetBufferPointer()),
-        mShaders["shadowOpaquePS"]->GetBufferSize()
-    };
+    smapPsoDesc.PS = { nullptr, 0 };
 
     // Shadow map pass does not have a render target.
     smapPsoDesc.RTVFormats[0] = DXGI_FORMAT_UNKNOWN;
     smapPsoDesc.NumRenderTargets = 0;
     ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&smapPsoDesc, IID_PPV_ARGS(&mPSOs["shadow_opaque"])));
 
+    //
+    // PSO for drawing every cascade of the shadow map pass at once.
+    //
+    D3D12_GRAPHICS_PIPELINE_STATE_DESC smapCascadesPsoDesc = smapPsoDesc;
+    smapCascadesPsoDesc.VS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["shadowCascadesVS"]->GetBufferPointer()),
+        mShaders["shadowCascadesVS"]->GetBufferSize()
+    };
+
+    ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&smapCascadesPsoDesc, IID_PPV_ARGS(&mPSOs["shadow_opaque_cascades"])));
+
+    //
+    // PSO for copying the static shadow caster cache into the atlas.
+    //
+    D3D12_GRAPHICS_PIPELINE_STATE_DESC shadowCacheBlitPsoDesc = smapPsoDesc;
+    shadowCacheBlitPsoDesc.InputLayout = { nullptr, 0 };
+    shadowCacheBlitPsoDesc.pRootSignature = mShadowCacheRootSignature.Get();
+    shadowCacheBlitPsoDesc.VS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["shadowCacheBlitVS"]->GetBufferPointer()),
+        mShaders["shadowCacheBlitVS"]->GetBufferSize()
+    };
+    shadowCacheBlitPsoDesc.PS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["shadowCacheBlitPS"]->GetBufferPointer()),
+        mShaders["shadowCacheBlitPS"]->GetBufferSize()
+    };
+
+    // The cached depth already carries the bias; overwrite whatever the atlas holds.
+    shadowCacheBlitPsoDesc.RasterizerState = CD3DX12_RASTERIZER_DESC(D3D12_DEFAULT);
+    shadowCacheBlitPsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+    shadowCacheBlitPsoDesc.DepthStencilState.DepthFunc = D3D12_COMPARISON_FUNC_ALWAYS;
+    ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&shadowCacheBlitPsoDesc, IID_PPV_ARGS(&mPSOs["shadowCacheBlit"])));
+
     //
     // PSO for debug layer.
     //
@@ -1697,18 +3090,121 @@ void CRYCHIC::BuildPSOs()
     };
     ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&ssaoBlurPsoDesc, IID_PPV_ARGS(&mPSOs["ssaoBlur"])));
 
+    //
+    // PSO for reducing the depth buffer to the visible sample bounds.
+    //
+    D3D12_COMPUTE_PIPELINE_STATE_DESC depthReducePsoDesc = {};
+    depthReducePsoDesc.pRootSignature = mDepthReduceRootSignature.Get();
+    depthReducePsoDesc.CS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["depthReduceCS"]->GetBufferPointer()),
+        mShaders["depthReduceCS"]->GetBufferSize()
+    };
+    depthReducePsoDesc.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+    ThrowIfFailed(md3dDevice->CreateComputePipelineState(&depthReducePsoDesc, IID_PPV_ARGS(&mPSOs["depthReduce"])));
+
+    //
+    // PSO for marking the virtual shadow pages the depth buffer needs; same bindings
+    // as the reduction.
+    //
+    D3D12_COMPUTE_PIPELINE_STATE_DESC virtualShadowMarkPsoDesc = depthReducePsoDesc;
+    virtualShadowMarkPsoDesc.CS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["virtualShadowMarkCS"]->GetBufferPointer()),
+        mShaders["virtualShadowMarkCS"]->GetBufferSize()
+    };
+    ThrowIfFailed(md3dDevice->CreateComputePipelineState(&virtualShadowMarkPsoDesc, IID_PPV_ARGS(&mPSOs["virtualShadowMark"])));
+
+    //
+    // PSOs for computing and blurring the ambient map in compute shaders.
+    //
+    D3D12_COMPUTE_PIPELINE_STATE_DESC ssaoComputePsoDesc = {};
+    ssaoComputePsoDesc.pRootSignature = mSsaoComputeRootSignature.Get();
+    ssaoComputePsoDesc.CS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["ssaoCS"]->GetBufferPointer()),
+        mShaders["ssaoCS"]->GetBufferSize()
+    };
+    ssaoComputePsoDesc.Flags = D3D12_PIPELINE_STATE_FLAG_NONE;
+    ThrowIfFailed(md3dDevice->CreateComputePipelineState(&ssaoComputePsoDesc, IID_PPV_ARGS(&mPSOs["ssaoCompute"])));
+
+    D3D12_COMPUTE_PIPELINE_STATE_DESC ssaoBlurComputePsoDesc = ssaoComputePsoDesc;
+    ssaoBlurComputePsoDesc.CS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["ssaoBlurCS"]->GetBufferPointer()),
+        mShaders["ssaoBlurCS"]->GetBufferSize()
+    };
+    ThrowIfFailed(md3dDevice->CreateComputePipelineState(&ssaoBlurComputePsoDesc, IID_PPV_ARGS(&mPSOs["ssaoBlurCompute"])));
+
+    D3D12_COMPUTE_PIPELINE_STATE_DESC ssaoTemporalPsoDesc = ssaoComputePsoDesc;
+    ssaoTemporalPsoDesc.CS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["ssaoTemporalCS"]->GetBufferPointer()),
+        mShaders["ssaoTemporalCS"]->GetBufferSize()
+    };
+    ThrowIfFailed(md3dDevice->CreateComputePipelineState(&ssaoTemporalPsoDesc, IID_PPV_ARGS(&mPSOs["ssaoTemporal"])));
+
+    // One ground truth AO PSO per GtaoTier.
+    for (int i = 0; i < (int)GtaoTier::Count; ++i)
+    {
+        std::string name = "gtao" + std::to_string(i);
+        D3D12_COMPUTE_PIPELINE_STATE_DESC gtaoPsoDesc = ssaoComputePsoDesc;
+        gtaoPsoDesc.CS =
+        {
+            reinterpret_cast<BYTE*>(mShaders[name + "CS"]->GetBufferPointer()),
+            mShaders[name + "CS"]->GetBufferSize()
+        };
+        ThrowIfFailed(md3dDevice->CreateComputePipelineState(&gtaoPsoDesc, IID_PPV_ARGS(&mPSOs[name])));
+    }
+
+    //
+    // PSOs for converting the shadow atlas to EVSM moments and blurring them.
+    //
+    D3D12_GRAPHICS_PIPELINE_STATE_DESC evsmPsoDesc = ssaoPsoDesc;
+    evsmPsoDesc.pRootSignature = mEvsmRootSignature.Get();
+    evsmPsoDesc.VS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["evsmVS"]->GetBufferPointer()),
+        mShaders["evsmVS"]->GetBufferSize()
+    };
+    evsmPsoDesc.PS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["evsmConvertPS"]->GetBufferPointer()),
+        mShaders["evsmConvertPS"]->GetBufferSize()
+    };
+    evsmPsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
+    evsmPsoDesc.RTVFormats[0] = EvsmMap::Format;
+    ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&evsmPsoDesc, IID_PPV_ARGS(&mPSOs["evsmConvert"])));
+
+    evsmPsoDesc.PS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["evsmBlurHorzPS"]->GetBufferPointer()),
+        mShaders["evsmBlurHorzPS"]->GetBufferSize()
+    };
+    ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&evsmPsoDesc, IID_PPV_ARGS(&mPSOs["evsmBlurHorz"])));
+
+    evsmPsoDesc.PS =
+    {
+        reinterpret_cast<BYTE*>(mShaders["evsmBlurVertPS"]->GetBufferPointer()),
+        mShaders["evsmBlurVertPS"]->GetBufferSize()
+    };
+    ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&evsmPsoDesc, IID_PPV_ARGS(&mPSOs["evsmBlurVert"])));
+
     //
     // PSO for sky.
     //
     D3D12_GRAPHICS_PIPELINE_STATE_DESC skyPsoDesc = basePsoDesc;
 
-    // The camera is inside the sky sphere, so just turn off culling.
+    // A fullscreen triangle built from SV_VertexID.
+    skyPsoDesc.InputLayout = { nullptr, 0 };
     skyPsoDesc.RasterizerState.CullMode = D3D12_CULL_MODE_NONE;
 
     // Make sure the depth function is LESS_EQUAL and not just LESS.  
     // Otherwise, the normalized depth values at z = 1 (NDC) will 
     // fail the depth test if the depth buffer was cleared to 1.
     skyPsoDesc.DepthStencilState.DepthFunc = D3D12_COMPARISON_FUNC_LESS_EQUAL;
+    // Nothing after the sky reads depth, and the deferred path binds it read-only.
+    skyPsoDesc.DepthStencilState.DepthWriteMask = D3D12_DEPTH_WRITE_MASK_ZERO;
     skyPsoDesc.pRootSignature = mRootSignature.Get();
     skyPsoDesc.VS =
     {
@@ -1734,12 +3230,18 @@ void CRYCHIC::BuildPSOs()
         reinterpret_cast<BYTE*>(mShaders["geometryPS"]->GetBufferPointer()),
         mShaders["geometryPS"]->GetBufferSize()
     };
-    gBufferPsoDesc.NumRenderTargets = 4;
-    for (size_t i = 0; i < 4; i++)
+    // Mark covered pixels in the stencil, so the lighting pass skips the background.
+    gBufferPsoDesc.DepthStencilState.StencilEnable = TRUE;
+    gBufferPsoDesc.DepthStencilState.FrontFace.StencilPassOp = D3D12_STENCIL_OP_REPLACE;
+    gBufferPsoDesc.DepthStencilState.BackFace.StencilPassOp = D3D12_STENCIL_OP_REPLACE;
+    gBufferPsoDesc.NumRenderTargets = DeferredShading::GBufferCount;
+    for (size_t i = 0; i < DeferredShading::GBufferCount; i++)
     {
-        gBufferPsoDesc.RTVFormats[i] = mDeferred->Format();
+        gBufferPsoDesc.RTVFormats[i] = DeferredShading::Format((int)i);
     }
     ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&gBufferPsoDesc, IID_PPV_ARGS(&mPSOs["geometryPass"])));
+    mShaderPermutations->AddPipeline("geometryPass", gBufferPsoDesc, L"Shaders\\GeometryPass.hlsl", "PS",
+        ShaderFeatureAlphaTest | ShaderFeatureNormalMap);
 
     //
     // PSO for DeferredShading.
@@ -1753,7 +3255,16 @@ void CRYCHIC::BuildPSOs()
     reinterpret_cast<BYTE*>(mShaders["deferredPS"]->GetBufferPointer()),
     mShaders["deferredPS"]->GetBufferSize()
     };
+    deferredPsoDesc.InputLayout = { nullptr, 0 };
+    deferredPsoDesc.DepthStencilState.DepthEnable = FALSE;
+    deferredPsoDesc.DepthStencilState.DepthWriteMask = D3D12_DEPTH_WRITE_MASK_ZERO;
+    deferredPsoDesc.DepthStencilState.StencilEnable = TRUE;
+    deferredPsoDesc.DepthStencilState.StencilWriteMask = 0;
+    deferredPsoDesc.DepthStencilState.FrontFace.StencilFunc = D3D12_COMPARISON_FUNC_EQUAL;
+    deferredPsoDesc.DepthStencilState.BackFace.StencilFunc = D3D12_COMPARISON_FUNC_EQUAL;
     ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&deferredPsoDesc, IID_PPV_ARGS(&mPSOs["deferredShading"])));
+    mShaderPermutations->AddPipeline("deferredShading", deferredPsoDesc, L"Shaders\\DeferredShading.hlsl", "PS",
+        ShaderFeatureLights | ShaderFeatureShadowFilter);
 }
 
 void CRYCHIC::BuildFrameResources()
@@ -1761,7 +3272,7 @@ void CRYCHIC::BuildFrameResources()
     for (int i = 0; i < gNumFrameResources; ++i)
     {
         mFrameResources.push_back(std::make_unique<FrameResource>(md3dDevice.Get(),
-            1 + 12, mInstanceCounts, (UINT)mAllRitems.size(), (UINT)mMaterials.size()));
+            1 + MaxShadowCascades + MaxShadowedLights + VirtualShadowLevels, mInstanceCounts, (UINT)mAllRitems.size(), (UINT)mMaterials.size()));
     }
 }
 
@@ -1818,33 +3329,14 @@ void CRYCHIC::BuildMaterials()
     mMaterials["mirror0"] = std::move(mirror0);
     mMaterials["skullMat"] = std::move(skullMat);
     mMaterials["sky"] = std::move(sky);
+
+    mMaterialFeatures.resize(mMaterials.size());
+    for (const auto& e : mMaterials)
+        mMaterialFeatures[e.second->MatCBIndex] = MaterialFeatures(*e.second);
 }
 
 void CRYCHIC::BuildRenderItems()
 {
-    auto skyRitem = std::make_unique<RenderItem>();
-    //XMStoreFloat4x4(&skyRitem->World, XMMatrixScaling(5000.0f, 5000.0f, 5000.0f));
-    //skyRitem->TexTransform = MathHelper::Identity4x4();
-    //skyRitem->ObjCBIndex = 0;
-    skyRitem->itemIndex = mItemIndex++;
-    skyRitem->Mat = mMaterials["sky"].get();
-    skyRitem->Geo = mGeometries["shapeGeo"].get();
-    skyRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
-    skyRitem->IndexCount = skyRitem->Geo->DrawArgs["sphere"].IndexCount;
-    skyRitem->StartIndexLocation = skyRitem->Geo->DrawArgs["sphere"].StartIndexLocation;
-    skyRitem->BaseVertexLocation = skyRitem->Geo->DrawArgs["sphere"].BaseVertexLocation;
-    skyRitem->Bounds = skyRitem->Geo->DrawArgs["sphere"].Bounds;
-    UINT skyInstanceCount = 1;
-    mInstanceCounts.push_back(skyInstanceCount);
-    mSceneInstancesCount += skyInstanceCount;
-    skyRitem->Instances.resize(skyInstanceCount);
-    skyRitem->InstanceCount = skyInstanceCount;
-    XMStoreFloat4x4(&skyRitem->Instances[0].World, XMMatrixScaling(5000.0f, 5000.0f, 5000.0f));
-    skyRitem->Instances[0].TexTransform = MathHelper::Identity4x4();
-    skyRitem->Instances[0].MaterialIndex = 4;
-    mRitemLayer[(int)RenderLayer::Sky].push_back(skyRitem.get());
-    mAllRitems.push_back(std::move(skyRitem));
-
     auto quadRitem = std::make_unique<RenderItem>();
     //quadRitem->World = MathHelper::Identity4x4();
     //quadRitem->TexTransform = MathHelper::Identity4x4();
@@ -2273,29 +3765,6 @@ void CRYCHIC::BuildRenderItemsWithShadow()
 
 void CRYCHIC::BuildCascadeShadowRenderItems()
 {
-    auto skyRitem = std::make_unique<RenderItem>();
-    //XMStoreFloat4x4(&skyRitem->World, XMMatrixScaling(5000.0f, 5000.0f, 5000.0f));
-    //skyRitem->TexTransform = MathHelper::Identity4x4();
-    //skyRitem->ObjCBIndex = 0;
-    skyRitem->itemIndex = mItemIndex++;
-    skyRitem->Mat = mMaterials["sky"].get();
-    skyRitem->Geo = mGeometries["shapeGeo"].get();
-    skyRitem->PrimitiveType = D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST;
-    skyRitem->IndexCount = skyRitem->Geo->DrawArgs["sphere"].IndexCount;
-    skyRitem->StartIndexLocation = skyRitem->Geo->DrawArgs["sphere"].StartIndexLocation;
-    skyRitem->BaseVertexLocation = skyRitem->Geo->DrawArgs["sphere"].BaseVertexLocation;
-    skyRitem->Bounds = skyRitem->Geo->DrawArgs["sphere"].Bounds;
-    UINT skyInstanceCount = 1;
-    mInstanceCounts.push_back(skyInstanceCount);
-    mSceneInstancesCount += skyInstanceCount;
-    skyRitem->Instances.resize(skyInstanceCount);
-    skyRitem->InstanceCount = skyInstanceCount;
-    XMStoreFloat4x4(&skyRitem->Instances[0].World, XMMatrixScaling(5000.0f, 5000.0f, 5000.0f));
-    skyRitem->Instances[0].TexTransform = MathHelper::Identity4x4();
-    skyRitem->Instances[0].MaterialIndex = 4;
-    mRitemLayer[(int)RenderLayer::Sky].push_back(skyRitem.get());
-    mAllRitems.push_back(std::move(skyRitem));
-
     auto quadRitem = std::make_unique<RenderItem>();
     //quadRitem->World = MathHelper::Identity4x4();
     //quadRitem->TexTransform = MathHelper::Identity4x4();
@@ -2388,6 +3857,7 @@ void CRYCHIC::BuildCascadeShadowRenderItemsWithShadow()
     boxRitem->StartIndexLocation = boxRitem->Geo->DrawArgs["box"].StartIndexLocation;
     boxRitem->BaseVertexLocation = boxRitem->Geo->DrawArgs["box"].BaseVertexLocation;
     boxRitem->Bounds = boxRitem->Geo->DrawArgs["box"].Bounds;
+    boxRitem->ShadowLods = { boxRitem->Geo->DrawArgs["boxLod1"], boxRitem->Geo->DrawArgs["boxLod2"] };
 
     UINT boxInstanceCount = 100;
     mInstanceCounts.push_back(boxInstanceCount);
@@ -2422,6 +3892,7 @@ void CRYCHIC::BuildCascadeShadowRenderItemsWithShadow()
     gridRitem->StartIndexLocation = gridRitem->Geo->DrawArgs["grid"].StartIndexLocation;
     gridRitem->BaseVertexLocation = gridRitem->Geo->DrawArgs["grid"].BaseVertexLocation;
     gridRitem->Bounds = gridRitem->Geo->DrawArgs["grid"].Bounds;
+    gridRitem->ShadowLods = { gridRitem->Geo->DrawArgs["gridLod1"], gridRitem->Geo->DrawArgs["gridLod2"] };
 
     UINT gridInstanceCount = 1;
     mInstanceCounts.push_back(gridInstanceCount);
@@ -2435,7 +3906,38 @@ void CRYCHIC::BuildCascadeShadowRenderItemsWithShadow()
     mAllRitems.push_back(std::move(gridRitem));
 }
 
-void CRYCHIC::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems)
+void CRYCHIC::BuildSpotLights()
+{
+    // A grid of downlights over the box field, more than MaxShadowedLights so the
+    // scheduler has to pick.
+    const XMFLOAT3 colors[] =
+    {
+        { 3.0f, 2.6f, 2.0f },
+        { 2.0f, 2.4f, 3.0f },
+        { 2.8f, 1.6f, 1.2f },
+        { 1.6f, 2.8f, 1.8f },
+    };
+
+    mSpotLights.clear();
+    for (int i = 0; i < 3; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            Light light;
+            light.Strength = colors[(i + j) % _countof(colors)];
+            light.FalloffStart = 2.0f;
+            light.Direction = { 0.0f, -1.0f, 0.0f };
+            light.FalloffEnd = 14.0f;
+            light.Position = { -17.5f + j * 12.5f, 7.0f, -15.0f + i * 15.0f };
+            light.SpotPower = 6.0f;
+            mSpotLights.push_back(light);
+        }
+    }
+    assert(mSpotLights.size() == SpotLightCount);
+}
+
+void CRYCHIC::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems, UINT viewCount,
+    bool positionsOnly)
 {
     /*UINT objCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(ObjectConstants));
 
@@ -2462,51 +3964,396 @@ void CRYCHIC::DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vec
     {
         auto ri = ritems[i];
 
-        cmdList->IASetVertexBuffers(0, 1, &ri->Geo->VertexBufferView());
+        D3D12_VERTEX_BUFFER_VIEW vbv = positionsOnly ? ri->Geo->PositionBufferView() : ri->Geo->VertexBufferView();
+        cmdList->IASetVertexBuffers(0, 1, &vbv);
         cmdList->IASetIndexBuffer(&ri->Geo->IndexBufferView());
         cmdList->IASetPrimitiveTopology(ri->PrimitiveType);
 
         // Set instance buffer used by the render item. 
         auto instanceBuffer = mCurrFrameResource->InstanceBuffers[ri->itemIndex]->Resource();
-        mCommandList->SetGraphicsRootShaderResourceView(0, instanceBuffer->GetGPUVirtualAddress());
+        cmdList->SetGraphicsRootShaderResourceView(0, instanceBuffer->GetGPUVirtualAddress());
         // debugʱri->InstanceCount = 0ΪʼλÿЩ壬ü
-        cmdList->DrawIndexedInstanced(ri->IndexCount, ri->InstanceCount, ri->StartIndexLocation, ri->BaseVertexLocation, 0);
+        cmdList->DrawIndexedInstanced(ri->IndexCount, ri->InstanceCount * viewCount, ri->StartIndexLocation, ri->BaseVertexLocation, 0);
     }
 }
 
-void CRYCHIC::DrawSceneToShadowMap()
+void CRYCHIC::DrawSpecializedRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems,
+    const std::string& pipeline)
+{
+    // Group the items by variant, so the pipeline state changes once per variant.
+    ShaderFeatures frameFeatures = FrameFeatures();
+    std::vector<std::pair<ID3D12PipelineState*, RenderItem*>> draws;
+    for (auto ri : ritems)
+    {
+        // Nothing visible, so no reason to build a variant for it.
+        if (ri->InstanceCount == 0)
+            continue;
+
+        ShaderFeatures features = frameFeatures;
+        features.Merge(ri->Features);
+        draws.push_back({ mShaderPermutations->Pso(pipeline, features), ri });
+    }
+    std::stable_sort(draws.begin(), draws.end(),
+        [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<RenderItem*> run;
+    for (size_t i = 0; i < draws.size(); ++i)
+    {
+        run.push_back(draws[i].second);
+        if (i + 1 < draws.size() && draws[i + 1].first == draws[i].first)
+            continue;
+
+        cmdList->SetPipelineState(draws[i].first);
+        DrawRenderItems(cmdList, run);
+        run.clear();
+    }
+}
+
+ShaderFeatures CRYCHIC::MaterialFeatures(const Material& mat)const
 {
-    for (size_t i = 0; i < 6; i++)
+    ShaderFeatures features;
+    features.AlphaTest = mat.AlphaTested;
+    features.NormalMap = mat.NormalSrvHeapIndex != FlatNormalSrvHeapIndex;
+    return features;
+}
+
+ShaderFeatures CRYCHIC::FrameFeatures()const
+{
+    ShaderFeatures features;
+    features.DirLightCount = mActiveDirLightCount;
+    features.ShadowFilter = (UINT)mCascadeSettings.Filter;
+    return features;
+}
+
+void CRYCHIC::DrawShadowCasters(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems, UINT viewCount)
+{
+    // Each LOD draws only its run of instances; the cascade masks still keep an
+    // instance to the cascades it was given that LOD in.
+    for (UINT lod = 0; lod < MaxCasterLods; ++lod)
     {
-        mCommandList->RSSetViewports(1, &mShadowMap->Viewport());
-        mCommandList->RSSetScissorRects(1, &mShadowMap->ScissorRect());
+        cmdList->SetGraphicsRoot32BitConstant(5, lod, 1);
+        for (auto ri : ritems)
+        {
+            if (lod > ri->ShadowLods.size() || ri->ShadowLodCount[lod] == 0)
+                continue;
 
-        // Change to DEPTH_WRITE.
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mShadowMap->Resource(i),
-            D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_DEPTH_WRITE));
+            UINT indexCount = lod == 0 ? ri->IndexCount : ri->ShadowLods[lod - 1].IndexCount;
+            UINT startIndexLocation = lod == 0 ? ri->StartIndexLocation : ri->ShadowLods[lod - 1].StartIndexLocation;
+            int baseVertexLocation = lod == 0 ? ri->BaseVertexLocation : ri->ShadowLods[lod - 1].BaseVertexLocation;
 
-        // Clear the back buffer and depth buffer.
-        mCommandList->ClearDepthStencilView(mShadowMap->Dsv(i),
-            D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 0, nullptr);
+            cmdList->IASetVertexBuffers(0, 1, &ri->Geo->PositionBufferView());
+            cmdList->IASetIndexBuffer(&ri->Geo->IndexBufferView());
+            cmdList->IASetPrimitiveTopology(ri->PrimitiveType);
 
-        // Specify the buffers we are going to render to.
-        mCommandList->OMSetRenderTargets(0, nullptr, false, &mShadowMap->Dsv(i));
+            auto instanceBuffer = mCurrFrameResource->ShadowLodInstanceBuffers[ri->itemIndex]->Resource();
+            cmdList->SetGraphicsRootShaderResourceView(0, instanceBuffer->GetGPUVirtualAddress() +
+                ri->ShadowLodStart[lod] * sizeof(InstanceData));
+            cmdList->DrawIndexedInstanced(indexCount, ri->ShadowLodCount[lod] * viewCount, startIndexLocation, baseVertexLocation, 0);
+        }
+    }
+}
+
+std::vector<UINT64> CRYCHIC::DrawSignature(const std::vector<RenderItem*>& ritems, UINT viewCount)const
+{
+    std::vector<UINT64> signature;
+    signature.reserve(ritems.size() * (8 + MaxCasterLods));
+    for (auto ri : ritems)
+    {
+        auto instanceBuffer = mCurrFrameResource->InstanceBuffers[ri->itemIndex]->Resource();
+        signature.push_back(ri->Geo->VertexBufferGPU->GetGPUVirtualAddress());
+        signature.push_back(ri->Geo->IndexBufferGPU->GetGPUVirtualAddress());
+        signature.push_back(instanceBuffer->GetGPUVirtualAddress());
+        signature.push_back(ri->IndexCount);
+        signature.push_back(ri->InstanceCount * viewCount);
+        signature.push_back(ri->StartIndexLocation);
+        signature.push_back((UINT64)ri->BaseVertexLocation);
+        signature.push_back(mCurrFrameResource->ShadowLodInstanceBuffers[ri->itemIndex]->Resource()->GetGPUVirtualAddress());
+        for (UINT lod = 0; lod < MaxCasterLods; ++lod)
+            signature.push_back(((UINT64)ri->ShadowLodStart[lod] << 32) | ri->ShadowLodCount[lod]);
+    }
+    return signature;
+}
+
+UINT CRYCHIC::ShadowViewCount()const
+{
+    return mCascadeSettings.SinglePass ? mCascadeSettings.Count : 1;
+}
+
+UINT CRYCHIC::CascadeCount()const
+{
+    return mCascadeSettings.Virtual ? 0 : mCascadeSettings.Count;
+}
+
+void CRYCHIC::SetCascadeViewports()
+{
+    // One viewport and scissor per cascade; the single pass shader picks one per instance.
+    D3D12_VIEWPORT viewports[MaxShadowCascades];
+    D3D12_RECT scissorRects[MaxShadowCascades];
+    for (UINT i = 0; i < CascadeCount(); i++)
+    {
+        viewports[i] = mShadowMap->Viewport(mCascadeTiles[i]);
+        scissorRects[i] = mShadowMap->ScissorRect(mCascadeTiles[i]);
+    }
+    mCommandList->RSSetViewports(CascadeCount(), viewports);
+    mCommandList->RSSetScissorRects(CascadeCount(), scissorRects);
+}
+
+void CRYCHIC::UpdateBundles()
+{
+    // Only re-recorded when instances are spawned or removed, instance buffers grow,
+    // or culling changes the number of visible instances.
+    mStaticCasters.clear();
+    mDynamicCasters.clear();
+    for (auto ri : mRitemLayer[(int)RenderLayer::OpaqueShadow])
+        (ri->DynamicCaster ? mDynamicCasters : mStaticCasters).push_back(ri);
+
+    const auto& shadowItems = mStaticCasters;
+    UINT viewCount = ShadowViewCount();
+    auto shadowPso = mCascadeSettings.SinglePass ? mPSOs["shadow_opaque_cascades"].Get() : mPSOs["shadow_opaque"].Get();
+    mCurrFrameResource->ShadowBundle->Prepare(shadowPso, DrawSignature(shadowItems, viewCount),
+        [this, &shadowItems, viewCount](ID3D12GraphicsCommandList* bundle)
+    {
+        // Root arguments are inherited from the calling list, which uses the same signature.
+        bundle->SetGraphicsRootSignature(mRootSignature.Get());
+        if (mCascadeSettings.SinglePass)
+            DrawShadowCasters(bundle, shadowItems, viewCount);
+        else
+            DrawRenderItems(bundle, shadowItems, viewCount, true);
+    });
+
+    // The sky is one fullscreen triangle on the far plane, so it is recorded only once.
+    mCurrFrameResource->SkyBundle->Prepare(mPSOs["sky"].Get(), {},
+        [this](ID3D12GraphicsCommandList* bundle)
+    {
+        bundle->SetGraphicsRootSignature(mRootSignature.Get());
+        bundle->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        bundle->DrawInstanced(3, 1, 0, 0);
+    });
+}
+
+void CRYCHIC::DrawStaticCastersToShadowCache()
+{
+    auto cacheDsv = mShadowMap->CacheDsv();
+    mCommandList->OMSetRenderTargets(0, nullptr, false, &cacheDsv);
+
+    UINT passCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants));
+    auto passCB = mCurrFrameResource->PassCB->Resource();
+
+    if (mCascadeSettings.SinglePass)
+    {
+        // Clear the refreshed tiles and draw the static casters into all of them with
+        // one bundle; the mask keeps the other cascades' cached depth untouched.
+        UINT refreshMask = 0;
+        UINT clearRectCount = 0;
+        D3D12_RECT clearRects[MaxShadowCascades];
+        for (UINT i = 0; i < CascadeCount(); i++)
+        {
+            if (!mCascadeCaches[i].Refresh)
+                continue;
+            refreshMask |= 1u << i;
+            clearRects[clearRectCount++] = mShadowMap->ScissorRect(mCascadeTiles[i]);
+        }
+
+        SetCascadeViewports();
+        mCommandList->ClearDepthStencilView(cacheDsv,
+            D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, clearRectCount, clearRects);
+
+        mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress() + passCBByteSize);
+        mCommandList->SetGraphicsRoot32BitConstant(5, refreshMask, 0);
+        mCurrFrameResource->ShadowBundle->Execute(mCommandList.Get());
+        return;
+    }
+
+    for (size_t i = 0; i < CascadeCount(); i++)
+    {
+        if (!mCascadeCaches[i].Refresh)
+            continue;
+
+        // The viewport maps the cascade onto its tile; the scissor keeps it there.
+        D3D12_VIEWPORT viewport = mShadowMap->Viewport(mCascadeTiles[i]);
+        D3D12_RECT scissorRect = mShadowMap->ScissorRect(mCascadeTiles[i]);
+        mCommandList->RSSetViewports(1, &viewport);
+        mCommandList->RSSetScissorRects(1, &scissorRect);
+
+        // Only this tile is cleared; the other cascades keep their cached depth.
+        mCommandList->ClearDepthStencilView(cacheDsv,
+            D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 1, &scissorRect);
 
         // Bind the pass constant buffer for the shadow map pass.
-        UINT passCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants));
-        auto passCB = mCurrFrameResource->PassCB->Resource();
         D3D12_GPU_VIRTUAL_ADDRESS passCBAddress = passCB->GetGPUVirtualAddress() + (1 + i) * passCBByteSize;
         mCommandList->SetGraphicsRootConstantBufferView(2, passCBAddress);
 
-        mCommandList->SetPipelineState(mPSOs["shadow_opaque"].Get());
+        // Same casters for every slice; only the pass constants above differ.
+        mCurrFrameResource->ShadowBundle->Execute(mCommandList.Get());
+    }
+}
+
+void CRYCHIC::DrawLightShadowsToCache()
+{
+    auto cacheDsv = mShadowMap->CacheDsv();
+    mCommandList->OMSetRenderTargets(0, nullptr, false, &cacheDsv);
+
+    UINT passCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants));
+    auto passCB = mCurrFrameResource->PassCB->Resource();
+
+    // Unlike the cascades, the lights draw their dynamic casters into the cache too;
+    // the scheduler redraws the lights they reach within the per-frame budget.
+    mCommandList->SetPipelineState(mPSOs["shadow_opaque"].Get());
+    const auto& slots = mShadowScheduler.Slots();
+    for (size_t k = 0; k < slots.size(); ++k)
+    {
+        if (!slots[k].Refresh)
+            continue;
+
+        D3D12_VIEWPORT viewport = mShadowMap->Viewport(slots[k].Tile);
+        D3D12_RECT scissorRect = mShadowMap->ScissorRect(slots[k].Tile);
+        mCommandList->RSSetViewports(1, &viewport);
+        mCommandList->RSSetScissorRects(1, &scissorRect);
+        mCommandList->ClearDepthStencilView(cacheDsv,
+            D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 1, &scissorRect);
+
+        D3D12_GPU_VIRTUAL_ADDRESS passCBAddress = passCB->GetGPUVirtualAddress() +
+            (1 + MaxShadowCascades + k) * passCBByteSize;
+        mCommandList->SetGraphicsRootConstantBufferView(2, passCBAddress);
+
+        DrawRenderItems(mCommandList.Get(), mStaticCasters, 1, true);
+        DrawRenderItems(mCommandList.Get(), mDynamicCasters, 1, true);
+    }
+}
+
+void CRYCHIC::DrawVirtualPagesToCache()
+{
+    auto cacheDsv = mShadowMap->CacheDsv();
+    mCommandList->OMSetRenderTargets(0, nullptr, false, &cacheDsv);
+
+    UINT passCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants));
+    auto passCB = mCurrFrameResource->PassCB->Resource();
+
+    const UINT pageSize = VirtualShadowPages::PageSize;
+    const UINT levelSize = VirtualShadowPages::PagesPerLevel * pageSize;
+    const auto& pages = mVirtualPages.PhysicalPages();
+    const VirtualShadowLevel* levels = mVirtualPages.Levels();
 
-        DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::OpaqueShadow]);
+    mCommandList->SetPipelineState(mPSOs["shadow_opaque"].Get());
+    for (UINT physical : mVirtualPages.PagesToRender())
+    {
+        const auto& page = pages[physical];
+        XMINT2 rel(page.Coord.x - levels[page.Level].Origin.x, page.Coord.y - levels[page.Level].Origin.y);
+        XMUINT2 physicalCoord = mVirtualPages.PhysicalPageCoord(physical);
+        LONG x = (LONG)(mVirtualPoolTile.X + physicalCoord.x * pageSize);
+        LONG y = (LONG)(mVirtualPoolTile.Y + physicalCoord.y * pageSize);
+
+        // The viewport spans the level's whole window, placed so the page lands on its
+        // physical page; the scissor keeps the rest of the window out of the pool.
+        D3D12_VIEWPORT viewport = { (float)(x - rel.x * (LONG)pageSize), (float)(y - rel.y * (LONG)pageSize),
+            (float)levelSize, (float)levelSize, 0.0f, 1.0f };
+        D3D12_RECT scissorRect = { x, y, x + (LONG)pageSize, y + (LONG)pageSize };
+        mCommandList->RSSetViewports(1, &viewport);
+        mCommandList->RSSetScissorRects(1, &scissorRect);
+        mCommandList->ClearDepthStencilView(cacheDsv,
+            D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 1, &scissorRect);
+
+        D3D12_GPU_VIRTUAL_ADDRESS passCBAddress = passCB->GetGPUVirtualAddress() +
+            (1 + MaxShadowCascades + MaxShadowedLights + page.Level) * passCBByteSize;
+        mCommandList->SetGraphicsRootConstantBufferView(2, passCBAddress);
 
-        // Change back to GENERIC_READ so we can read the texture in a shader.
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mShadowMap->Resource(i),
-            D3D12_RESOURCE_STATE_DEPTH_WRITE, D3D12_RESOURCE_STATE_GENERIC_READ));
+        DrawRenderItems(mCommandList.Get(), mStaticCasters, 1, true);
+        DrawRenderItems(mCommandList.Get(), mDynamicCasters, 1, true);
     }
-    
+}
+
+void CRYCHIC::DrawSceneToShadowMap()
+{
+    auto atlasDsv = mShadowMap->Dsv();
+    mCommandList->OMSetRenderTargets(0, nullptr, false, &atlasDsv);
+
+    // Start from the cached static casters.  The cache shares the atlas layout, so one
+    // blit over the whole atlas covers every cascade, and it overwrites instead of clearing.
+    ShadowAtlasTile wholeAtlas = mShadowMap->WholeAtlas();
+    D3D12_VIEWPORT atlasViewport = mShadowMap->Viewport(wholeAtlas);
+    D3D12_RECT atlasScissorRect = mShadowMap->ScissorRect(wholeAtlas);
+    mCommandList->RSSetViewports(1, &atlasViewport);
+    mCommandList->RSSetScissorRects(1, &atlasScissorRect);
+
+    mCommandList->SetGraphicsRootSignature(mShadowCacheRootSignature.Get());
+    mCommandList->SetGraphicsRootDescriptorTable(0, mShadowMap->CacheSrv());
+    mCommandList->SetPipelineState(mPSOs["shadowCacheBlit"].Get());
+    mCommandList->IASetVertexBuffers(0, 0, nullptr);
+    mCommandList->IASetIndexBuffer(nullptr);
+    mCommandList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    mCommandList->DrawInstanced(3, 1, 0, 0);
+
+    // Rebind state whenever graphics root signature changes.
+    mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+    auto matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
+    mCommandList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootShaderResourceView(6, mCurrFrameResource->VirtualPageTable->Resource()->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootConstantBufferView(10, mCurrFrameResource->FrameCB->Resource()->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootDescriptorTable(3, mNullSrv);
+    mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
+
+    // The virtual pages hold their dynamic casters already.
+    if (mDynamicCasters.empty() || CascadeCount() == 0)
+        return;
+
+    UINT passCBByteSize = d3dUtil::CalcConstantBufferByteSize(sizeof(PassConstants));
+    auto passCB = mCurrFrameResource->PassCB->Resource();
+
+    // Dynamic casters go on top, depth tested against the static ones.
+    if (mCascadeSettings.SinglePass)
+    {
+        SetCascadeViewports();
+        mCommandList->SetGraphicsRootConstantBufferView(2, passCB->GetGPUVirtualAddress() + passCBByteSize);
+        mCommandList->SetGraphicsRoot32BitConstant(5, (1u << CascadeCount()) - 1, 0);
+        mCommandList->SetPipelineState(mPSOs["shadow_opaque_cascades"].Get());
+        DrawShadowCasters(mCommandList.Get(), mDynamicCasters, CascadeCount());
+        return;
+    }
+
+    mCommandList->SetPipelineState(mPSOs["shadow_opaque"].Get());
+    for (size_t i = 0; i < CascadeCount(); i++)
+    {
+        D3D12_VIEWPORT viewport = mShadowMap->Viewport(mCascadeTiles[i]);
+        D3D12_RECT scissorRect = mShadowMap->ScissorRect(mCascadeTiles[i]);
+        mCommandList->RSSetViewports(1, &viewport);
+        mCommandList->RSSetScissorRects(1, &scissorRect);
+
+        D3D12_GPU_VIRTUAL_ADDRESS passCBAddress = passCB->GetGPUVirtualAddress() + (1 + i) * passCBByteSize;
+        mCommandList->SetGraphicsRootConstantBufferView(2, passCBAddress);
+
+        DrawRenderItems(mCommandList.Get(), mDynamicCasters, 1, true);
+    }
+}
+
+void CRYCHIC::ReduceDepth()
+{
+    mCommandList->SetComputeRootSignature(mDepthReduceRootSignature.Get());
+    auto depthReduceCB = mCurrFrameResource->DepthReduceCB->Resource();
+    mSampleDistribution->Reduce(mCommandList.Get(), mPSOs["depthReduce"].Get(), mCurrFrameResourceIndex,
+        depthReduceCB->GetGPUVirtualAddress(), mClientWidth, mClientHeight);
+}
+
+void CRYCHIC::MarkVirtualShadowPages()
+{
+    mCommandList->SetComputeRootSignature(mDepthReduceRootSignature.Get());
+    auto markCB = mCurrFrameResource->VirtualShadowMarkCB->Resource();
+    mVirtualShadowMap->MarkPages(mCommandList.Get(), mPSOs["virtualShadowMark"].Get(), mCurrFrameResourceIndex,
+        markCB->GetGPUVirtualAddress(), GetGpuSrv(mDepthReduceHeapIndex), mClientWidth, mClientHeight);
+}
+
+void CRYCHIC::PrefilterEvsm()
+{
+    mCommandList->SetGraphicsRootSignature(mEvsmRootSignature.Get());
+    mEvsmMap->Prefilter(mCommandList.Get(), mShadowMap->Srv(), mCascadeTiles, CascadeCount());
+
+    // Rebind state whenever graphics root signature changes.
+    mCommandList->SetGraphicsRootSignature(mRootSignature.Get());
+    auto matBuffer = mCurrFrameResource->MaterialBuffer->Resource();
+    mCommandList->SetGraphicsRootShaderResourceView(1, matBuffer->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootShaderResourceView(6, mCurrFrameResource->VirtualPageTable->Resource()->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootConstantBufferView(10, mCurrFrameResource->FrameCB->Resource()->GetGPUVirtualAddress());
+    mCommandList->SetGraphicsRootDescriptorTable(3, mNullSrv);
+    mCommandList->SetGraphicsRootDescriptorTable(4, mSrvDescriptorHeap->GetGPUDescriptorHandleForHeapStart());
 }
 
 void CRYCHIC::DrawNormalsAndDepth()
@@ -2514,13 +4361,8 @@ void CRYCHIC::DrawNormalsAndDepth()
     mCommandList->RSSetViewports(1, &mScreenViewport);
     mCommandList->RSSetScissorRects(1, &mScissorRect);
 
-    auto normalMap = mSsao->NormalMap();
     auto normalMapRtv = mSsao->NormalMapRtv();
 
-    // Change to RENDER_TARGET.
-    mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(normalMap,
-        D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET));
-
     // Clear the screen normal map and depth buffer.
     float clearValue[] = { 0.0f, 0.0f, 1.0f, 0.0f };
     mCommandList->ClearRenderTargetView(normalMapRtv, clearValue, 0, nullptr);
@@ -2536,38 +4378,26 @@ void CRYCHIC::DrawNormalsAndDepth()
     mCommandList->SetPipelineState(mPSOs["drawNormals"].Get());
 
     DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
-
-    // Change back to GENERIC_READ so we can read the texture in a shader.
-    mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(normalMap,
-        D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ));
 }
 
 void CRYCHIC::DrawGBuffer()
 {
     mCommandList->RSSetViewports(1, &mScreenViewport);
     mCommandList->RSSetScissorRects(1, &mScissorRect);
-    mCommandList->SetPipelineState(mPSOs["geometryPass"].Get());
-    for (size_t i = 0; i < 4; i++)
+    mCommandList->OMSetStencilRef(1);
+    for (size_t i = 0; i < DeferredShading::GBufferCount; i++)
     {
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mDeferred->Resource(i),
-            D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET));
         mCommandList->ClearRenderTargetView(mDeferred->Rtv(i), Colors::Black, 0, nullptr);
     }
     mCommandList->ClearDepthStencilView(DepthStencilView(), D3D12_CLEAR_FLAG_DEPTH | D3D12_CLEAR_FLAG_STENCIL, 1.0f, 0, 0, nullptr);
     // Specify the buffers we are going to render to.
-    D3D12_CPU_DESCRIPTOR_HANDLE deferredRtvs[4];
-    for (size_t i = 0; i < 4; i++)
+    D3D12_CPU_DESCRIPTOR_HANDLE deferredRtvs[DeferredShading::GBufferCount];
+    for (size_t i = 0; i < DeferredShading::GBufferCount; i++)
     {
         deferredRtvs[i] = mDeferred->Rtv(i);
     }
-    mCommandList->OMSetRenderTargets(4, deferredRtvs, false, &DepthStencilView());
-    DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque]);
-    //DrawRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Sky]);
-    for (size_t i = 0; i < 4; i++)
-    {
-        mCommandList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mDeferred->Resource(i),
-            D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ));
-    }
+    mCommandList->OMSetRenderTargets(DeferredShading::GBufferCount, deferredRtvs, false, &DepthStencilView());
+    DrawSpecializedRenderItems(mCommandList.Get(), mRitemLayer[(int)RenderLayer::Opaque], "geometryPass");
 }
 
 CD3DX12_CPU_DESCRIPTOR_HANDLE CRYCHIC::GetCpuSrv(int index) const
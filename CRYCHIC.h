@@ -9,6 +9,16 @@
 #include "ShadowMap.h"
 #include "Ssao.h"
 #include "DeferredShading.h"
+#include "RenderGraph.h"
+#include "SceneEditQueue.h"
+#include "SampleDistribution.h"
+#include "EvsmMap.h"
+#include "ShadowScheduler.h"
+#include "VirtualShadowMap.h"
+#include "Gtao.h"
+#include "ClusteredLights.h"
+#include "ShaderPermutations.h"
+#include "SphericalHarmonics.h"
 
 using Microsoft::WRL::ComPtr;
 using namespace DirectX;
@@ -19,6 +29,22 @@ using namespace DirectX::PackedVector;
 
 const int gNumFrameResources = 3;
 const UINT CubeMapSize = 512;
+// GPU memory the shadow atlas and its static caster cache may take together.  The
+// EVSM moments come on top, a quarter of the atlas texels at 16 bytes, once that
+// filter is first picked; EvsmMap::MemoryUsage reports them.
+const UINT64 ShadowAtlasBudget = 128ull * 1024 * 1024;
+// Edits applied per frame at most; the rest wait for the next frame.
+const UINT MaxSceneEditsPerFrame = 4096;
+// Lights in FrameConstants::Lights, all directional.  Must match NUM_DIR_LIGHTS in
+// Default.hlsl and DeferredShading.hlsl, and ShadowedLightBase in Common.hlsl.  The
+// spot lights lead the clustered lights; ShadowScheduler knows spot light i as light
+// DirLightCount + i, even when the shaders are specialized on fewer lit lights.
+const UINT DirLightCount = 3;
+const UINT SpotLightCount = 12;
+// Near plane of the spot light shadow frusta.
+const float SpotShadowNearZ = 0.1f;
+// SRV heap index of the flat default normal map, see BuildDescriptorHeaps.
+const int FlatNormalSrvHeapIndex = 5;
 
 struct RenderItem
 {
@@ -39,6 +65,123 @@ struct RenderItem
 	std::vector<InstanceData> Instances;
 	BoundingBox Bounds;
 	UINT itemIndex = 0;
+	// Id of each of Instances as scene edits name it, and the slot of each id.
+	std::vector<UINT> InstanceIds;
+	std::unordered_map<UINT, UINT> InstanceSlots;
+	// Indices into Instances that passed culling, in instance buffer order.
+	std::vector<UINT> VisibleInstances;
+	// Drawn into the shadow atlas every frame on top of the cached static casters.
+	bool DynamicCaster = false;
+	// Coarser meshes for shadow cascades the caster covers few texels of, from LOD 1 on.
+	std::vector<SubmeshGeometry> ShadowLods;
+	// Run of each caster LOD's instances in ShadowLodInstanceBuffers, by UpdateCascadeMasks.
+	UINT ShadowLodStart[MaxCasterLods] = {};
+	UINT ShadowLodCount[MaxCasterLods] = {};
+	// Material switches of the visible instances together, refreshed by UpdateInstanceData.
+	ShaderFeatures Features;
+};
+
+// How the lighting shaders filter the cascades; must match Common.hlsl.
+enum class ShadowFilter : UINT
+{
+	// 16 rotated Poisson taps of hardware PCF.
+	Pcf = 0,
+	// One bilinear fetch of the prefiltered exponential variance moments.
+	Evsm
+};
+
+// Cascaded shadow map layout, changeable at runtime through CRYCHIC::SetCascadeSettings.
+struct CascadeSettings
+{
+	UINT Count = MaxShadowCascades;
+	// Blend between uniform (0) and logarithmic (1) split distances, as in PSSM.
+	float SplitLambda = 0.5f;
+	// Distance before a split over which a cascade is blended with the next one.
+	float BlendBand = 5.0f;
+	// Atlas tile size of each cascade, in texels.
+	UINT Resolution[MaxShadowCascades] = { 2048, 2048, 1024, 1024 };
+	// Frames a cascade may lag behind the camera before its static casters are
+	// re-rendered, so far cascades refresh on a staggered schedule.
+	UINT RefreshInterval[MaxShadowCascades] = { 1, 1, 2, 4 };
+	// Draw every cascade with one instanced submission, routing instances to their
+	// tile with SV_ViewportArrayIndex.  Ignored where that needs GS emulation.
+	bool SinglePass = true;
+	// Fit the splits to the depth range of the visible samples (sample distribution
+	// shadow maps).  The depth buffer reduction is read back frames late, so the range
+	// is padded.
+	bool FitToSamples = false;
+	// With FitToSamples, also shrink each cascade to the light space box of its
+	// samples while the camera and light hold still.
+	bool FitLightSpaceBounds = true;
+	ShadowFilter Filter = ShadowFilter::Pcf;
+	// Skip casters whose shadow cannot fall on a visible receiver inside the cascade,
+	// found by sweeping the receivers' light space box toward the light.  This and
+	// the caster LODs below only apply to single pass cascades.
+	bool CullCasters = true;
+	// Casters narrower than this many texels of a cascade are not drawn into it.
+	float MinCasterTexels[MaxShadowCascades] = { 0.0f, 0.0f, 2.0f, 4.0f };
+	// Footprint in texels below which a caster steps down one LOD, halving per LOD.
+	float CasterLodTexels = 64.0f;
+	// LODs added on top in each cascade, so far cascades draw coarser casters.
+	UINT CasterLodBias[MaxShadowCascades] = { 0, 0, 1, 1 };
+	// Shadow the main light with a virtual shadow map instead of the cascades, for
+	// large outdoor scenes.  Only the pages the visible samples need get memory, and
+	// a page is only re-rendered when a caster over it moves.  Always 3x3 PCF.
+	bool Virtual = false;
+	// Atlas tile the physical pages are carved from, in texels.
+	UINT VirtualPoolSize = 2048;
+	// World size of the finest clipmap level; each further level doubles it.
+	float VirtualExtent = 16.0f;
+	// Pages rendered per frame at most; the others fall back to coarser levels meanwhile.
+	UINT VirtualPagesPerFrame = 16;
+};
+
+// Ambient occlusion path, changeable at runtime through CRYCHIC::SetSsaoSettings.
+struct SsaoSettings
+{
+	// Compute the ambient map and blur it in compute shaders instead of fullscreen
+	// pixel shader passes.
+	bool Compute = true;
+	// Blur iterations, each a horizontal and a vertical pass.
+	int BlurCount = 3;
+	// Spread the samples over frames: each frame takes TemporalSampleCount of the
+	// offset vectors about shifted random vectors and blends them into the last
+	// frames' result, reprojected where the depth and normal still match.  Compute
+	// path only.
+	bool Temporal = false;
+	UINT TemporalSampleCount = 4;
+	// Weight of each new frame against the history.
+	float TemporalAlpha = 0.1f;
+	// Ground truth AO from the horizons of GtaoTier's slices instead of the
+	// hemisphere samples.  Compute path only.
+	bool GroundTruth = false;
+	GtaoTier Tier = GtaoTier::Medium;
+};
+
+// Camera, light and splits a depth reduction was recorded with.  Its light space
+// boxes only fit the cascades while these stay the same.
+struct DepthReduceInputs
+{
+	XMFLOAT4X4 View = MathHelper::Identity4x4();
+	XMFLOAT4X4 LightView = MathHelper::Identity4x4();
+	float Splits[MaxShadowCascades] = {};
+};
+
+// Cached static caster depth of one cascade.
+struct CascadeCache
+{
+	bool Valid = false;
+	// A static caster inside the cascade moved, was spawned or was removed since it
+	// was rendered.
+	bool Dirty = false;
+	// Re-render the static casters this frame.
+	bool Refresh = false;
+	// Light view space box of the visible receivers the static casters were culled
+	// against; receivers spreading beyond it re-render the cascade.
+	bool HasReceivers = false;
+	BoundingBox Receivers;
+	// Frames since the static casters were rendered.
+	UINT Age = 0;
 };
 
 enum class RenderLayer : int
@@ -49,7 +192,6 @@ enum class RenderLayer : int
 	SkyDynamicCamera,
 	OpaqueShadow,
 	Debug,
-	Sky,
 	Count
 };
 
@@ -63,10 +205,30 @@ public:
 
 	virtual bool Initialize()override;
 
+	// Thread safe entry point for changing the scene while it renders.
+	SceneEditQueue& SceneEdits();
+	// Id of the instanceIndex-th instance itemIndex is built with, for scene edits.
+	// Fixed once Initialize returns, so callable from any thread.
+	UINT InstanceId(UINT itemIndex, UINT instanceIndex)const;
+
+	const CascadeSettings& GetCascadeSettings()const;
+	// Re-carves the shadow atlas for the new resolutions; takes effect next frame.
+	// Returns false, keeping the current cascades, if the atlas cannot fit them.
+	bool SetCascadeSettings(const CascadeSettings& settings);
+
+	const SsaoSettings& GetSsaoSettings()const;
+	void SetSsaoSettings(const SsaoSettings& settings);
+
+	// Unshadowed point lights, SpotPower 0, shaded through the clustered lights after
+	// the spot lights.  Past MaxClusteredLights in all the rest are ignored.
+	const std::vector<Light>& GetPointLights()const;
+	void SetPointLights(const std::vector<Light>& lights);
+
 private:
 	virtual void CreateRtvAndDsvDescriptorHeaps()override;
 	virtual void OnResize()override;
 	virtual void Update(const GameTimer& gt)override;
+	virtual void FixedUpdate(float dt)override;
 	virtual void Draw(const GameTimer& gt)override;
 
 	virtual void OnMouseDown(WPARAM btnState, int x, int y)override;
@@ -75,22 +237,37 @@ private:
 
 	void OnKeyboardInput(const GameTimer& gt);
 	void AnimateMaterials(const GameTimer& gt);
+	void ApplySceneEdits();
+	void AssignInstanceIds();
 	//void UpdateObjectCBs(const GameTimer& gt);
 	void UpdateInstanceData(const GameTimer& gt);
 	void UpdateMaterialBuffer(const GameTimer& gt);
 	void UpdateShadowTransform(const GameTimer& gt);
+	void UpdateSampleBounds();
 	void UpdateCascadeShadowTransform(const GameTimer& gt);
+	void UpdateCascadeMasks();
+	// Reads back the page requests, moves the clipmap and picks the pages to render.
+	void UpdateVirtualShadowPages();
+	// Bins the spot and point lights into the froxels of this frame's view.
+	void UpdateClusteredLights();
+	void UpdateFrameCB(const GameTimer& gt);
 	void UpdateMainPassCB(const GameTimer& gt);
 	void UpdateShadowPassCB(const GameTimer& gt);
 	void UpdateSsaoCB(const GameTimer& gt);
+	void UpdateDepthReduceCB(const GameTimer& gt);
 
 	void LoadTextures();
+	// Projects the sky cube map for the ambient term, or reads the projection cached beside it.
+	void LoadSkyAmbient();
 	void BuildRootSignature();
 	void BuildSsaoRootSignature();
+	void BuildSsaoComputeRootSignature();
 	void BuildDescriptorHeaps();
 	void BuildShadersAndInputLayout();
 	void BuildShapeGeometry();
 	void BuildSkullGeometry();
+	// Uploads the positions of vertices as geo's position stream.
+	void BuildPositionStream(MeshGeometry* geo, const std::vector<Vertex>& vertices);
 	void BuildPSOs();
 	void BuildFrameResources();
 	void BuildMaterials();
@@ -98,10 +275,46 @@ private:
 	void BuildRenderItemsWithShadow();
 	void BuildCascadeShadowRenderItems();
 	void BuildCascadeShadowRenderItemsWithShadow();
-	void DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems);
+	// viewCount > 1 draws each instance that many times, once per cascade.
+	// positionsOnly binds the position streams, for PSOs with mPositionInputLayout.
+	void DrawRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems, UINT viewCount = 1,
+		bool positionsOnly = false);
+	// Draws each item with the variant of pipeline fitting its materials and this frame's lights.
+	void DrawSpecializedRenderItems(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems,
+		const std::string& pipeline);
+	ShaderFeatures MaterialFeatures(const Material& mat)const;
+	// Light count and shadow filter the frame shades with.
+	ShaderFeatures FrameFeatures()const;
+
+	// Single pass cascade casters, one submission per caster LOD.
+	void DrawShadowCasters(ID3D12GraphicsCommandList* cmdList, const std::vector<RenderItem*>& ritems, UINT viewCount);
+	std::vector<UINT64> DrawSignature(const std::vector<RenderItem*>& ritems, UINT viewCount = 1)const;
+	// Instances per caster instance in the shadow passes: the cascade count in single pass mode.
+	UINT ShadowViewCount()const;
+	// Cascades in use; none while the virtual shadow map replaces them.
+	UINT CascadeCount()const;
+	void SetCascadeViewports();
+	void UpdateBundles();
+	void DrawStaticCastersToShadowCache();
 	void DrawSceneToShadowMap();
+	void BuildShadowCacheRootSignature();
+	void BuildDepthReduceRootSignature();
+	void ReduceDepth();
+	void BuildEvsmRootSignature();
+	void PrefilterEvsm();
+	void BuildSpotLights();
+	// Ranks the spot lights and picks the ones whose shadows are redrawn this frame.
+	void UpdateLightShadows();
+	void DrawLightShadowsToCache();
+	void MarkVirtualShadowPages();
+	void DrawVirtualPagesToCache();
+	// Marks the cascades overlapping an instance of a static caster as dirty.
+	void InvalidateShadowCaches(const RenderItem* ri, const XMFLOAT4X4& world);
+	// Hands out the cascades' or the page pool's atlas tiles; false if they do not fit.
+	bool CarveShadowAtlas(const CascadeSettings& settings);
 	void DrawNormalsAndDepth();
 	void DrawGBuffer();
+	void BuildRenderGraph();
 
 	CD3DX12_CPU_DESCRIPTOR_HANDLE GetCpuSrv(int index)const;
 	CD3DX12_GPU_DESCRIPTOR_HANDLE GetGpuSrv(int index)const;
@@ -117,6 +330,10 @@ private:
 
 	ComPtr<ID3D12RootSignature> mRootSignature = nullptr;
 	ComPtr<ID3D12RootSignature> mSsaoRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mSsaoComputeRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mShadowCacheRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mDepthReduceRootSignature = nullptr;
+	ComPtr<ID3D12RootSignature> mEvsmRootSignature = nullptr;
 
 	ComPtr<ID3D12DescriptorHeap> mSrvDescriptorHeap = nullptr;
 
@@ -127,6 +344,8 @@ private:
 	std::unordered_map<std::string, ComPtr<ID3D12PipelineState>> mPSOs;
 
 	std::vector<D3D12_INPUT_ELEMENT_DESC> mInputLayout;
+	// Depth-only passes read the position alone.
+	std::vector<D3D12_INPUT_ELEMENT_DESC> mPositionInputLayout;
 
 	// List of all the render items.
 	std::vector<std::unique_ptr<RenderItem>> mAllRitems;
@@ -137,8 +356,12 @@ private:
 	UINT mSkyTexHeapIndex = 0;
 	UINT mDeferredIndex = 0;
 	UINT mShadowMapHeapIndex = 0;
+	UINT mShadowCacheHeapIndex = 0;
+	UINT mDepthReduceHeapIndex = 0;
+	UINT mEvsmHeapIndex = 0;
 	UINT mSsaoHeapIndexStart = 0;
 	UINT mSsaoAmbientMapIndex = 0;
+	UINT mSsaoUavHeapIndex = 0;
 
 	UINT mNullCubeSrvIndex = 0;
 	UINT mNullTexSrvIndex1 = 0;
@@ -146,17 +369,37 @@ private:
 
 	CD3DX12_GPU_DESCRIPTOR_HANDLE mNullSrv;
 
+	// Sky irradiance the frame constants carry as AmbientSH.
+	SH9 mSkyAmbient;
+	FrameConstants mFrameCB;
 	PassConstants mMainPassCB;  // index 0 of pass cbuffer.
 	PassConstants mShadowPassCB;// index 1 of pass cbuffer.
 
 	Camera mCamera;
 
 	std::unique_ptr<ShadowMap> mShadowMap;
+	std::unique_ptr<EvsmMap> mEvsmMap;
+	// The moments no longer match the atlas and must be prefiltered before use.
+	bool mEvsmStale = true;
 
 	std::unique_ptr<Ssao> mSsao;
+	SsaoSettings mSsaoSettings;
+	// View-projection the last ambient map was computed with, for reprojecting its history.
+	XMFLOAT4X4 mSsaoPrevViewProj = MathHelper::Identity4x4();
+	UINT mSsaoFrame = 0;
+
+	std::unique_ptr<SampleDistribution> mSampleDistribution;
+	// Latest depth reduction read back, and what it was recorded with.
+	DepthBounds mSampleBounds;
+	DepthReduceInputs mSampleBoundsInputs;
+	bool mSampleBoundsValid = false;
+	// What each frame resource's pending reduction is being recorded with.
+	DepthReduceInputs mDepthReduceInputs[gNumFrameResources];
 
 	std::unique_ptr<DeferredShading> mDeferred;
 
+	std::unique_ptr<RenderGraph> mRenderGraph;
+
 	DirectX::BoundingSphere mSceneBounds;
 
 	float mLightNearZ = 0.0f;
@@ -168,14 +411,57 @@ private:
 	XMFLOAT4X4 mLightProjs[MaxLights];
 	//XMFLOAT4X4 mShadowTransform = MathHelper::Identity4x4();
 	XMFLOAT4X4 mShadowTransforms[MaxLights];
+	// Light view all cascades are fitted in, anchored at the origin.
+	XMFLOAT4X4 mCascadeLightView = MathHelper::Identity4x4();
+	// Where each cascade lives in the shadow atlas.
+	ShadowAtlasTile mCascadeTiles[MaxShadowCascades];
+	CascadeSettings mCascadeSettings;
+	// View distance at which each cascade ends.
+	float mCascadeSplits[MaxShadowCascades];
+	CascadeCache mCascadeCaches[MaxShadowCascades];
+	// One caster's instances with their cascade masks, before UpdateCascadeMasks regroups them by LOD.
+	std::vector<InstanceData> mCasterLodScratch;
+	// Light view space box each cascade was last rendered with.
+	BoundingBox mCascadeBounds[MaxShadowCascades];
+	std::vector<RenderItem*> mStaticCasters;
+	std::vector<RenderItem*> mDynamicCasters;
+	bool mAtlasHasDynamicCasters = false;
+	bool mSinglePassCascadesSupported = false;
 
 	float mLightRotationAngle = 0.0f;
+	float mPrevLightRotationAngle = 0.0f;
 	XMFLOAT3 mBaseLightDirections[3] = {
 		XMFLOAT3(0.57735f, -0.57735f, 0.57735f),
 		XMFLOAT3(-0.57735f, -0.57735f, 0.57735f),
 		XMFLOAT3(0.0f, -0.707f, -0.707f)
 	};
 	XMFLOAT3 mRotatedLightDirections[3];
+	// Lead the clustered lights.
+	std::vector<Light> mSpotLights;
+	std::vector<Light> mPointLights;
+	ShadowScheduler mShadowScheduler;
+	ClusteredLights mClusteredLights;
+
+	// Specialized variants of the lighting and geometry pipelines.
+	std::unique_ptr<ShaderPermutations> mShaderPermutations;
+	// MaterialFeatures of each material, by MatCBIndex.
+	std::vector<ShaderFeatures> mMaterialFeatures;
+	// Directional lights up to the last one with any strength.
+	UINT mActiveDirLightCount = DirLightCount;
+
+	std::unique_ptr<VirtualShadowMap> mVirtualShadowMap;
+	VirtualShadowPages mVirtualPages;
+	// Atlas tile holding the physical pages.
+	ShadowAtlasTile mVirtualPoolTile;
+	// Light view and depth range the pages were rendered with.
+	XMFLOAT4X4 mVirtualLightView = MathHelper::Identity4x4();
+	float mVirtualDepthNear = 0.0f;
+	float mVirtualDepthFar = 1.0f;
+	float mVirtualLodScale = 0.0f;
+	// Light view space boxes of the dynamic casters when the pages were last updated.
+	std::vector<BoundingBox> mPrevDynamicCasterBoundsL;
+	// Windows each frame resource's pending page requests are being marked in.
+	VirtualShadowLevel mVirtualMarkLevels[gNumFrameResources][VirtualShadowLevels];
 
 	POINT mLastMousePos;
 
@@ -187,4 +473,9 @@ private:
 	BoundingFrustum mCamFrustum;
 	bool mFrustumCullingEnabled = true;
 	bool isDeferred = true;
+
+	SceneEditQueue mSceneEdits;
+	std::vector<SceneEdit> mDrainedEdits;
+	// First id of each render item's initial instances, by AssignInstanceIds.
+	std::vector<UINT> mFirstInstanceIds;
 };
@@ -0,0 +1,184 @@
+#include "ClusteredLights.h"
+
+using namespace DirectX;
+
+void ClusteredLights::SetProjection(const XMFLOAT4X4& proj, float nearZ, float farZ)
+{
+	mNearZ = nearZ;
+	mFarZ = farZ;
+
+	// Slice k starts at nearZ * (farZ / nearZ)^(k / ClusterCountZ).
+	float logRange = log2f(farZ / nearZ);
+	mZScale = ClusterCountZ / logRange;
+	mZBias = -ClusterCountZ * log2f(nearZ) / logRange;
+	for (UINT k = 0; k <= ClusterCountZ; ++k)
+		mSliceZ[k] = nearZ * powf(farZ / nearZ, (float)k / ClusterCountZ);
+
+	// View x = ndcX * viewZ / proj[0][0]; tile 0 is on the left and, along y, at the top.
+	float tileMinX[ClusterCountX], tileMaxX[ClusterCountX];
+	for (UINT x = 0; x < ClusterCountX; ++x)
+	{
+		tileMinX[x] = (-1.0f + 2.0f * x / ClusterCountX) / proj.m[0][0];
+		tileMaxX[x] = (-1.0f + 2.0f * (x + 1) / ClusterCountX) / proj.m[0][0];
+	}
+	float tileMinY[ClusterCountY], tileMaxY[ClusterCountY];
+	for (UINT y = 0; y < ClusterCountY; ++y)
+	{
+		tileMinY[y] = (1.0f - 2.0f * (y + 1) / ClusterCountY) / proj.m[1][1];
+		tileMaxY[y] = (1.0f - 2.0f * y / ClusterCountY) / proj.m[1][1];
+	}
+	for (UINT g = 0; g < ClusterCountX / 4; ++g)
+	{
+		mTileMinX[g] = XMFLOAT4(&tileMinX[4 * g]);
+		mTileMaxX[g] = XMFLOAT4(&tileMaxX[4 * g]);
+	}
+	for (UINT g = 0; g < ClusterCountY / 4; ++g)
+	{
+		mTileMinY[g] = XMFLOAT4(&tileMinY[4 * g]);
+		mTileMaxY[g] = XMFLOAT4(&tileMaxY[4 * g]);
+	}
+}
+
+// Squared distances from c to four tiles' extents over the depths [zn, zf].
+static XMVECTOR TileDistanceSq(const XMFLOAT4& tileMin, const XMFLOAT4& tileMax, FXMVECTOR c,
+	FXMVECTOR zn, FXMVECTOR zf)
+{
+	XMVECTOR minSlope = XMLoadFloat4(&tileMin);
+	XMVECTOR maxSlope = XMLoadFloat4(&tileMax);
+	XMVECTOR lo = XMVectorMin(minSlope * zn, minSlope * zf);
+	XMVECTOR hi = XMVectorMax(maxSlope * zn, maxSlope * zf);
+	XMVECTOR d = XMVectorMax(XMVectorMax(lo - c, c - hi), XMVectorZero());
+	return d * d;
+}
+
+void ClusteredLights::Build(const std::vector<Light>& lights, const XMFLOAT4X4& view)
+{
+	mLightCount = std::min<UINT>((UINT)lights.size(), MaxClusteredLights);
+	mClusters.assign(ClusterCount, ClusterRange());
+	mHits.clear();
+
+	XMMATRIX V = XMLoadFloat4x4(&view);
+	for (UINT i = 0; i < mLightCount; ++i)
+	{
+		const Light& light = lights[i];
+		XMVECTOR centerV = XMVector3TransformCoord(XMLoadFloat3(&light.Position), V);
+		XMFLOAT3 c;
+		XMStoreFloat3(&c, centerV);
+		float r = light.FalloffEnd;
+		if (c.z + r < mNearZ || c.z - r > mFarZ)
+			continue;
+
+		XMVECTOR cx = XMVectorSplatX(centerV);
+		XMVECTOR cy = XMVectorSplatY(centerV);
+		UINT firstSlice = Slice(std::max<float>(c.z - r, mNearZ));
+		UINT lastSlice = Slice(std::min<float>(c.z + r, mFarZ));
+		for (UINT z = firstSlice; z <= lastSlice; ++z)
+		{
+			float zn = mSliceZ[z];
+			float zf = mSliceZ[z + 1];
+			float dz = std::max<float>(std::max<float>(zn - c.z, c.z - zf), 0.0f);
+			float rest = r * r - dz * dz;
+			if (rest < 0.0f)
+				continue;
+
+			XMVECTOR vzn = XMVectorReplicate(zn);
+			XMVECTOR vzf = XMVectorReplicate(zf);
+			XMVECTOR dx2[ClusterCountX / 4];
+			for (UINT g = 0; g < ClusterCountX / 4; ++g)
+				dx2[g] = TileDistanceSq(mTileMinX[g], mTileMaxX[g], cx, vzn, vzf);
+			float dy2[ClusterCountY];
+			for (UINT g = 0; g < ClusterCountY / 4; ++g)
+				XMStoreFloat4((XMFLOAT4*)&dy2[4 * g], TileDistanceSq(mTileMinY[g], mTileMaxY[g], cy, vzn, vzf));
+
+			for (UINT y = 0; y < ClusterCountY; ++y)
+			{
+				if (dy2[y] > rest)
+					continue;
+
+				// The sphere reaches a froxel when dx^2 + dy^2 + dz^2 <= r^2.
+				XMVECTOR limit = XMVectorReplicate(rest - dy2[y]);
+				UINT row = (z * ClusterCountY + y) * ClusterCountX;
+				for (UINT g = 0; g < ClusterCountX / 4; ++g)
+				{
+					XMUINT4 hit;
+					XMStoreUInt4(&hit, XMVectorLessOrEqual(dx2[g], limit));
+					const UINT* lanes = &hit.x;
+					for (UINT lane = 0; lane < 4; ++lane)
+					{
+						if (lanes[lane] == 0)
+							continue;
+						UINT cluster = row + 4 * g + lane;
+						mClusters[cluster].Count++;
+						mHits.push_back(XMUINT2(cluster, i));
+					}
+				}
+			}
+		}
+	}
+
+	// Lay the runs out one after another, cut short where the index list is full.
+	UINT offset = 0;
+	mDroppedIndexCount = 0;
+	for (auto& cluster : mClusters)
+	{
+		UINT count = std::min<UINT>(cluster.Count, MaxClusterLightIndices - offset);
+		mDroppedIndexCount += cluster.Count - count;
+		cluster.Offset = offset;
+		cluster.Count = count;
+		offset += count;
+	}
+
+	// Hits come in light order, so every run is sorted.
+	mLightIndices.resize(offset);
+	mFilled.assign(ClusterCount, 0);
+	for (const auto& hit : mHits)
+	{
+		const ClusterRange& cluster = mClusters[hit.x];
+		UINT& filled = mFilled[hit.x];
+		if (filled < cluster.Count)
+			mLightIndices[cluster.Offset + filled++] = hit.y;
+	}
+}
+
+UINT ClusteredLights::LightCount()const
+{
+	return mLightCount;
+}
+
+const std::vector<ClusterRange>& ClusteredLights::Clusters()const
+{
+	return mClusters;
+}
+
+const std::vector<UINT>& ClusteredLights::LightIndices()const
+{
+	return mLightIndices;
+}
+
+UINT ClusteredLights::DroppedIndexCount()const
+{
+	return mDroppedIndexCount;
+}
+
+float ClusteredLights::ZScale()const
+{
+	return mZScale;
+}
+
+float ClusteredLights::ZBias()const
+{
+	return mZBias;
+}
+
+UINT ClusteredLights::ClusterIndex(float u, float v, float viewZ)const
+{
+	UINT x = std::min<UINT>((UINT)std::max<float>(u * ClusterCountX, 0.0f), ClusterCountX - 1);
+	UINT y = std::min<UINT>((UINT)std::max<float>(v * ClusterCountY, 0.0f), ClusterCountY - 1);
+	return (Slice(viewZ) * ClusterCountY + y) * ClusterCountX + x;
+}
+
+UINT ClusteredLights::Slice(float viewZ)const
+{
+	float slice = log2f(std::max<float>(viewZ, mNearZ)) * mZScale + mZBias;
+	return (UINT)MathHelper::Clamp(slice, 0.0f, ClusterCountZ - 1.0f);
+}
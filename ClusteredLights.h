@@ -0,0 +1,83 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+static_assert(ClusterCountX % 4 == 0 && ClusterCountY % 4 == 0, "ClusteredLights tests four tiles at a time.");
+
+// Run of a froxel's light indices in ClusteredLights::LightIndices, as gClusters reads it.
+struct ClusterRange
+{
+	UINT Offset = 0;
+	UINT Count = 0;
+};
+
+///<summary>
+/// Point and spot lights binned into a froxel grid: ClusterCountX*ClusterCountY
+/// screen tiles by ClusterCountZ depth slices, spaced exponentially between the
+/// near and far planes.  Each light's bounding sphere is tested against the
+/// froxels of the slices it spans, a row of tiles four at a time, and the hits
+/// are packed into one light index list with an offset and count per froxel.
+/// Pure bookkeeping, rebuilt on the CPU every frame; ClusteredLighting in
+/// Common.hlsl reads the result.
+///</summary>
+class ClusteredLights
+{
+public:
+	static const UINT ClusterCount = ClusterCountX * ClusterCountY * ClusterCountZ;
+
+	ClusteredLights() = default;
+	ClusteredLights(const ClusteredLights& rhs) = delete;
+	ClusteredLights& operator=(const ClusteredLights& rhs) = delete;
+	~ClusteredLights() = default;
+
+	///<summary>
+	/// Fits the grid to a perspective projection (not transposed) with clip planes
+	/// nearZ and farZ.
+	///</summary>
+	void SetProjection(const DirectX::XMFLOAT4X4& proj, float nearZ, float farZ);
+
+	///<summary>
+	/// Bins world space lights seen through view (not transposed).  A light is a spot
+	/// light, or a point light when its SpotPower is 0, and reaches FalloffEnd.  Only
+	/// the first MaxClusteredLights lights are taken, and froxels past
+	/// MaxClusterLightIndices indices in all are cut short.
+	///</summary>
+	void Build(const std::vector<Light>& lights, const DirectX::XMFLOAT4X4& view);
+
+	// Lights the last Build took, the first ones of the list it was given.
+	UINT LightCount()const;
+	const std::vector<ClusterRange>& Clusters()const;
+	const std::vector<UINT>& LightIndices()const;
+	// Indices the last Build had no room for.
+	UINT DroppedIndexCount()const;
+
+	// The slice of a view depth is log2(viewZ) * ZScale() + ZBias().
+	float ZScale()const;
+	float ZBias()const;
+
+	// Froxel of a pixel at texture coordinates (u, v) and view depth viewZ, as ClusterIndex.
+	UINT ClusterIndex(float u, float v, float viewZ)const;
+
+private:
+	UINT Slice(float viewZ)const;
+
+private:
+	float mNearZ = 1.0f;
+	float mFarZ = 1000.0f;
+	float mZScale = 0.0f;
+	float mZBias = 0.0f;
+	// View depth where each slice starts, and where the last one ends.
+	float mSliceZ[ClusterCountZ + 1] = {};
+	// Tile edges as view x (or y) per unit of view depth, four tiles to a vector.
+	DirectX::XMFLOAT4 mTileMinX[ClusterCountX / 4];
+	DirectX::XMFLOAT4 mTileMaxX[ClusterCountX / 4];
+	DirectX::XMFLOAT4 mTileMinY[ClusterCountY / 4];
+	DirectX::XMFLOAT4 mTileMaxY[ClusterCountY / 4];
+
+	UINT mLightCount = 0;
+	UINT mDroppedIndexCount = 0;
+	std::vector<ClusterRange> mClusters;
+	std::vector<UINT> mLightIndices;
+	// Froxel (x) and light (y) of every hit, in light order.
+	std::vector<DirectX::XMUINT2> mHits;
+	std::vector<UINT> mFilled;
+};
@@ -0,0 +1,196 @@
+//***************************************************************************************
+// FramePacer.cpp
+//***************************************************************************************
+
+#include "FramePacer.h"
+#include <algorithm>
+#include <sstream>
+#include <timeapi.h>
+
+#pragma comment(lib, "winmm.lib")
+
+namespace
+{
+	// Never simulate more than this many steps in one frame.  After a long stall
+	// the remaining time is dropped instead of spiralling further behind.
+	const UINT MaxStepsPerFrame = 8;
+
+	// Longest frame fed into the simulation, e.g. after stepping in a debugger.
+	const double MaxFrameTime = 0.25;
+}
+
+FramePacer::FramePacer()
+{
+	__int64 countsPerSec;
+	QueryPerformanceFrequency((LARGE_INTEGER*)&countsPerSec);
+	mSecondsPerCount = 1.0 / (double)countsPerSec;
+
+	// The default scheduler tick is 15.6 ms, far too coarse to sleep in.
+	mRaisedTimerResolution = timeBeginPeriod(1) == TIMERR_NOERROR;
+
+	ResetStats();
+}
+
+FramePacer::~FramePacer()
+{
+	if (mRaisedTimerResolution)
+		timeEndPeriod(1);
+}
+
+void FramePacer::SetTargetFrameRate(double framesPerSecond)
+{
+	SetTargetInterval(framesPerSecond > 0.0 ? 1.0 / framesPerSecond : 0.0);
+}
+
+void FramePacer::SetTargetInterval(double seconds)
+{
+	mTargetInterval = std::max<double>(seconds, 0.0);
+	mNextDeadline = Now() + mTargetInterval;
+}
+
+double FramePacer::TargetInterval()const
+{
+	return mTargetInterval;
+}
+
+void FramePacer::SetFixedTimestep(double seconds)
+{
+	mFixedTimestep = std::max<double>(seconds, 0.0);
+	mAccumulator = 0.0;
+}
+
+double FramePacer::FixedTimestep()const
+{
+	return mFixedTimestep;
+}
+
+void FramePacer::SetSpinThreshold(double seconds)
+{
+	mSpinThreshold = std::max<double>(seconds, 0.0);
+}
+
+void FramePacer::Reset()
+{
+	mAccumulator = 0.0;
+	mNextDeadline = Now() + mTargetInterval;
+}
+
+UINT FramePacer::BeginFrame(float deltaTime)
+{
+	if (mFixedTimestep <= 0.0)
+		return 0;
+
+	mAccumulator += std::min<double>(std::max<double>((double)deltaTime, 0.0), MaxFrameTime);
+
+	UINT steps = 0;
+	while (mAccumulator >= mFixedTimestep && steps < MaxStepsPerFrame)
+	{
+		mAccumulator -= mFixedTimestep;
+		steps++;
+	}
+
+	if (steps == MaxStepsPerFrame)
+		mAccumulator = std::min<double>(mAccumulator, mFixedTimestep);
+
+	return steps;
+}
+
+float FramePacer::InterpolationAlpha()const
+{
+	if (mFixedTimestep <= 0.0)
+		return 1.0f;
+
+	return (float)std::min<double>(mAccumulator / mFixedTimestep, 1.0);
+}
+
+void FramePacer::WaitForNextFrame()
+{
+	if (mTargetInterval <= 0.0)
+		return;
+
+	double now = Now();
+	double remaining = mNextDeadline - now;
+
+	// Sleep through most of the wait; Sleep may overshoot by up to a tick,
+	// so the last mSpinThreshold seconds are spun.
+	if (remaining > mSpinThreshold)
+	{
+		Sleep((DWORD)((remaining - mSpinThreshold) * 1000.0));
+		now = Now();
+	}
+	while (now < mNextDeadline)
+	{
+		YieldProcessor();
+		now = Now();
+	}
+
+	double error = now - mNextDeadline;
+
+	// Schedule against the ideal timeline so errors do not accumulate, unless the
+	// frame missed its slot entirely; catching up would only deliver a burst.
+	mNextDeadline += mTargetInterval;
+	if (mNextDeadline < now)
+		mNextDeadline = now + mTargetInterval;
+
+	int bucket = std::min<int>((int)(error / HistogramBucketWidth), HistogramBucketCount - 1);
+	mHistogram[bucket]++;
+	mSampleCount++;
+	mErrorSum += error;
+	mMaxError = std::max<double>(mMaxError, error);
+}
+
+const std::array<UINT, FramePacer::HistogramBucketCount>& FramePacer::ErrorHistogram()const
+{
+	return mHistogram;
+}
+
+double FramePacer::AverageError()const
+{
+	return mSampleCount > 0 ? mErrorSum / mSampleCount : 0.0;
+}
+
+double FramePacer::MaxError()const
+{
+	return mMaxError;
+}
+
+double FramePacer::ErrorPercentile(double fraction)const
+{
+	UINT target = (UINT)(fraction * mSampleCount);
+	UINT count = 0;
+	for (int i = 0; i < HistogramBucketCount; ++i)
+	{
+		count += mHistogram[i];
+		if (count > target)
+			return i < HistogramBucketCount - 1 ? (i + 1) * HistogramBucketWidth : mMaxError;
+	}
+	return mMaxError;
+}
+
+void FramePacer::ResetStats()
+{
+	mHistogram.fill(0);
+	mSampleCount = 0;
+	mErrorSum = 0.0;
+	mMaxError = 0.0;
+}
+
+std::wstring FramePacer::StatsText()const
+{
+	if (mTargetInterval <= 0.0 || mSampleCount == 0)
+		return L"pacing off";
+
+	std::wostringstream outs;
+	outs.precision(2);
+	outs << std::fixed << L"pace err avg " << AverageError() * 1000.0 <<
+		L"ms p99 " << ErrorPercentile(0.99) * 1000.0 <<
+		L"ms max " << MaxError() * 1000.0 << L"ms";
+	return outs.str();
+}
+
+double FramePacer::Now()const
+{
+	__int64 currTime;
+	QueryPerformanceCounter((LARGE_INTEGER*)&currTime);
+	return currTime * mSecondsPerCount;
+}
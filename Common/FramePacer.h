@@ -0,0 +1,79 @@
+//***************************************************************************************
+// FramePacer.h
+//
+// Paces the main loop to a target frame interval and drives a fixed-step
+// simulation.  Frames are waited for with a coarse Sleep followed by a short
+// spin, which is precise to a few microseconds without burning a whole core.
+//***************************************************************************************
+
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+#include <windows.h>
+#include <array>
+#include <string>
+
+class FramePacer
+{
+public:
+	// Pacing error buckets are BucketWidth seconds wide; the last one is open ended.
+	static const int HistogramBucketCount = 16;
+	static constexpr double HistogramBucketWidth = 0.00025;
+
+	FramePacer();
+	~FramePacer();
+
+	// 0 disables pacing and frames are presented as fast as possible.
+	void SetTargetFrameRate(double framesPerSecond);
+	void SetTargetInterval(double seconds);
+	double TargetInterval()const;
+
+	// 0 runs one variable-length simulation step per frame.
+	void SetFixedTimestep(double seconds);
+	double FixedTimestep()const;
+
+	// Time before a deadline that is spun instead of slept.
+	void SetSpinThreshold(double seconds);
+
+	void Reset(); // Call before the loop and after a pause.
+
+	// Accumulates deltaTime and returns how many fixed steps the simulation should run.
+	UINT BeginFrame(float deltaTime);
+
+	// How far the render time is between the last two simulation states, in [0, 1).
+	float InterpolationAlpha()const;
+
+	// Blocks until the next frame is due and records how late it woke up.
+	void WaitForNextFrame();
+
+	const std::array<UINT, HistogramBucketCount>& ErrorHistogram()const;
+	double AverageError()const;
+	double MaxError()const;
+	// Upper bound of the bucket holding the given fraction of frames, in seconds.
+	double ErrorPercentile(double fraction)const;
+	void ResetStats();
+
+	// e.g. "pace err avg 0.04ms p99 0.25ms max 0.61ms".
+	std::wstring StatsText()const;
+
+private:
+	double Now()const;
+
+private:
+	double mSecondsPerCount = 0.0;
+	bool mRaisedTimerResolution = false;
+
+	double mTargetInterval = 0.0;
+	double mSpinThreshold = 0.002;
+	double mNextDeadline = 0.0;
+
+	double mFixedTimestep = 0.0;
+	double mAccumulator = 0.0;
+
+	std::array<UINT, HistogramBucketCount> mHistogram;
+	UINT mSampleCount = 0;
+	double mErrorSum = 0.0;
+	double mMaxError = 0.0;
+};
+
+#endif // FRAMEPACER_H
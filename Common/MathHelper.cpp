@@ -33,6 +33,19 @@ float MathHelper::AngleFromXY(float x, float y)
 	return theta;
 }
 
+bool MathHelper::NearEqual(const XMFLOAT4X4& a, const XMFLOAT4X4& b)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = 0; j < 4; ++j)
+		{
+			if (fabsf(a.m[i][j] - b.m[i][j]) > 1e-4f)
+				return false;
+		}
+	}
+	return true;
+}
+
 XMVECTOR MathHelper::RandUnitVec3()
 {
 	XMVECTOR One  = XMVectorSet(1.0f, 1.0f, 1.0f, 1.0f);
@@ -89,6 +89,10 @@ public:
         return I;
     }
 
+    // True when no element of a and b differs by more than 1e-4: what is left is
+    // float noise, well below moving anything by a shadow map texel.
+    static bool NearEqual(const DirectX::XMFLOAT4X4& a, const DirectX::XMFLOAT4X4& b);
+
     static DirectX::XMVECTOR RandUnitVec3();
     static DirectX::XMVECTOR RandHemisphereUnitVec3(DirectX::XMVECTOR n);
 
@@ -74,6 +74,7 @@ int D3DApp::Run()
 	MSG msg = {0};
  
 	mTimer.Reset();
+	mFramePacer.Reset();
 
 	while(msg.message != WM_QUIT)
 	{
@@ -90,9 +91,15 @@ int D3DApp::Run()
 
 			if( !mAppPaused )
 			{
+				UINT steps = mFramePacer.BeginFrame(mTimer.DeltaTime());
+				for(UINT i = 0; i < steps; ++i)
+					FixedUpdate((float)mFramePacer.FixedTimestep());
+
 				CalculateFrameStats();
 				Update(mTimer);	
                 Draw(mTimer);
+
+				mFramePacer.WaitForNextFrame();
 			}
 			else
 			{
@@ -252,6 +259,7 @@ LRESULT D3DApp::MsgProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
 		{
 			mAppPaused = false;
 			mTimer.Start();
+			mFramePacer.Reset();
 		}
 		return 0;
 
@@ -617,12 +625,14 @@ void D3DApp::CalculateFrameStats()
 
         wstring windowText = mMainWndCaption +
             L"    fps: " + fpsStr +
-            L"   mspf: " + mspfStr;
+            L"   mspf: " + mspfStr +
+            L"   " + mFramePacer.StatsText();
 
         SetWindowText(mhMainWnd, windowText.c_str());
 		
 		// Reset for next average.
 		frameCnt = 0;
+		mFramePacer.ResetStats();
 		timeElapsed += 1.0f;
 	}
 }
@@ -11,6 +11,7 @@
 
 #include "d3dUtil.h"
 #include "GameTimer.h"
+#include "FramePacer.h"
 
 // Link necessary d3d12 libraries.
 #pragma comment(lib,"d3dcompiler.lib")
@@ -46,6 +47,8 @@ protected:
     virtual void CreateRtvAndDsvDescriptorHeaps();
 	virtual void OnResize(); 
 	virtual void Update(const GameTimer& gt)=0;
+	// Called zero or more times per frame with a constant dt when a fixed timestep is set.
+	virtual void FixedUpdate(float dt){ }
     virtual void Draw(const GameTimer& gt)=0;
 
 	// Convenience overrides for handling mouse input.
@@ -91,6 +94,9 @@ protected:
 
 	// Used to keep track of the delta-time?and game time (?.4).
 	GameTimer mTimer;
+
+	// Target frame interval and fixed simulation step; both off by default.
+	FramePacer mFramePacer;
 	
     Microsoft::WRL::ComPtr<IDXGIFactory4> mdxgiFactory;
     Microsoft::WRL::ComPtr<IDXGISwapChain> mSwapChain;
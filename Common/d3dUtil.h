@@ -180,6 +180,13 @@ struct MeshGeometry
 	DXGI_FORMAT IndexFormat = DXGI_FORMAT_R16_UINT;
 	UINT IndexBufferByteSize = 0;
 
+	// Optional tightly packed positions of the same vertices, for the depth-only passes
+	// that read nothing else.
+	Microsoft::WRL::ComPtr<ID3DBlob> PositionBufferCPU = nullptr;
+	Microsoft::WRL::ComPtr<ID3D12Resource> PositionBufferGPU = nullptr;
+	Microsoft::WRL::ComPtr<ID3D12Resource> PositionBufferUploader = nullptr;
+	UINT PositionBufferByteSize = 0;
+
 	// A MeshGeometry may store multiple geometries in one vertex/index buffer.
 	// Use this container to define the Submesh geometries so we can draw
 	// the Submeshes individually.
@@ -195,6 +202,21 @@ struct MeshGeometry
 		return vbv;
 	}
 
+	// Vertices for a position-only input layout: the position stream if there is one,
+	// else the full vertices, which start with the position as well.
+	D3D12_VERTEX_BUFFER_VIEW PositionBufferView()const
+	{
+		if (PositionBufferGPU == nullptr)
+			return VertexBufferView();
+
+		D3D12_VERTEX_BUFFER_VIEW vbv;
+		vbv.BufferLocation = PositionBufferGPU->GetGPUVirtualAddress();
+		vbv.StrideInBytes = sizeof(DirectX::XMFLOAT3);
+		vbv.SizeInBytes = PositionBufferByteSize;
+
+		return vbv;
+	}
+
 	D3D12_INDEX_BUFFER_VIEW IndexBufferView()const
 	{
 		D3D12_INDEX_BUFFER_VIEW ibv;
@@ -210,6 +232,7 @@ struct MeshGeometry
 	{
 		VertexBufferUploader = nullptr;
 		IndexBufferUploader = nullptr;
+		PositionBufferUploader = nullptr;
 	}
 };
 
@@ -224,6 +247,21 @@ struct Light
 };
 
 #define MaxLights 16
+#define MaxShadowCascades 4
+// Shadow caster LODs; InstanceData::CascadeMask holds MaxShadowCascades bits per LOD.
+#define MaxCasterLods 3
+// Lights ShadowScheduler can give an atlas tile at once.
+#define MaxShadowedLights 8
+// Clipmap levels of the virtual shadow map, and pages along each side of a level.
+#define VirtualShadowLevels 6
+#define VirtualShadowPagesPerLevel 64
+// Froxel grid of the clustered lights: screen tiles along x and y, depth slices along z.
+#define ClusterCountX 16
+#define ClusterCountY 8
+#define ClusterCountZ 24
+// Point and spot lights the clustered light buffer holds, and light indices over all froxels.
+#define MaxClusteredLights 4096
+#define MaxClusterLightIndices (64 * ClusterCountX * ClusterCountY * ClusterCountZ)
 
 struct MaterialConstants
 {
@@ -262,6 +300,9 @@ struct Material
 	DirectX::XMFLOAT3 FresnelR0 = { 0.01f, 0.01f, 0.01f };
 	float Roughness = .25f;
 	DirectX::XMFLOAT4X4 MatTransform = MathHelper::Identity4x4();
+
+	// Diffuse alpha cuts out texels, so its pixels run the ALPHA_TEST shader variants.
+	bool AlphaTested = false;
 };
 
 struct Texture
@@ -1,15 +1,14 @@
 #include "DeferredShading.h"
 
-DeferredShading::DeferredShading(ID3D12Device* device, UINT width, 
-					UINT height, DXGI_FORMAT format)
+using namespace DirectX;
+
+DeferredShading::DeferredShading(ID3D12Device* device, UINT width, UINT height)
 {
 	md3dDevice = device;
 	mWidth = width;
 	mHeight = height;
 	mViewport = { 0.0f, 0.0f, (float)width, (float)height, 0.0f, 1.0f };
 	mScissorRect = { 0, 0, (int)width, (int)height };
-
-	BuildResource();
 }
 
 UINT DeferredShading::Width() const
@@ -22,14 +21,26 @@ UINT DeferredShading::Height() const
 	return mHeight;
 }
 
-DXGI_FORMAT DeferredShading::Format() const
+DXGI_FORMAT DeferredShading::Format(int index)
+{
+	return index == 0 ? DXGI_FORMAT_R8G8B8A8_UNORM : DXGI_FORMAT_R10G10B10A2_UNORM;
+}
+
+D3D12_CLEAR_VALUE DeferredShading::ClearValue(int index)
 {
-	return mFormat;
+	float clearColor[] = { 0.0f, 0.0f, 0.0f, 1.0f };
+	return CD3DX12_CLEAR_VALUE(Format(index), clearColor);
 }
 
 ID3D12Resource* DeferredShading::Resource(int index)
 {
-	return mGBuffer[index].Get();
+	return mGBuffer[index];
+}
+
+void DeferredShading::SetResource(int index, ID3D12Resource* resource)
+{
+	mGBuffer[index] = resource;
+	BuildDescriptors();
 }
 
 CD3DX12_GPU_DESCRIPTOR_HANDLE DeferredShading::Srv(int index) const
@@ -58,7 +69,7 @@ void DeferredShading::BuildDescriptors(CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
 {
 	UINT mRtvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_RTV);
 	UINT mCbvSrvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
-	for (size_t i = 0; i < 4; i++)
+	for (size_t i = 0; i < GBufferCount; i++)
 	{
 		mhCpuSrv[i] = hCpuSrv;
 		mhGpuSrv[i] = hGpuSrv;
@@ -76,11 +87,8 @@ void DeferredShading::OnResize(UINT newWidth, UINT newHeight)
 	{
 		mWidth = newWidth;
 		mHeight = newHeight;
-
-		BuildResource();
-
-		// New resource, so we need new descriptors to that resource.
-		BuildDescriptors();
+		mViewport = { 0.0f, 0.0f, (float)newWidth, (float)newHeight, 0.0f, 1.0f };
+		mScissorRect = { 0, 0, (int)newWidth, (int)newHeight };
 	}
 }
 
@@ -88,55 +96,86 @@ void DeferredShading::BuildDescriptors()
 {
 	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
 	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
-	srvDesc.Format = mFormat;
 	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
 	srvDesc.Texture2D.MostDetailedMip = 0;
 	srvDesc.Texture2D.MipLevels = 1;
 
 	// Create RTV for every gBuffer
 	D3D12_RENDER_TARGET_VIEW_DESC rtvDesc;
-	rtvDesc.ViewDimension = D3D12_RTV_DIMENSION_TEXTURE2DARRAY;
-	rtvDesc.Format = mFormat;
-	rtvDesc.Texture2DArray.MipSlice = 0;
-	rtvDesc.Texture2DArray.FirstArraySlice = 0;
-	rtvDesc.Texture2DArray.ArraySize = 1;
-	rtvDesc.Texture2DArray.PlaneSlice = 0;
-
-	for (size_t i = 0; i < 4; i++)
+	rtvDesc.ViewDimension = D3D12_RTV_DIMENSION_TEXTURE2D;
+	rtvDesc.Texture2D.MipSlice = 0;
+	rtvDesc.Texture2D.PlaneSlice = 0;
+
+	for (size_t i = 0; i < GBufferCount; i++)
 	{
-		md3dDevice->CreateShaderResourceView(mGBuffer[i].Get(), &srvDesc, mhCpuSrv[i]);
-		md3dDevice->CreateRenderTargetView(mGBuffer[i].Get(), &rtvDesc, mhCpuRtv[i]);
+		srvDesc.Format = Format((int)i);
+		rtvDesc.Format = Format((int)i);
+		md3dDevice->CreateShaderResourceView(mGBuffer[i], &srvDesc, mhCpuSrv[i]);
+		md3dDevice->CreateRenderTargetView(mGBuffer[i], &rtvDesc, mhCpuRtv[i]);
 	}
 }
 
-void DeferredShading::BuildResource()
+static UINT Quantize(float x, float maxValue)
 {
-	D3D12_RESOURCE_DESC texDesc;
-	ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
-	texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
-	texDesc.Alignment = 0;
-	texDesc.Width = mWidth;
-	texDesc.Height = mHeight;
-	texDesc.DepthOrArraySize = 4;
-	texDesc.MipLevels = 1;
-	texDesc.Format = mFormat;
-	texDesc.SampleDesc.Count = 1;
-	texDesc.SampleDesc.Quality = 0;
-	texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
-	texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET;
+	return (UINT)(MathHelper::Clamp(x, 0.0f, 1.0f) * maxValue + 0.5f);
+}
 
-	// Clear the back buffer and depth buffer.
-	float clearColor[] = { 0.0f, 0.0f, 0.0f, 1.0f };
-	CD3DX12_CLEAR_VALUE clearValue(mFormat, clearColor);
-	for (size_t i = 0; i < 4; i++)
+GBufferTexel DeferredShading::EncodeGBuffer(const GBufferSample& sample)
+{
+	XMFLOAT2 e = OctEncode(sample.NormalW);
+
+	GBufferTexel texel;
+	texel.Texel0 = Quantize(sample.Albedo.x, 255.0f) | Quantize(sample.Albedo.y, 255.0f) << 8 |
+		Quantize(sample.Albedo.z, 255.0f) << 16 | Quantize(sample.Metalness, 255.0f) << 24;
+	texel.Texel1 = Quantize(e.x * 0.5f + 0.5f, 1023.0f) | Quantize(e.y * 0.5f + 0.5f, 1023.0f) << 10 |
+		Quantize(sample.Roughness, 1023.0f) << 20;
+	return texel;
+}
+
+GBufferSample DeferredShading::DecodeGBuffer(const GBufferTexel& texel)
+{
+	GBufferSample sample;
+	sample.Albedo = XMFLOAT3((texel.Texel0 & 0xff) / 255.0f, (texel.Texel0 >> 8 & 0xff) / 255.0f,
+		(texel.Texel0 >> 16 & 0xff) / 255.0f);
+	sample.Metalness = (texel.Texel0 >> 24) / 255.0f;
+	sample.NormalW = OctDecode(XMFLOAT2((texel.Texel1 & 0x3ff) / 1023.0f * 2.0f - 1.0f,
+		(texel.Texel1 >> 10 & 0x3ff) / 1023.0f * 2.0f - 1.0f));
+	sample.Roughness = (texel.Texel1 >> 20 & 0x3ff) / 1023.0f;
+	return sample;
+}
+
+XMFLOAT2 DeferredShading::OctEncode(const XMFLOAT3& n)
+{
+	float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+	XMFLOAT2 e(n.x / l1, n.y / l1);
+	if (n.z < 0.0f)
 	{
-		// Create texture array with 4 elements
-		ThrowIfFailed(md3dDevice->CreateCommittedResource(
-			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
-			D3D12_HEAP_FLAG_NONE,
-			&texDesc,
-			D3D12_RESOURCE_STATE_GENERIC_READ,
-			&clearValue,
-			IID_PPV_ARGS(&mGBuffer[i])));
+		XMFLOAT2 f((1.0f - fabsf(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f),
+			(1.0f - fabsf(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f));
+		e = f;
 	}
+	return e;
+}
+
+XMFLOAT3 DeferredShading::OctDecode(const XMFLOAT2& e)
+{
+	XMFLOAT3 n(e.x, e.y, 1.0f - fabsf(e.x) - fabsf(e.y));
+	if (n.z < 0.0f)
+	{
+		n.x = (1.0f - fabsf(e.y)) * (e.x >= 0.0f ? 1.0f : -1.0f);
+		n.y = (1.0f - fabsf(e.x)) * (e.y >= 0.0f ? 1.0f : -1.0f);
+	}
+	XMStoreFloat3(&n, XMVector3Normalize(XMLoadFloat3(&n)));
+	return n;
+}
+
+XMFLOAT3 DeferredShading::ReconstructPosition(float depth, float u, float v,
+	const XMFLOAT4X4& invViewProj)
+{
+	XMVECTOR posW = XMVector4Transform(XMVectorSet(2.0f * u - 1.0f, 1.0f - 2.0f * v, depth, 1.0f),
+		XMLoadFloat4x4(&invViewProj));
+
+	XMFLOAT3 p;
+	XMStoreFloat3(&p, posW / XMVectorSplatW(posW));
+	return p;
 }
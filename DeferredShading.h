@@ -1,19 +1,50 @@
 #pragma once
 #include "Common/d3dUtil.h"
 
+// A G-buffer texel as the two targets store it.
+struct GBufferTexel
+{
+	// R8G8B8A8_UNORM: albedo rgb, metalness a.
+	UINT Texel0;
+	// R10G10B10A2_UNORM: octahedral normal rg, roughness b.
+	UINT Texel1;
+};
+
+// The surface a G-buffer texel describes.
+struct GBufferSample
+{
+	DirectX::XMFLOAT3 Albedo;
+	float Metalness;
+	DirectX::XMFLOAT3 NormalW;
+	float Roughness;
+};
+
+///<summary>
+/// The G-buffer of the deferred path: albedo and metalness in one R8G8B8A8 target,
+/// an octahedral normal and roughness in one R10G10B10A2 target.  World position
+/// is not stored; the lighting pass rebuilds it from the depth buffer.  8 bytes
+/// per pixel plus depth.  The targets only live from the geometry pass to the
+/// lighting pass, so the render graph places them in its transient heap and hands
+/// them over through SetResource.
+///</summary>
 class DeferredShading
 {
 public:
-	DeferredShading(ID3D12Device* device, UINT width, UINT height,
-					DXGI_FORMAT format);
+	static const UINT GBufferCount = 2;
+
+	DeferredShading(ID3D12Device* device, UINT width, UINT height);
 	DeferredShading(const DeferredShading& rhs) = delete;
 	DeferredShading& operator=(const DeferredShading& rhs) = delete;
 	virtual ~DeferredShading() = default;
 
 	UINT Width() const;
 	UINT Height() const;
-	DXGI_FORMAT Format() const;
+	static DXGI_FORMAT Format(int index);
+	// Clear value the targets are created with; DrawGBuffer clears them to black.
+	static D3D12_CLEAR_VALUE ClearValue(int index);
 	ID3D12Resource* Resource(int index);
+	// Points target index at resource, Format(index) at Width() x Height(), and rebuilds its views.
+	void SetResource(int index, ID3D12Resource* resource);
 	CD3DX12_GPU_DESCRIPTOR_HANDLE Srv(int index)const;
 	CD3DX12_CPU_DESCRIPTOR_HANDLE Rtv(int index)const;
 
@@ -29,8 +60,21 @@ public:
 	
 	void BuildDescriptors();
 
-private:	
-	void BuildResource();
+	///<summary>
+	/// CPU reference of EncodePBRToGBuffer and DecodeGBuffer in GBuffer.hlsl,
+	/// quantized the way the UNORM targets store them.
+	///</summary>
+	static GBufferTexel EncodeGBuffer(const GBufferSample& sample);
+	static GBufferSample DecodeGBuffer(const GBufferTexel& texel);
+	// Octahedral mapping of a unit vector to [-1,1]^2 and back.
+	static DirectX::XMFLOAT2 OctEncode(const DirectX::XMFLOAT3& n);
+	static DirectX::XMFLOAT3 OctDecode(const DirectX::XMFLOAT2& e);
+	///<summary>
+	/// World position of the depth buffer value at texture coordinates (u, v), as
+	/// DepthToPositionW.  invViewProj is not transposed.
+	///</summary>
+	static DirectX::XMFLOAT3 ReconstructPosition(float depth, float u, float v,
+		const DirectX::XMFLOAT4X4& invViewProj);
 
 private:
 	ID3D12Device* md3dDevice = nullptr;
@@ -38,9 +82,9 @@ private:
 	D3D12_RECT mScissorRect;
 	UINT mWidth = 0;
 	UINT mHeight = 0;
-	DXGI_FORMAT mFormat = DXGI_FORMAT_R32G32B32A32_FLOAT;
-	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuSrv[4];
-	CD3DX12_GPU_DESCRIPTOR_HANDLE mhGpuSrv[4];
-	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuRtv[4];
-	Microsoft::WRL::ComPtr<ID3D12Resource> mGBuffer[4];
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuSrv[GBufferCount];
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhGpuSrv[GBufferCount];
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuRtv[GBufferCount];
+	// Owned by the render graph.
+	ID3D12Resource* mGBuffer[GBufferCount] = {};
 };
\ No newline at end of file
@@ -0,0 +1,53 @@
+#include "DrawBundle.h"
+
+DrawBundle::DrawBundle(ID3D12Device* device)
+{
+	ThrowIfFailed(device->CreateCommandAllocator(
+		D3D12_COMMAND_LIST_TYPE_BUNDLE,
+		IID_PPV_ARGS(mAllocator.GetAddressOf())));
+
+	ThrowIfFailed(device->CreateCommandList(
+		0,
+		D3D12_COMMAND_LIST_TYPE_BUNDLE,
+		mAllocator.Get(),
+		nullptr,
+		IID_PPV_ARGS(mBundle.GetAddressOf())));
+
+	// Start off in a closed state, like the direct command list.
+	mBundle->Close();
+}
+
+bool DrawBundle::Prepare(ID3D12PipelineState* pso, const std::vector<UINT64>& signature, RecordFunc record)
+{
+	if (mRecorded && pso == mPso && signature == mSignature)
+		return false;
+
+	ThrowIfFailed(mAllocator->Reset());
+	ThrowIfFailed(mBundle->Reset(mAllocator.Get(), pso));
+
+	record(mBundle.Get());
+
+	ThrowIfFailed(mBundle->Close());
+
+	mPso = pso;
+	mSignature = signature;
+	mRecorded = true;
+	mRecordCount++;
+	return true;
+}
+
+void DrawBundle::Execute(ID3D12GraphicsCommandList* cmdList)
+{
+	assert(mRecorded);
+	cmdList->ExecuteBundle(mBundle.Get());
+}
+
+bool DrawBundle::IsRecorded()const
+{
+	return mRecorded;
+}
+
+UINT DrawBundle::RecordCount()const
+{
+	return mRecordCount;
+}
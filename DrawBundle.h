@@ -0,0 +1,42 @@
+#pragma once
+#include "Common/d3dUtil.h"
+#include <functional>
+
+///<summary>
+/// A D3D12 bundle holding a static draw sequence.  The bundle is recorded once
+/// and replayed with ExecuteBundle until the signature of what it draws changes.
+/// Bundles inherit root arguments from the calling list, so per-pass constants
+/// (e.g. the pass CB of a shadow slice) are bound by the caller.
+///</summary>
+class DrawBundle
+{
+public:
+	typedef std::function<void(ID3D12GraphicsCommandList*)> RecordFunc;
+
+	DrawBundle(ID3D12Device* device);
+	DrawBundle(const DrawBundle& rhs) = delete;
+	DrawBundle& operator=(const DrawBundle& rhs) = delete;
+	~DrawBundle() = default;
+
+	///<summary>
+	/// Re-records the bundle when signature differs from the one it was recorded
+	/// with.  signature must capture everything record reads, e.g. buffer addresses
+	/// and draw counts.  The GPU must be done with any previous replay.
+	/// Returns true if the bundle was recorded.
+	///</summary>
+	bool Prepare(ID3D12PipelineState* pso, const std::vector<UINT64>& signature, RecordFunc record);
+
+	void Execute(ID3D12GraphicsCommandList* cmdList);
+
+	bool IsRecorded()const;
+	UINT RecordCount()const;
+
+private:
+	Microsoft::WRL::ComPtr<ID3D12CommandAllocator> mAllocator;
+	Microsoft::WRL::ComPtr<ID3D12GraphicsCommandList> mBundle;
+
+	ID3D12PipelineState* mPso = nullptr;
+	std::vector<UINT64> mSignature;
+	bool mRecorded = false;
+	UINT mRecordCount = 0;
+};
@@ -0,0 +1,199 @@
+#include "EvsmMap.h"
+
+using namespace DirectX;
+
+EvsmMap::EvsmMap(ID3D12Device* device, UINT shadowMapSize)
+{
+	md3dDevice = device;
+
+	// The conversion averages 2x2 atlas texels into one moments texel.
+	mWidth = std::max<UINT>(shadowMapSize / 2, 1);
+	mHeight = mWidth;
+}
+
+UINT EvsmMap::Width()const
+{
+	return mWidth;
+}
+
+UINT EvsmMap::Height()const
+{
+	return mHeight;
+}
+
+UINT64 EvsmMap::MemoryUsage()const
+{
+	return mMemoryUsage;
+}
+
+ID3D12Resource* EvsmMap::Resource()
+{
+	return mMoments.Get();
+}
+
+CD3DX12_GPU_DESCRIPTOR_HANDLE EvsmMap::Srv()const
+{
+	return mhMomentsGpuSrv;
+}
+
+void EvsmMap::BuildDescriptors(
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv,
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuRtv,
+	UINT cbvSrvUavDescriptorSize,
+	UINT rtvDescriptorSize)
+{
+	mhMomentsCpuSrv = hCpuSrv;
+	mhBlurTempCpuSrv = hCpuSrv.Offset(1, cbvSrvUavDescriptorSize);
+
+	mhMomentsGpuSrv = hGpuSrv;
+	mhBlurTempGpuSrv = hGpuSrv.Offset(1, cbvSrvUavDescriptorSize);
+
+	mhMomentsCpuRtv = hCpuRtv;
+	mhBlurTempCpuRtv = hCpuRtv.Offset(1, rtvDescriptorSize);
+
+	mHasDescriptors = true;
+	BuildDescriptors();
+}
+
+void EvsmMap::SetPSOs(ID3D12PipelineState* convertPso, ID3D12PipelineState* blurHorzPso, ID3D12PipelineState* blurVertPso)
+{
+	mConvertPso = convertPso;
+	mBlurHorzPso = blurHorzPso;
+	mBlurVertPso = blurVertPso;
+}
+
+void EvsmMap::Create()
+{
+	if (Created())
+		return;
+
+	BuildResources();
+	if (mHasDescriptors)
+		BuildDescriptors();
+}
+
+bool EvsmMap::Created()const
+{
+	return mMoments != nullptr;
+}
+
+void EvsmMap::Prefilter(ID3D12GraphicsCommandList* cmdList, CD3DX12_GPU_DESCRIPTOR_HANDLE shadowMapSrv,
+	const ShadowAtlasTile* tiles, UINT tileCount)
+{
+	cmdList->IASetVertexBuffers(0, 0, nullptr);
+	cmdList->IASetIndexBuffer(nullptr);
+	cmdList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+
+	// Warp the atlas depths into moments.
+	mBarriers.Transition(mMoments.Get(),
+		D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	mBarriers.Flush(cmdList);
+	DrawTiles(cmdList, mConvertPso, shadowMapSrv, mhMomentsCpuRtv, tiles, tileCount);
+
+	// Horizontal blur into the temp map.
+	mBarriers.Transition(mMoments.Get(),
+		D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ);
+	mBarriers.Transition(mBlurTemp.Get(),
+		D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	mBarriers.Flush(cmdList);
+	DrawTiles(cmdList, mBlurHorzPso, mhMomentsGpuSrv, mhBlurTempCpuRtv, tiles, tileCount);
+
+	// Vertical blur back into the moments.
+	mBarriers.Transition(mBlurTemp.Get(),
+		D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ);
+	mBarriers.Transition(mMoments.Get(),
+		D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	mBarriers.Flush(cmdList);
+	DrawTiles(cmdList, mBlurVertPso, mhBlurTempGpuSrv, mhMomentsCpuRtv, tiles, tileCount);
+
+	mBarriers.Transition(mMoments.Get(),
+		D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ);
+	mBarriers.Flush(cmdList);
+}
+
+void EvsmMap::DrawTiles(ID3D12GraphicsCommandList* cmdList, ID3D12PipelineState* pso,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE input, CD3DX12_CPU_DESCRIPTOR_HANDLE target,
+	const ShadowAtlasTile* tiles, UINT tileCount)
+{
+	cmdList->OMSetRenderTargets(1, &target, true, nullptr);
+	cmdList->SetPipelineState(pso);
+	cmdList->SetGraphicsRootDescriptorTable(0, input);
+
+	for (UINT i = 0; i < tileCount; ++i)
+	{
+		// The tile at half scale, in moments texels.
+		UINT x = tiles[i].X / 2;
+		UINT y = tiles[i].Y / 2;
+		UINT size = std::max<UINT>(tiles[i].Size / 2, 1);
+
+		D3D12_VIEWPORT viewport = { (float)x, (float)y, (float)size, (float)size, 0.0f, 1.0f };
+		D3D12_RECT scissorRect = { (LONG)x, (LONG)y, (LONG)(x + size), (LONG)(y + size) };
+		cmdList->RSSetViewports(1, &viewport);
+		cmdList->RSSetScissorRects(1, &scissorRect);
+
+		// Inclusive texel rectangle the blur clamps its taps to.
+		UINT tileRect[4] = { x, y, x + size - 1, y + size - 1 };
+		cmdList->SetGraphicsRoot32BitConstants(1, 4, tileRect, 0);
+
+		cmdList->DrawInstanced(3, 1, 0, 0);
+	}
+}
+
+void EvsmMap::BuildDescriptors()
+{
+	// Before Create the resources are null; with a description those make null views.
+	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srvDesc.Format = Format;
+	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	srvDesc.Texture2D.MostDetailedMip = 0;
+	srvDesc.Texture2D.MipLevels = 1;
+	md3dDevice->CreateShaderResourceView(mMoments.Get(), &srvDesc, mhMomentsCpuSrv);
+	md3dDevice->CreateShaderResourceView(mBlurTemp.Get(), &srvDesc, mhBlurTempCpuSrv);
+
+	D3D12_RENDER_TARGET_VIEW_DESC rtvDesc = {};
+	rtvDesc.Format = Format;
+	rtvDesc.ViewDimension = D3D12_RTV_DIMENSION_TEXTURE2D;
+	rtvDesc.Texture2D.MipSlice = 0;
+	rtvDesc.Texture2D.PlaneSlice = 0;
+	md3dDevice->CreateRenderTargetView(mMoments.Get(), &rtvDesc, mhMomentsCpuRtv);
+	md3dDevice->CreateRenderTargetView(mBlurTemp.Get(), &rtvDesc, mhBlurTempCpuRtv);
+}
+
+void EvsmMap::BuildResources()
+{
+	D3D12_RESOURCE_DESC texDesc;
+	ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
+	texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+	texDesc.Alignment = 0;
+	texDesc.Width = mWidth;
+	texDesc.Height = mHeight;
+	texDesc.DepthOrArraySize = 1;
+	texDesc.MipLevels = 1;
+	texDesc.Format = Format;
+	texDesc.SampleDesc.Count = 1;
+	texDesc.SampleDesc.Quality = 0;
+	texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+	texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET;
+
+	D3D12_RESOURCE_ALLOCATION_INFO info = md3dDevice->GetResourceAllocationInfo(0, 1, &texDesc);
+	mMemoryUsage = 2 * info.SizeInBytes;
+
+	// Every texel is written before it is read, so no clear value is needed.
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&texDesc,
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&mMoments)));
+
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&texDesc,
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&mBlurTemp)));
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include "Common/d3dUtil.h"
+#include "ShadowAtlas.h"
+#include "BarrierBatcher.h"
+
+///<summary>
+/// Exponential variance shadow map: the shadow atlas depths warped by a positive
+/// and a negative exponential, stored with their squares as four moments, at half
+/// the atlas resolution.  The moments are prefiltered once after the atlas is
+/// drawn, a 2x2 box while converting and then a separable Gaussian, so lighting
+/// gets a soft shadow from one bilinear fetch.  The layout follows the atlas, each
+/// tile at half scale, and every filter stays inside its tile.  The two targets
+/// only exist once Create is called, so PCF never pays for them.
+///</summary>
+class EvsmMap
+{
+public:
+	static const DXGI_FORMAT Format = DXGI_FORMAT_R16G16B16A16_FLOAT;
+
+	EvsmMap(ID3D12Device* device, UINT shadowMapSize);
+	EvsmMap(const EvsmMap& rhs) = delete;
+	EvsmMap& operator=(const EvsmMap& rhs) = delete;
+	~EvsmMap() = default;
+
+	UINT Width()const;
+	UINT Height()const;
+	// Bytes the moments and the blur target take on the GPU, 0 before Create.
+	UINT64 MemoryUsage()const;
+	ID3D12Resource* Resource();
+	CD3DX12_GPU_DESCRIPTOR_HANDLE Srv()const;
+
+	// Two contiguous SRVs and RTVs: the moments map, then the blur target.
+	void BuildDescriptors(
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv,
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuRtv,
+		UINT cbvSrvUavDescriptorSize,
+		UINT rtvDescriptorSize);
+
+	void SetPSOs(ID3D12PipelineState* convertPso, ID3D12PipelineState* blurHorzPso, ID3D12PipelineState* blurVertPso);
+
+	///<summary>
+	/// Creates the moments map and the blur target, and points the views at them.
+	/// Until then the views are null.  Does nothing the second time.
+	///</summary>
+	void Create();
+	bool Created()const;
+
+	///<summary>
+	/// Converts the given atlas tiles to moments and blurs them.  The caller binds
+	/// the root signature (SRV table t0, four root constants b0) and leaves the atlas
+	/// readable by pixel shaders.  The moments map goes back to GENERIC_READ.
+	///</summary>
+	void Prefilter(ID3D12GraphicsCommandList* cmdList, CD3DX12_GPU_DESCRIPTOR_HANDLE shadowMapSrv,
+		const ShadowAtlasTile* tiles, UINT tileCount);
+
+private:
+	void BuildResources();
+	void BuildDescriptors();
+
+	// Draws a fullscreen triangle into each tile of target, reading input.
+	void DrawTiles(ID3D12GraphicsCommandList* cmdList, ID3D12PipelineState* pso,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE input, CD3DX12_CPU_DESCRIPTOR_HANDLE target,
+		const ShadowAtlasTile* tiles, UINT tileCount);
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+
+	UINT mWidth = 0;
+	UINT mHeight = 0;
+	UINT64 mMemoryUsage = 0;
+
+	ID3D12PipelineState* mConvertPso = nullptr;
+	ID3D12PipelineState* mBlurHorzPso = nullptr;
+	ID3D12PipelineState* mBlurVertPso = nullptr;
+
+	bool mHasDescriptors = false;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mMoments;
+	// Holds the horizontal blur between the two blur passes.
+	Microsoft::WRL::ComPtr<ID3D12Resource> mBlurTemp;
+
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhMomentsCpuSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhMomentsGpuSrv;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhMomentsCpuRtv;
+
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhBlurTempCpuSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhBlurTempGpuSrv;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhBlurTempCpuRtv;
+
+	BarrierBatcher mBarriers;
+};
@@ -8,13 +8,30 @@ FrameResource::FrameResource(ID3D12Device* device, UINT passCount,
 		D3D12_COMMAND_LIST_TYPE_DIRECT,
 		IID_PPV_ARGS(CmdListAlloc.GetAddressOf())));
 
+	FrameCB = std::make_unique<UploadBuffer<FrameConstants>>(device, 1, true);
 	PassCB = std::make_unique<UploadBuffer<PassConstants>>(device, passCount, true);
 	SsaoCB = std::make_unique<UploadBuffer<SsaoConstants>>(device, 1, true);
+	DepthReduceCB = std::make_unique<UploadBuffer<DepthReduceConstants>>(device, 1, true);
+	VirtualShadowMarkCB = std::make_unique<UploadBuffer<VirtualShadowMarkConstants>>(device, 1, true);
+	VirtualPageTable = std::make_unique<UploadBuffer<UINT>>(device,
+		VirtualShadowLevels * VirtualShadowPagesPerLevel * VirtualShadowPagesPerLevel, false);
+	ClusterLights = std::make_unique<UploadBuffer<Light>>(device, MaxClusteredLights, false);
+	Clusters = std::make_unique<UploadBuffer<DirectX::XMUINT2>>(device,
+		ClusterCountX * ClusterCountY * ClusterCountZ, false);
+	ClusterLightIndices = std::make_unique<UploadBuffer<UINT>>(device, MaxClusterLightIndices, false);
 	MaterialBuffer = std::make_unique<UploadBuffer<MaterialData>>(device, materialCount, false);
 	InstanceBuffers.resize(itemCount);
+	ShadowLodInstanceBuffers.resize(itemCount);
+	InstanceCapacities.resize(itemCount);
 	for (size_t i = 0; i < itemCount; i++)
 	{
 		InstanceBuffers[i] = std::make_unique<UploadBuffer<InstanceData>>(device, InstanceCounts[i], false);
+		ShadowLodInstanceBuffers[i] = std::make_unique<UploadBuffer<InstanceData>>(device,
+			InstanceCounts[i] * MaxCasterLods, false);
+		InstanceCapacities[i] = InstanceCounts[i];
 	}
+
+	ShadowBundle = std::make_unique<DrawBundle>(device);
+	SkyBundle = std::make_unique<DrawBundle>(device);
 	
 }
@@ -3,13 +3,16 @@
 #include "Common/d3dUtil.h"
 #include "Common/MathHelper.h"
 #include "Common/UploadBuffer.h"
+#include "DrawBundle.h"
 
 struct InstanceData
 {
 	DirectX::XMFLOAT4X4 World = MathHelper::Identity4x4();
 	DirectX::XMFLOAT4X4 TexTransform = MathHelper::Identity4x4();
 	UINT MaterialIndex;
-	UINT ObjPad0;
+	// Bit lod * MaxShadowCascades + i is set when the instance casts into shadow
+	// cascade i with caster LOD lod.  Every cascade at full detail by default.
+	UINT CascadeMask = (1u << MaxShadowCascades) - 1;
 	UINT ObjPad1;
 	UINT ObjPad2;
 };
@@ -26,6 +29,10 @@ struct MaterialData
 	UINT MaterialPad0;
 };
 
+static_assert(MaxShadowCascades <= 4, "FrameConstants::CascadeSplits holds one float per cascade.");
+
+// Constants of one view: the camera, or a shadow cascade, spot light or virtual shadow
+// map level.  Uploaded once per view, so keep it small.
 struct PassConstants
 {
 	DirectX::XMFLOAT4X4 View = MathHelper::Identity4x4();
@@ -35,19 +42,63 @@ struct PassConstants
 	DirectX::XMFLOAT4X4 ViewProj = MathHelper::Identity4x4();
 	DirectX::XMFLOAT4X4 InvViewProj = MathHelper::Identity4x4();
 	DirectX::XMFLOAT4X4 ViewProjTex = MathHelper::Identity4x4();
-	// multi shadowmaps need multi shadowtransforms
-	DirectX::XMFLOAT4X4 ShadowTransforms[12];
 	DirectX::XMFLOAT3 EyePosW = { 0.0f, 0.0f, 0.0f };
 	float cbPerObjectPad1 = 0.0f;
 	DirectX::XMFLOAT2 RenderTargetSize = { 0.0f, 0.0f };
 	DirectX::XMFLOAT2 InvRenderTargetSize = { 0.0f, 0.0f };
 	float NearZ = 0.0f;
 	float FarZ = 0.0f;
+};
+
+// Constants shared by every view of a frame: lights, shadows and time.
+struct FrameConstants
+{
+	// multi shadowmaps need multi shadowtransforms
+	DirectX::XMFLOAT4X4 ShadowTransforms[MaxShadowCascades];
+	// Atlas tile of each cascade as (minU, minV, maxU, maxV), for clamping PCF taps.
+	DirectX::XMFLOAT4 ShadowTileBounds[MaxShadowCascades];
+	// Distance from the eye at which each cascade ends, one component per cascade.
+	DirectX::XMFLOAT4 CascadeSplits = { 0.0f, 0.0f, 0.0f, 0.0f };
+	UINT CascadeCount = 0;
+	float CascadeBlendBand = 0.0f;
+	// ShadowFilter the lighting shaders sample the cascades with.
+	UINT ShadowFilter = 0;
+	// Non-zero when the main light samples the virtual shadow map instead of the cascades.
+	UINT VirtualShadows = 0;
+	// Light view-projection of each cascade, for drawing all cascades in one pass.
+	DirectX::XMFLOAT4X4 CascadeViewProj[MaxShadowCascades];
+	// Shadow transform and atlas tile of each ShadowScheduler slot.
+	DirectX::XMFLOAT4X4 LightShadowTransforms[MaxShadowedLights];
+	DirectX::XMFLOAT4 LightShadowTileBounds[MaxShadowedLights];
+	// Slot + 1 of each light in Lights, 0 for unshadowed lights; four lights per vector.
+	DirectX::XMUINT4 LightShadowSlots[MaxLights / 4];
+	// World to light view space of the virtual shadow map.
+	DirectX::XMFLOAT4X4 VirtualShadowView = MathHelper::Identity4x4();
+	// Per level the page table window origin in pages (xy) and 1 / page world size (z).
+	DirectX::XMFLOAT4 VirtualLevels[VirtualShadowLevels];
+	// Pixel footprint per unit distance over the texel size of level 0.
+	float VirtualLodScale = 0.0f;
+	// Light view depth range the pages are rendered with.
+	float VirtualDepthNear = 0.0f;
+	float VirtualInvDepthRange = 0.0f;
+	// Texels along each side of a page.
+	float VirtualPageSize = 0.0f;
 	float TotalTime = 0.0f;
 	float DeltaTime = 0.0f;
-	
+	float FramePad0 = 0.0f;
+	float FramePad1 = 0.0f;
+
+	// Scales the sky ambient, AmbientSH.
 	DirectX::XMFLOAT4 AmbientLight = { 0.0f, 0.0f, 0.0f, 1.0f };
+	// Sky irradiance over pi as L2 spherical harmonics, from SphericalHarmonics.
+	DirectX::XMFLOAT4 AmbientSH[9] = {};
+	// Directional lights; point and spot lights go through the clustered light lists.
 	Light Lights[MaxLights];
+	// The froxel slice of a view depth is log2(viewZ) * ClusterZScale + ClusterZBias.
+	float ClusterZScale = 0.0f;
+	float ClusterZBias = 0.0f;
+	UINT ClusterLightCount = 0;
+	UINT ClusterPad0 = 0;
 };
 
 struct SsaoConstants
@@ -64,6 +115,43 @@ struct SsaoConstants
 	float OcclusionFadeStart = 0.2f;
 	float OcclusionFadeEnd = 2.0f;
 	float SurfaceEpsilon = 0.05f;
+
+	// Temporal accumulation, see SsaoCompute.hlsl.
+	DirectX::XMFLOAT4X4 InvView = MathHelper::Identity4x4();
+	// Previous frame's view-projection followed by the NDC to texture space transform.
+	DirectX::XMFLOAT4X4 PrevViewProjTex = MathHelper::Identity4x4();
+	// Offset vectors taken per pixel, starting at SampleOffset.
+	UINT SampleCount = 14;
+	UINT SampleOffset = 0;
+	// Weight of this frame's samples against the history; 1 drops the history.
+	float TemporalAlpha = 1.0f;
+	// Shifts the random vectors every frame.
+	float NoiseOffset = 0.0f;
+	// NormalMap is the G-buffer's, octahedral world normals in rg.
+	UINT NormalsFromGBuffer = 0;
+};
+
+struct DepthReduceConstants
+{
+	DirectX::XMFLOAT4X4 InvProj = MathHelper::Identity4x4();
+	DirectX::XMFLOAT4X4 ViewToLight = MathHelper::Identity4x4();
+	// Eye distance at which each cascade ends, one component per cascade.
+	DirectX::XMFLOAT4 CascadeSplits = { 0.0f, 0.0f, 0.0f, 0.0f };
+	UINT CascadeCount = 0;
+	float CascadeBlendBand = 0.0f;
+	DirectX::XMUINT2 DepthMapSize = { 0, 0 };
+};
+
+struct VirtualShadowMarkConstants
+{
+	DirectX::XMFLOAT4X4 InvViewProj = MathHelper::Identity4x4();
+	DirectX::XMFLOAT4X4 LightView = MathHelper::Identity4x4();
+	// Per level the page table window origin in pages (xy) and 1 / page world size (z).
+	DirectX::XMFLOAT4 Levels[VirtualShadowLevels];
+	DirectX::XMFLOAT3 EyePosW = { 0.0f, 0.0f, 0.0f };
+	float LodScale = 0.0f;
+	DirectX::XMUINT2 DepthMapSize = { 0, 0 };
+	DirectX::XMUINT2 MarkPad = { 0, 0 };
 };
 
 struct Vertex
@@ -87,11 +175,32 @@ public:
 	// ÿһ֡һallocator
 	Microsoft::WRL::ComPtr<ID3D12CommandAllocator> CmdListAlloc;
 
+	std::unique_ptr<UploadBuffer<FrameConstants>> FrameCB = nullptr;
+	// The camera's view first, then every shadow view.
 	std::unique_ptr<UploadBuffer<PassConstants>> PassCB = nullptr;
 	std::unique_ptr<UploadBuffer<MaterialData>> MaterialBuffer = nullptr;
 	std::unique_ptr<UploadBuffer<SsaoConstants>> SsaoCB = nullptr;
+	std::unique_ptr<UploadBuffer<DepthReduceConstants>> DepthReduceCB = nullptr;
+	std::unique_ptr<UploadBuffer<VirtualShadowMarkConstants>> VirtualShadowMarkCB = nullptr;
+	// Virtual shadow map page table, one entry per page of every level's window.
+	std::unique_ptr<UploadBuffer<UINT>> VirtualPageTable = nullptr;
+	// Clustered point and spot lights, each froxel's (offset, count) run of light
+	// indices and the indices themselves, see ClusteredLights.
+	std::unique_ptr<UploadBuffer<Light>> ClusterLights = nullptr;
+	std::unique_ptr<UploadBuffer<DirectX::XMUINT2>> Clusters = nullptr;
+	std::unique_ptr<UploadBuffer<UINT>> ClusterLightIndices = nullptr;
 	// every render items have a instancebuffer
 	std::vector<std::unique_ptr<UploadBuffer<InstanceData> > > InstanceBuffers;
+	// Single pass cascade casters of each render item regrouped by caster LOD, one run
+	// per LOD, so a LOD's submission only runs the instances drawn with it.  An
+	// instance used at several LODs is in several runs; MaxCasterLods times the
+	// capacity of the item's instance buffer.
+	std::vector<std::unique_ptr<UploadBuffer<InstanceData> > > ShadowLodInstanceBuffers;
+	// element count of each instance buffer, grown when instances are spawned
+	std::vector<UINT> InstanceCapacities;
+	// static draw sequences; they reference this frame's instance buffers
+	std::unique_ptr<DrawBundle> ShadowBundle = nullptr;
+	std::unique_ptr<DrawBundle> SkyBundle = nullptr;
 	// check if the frame resources have been used by GPU
 	UINT64 Fence = 0;
 };
\ No newline at end of file
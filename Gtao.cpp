@@ -0,0 +1,155 @@
+#include "Gtao.h"
+
+using namespace DirectX;
+
+GtaoTierDesc Gtao::TierDesc(GtaoTier tier)
+{
+	switch (tier)
+	{
+	case GtaoTier::Low:
+		return { 1, 2 };
+	case GtaoTier::Medium:
+		return { 2, 2 };
+	default:
+		return { 3, 3 };
+	}
+}
+
+// View space point a depth buffer holds at (u, v), sampled like gsamPointClamp.
+static XMVECTOR ViewPositionAt(const float* depth, UINT width, UINT height, const XMFLOAT4X4& proj,
+	float u, float v)
+{
+	UINT x = std::min<UINT>((UINT)std::max<float>(u * width, 0.0f), width - 1);
+	UINT y = std::min<UINT>((UINT)std::max<float>(v * height, 0.0f), height - 1);
+
+	// z_ndc = A + B/viewZ, as NdcDepthToViewDepth.
+	float z = proj.m[3][2] / (depth[y * width + x] - proj.m[2][2]);
+	return XMVectorSet((2.0f * u - 1.0f) * z / proj.m[0][0], (1.0f - 2.0f * v) * z / proj.m[1][1], z, 0.0f);
+}
+
+void Gtao::ComputeOnCpu(const float* depth, const XMFLOAT3* normals, UINT width, UINT height,
+	const XMFLOAT4X4& proj, const GtaoFalloff& falloff, UINT slices, UINT stepsPerSide,
+	float* ambient)
+{
+	for (UINT y = 0; y < height; ++y)
+	{
+		for (UINT x = 0; x < width; ++x)
+		{
+			float u = (x + 0.5f) / width;
+			float v = (y + 0.5f) / height;
+
+			XMVECTOR p = ViewPositionAt(depth, width, height, proj, u, v);
+			XMVECTOR n = XMVector3Normalize(XMLoadFloat3(&normals[y * width + x]));
+			XMVECTOR viewV = XMVector3Normalize(-p);
+
+			// Search radius in texture space at this depth.
+			float pz = XMVectorGetZ(p);
+			float radiusU = falloff.Radius * 0.5f * proj.m[0][0] / pz;
+			float radiusV = falloff.Radius * 0.5f * proj.m[1][1] / pz;
+
+			float visibility = 0.0f;
+			for (UINT slice = 0; slice < slices; ++slice)
+			{
+				float phi = (slice + 0.5f) * XM_PI / slices;
+				XMVECTOR directionV = XMVectorSet(cosf(phi), sinf(phi), 0.0f, 0.0f);
+
+				XMVECTOR orthoDirectionV = directionV - XMVector3Dot(directionV, viewV) * viewV;
+				XMVECTOR axisV = XMVector3Normalize(XMVector3Cross(directionV, viewV));
+				XMVECTOR projNormalV = n - axisV * XMVector3Dot(n, axisV);
+				float projNormalLength = XMVectorGetX(XMVector3Length(projNormalV));
+				float cosNorm = MathHelper::Clamp(XMVectorGetX(XMVector3Dot(projNormalV, viewV)) / projNormalLength, 0.0f, 1.0f);
+				float normalSign = XMVectorGetX(XMVector3Dot(orthoDirectionV, projNormalV)) >= 0.0f ? 1.0f : -1.0f;
+				float normalAngle = normalSign * acosf(cosNorm);
+
+				// Both horizons start at the tangent plane.
+				float lowCos[2] = { cosf(normalAngle + XM_PIDIV2), cosf(normalAngle - XM_PIDIV2) };
+				float horizonCos[2] = { lowCos[0], lowCos[1] };
+
+				for (UINT step = 0; step < stepsPerSide; ++step)
+				{
+					float s = (step + 0.5f) / stepsPerSide;
+					float offsetU = s * s * cosf(phi) * radiusU;
+					float offsetV = -s * s * sinf(phi) * radiusV;
+
+					for (int side = 0; side < 2; ++side)
+					{
+						float sign = side == 0 ? 1.0f : -1.0f;
+						float sampleU = u + sign * offsetU;
+						float sampleV = v + sign * offsetV;
+						if (sampleU <= 0.0f || sampleU >= 1.0f || sampleV <= 0.0f || sampleV >= 1.0f)
+							continue;
+
+						XMVECTOR delta = ViewPositionAt(depth, width, height, proj, sampleU, sampleV) - p;
+						float dist = XMVectorGetX(XMVector3Length(delta));
+						float sampleCos = XMVectorGetX(XMVector3Dot(delta, viewV)) / dist;
+						float weight = MathHelper::Clamp((falloff.FadeEnd - dist) / (falloff.FadeEnd - falloff.FadeStart), 0.0f, 1.0f);
+						horizonCos[side] = std::max<float>(horizonCos[side], MathHelper::Lerp(lowCos[side], sampleCos, weight));
+					}
+				}
+
+				float h0 = -acosf(MathHelper::Clamp(horizonCos[1], -1.0f, 1.0f));
+				float h1 = acosf(MathHelper::Clamp(horizonCos[0], -1.0f, 1.0f));
+				h0 = normalAngle + std::max<float>(h0 - normalAngle, -XM_PIDIV2);
+				h1 = normalAngle + std::min<float>(h1 - normalAngle, XM_PIDIV2);
+
+				float sinNorm = sinf(normalAngle);
+				float arc0 = (cosNorm + 2.0f * h0 * sinNorm - cosf(2.0f * h0 - normalAngle)) / 4.0f;
+				float arc1 = (cosNorm + 2.0f * h1 * sinNorm - cosf(2.0f * h1 - normalAngle)) / 4.0f;
+				visibility += projNormalLength * (arc0 + arc1);
+			}
+
+			ambient[y * width + x] = MathHelper::Clamp(visibility / slices, 0.0f, 1.0f);
+		}
+	}
+}
+
+void Gtao::ComputeHemisphereOnCpu(const float* depth, const XMFLOAT3* normals, UINT width, UINT height,
+	const XMFLOAT4X4& proj, const GtaoFalloff& falloff, float surfaceEpsilon,
+	const XMFLOAT4* offsets, UINT sampleCount,
+	const XMFLOAT3* randomVectors, UINT randomSize, float* ambient)
+{
+	for (UINT y = 0; y < height; ++y)
+	{
+		for (UINT x = 0; x < width; ++x)
+		{
+			float u = (x + 0.5f) / width;
+			float v = (y + 0.5f) / height;
+
+			XMVECTOR p = ViewPositionAt(depth, width, height, proj, u, v);
+			XMVECTOR n = XMVector3Normalize(XMLoadFloat3(&normals[y * width + x]));
+
+			UINT randomX = (UINT)(4.0f * u * randomSize) % randomSize;
+			UINT randomY = (UINT)(4.0f * v * randomSize) % randomSize;
+			XMVECTOR randVec = XMLoadFloat3(&randomVectors[randomY * randomSize + randomX]);
+
+			float occlusionSum = 0.0f;
+			for (UINT i = 0; i < sampleCount; ++i)
+			{
+				XMVECTOR offset = XMLoadFloat4(&offsets[i]);
+				offset = offset - 2.0f * XMVector3Dot(offset, randVec) * randVec;
+
+				// Flip the offset into the hemisphere of n.
+				float flip = XMVectorGetX(XMVector3Dot(offset, n)) >= 0.0f ? 1.0f : -1.0f;
+				XMVECTOR q = p + flip * falloff.Radius * offset;
+
+				// Nearest depth along the ray through q; outside the buffer the
+				// border of gsamDepthMap reads the far plane, which occludes nothing.
+				float qz = XMVectorGetZ(q);
+				float qu = 0.5f * XMVectorGetX(q) * proj.m[0][0] / qz + 0.5f;
+				float qv = -0.5f * XMVectorGetY(q) * proj.m[1][1] / qz + 0.5f;
+				if (qu < 0.0f || qu >= 1.0f || qv < 0.0f || qv >= 1.0f)
+					continue;
+
+				float rz = XMVectorGetZ(ViewPositionAt(depth, width, height, proj, qu, qv));
+				XMVECTOR r = (rz / qz) * q;
+
+				float distZ = XMVectorGetZ(p) - rz;
+				float dp = std::max<float>(XMVectorGetX(XMVector3Dot(n, XMVector3Normalize(r - p))), 0.0f);
+				if (distZ > surfaceEpsilon)
+					occlusionSum += dp * MathHelper::Clamp((falloff.FadeEnd - distZ) / (falloff.FadeEnd - falloff.FadeStart), 0.0f, 1.0f);
+			}
+
+			ambient[y * width + x] = MathHelper::Clamp(1.0f - occlusionSum / sampleCount, 0.0f, 1.0f);
+		}
+	}
+}
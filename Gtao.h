@@ -0,0 +1,70 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+// Quality tiers of the ground truth AO; each compiles its own GtaoCS.
+enum class GtaoTier : int
+{
+	Low = 0,
+	Medium,
+	High,
+	Count
+};
+
+// Slice and step counts of a tier.
+struct GtaoTierDesc
+{
+	// Screen space directions whose horizons are searched.
+	UINT Slices;
+	// Depth samples on each side of the pixel along a slice.
+	UINT StepsPerSide;
+};
+
+// Occlusion falloff, the same view space distances as SsaoConstants.
+struct GtaoFalloff
+{
+	// Screen radius of the horizon search at the pixel's depth.
+	float Radius = 0.5f;
+	// Samples further from the pixel than FadeStart fade out until FadeEnd.
+	float FadeStart = 0.2f;
+	float FadeEnd = 1.0f;
+};
+
+///<summary>
+/// Ground truth ambient occlusion (Jimenez et al. 2016): per slice through the
+/// view vector the highest horizon on each side of the pixel is found from the
+/// depth buffer, and the cosine weighted visible arc between the two horizons is
+/// integrated analytically.  The GPU version is GtaoCS in SsaoCompute.hlsl; this
+/// is its CPU reference, for comparing the tiers against a many-slice ground
+/// truth.  Beside it sits a CPU port of the hemisphere sampling of Ssao.hlsl, so
+/// that the two techniques can be measured against the same ground truth.
+///</summary>
+class Gtao
+{
+public:
+	static GtaoTierDesc TierDesc(GtaoTier tier);
+
+	///<summary>
+	/// Visibility of every texel of a width*height depth buffer.  depth holds depth
+	/// buffer values, normals view space normals and proj the camera projection (not
+	/// transposed).  Every slice and step sits in the middle of the range GtaoCS
+	/// jitters it over, which the jittered result averages to.  Writes width*height
+	/// visibilities to ambient.
+	///</summary>
+	static void ComputeOnCpu(const float* depth, const DirectX::XMFLOAT3* normals, UINT width, UINT height,
+		const DirectX::XMFLOAT4X4& proj, const GtaoFalloff& falloff, UINT slices, UINT stepsPerSide,
+		float* ambient);
+
+	///<summary>
+	/// AmbientAccess of Ssao.hlsl over the same buffers: sampleCount of the offsets,
+	/// each reflected about the texel's random vector, flipped into the hemisphere
+	/// of the normal and tested against the depth buffer.  randomVectors holds
+	/// randomSize*randomSize vectors in [-1, 1], tiled four times across the buffer
+	/// like gRandomVecMap and point sampled.  Writes the accessibility before the
+	/// shader's pow(access, 6), which sharpens the look rather than estimating
+	/// visibility.
+	///</summary>
+	static void ComputeHemisphereOnCpu(const float* depth, const DirectX::XMFLOAT3* normals, UINT width, UINT height,
+		const DirectX::XMFLOAT4X4& proj, const GtaoFalloff& falloff, float surfaceEpsilon,
+		const DirectX::XMFLOAT4* offsets, UINT sampleCount,
+		const DirectX::XMFLOAT3* randomVectors, UINT randomSize, float* ambient);
+};
@@ -0,0 +1,650 @@
+#include "RenderGraph.h"
+
+using Microsoft::WRL::ComPtr;
+
+namespace
+{
+	const D3D12_RESOURCE_STATES ReadStates =
+		D3D12_RESOURCE_STATE_VERTEX_AND_CONSTANT_BUFFER |
+		D3D12_RESOURCE_STATE_INDEX_BUFFER |
+		D3D12_RESOURCE_STATE_DEPTH_READ |
+		D3D12_RESOURCE_STATE_NON_PIXEL_SHADER_RESOURCE |
+		D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE |
+		D3D12_RESOURCE_STATE_INDIRECT_ARGUMENT |
+		D3D12_RESOURCE_STATE_COPY_SOURCE;
+
+	// Only used when the graph has no device to ask, e.g. when compiling on the CPU.
+	UINT EstimateBytesPerPixel(DXGI_FORMAT format)
+	{
+		switch (format)
+		{
+		case DXGI_FORMAT_R32G32B32A32_FLOAT:
+		case DXGI_FORMAT_R32G32B32A32_UINT:
+			return 16;
+		case DXGI_FORMAT_R16G16B16A16_FLOAT:
+		case DXGI_FORMAT_R16G16B16A16_UNORM:
+		case DXGI_FORMAT_R32G32_FLOAT:
+			return 8;
+		case DXGI_FORMAT_R16_UNORM:
+		case DXGI_FORMAT_R16_FLOAT:
+		case DXGI_FORMAT_R8G8_UNORM:
+			return 2;
+		case DXGI_FORMAT_R8_UNORM:
+			return 1;
+		default:
+			return 4;
+		}
+	}
+
+	UINT64 AlignUp(UINT64 value, UINT64 alignment)
+	{
+		return (value + alignment - 1) & ~(alignment - 1);
+	}
+}
+
+RenderGraph::PassBuilder::PassBuilder(RenderGraph* graph, UINT passIndex)
+{
+	mGraph = graph;
+	mPassIndex = passIndex;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::Read(RGResourceHandle handle, D3D12_RESOURCE_STATES state)
+{
+	mGraph->AddAccess(mPassIndex, handle, RGAccess::Read, state);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::Write(RGResourceHandle handle, D3D12_RESOURCE_STATES state)
+{
+	mGraph->AddAccess(mPassIndex, handle, RGAccess::Write, state);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::ReadWrite(RGResourceHandle handle, D3D12_RESOURCE_STATES state)
+{
+	mGraph->AddAccess(mPassIndex, handle, RGAccess::ReadWrite, state);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::SideEffect()
+{
+	mGraph->mPasses[mPassIndex].HasSideEffect = true;
+	return *this;
+}
+
+RenderGraph::RenderGraph(ID3D12Device* device, UINT framesInFlight)
+{
+	md3dDevice = device;
+	mFramesInFlight = framesInFlight;
+}
+
+void RenderGraph::Reset()
+{
+	mPasses.clear();
+	mResources.clear();
+	mEndTransitions.clear();
+	mFrameSplitBegins.clear();
+	mStats = Stats();
+	mCompiled = false;
+}
+
+RGResourceHandle RenderGraph::ImportResource(const std::string& name, ID3D12Resource* resource,
+	D3D12_RESOURCE_STATES homeState)
+{
+	ResourceNode node;
+	node.Name = name;
+	node.Imported = true;
+	node.External = resource;
+	node.HomeState = homeState;
+	mResources.push_back(node);
+
+	return (RGResourceHandle)mResources.size() - 1;
+}
+
+RGResourceHandle RenderGraph::CreateTexture(const std::string& name, const RGTextureDesc& desc,
+	RealizeFunc onRealize)
+{
+	assert((desc.Flags & (D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET | D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL)) != 0);
+
+	ResourceNode node;
+	node.Name = name;
+	node.Desc = desc;
+	node.OnRealize = onRealize;
+	mResources.push_back(node);
+
+	return (RGResourceHandle)mResources.size() - 1;
+}
+
+void RenderGraph::MarkOutput(RGResourceHandle handle)
+{
+	mResources[handle].Output = true;
+}
+
+RenderGraph::PassBuilder RenderGraph::AddPass(const std::string& name, ExecuteFunc execute)
+{
+	Pass pass;
+	pass.Name = name;
+	pass.Execute = execute;
+	mPasses.push_back(pass);
+
+	return PassBuilder(this, (UINT)mPasses.size() - 1);
+}
+
+void RenderGraph::AddAccess(UINT passIndex, RGResourceHandle handle, RGAccess type, D3D12_RESOURCE_STATES state)
+{
+	assert(handle < mResources.size());
+
+	// Several accesses to one resource in the same pass are merged into one.
+	// Reads can be combined; a resource cannot be written in two different states.
+	for (auto& access : mPasses[passIndex].Accesses)
+	{
+		if (access.Handle != handle)
+			continue;
+
+		if (type == RGAccess::Read && access.Type == RGAccess::Read)
+		{
+			access.State |= state;
+		}
+		else
+		{
+			assert(type == RGAccess::Read || access.Type == RGAccess::Read || access.State == state);
+			if (type != RGAccess::Read)
+				access.State = state;
+			access.Type = RGAccess::ReadWrite;
+		}
+		return;
+	}
+
+	mPasses[passIndex].Accesses.push_back({ handle, type, state });
+}
+
+void RenderGraph::Compile()
+{
+	for (auto& res : mResources)
+	{
+		res.FirstPass = -1;
+		res.LastPass = -1;
+		res.Size = 0;
+		res.Alignment = 0;
+		res.HeapOffset = 0;
+		res.AliasedFrom = RGInvalidHandle;
+	}
+	for (auto& pass : mPasses)
+	{
+		pass.Culled = false;
+		pass.Transitions.clear();
+		pass.AliasingBegins.clear();
+		pass.SplitBegins.clear();
+	}
+	mEndTransitions.clear();
+	mFrameSplitBegins.clear();
+	mStats = Stats();
+
+	CullPasses();
+	AllocateTransients();
+	ComputeBarriers();
+
+	mStats.PassCount = (UINT)mPasses.size();
+	mCompiled = true;
+}
+
+void RenderGraph::CullPasses()
+{
+	const int passCount = (int)mPasses.size();
+
+	// producers[p] lists the passes whose results pass p consumes.
+	std::vector<std::vector<int>> producers(passCount);
+	std::vector<int> lastWriter(mResources.size(), -1);
+	std::vector<bool> needed(passCount, false);
+
+	for (int p = 0; p < passCount; ++p)
+	{
+		for (const auto& access : mPasses[p].Accesses)
+		{
+			if (access.Type != RGAccess::Write && lastWriter[access.Handle] >= 0)
+				producers[p].push_back(lastWriter[access.Handle]);
+		}
+		for (const auto& access : mPasses[p].Accesses)
+		{
+			if (access.Type != RGAccess::Read)
+			{
+				lastWriter[access.Handle] = p;
+				if (mResources[access.Handle].Output)
+					needed[p] = true;
+			}
+		}
+		if (mPasses[p].HasSideEffect)
+			needed[p] = true;
+	}
+
+	// Producers always come before their consumers, so one backward sweep
+	// propagates the flag through the whole chain.
+	for (int p = passCount - 1; p >= 0; --p)
+	{
+		if (!needed[p])
+			continue;
+		for (int producer : producers[p])
+			needed[producer] = true;
+	}
+
+	for (int p = 0; p < passCount; ++p)
+	{
+		mPasses[p].Culled = !needed[p];
+		if (mPasses[p].Culled)
+			mStats.CulledPassCount++;
+	}
+}
+
+void RenderGraph::AllocateTransients()
+{
+	// Lifetimes in terms of the surviving passes.
+	for (int p = 0; p < (int)mPasses.size(); ++p)
+	{
+		if (mPasses[p].Culled)
+			continue;
+		for (const auto& access : mPasses[p].Accesses)
+		{
+			auto& res = mResources[access.Handle];
+			if (res.FirstPass < 0)
+			{
+				res.FirstPass = p;
+
+				// A transient texture starts each frame in the state of its first use.
+				if (!res.Imported)
+				{
+					assert(access.Type == RGAccess::Write && "transient texture read before written");
+					res.HomeState = access.State;
+				}
+			}
+			res.LastPass = p;
+		}
+	}
+
+	std::vector<RGResourceHandle> transients;
+	for (RGResourceHandle h = 0; h < (RGResourceHandle)mResources.size(); ++h)
+	{
+		auto& res = mResources[h];
+		if (res.Imported || res.FirstPass < 0)
+			continue;
+
+		D3D12_RESOURCE_ALLOCATION_INFO info = AllocationInfo(res.Desc);
+		res.Size = info.SizeInBytes;
+		res.Alignment = info.Alignment;
+		mStats.TransientUnaliasedSize += res.Size;
+		transients.push_back(h);
+	}
+
+	// Biggest first; ties broken by declaration order so the layout is reproducible.
+	std::stable_sort(transients.begin(), transients.end(),
+		[this](RGResourceHandle a, RGResourceHandle b)
+		{
+			return mResources[a].Size > mResources[b].Size;
+		});
+
+	std::vector<RGResourceHandle> placed;
+	for (RGResourceHandle h : transients)
+	{
+		auto& res = mResources[h];
+
+		// Memory ranges of already placed textures that are alive at the same time.
+		std::vector<std::pair<UINT64, UINT64>> busy;
+		for (RGResourceHandle other : placed)
+		{
+			const auto& o = mResources[other];
+			bool overlapInTime = !(o.LastPass < res.FirstPass || res.LastPass < o.FirstPass);
+			if (overlapInTime)
+				busy.push_back({ o.HeapOffset, o.HeapOffset + o.Size });
+		}
+		std::sort(busy.begin(), busy.end());
+
+		// First fit.
+		UINT64 offset = 0;
+		for (const auto& range : busy)
+		{
+			if (offset + res.Size <= range.first)
+				break;
+			offset = std::max<UINT64>(offset, AlignUp(range.second, res.Alignment));
+		}
+		res.HeapOffset = offset;
+
+		// Remember the latest earlier user of the same memory for the aliasing barrier.
+		int latestEnd = -1;
+		for (RGResourceHandle other : placed)
+		{
+			const auto& o = mResources[other];
+			bool overlapInMemory = o.HeapOffset < res.HeapOffset + res.Size &&
+				res.HeapOffset < o.HeapOffset + o.Size;
+			if (overlapInMemory && o.LastPass < res.FirstPass && o.LastPass > latestEnd)
+			{
+				latestEnd = o.LastPass;
+				res.AliasedFrom = other;
+			}
+		}
+
+		mStats.TransientHeapSize = std::max<UINT64>(mStats.TransientHeapSize, res.HeapOffset + res.Size);
+		placed.push_back(h);
+	}
+
+	// Textures sharing memory with anything must be re-initialized on first use,
+	// since the previous frame may have left another texture's data there.
+	for (RGResourceHandle h : placed)
+	{
+		const auto& res = mResources[h];
+		for (RGResourceHandle other : placed)
+		{
+			const auto& o = mResources[other];
+			if (other != h && o.HeapOffset < res.HeapOffset + res.Size &&
+				res.HeapOffset < o.HeapOffset + o.Size)
+			{
+				mPasses[res.FirstPass].AliasingBegins.push_back(h);
+				mStats.AliasingBarrierCount++;
+				break;
+			}
+		}
+	}
+}
+
+void RenderGraph::ComputeBarriers()
+{
+	std::vector<D3D12_RESOURCE_STATES> states(mResources.size());
+	for (size_t i = 0; i < mResources.size(); ++i)
+		states[i] = mResources[i].HomeState;
+
+	// Last surviving pass that touched each resource; -1 means the start of the frame.
+	std::vector<int> lastUse(mResources.size(), -1);
+
+	int firstPass = -1;
+	int lastPass = -1;
+	for (int p = 0; p < (int)mPasses.size(); ++p)
+	{
+		if (mPasses[p].Culled)
+			continue;
+		if (firstPass < 0)
+			firstPass = p;
+		lastPass = p;
+	}
+
+	// When another pass runs between the previous use and the transition, the
+	// transition is split so the GPU can overlap it with that pass.
+	auto addTransition = [&](RGResourceHandle h, D3D12_RESOURCE_STATES after, int at,
+		std::vector<Transition>& transitions)
+	{
+		D3D12_RESOURCE_STATES before = states[h];
+		int previous = lastUse[h];
+		bool split = previous < 0 ? at != firstPass : previous != at &&
+			std::any_of(mPasses.begin() + previous + 1, mPasses.begin() + at,
+				[](const Pass& pass) { return !pass.Culled; });
+
+		if (split)
+		{
+			auto& begins = previous < 0 ? mFrameSplitBegins : mPasses[previous].SplitBegins;
+			begins.push_back({ h, before, after, true });
+			mStats.SplitBarrierCount++;
+		}
+		transitions.push_back({ h, before, after, split });
+		states[h] = after;
+		mStats.TransitionCount++;
+	};
+
+	for (int p = 0; p < (int)mPasses.size(); ++p)
+	{
+		auto& pass = mPasses[p];
+		if (pass.Culled)
+			continue;
+
+		for (const auto& access : pass.Accesses)
+		{
+			D3D12_RESOURCE_STATES current = states[access.Handle];
+			bool covered = current == access.State ||
+				// Already in a read state that covers this read, e.g. GENERIC_READ
+				// satisfies a pixel shader read.  Transitioning would only cost a barrier.
+				(access.Type == RGAccess::Read && IsReadState(current) &&
+				(current & access.State) == access.State);
+
+			if (!covered)
+				addTransition(access.Handle, access.State, p, pass.Transitions);
+			lastUse[access.Handle] = p;
+		}
+	}
+
+	// The end of the frame counts as a pass of its own for splitting.
+	for (RGResourceHandle h = 0; h < (RGResourceHandle)mResources.size(); ++h)
+	{
+		if (mResources[h].FirstPass >= 0 && states[h] != mResources[h].HomeState)
+			addTransition(h, mResources[h].HomeState, lastPass + 1, mEndTransitions);
+	}
+}
+
+void RenderGraph::RealizeTransients()
+{
+	if (mStats.TransientHeapSize == 0)
+		return;
+
+	assert(md3dDevice != nullptr);
+
+	if (mTransientHeap == nullptr || mTransientHeap->GetDesc().SizeInBytes < mStats.TransientHeapSize)
+	{
+		// Every placed texture lives in the old heap, so all of them go with it.
+		if (mTransientHeap != nullptr)
+			mRetired.push_back({ mFrameIndex, mTransientHeap });
+		for (auto& e : mPhysicalTextures)
+			mRetired.push_back({ mFrameIndex, e.second.Resource });
+		mPhysicalTextures.clear();
+
+		CD3DX12_HEAP_DESC heapDesc(mStats.TransientHeapSize, D3D12_HEAP_TYPE_DEFAULT, 0,
+			D3D12_HEAP_FLAG_ALLOW_ONLY_RT_DS_TEXTURES);
+		ThrowIfFailed(md3dDevice->CreateHeap(&heapDesc, IID_PPV_ARGS(mTransientHeap.ReleaseAndGetAddressOf())));
+	}
+
+	for (auto& res : mResources)
+	{
+		if (res.Imported || res.FirstPass < 0)
+			continue;
+
+		auto it = mPhysicalTextures.find(res.Name);
+		if (it != mPhysicalTextures.end())
+		{
+			const auto& p = it->second;
+			bool same = p.HeapOffset == res.HeapOffset && p.InitialState == res.HomeState &&
+				p.Desc.Width == res.Desc.Width && p.Desc.Height == res.Desc.Height &&
+				p.Desc.Format == res.Desc.Format && p.Desc.Flags == res.Desc.Flags;
+			if (same)
+				continue;
+
+			mRetired.push_back({ mFrameIndex, p.Resource });
+			mPhysicalTextures.erase(it);
+		}
+
+		PhysicalTexture physical;
+		physical.Desc = res.Desc;
+		physical.HeapOffset = res.HeapOffset;
+		physical.InitialState = res.HomeState;
+
+		D3D12_RESOURCE_DESC texDesc = ToResourceDesc(res.Desc);
+		const D3D12_CLEAR_VALUE* optClear =
+			res.Desc.ClearValue.Format != DXGI_FORMAT_UNKNOWN ? &res.Desc.ClearValue : nullptr;
+
+		ThrowIfFailed(md3dDevice->CreatePlacedResource(
+			mTransientHeap.Get(),
+			res.HeapOffset,
+			&texDesc,
+			res.HomeState,
+			optClear,
+			IID_PPV_ARGS(&physical.Resource)));
+
+		mPhysicalTextures[res.Name] = physical;
+
+		if (res.OnRealize)
+			res.OnRealize(physical.Resource.Get());
+	}
+}
+
+void RenderGraph::Execute(ID3D12GraphicsCommandList* cmdList)
+{
+	if (!mCompiled)
+		Compile();
+
+	RealizeTransients();
+
+	mBarriers.ResetCounters();
+
+	auto addTransitions = [this](const std::vector<Transition>& transitions)
+	{
+		for (const auto& t : transitions)
+		{
+			if (t.Split)
+				mBarriers.EndTransition(Resource(t.Handle), t.Before, t.After);
+			else
+				mBarriers.Transition(Resource(t.Handle), t.Before, t.After);
+		}
+	};
+
+	for (const auto& t : mFrameSplitBegins)
+		mBarriers.BeginTransition(Resource(t.Handle), t.Before, t.After);
+
+	for (auto& pass : mPasses)
+	{
+		if (pass.Culled)
+			continue;
+
+		// Everything this pass needs goes out in one call, together with the
+		// split begins queued after the previous pass.
+		for (RGResourceHandle h : pass.AliasingBegins)
+		{
+			RGResourceHandle before = mResources[h].AliasedFrom;
+			mBarriers.Aliasing(before != RGInvalidHandle ? Resource(before) : nullptr, Resource(h));
+		}
+		addTransitions(pass.Transitions);
+		mBarriers.Flush(cmdList);
+
+		// Aliased render targets and depth buffers hold garbage until initialized.
+		for (RGResourceHandle h : pass.AliasingBegins)
+			cmdList->DiscardResource(Resource(h), nullptr);
+
+		if (pass.Execute)
+			pass.Execute(cmdList);
+
+		for (const auto& t : pass.SplitBegins)
+			mBarriers.BeginTransition(Resource(t.Handle), t.Before, t.After);
+	}
+
+	addTransitions(mEndTransitions);
+	mBarriers.Flush(cmdList);
+
+	mStats.BarrierCallCount = mBarriers.CallCount();
+
+	// Release what the GPU can no longer be using.
+	mFrameIndex++;
+	mRetired.erase(std::remove_if(mRetired.begin(), mRetired.end(),
+		[this](const std::pair<UINT64, ComPtr<ID3D12Pageable>>& e)
+		{
+			return e.first + mFramesInFlight < mFrameIndex;
+		}), mRetired.end());
+}
+
+ID3D12Resource* RenderGraph::Resource(RGResourceHandle handle)const
+{
+	const auto& res = mResources[handle];
+	if (res.Imported)
+		return res.External;
+
+	auto it = mPhysicalTextures.find(res.Name);
+	return it != mPhysicalTextures.end() ? it->second.Resource.Get() : nullptr;
+}
+
+bool RenderGraph::IsPassCulled(const std::string& name)const
+{
+	for (const auto& pass : mPasses)
+	{
+		if (pass.Name == name)
+			return pass.Culled;
+	}
+	return true;
+}
+
+UINT64 RenderGraph::TransientOffset(RGResourceHandle handle)const
+{
+	return mResources[handle].HeapOffset;
+}
+
+const RenderGraph::Stats& RenderGraph::GetStats()const
+{
+	return mStats;
+}
+
+std::string RenderGraph::Dump()const
+{
+	std::ostringstream out;
+	for (const auto& t : mFrameSplitBegins)
+		DumpTransition(out, t, "begin ");
+	for (const auto& pass : mPasses)
+	{
+		out << "pass " << pass.Name << (pass.Culled ? " culled" : "") << "\n";
+		for (RGResourceHandle h : pass.AliasingBegins)
+		{
+			RGResourceHandle before = mResources[h].AliasedFrom;
+			out << "  alias " << (before != RGInvalidHandle ? mResources[before].Name : "*")
+				<< " -> " << mResources[h].Name << "\n";
+		}
+		for (const auto& t : pass.Transitions)
+			DumpTransition(out, t, t.Split ? "end " : "");
+		for (const auto& t : pass.SplitBegins)
+			DumpTransition(out, t, "begin ");
+	}
+	out << "end\n";
+	for (const auto& t : mEndTransitions)
+		DumpTransition(out, t, t.Split ? "end " : "");
+	for (const auto& res : mResources)
+	{
+		if (!res.Imported && res.FirstPass >= 0)
+		{
+			out << "transient " << res.Name << " offset " << res.HeapOffset
+				<< " size " << res.Size << " passes " << res.FirstPass << "-" << res.LastPass << "\n";
+		}
+	}
+	return out.str();
+}
+
+void RenderGraph::DumpTransition(std::ostringstream& out, const Transition& t, const char* prefix)const
+{
+	out << "  " << prefix << mResources[t.Handle].Name << " 0x" << std::hex << t.Before
+		<< " -> 0x" << t.After << std::dec << "\n";
+}
+
+D3D12_RESOURCE_DESC RenderGraph::ToResourceDesc(const RGTextureDesc& desc)const
+{
+	D3D12_RESOURCE_DESC texDesc;
+	ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
+	texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
+	texDesc.Alignment = 0;
+	texDesc.Width = desc.Width;
+	texDesc.Height = desc.Height;
+	texDesc.DepthOrArraySize = 1;
+	texDesc.MipLevels = 1;
+	texDesc.Format = desc.Format;
+	texDesc.SampleDesc.Count = 1;
+	texDesc.SampleDesc.Quality = 0;
+	texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
+	texDesc.Flags = desc.Flags;
+	return texDesc;
+}
+
+D3D12_RESOURCE_ALLOCATION_INFO RenderGraph::AllocationInfo(const RGTextureDesc& desc)const
+{
+	if (md3dDevice != nullptr)
+	{
+		D3D12_RESOURCE_DESC texDesc = ToResourceDesc(desc);
+		return md3dDevice->GetResourceAllocationInfo(0, 1, &texDesc);
+	}
+
+	D3D12_RESOURCE_ALLOCATION_INFO info;
+	info.Alignment = D3D12_DEFAULT_RESOURCE_PLACEMENT_ALIGNMENT;
+	info.SizeInBytes = AlignUp((UINT64)desc.Width * desc.Height * EstimateBytesPerPixel(desc.Format),
+		info.Alignment);
+	return info;
+}
+
+bool RenderGraph::IsReadState(D3D12_RESOURCE_STATES state)
+{
+	return state != D3D12_RESOURCE_STATE_COMMON && (state & ~ReadStates) == 0;
+}
@@ -0,0 +1,209 @@
+#pragma once
+#include "Common/d3dUtil.h"
+#include "BarrierBatcher.h"
+#include <functional>
+
+// Handle of a resource known by the render graph.  Only valid until the next Reset().
+typedef UINT RGResourceHandle;
+
+static const RGResourceHandle RGInvalidHandle = UINT_MAX;
+
+enum class RGAccess : int
+{
+	Read = 0,	// pass consumes the current contents
+	Write,		// pass overwrites the resource (clear or full redraw)
+	ReadWrite	// pass modifies the current contents (e.g. depth test + write)
+};
+
+// Transient textures are owned by the graph and placed in a shared heap.  Only
+// render target / depth stencil textures can be transient so a single heap
+// category is enough on resource heap tier 1 hardware.
+struct RGTextureDesc
+{
+	UINT Width = 0;
+	UINT Height = 0;
+	DXGI_FORMAT Format = DXGI_FORMAT_UNKNOWN;
+	D3D12_RESOURCE_FLAGS Flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET;
+	D3D12_CLEAR_VALUE ClearValue = {};
+};
+
+class RenderGraph
+{
+public:
+	typedef std::function<void(ID3D12GraphicsCommandList*)> ExecuteFunc;
+	typedef std::function<void(ID3D12Resource*)> RealizeFunc;
+
+	class PassBuilder
+	{
+	public:
+		PassBuilder& Read(RGResourceHandle handle, D3D12_RESOURCE_STATES state);
+		PassBuilder& Write(RGResourceHandle handle, D3D12_RESOURCE_STATES state);
+		PassBuilder& ReadWrite(RGResourceHandle handle, D3D12_RESOURCE_STATES state);
+
+		// Never cull this pass even if nothing reads what it writes.
+		PassBuilder& SideEffect();
+
+	private:
+		friend class RenderGraph;
+		PassBuilder(RenderGraph* graph, UINT passIndex);
+
+		RenderGraph* mGraph = nullptr;
+		UINT mPassIndex = 0;
+	};
+
+	struct Stats
+	{
+		UINT PassCount = 0;
+		UINT CulledPassCount = 0;
+		UINT TransitionCount = 0;
+		UINT AliasingBarrierCount = 0;
+		// Transitions issued as a begin/end pair around other passes.
+		UINT SplitBarrierCount = 0;
+		// ResourceBarrier calls recorded by the last Execute().
+		UINT BarrierCallCount = 0;
+		UINT64 TransientHeapSize = 0;
+		// Bytes the transient textures would take as separate committed resources.
+		UINT64 TransientUnaliasedSize = 0;
+	};
+
+	// device may be null; Compile() then estimates transient sizes and Execute()
+	// cannot create transient textures.  Used to test graph compilation on the CPU.
+	RenderGraph(ID3D12Device* device, UINT framesInFlight);
+	RenderGraph(const RenderGraph& rhs) = delete;
+	RenderGraph& operator=(const RenderGraph& rhs) = delete;
+	~RenderGraph() = default;
+
+	///<summary>
+	/// Drops all passes and resource declarations.  Call once per frame before
+	/// building the graph again.  Physical transient textures are kept and reused.
+	///</summary>
+	void Reset();
+
+	///<summary>
+	/// Registers a resource owned outside of the graph.  homeState is the state the
+	/// resource is in when the frame starts, and the graph returns it to that state
+	/// after the last pass.
+	///</summary>
+	RGResourceHandle ImportResource(const std::string& name, ID3D12Resource* resource,
+		D3D12_RESOURCE_STATES homeState);
+
+	RGResourceHandle CreateTexture(const std::string& name, const RGTextureDesc& desc,
+		RealizeFunc onRealize = nullptr);
+
+	// Passes writing an output are roots of the graph and are never culled.
+	void MarkOutput(RGResourceHandle handle);
+
+	PassBuilder AddPass(const std::string& name, ExecuteFunc execute);
+
+	///<summary>
+	/// Culls passes that do not contribute to an output, computes the resource
+	/// transitions of every remaining pass and assigns heap offsets to transient
+	/// textures.  Does not touch the GPU and gives the same result for the same
+	/// sequence of declarations.
+	///</summary>
+	void Compile();
+
+	void Execute(ID3D12GraphicsCommandList* cmdList);
+
+	ID3D12Resource* Resource(RGResourceHandle handle)const;
+	bool IsPassCulled(const std::string& name)const;
+	UINT64 TransientOffset(RGResourceHandle handle)const;
+	const Stats& GetStats()const;
+
+	// Human readable compiled schedule: passes, barriers and heap offsets.
+	std::string Dump()const;
+
+private:
+	struct Access
+	{
+		RGResourceHandle Handle;
+		RGAccess Type;
+		D3D12_RESOURCE_STATES State;
+	};
+
+	struct Transition
+	{
+		RGResourceHandle Handle;
+		D3D12_RESOURCE_STATES Before;
+		D3D12_RESOURCE_STATES After;
+		// Issued as the END_ONLY half; the begin half went out right after the previous use.
+		bool Split;
+	};
+
+	struct Pass
+	{
+		std::string Name;
+		ExecuteFunc Execute;
+		std::vector<Access> Accesses;
+		bool HasSideEffect = false;
+		bool Culled = false;
+
+		// Filled by Compile().
+		std::vector<Transition> Transitions;
+		std::vector<RGResourceHandle> AliasingBegins;
+		// BEGIN_ONLY halves issued once the pass has been recorded.
+		std::vector<Transition> SplitBegins;
+	};
+
+	struct ResourceNode
+	{
+		std::string Name;
+		bool Imported = false;
+		bool Output = false;
+		ID3D12Resource* External = nullptr;
+		D3D12_RESOURCE_STATES HomeState = D3D12_RESOURCE_STATE_COMMON;
+
+		RGTextureDesc Desc;
+		RealizeFunc OnRealize;
+
+		// Filled by Compile().
+		int FirstPass = -1;
+		int LastPass = -1;
+		UINT64 Size = 0;
+		UINT64 Alignment = 0;
+		UINT64 HeapOffset = 0;
+		RGResourceHandle AliasedFrom = RGInvalidHandle;
+	};
+
+	// Physical transient texture kept between frames.
+	struct PhysicalTexture
+	{
+		Microsoft::WRL::ComPtr<ID3D12Resource> Resource;
+		RGTextureDesc Desc;
+		UINT64 HeapOffset = 0;
+		D3D12_RESOURCE_STATES InitialState = D3D12_RESOURCE_STATE_COMMON;
+	};
+
+	void AddAccess(UINT passIndex, RGResourceHandle handle, RGAccess type, D3D12_RESOURCE_STATES state);
+	void CullPasses();
+	void ComputeBarriers();
+	void AllocateTransients();
+	void RealizeTransients();
+
+	void DumpTransition(std::ostringstream& out, const Transition& t, const char* prefix)const;
+
+	D3D12_RESOURCE_DESC ToResourceDesc(const RGTextureDesc& desc)const;
+	D3D12_RESOURCE_ALLOCATION_INFO AllocationInfo(const RGTextureDesc& desc)const;
+
+	static bool IsReadState(D3D12_RESOURCE_STATES state);
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+	UINT mFramesInFlight = 0;
+	UINT64 mFrameIndex = 0;
+
+	std::vector<Pass> mPasses;
+	std::vector<ResourceNode> mResources;
+	std::vector<Transition> mEndTransitions;
+	// BEGIN_ONLY halves for resources not used by any pass before their transition.
+	std::vector<Transition> mFrameSplitBegins;
+	bool mCompiled = false;
+	Stats mStats;
+	BarrierBatcher mBarriers;
+
+	Microsoft::WRL::ComPtr<ID3D12Heap> mTransientHeap;
+	std::unordered_map<std::string, PhysicalTexture> mPhysicalTextures;
+
+	// Heaps and textures replaced while older frames may still use them.
+	std::vector<std::pair<UINT64, Microsoft::WRL::ComPtr<ID3D12Pageable>>> mRetired;
+};
@@ -0,0 +1,281 @@
+#include "SampleDistribution.h"
+#include <float.h>
+
+using namespace DirectX;
+using Microsoft::WRL::ComPtr;
+
+const float DepthBounds::EmptyBound = FLT_MAX;
+
+DepthBounds::DepthBounds()
+{
+	MinDepth = +EmptyBound;
+	MaxDistance = -EmptyBound;
+	for (UINT i = 0; i < MaxShadowCascades; ++i)
+	{
+		LightMin[i] = XMFLOAT3(+EmptyBound, +EmptyBound, +EmptyBound);
+		LightMax[i] = XMFLOAT3(-EmptyBound, -EmptyBound, -EmptyBound);
+	}
+}
+
+bool DepthBounds::Empty()const
+{
+	return MinDepth > MaxDistance;
+}
+
+bool DepthBounds::Empty(UINT cascade)const
+{
+	return LightMin[cascade].x > LightMax[cascade].x;
+}
+
+SampleDistribution::SampleDistribution(ID3D12Device* device, UINT framesInFlight)
+{
+	md3dDevice = device;
+	mReadbackBuffers.resize(framesInFlight);
+	mReadbackPending.resize(framesInFlight, false);
+
+	BuildResources();
+}
+
+void SampleDistribution::BuildDescriptors(
+	ID3D12Resource* depthStencilBuffer,
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv)
+{
+	mhDepthMapCpuSrv = hCpuSrv;
+	mhDepthMapGpuSrv = hGpuSrv;
+
+	RebuildDescriptors(depthStencilBuffer);
+}
+
+void SampleDistribution::RebuildDescriptors(ID3D12Resource* depthStencilBuffer)
+{
+	mDepthStencilBuffer = depthStencilBuffer;
+
+	D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+	srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
+	srvDesc.Format = DXGI_FORMAT_R24_UNORM_X8_TYPELESS;
+	srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
+	srvDesc.Texture2D.MostDetailedMip = 0;
+	srvDesc.Texture2D.MipLevels = 1;
+	md3dDevice->CreateShaderResourceView(depthStencilBuffer, &srvDesc, mhDepthMapCpuSrv);
+}
+
+void SampleDistribution::Reduce(ID3D12GraphicsCommandList* cmdList, ID3D12PipelineState* pso, UINT frameIndex,
+	D3D12_GPU_VIRTUAL_ADDRESS constants, UINT width, UINT height)
+{
+	const UINT64 byteSize = BoundsCount * sizeof(UINT);
+
+	// Buffers decay to COMMON after every ExecuteCommandLists and are promoted to
+	// COPY_DEST by the copy, so only the UAV and copy source states need barriers.
+	cmdList->CopyBufferRegion(mBoundsBuffer.Get(), 0, mResetBuffer.Get(), 0, byteSize);
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mBoundsBuffer.Get(),
+		D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+
+	cmdList->SetPipelineState(pso);
+	cmdList->SetComputeRootConstantBufferView(0, constants);
+	cmdList->SetComputeRootDescriptorTable(1, mhDepthMapGpuSrv);
+	cmdList->SetComputeRootUnorderedAccessView(2, mBoundsBuffer->GetGPUVirtualAddress());
+
+	// 16x16 threads per group, see DepthReduce.hlsl.
+	cmdList->Dispatch((width + 15) / 16, (height + 15) / 16, 1);
+
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mBoundsBuffer.Get(),
+		D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE));
+	cmdList->CopyBufferRegion(mReadbackBuffers[frameIndex].Get(), 0, mBoundsBuffer.Get(), 0, byteSize);
+
+	mReadbackPending[frameIndex] = true;
+}
+
+bool SampleDistribution::ReadBounds(UINT frameIndex, DepthBounds& bounds)
+{
+	if (!mReadbackPending[frameIndex])
+		return false;
+	mReadbackPending[frameIndex] = false;
+
+	UINT values[BoundsCount];
+	D3D12_RANGE readRange = { 0, sizeof(values) };
+	void* mappedData = nullptr;
+	ThrowIfFailed(mReadbackBuffers[frameIndex]->Map(0, &readRange, &mappedData));
+	memcpy(values, mappedData, sizeof(values));
+	D3D12_RANGE writeRange = { 0, 0 };
+	mReadbackBuffers[frameIndex]->Unmap(0, &writeRange);
+
+	bounds.MinDepth = OrderedUintToFloat(values[0]);
+	bounds.MaxDistance = OrderedUintToFloat(values[1]);
+	for (UINT i = 0; i < MaxShadowCascades; ++i)
+	{
+		const UINT* box = &values[2 + 6 * i];
+		bounds.LightMin[i] = XMFLOAT3(OrderedUintToFloat(box[0]), OrderedUintToFloat(box[1]), OrderedUintToFloat(box[2]));
+		bounds.LightMax[i] = XMFLOAT3(OrderedUintToFloat(box[3]), OrderedUintToFloat(box[4]), OrderedUintToFloat(box[5]));
+	}
+	return true;
+}
+
+// Row vector times matrix, as mul(v, M) in the shaders with M not transposed.
+static void TransformPoint(const float v[4], const XMFLOAT4X4& m, float out[4])
+{
+	for (int c = 0; c < 4; ++c)
+		out[c] = v[0] * m.m[0][c] + v[1] * m.m[1][c] + v[2] * m.m[2][c] + v[3] * m.m[3][c];
+}
+
+static void GrowBox(XMFLOAT3& boxMin, XMFLOAT3& boxMax, const float p[3])
+{
+	boxMin.x = std::min<float>(boxMin.x, p[0]);
+	boxMin.y = std::min<float>(boxMin.y, p[1]);
+	boxMin.z = std::min<float>(boxMin.z, p[2]);
+	boxMax.x = std::max<float>(boxMax.x, p[0]);
+	boxMax.y = std::max<float>(boxMax.y, p[1]);
+	boxMax.z = std::max<float>(boxMax.z, p[2]);
+}
+
+DepthBounds SampleDistribution::ReduceOnCpu(const float* depth, UINT width, UINT height,
+	const XMFLOAT4X4& invProj, const XMFLOAT4X4& viewToLight,
+	const float* splits, UINT cascadeCount, float blendBand)
+{
+	DepthBounds bounds;
+	for (UINT y = 0; y < height; ++y)
+	{
+		for (UINT x = 0; x < width; ++x)
+		{
+			// Far plane means nothing was drawn there.
+			float d = depth[y * width + x];
+			if (d >= 1.0f)
+				continue;
+
+			float u = (x + 0.5f) / width;
+			float v = (y + 0.5f) / height;
+			float ndc[4] = { 2.0f * u - 1.0f, 1.0f - 2.0f * v, d, 1.0f };
+			float posV[4];
+			TransformPoint(ndc, invProj, posV);
+			posV[0] /= posV[3];
+			posV[1] /= posV[3];
+			posV[2] /= posV[3];
+			posV[3] = 1.0f;
+
+			float distance = sqrtf(posV[0] * posV[0] + posV[1] * posV[1] + posV[2] * posV[2]);
+			bounds.MinDepth = std::min<float>(bounds.MinDepth, posV[2]);
+			bounds.MaxDistance = std::max<float>(bounds.MaxDistance, distance);
+
+			UINT cascade = 0;
+			while (cascade < cascadeCount && distance >= splits[cascade])
+				cascade++;
+			if (cascade == cascadeCount)
+				continue;
+
+			float posL[4];
+			TransformPoint(posV, viewToLight, posL);
+			GrowBox(bounds.LightMin[cascade], bounds.LightMax[cascade], posL);
+			if (cascade + 1 < cascadeCount && splits[cascade] - distance < blendBand)
+				GrowBox(bounds.LightMin[cascade + 1], bounds.LightMax[cascade + 1], posL);
+		}
+	}
+	return bounds;
+}
+
+void SampleDistribution::FitSplits(float nearZ, float farZ, UINT count, float lambda, float* splits)
+{
+	for (UINT i = 0; i < count; ++i)
+	{
+		float s = (float)(i + 1) / count;
+		float logSplit = nearZ * powf(farZ / nearZ, s);
+		float uniformSplit = nearZ + (farZ - nearZ) * s;
+		splits[i] = lambda * logSplit + (1.0f - lambda) * uniformSplit;
+	}
+}
+
+bool SampleDistribution::FitCascadeBox(const DepthBounds& bounds, UINT cascade, UINT resolution,
+	XMFLOAT3& boxMin, XMFLOAT3& boxMax)
+{
+	if (bounds.Empty(cascade))
+		return false;
+
+	// Two texels of slack keep the filter taps of the outermost samples inside.
+	float pad = 2.0f * (boxMax.x - boxMin.x) / resolution;
+	const XMFLOAT3& sampleMin = bounds.LightMin[cascade];
+	const XMFLOAT3& sampleMax = bounds.LightMax[cascade];
+	float minX = std::max<float>(boxMin.x, sampleMin.x - pad);
+	float minY = std::max<float>(boxMin.y, sampleMin.y - pad);
+	float maxX = std::min<float>(boxMax.x, sampleMax.x + pad);
+	float maxY = std::min<float>(boxMax.y, sampleMax.y + pad);
+	float maxZ = std::min<float>(boxMax.z, sampleMax.z + pad);
+	if (minX >= maxX || minY >= maxY || boxMin.z >= maxZ)
+		return false;
+
+	// Square texels, with the centre on the texel grid so the map does not
+	// shimmer while the samples stay where they are.
+	float side = std::max<float>(maxX - minX, maxY - minY);
+	float texel = side / resolution;
+	float centerX = floorf(0.5f * (minX + maxX) / texel) * texel;
+	float centerY = floorf(0.5f * (minY + maxY) / texel) * texel;
+
+	boxMin.x = centerX - 0.5f * side;
+	boxMin.y = centerY - 0.5f * side;
+	boxMax.x = centerX + 0.5f * side;
+	boxMax.y = centerY + 0.5f * side;
+	boxMax.z = maxZ;
+	return true;
+}
+
+UINT SampleDistribution::FloatToOrderedUint(float f)
+{
+	UINT u;
+	memcpy(&u, &f, sizeof(u));
+	return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
+
+float SampleDistribution::OrderedUintToFloat(UINT u)
+{
+	u = (u & 0x80000000) ? (u & 0x7fffffff) : ~u;
+	float f;
+	memcpy(&f, &u, sizeof(f));
+	return f;
+}
+
+void SampleDistribution::BuildResources()
+{
+	const UINT64 byteSize = BoundsCount * sizeof(UINT);
+
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(byteSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+		D3D12_RESOURCE_STATE_COMMON,
+		nullptr,
+		IID_PPV_ARGS(&mBoundsBuffer)));
+
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(byteSize),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&mResetBuffer)));
+
+	// Mins start at the largest value and maxes at the smallest, as in DepthBounds.
+	UINT values[BoundsCount];
+	values[0] = FloatToOrderedUint(+DepthBounds::EmptyBound);
+	values[1] = FloatToOrderedUint(-DepthBounds::EmptyBound);
+	for (UINT i = 0; i < MaxShadowCascades; ++i)
+	{
+		for (UINT j = 0; j < 3; ++j)
+		{
+			values[2 + 6 * i + j] = FloatToOrderedUint(+DepthBounds::EmptyBound);
+			values[2 + 6 * i + 3 + j] = FloatToOrderedUint(-DepthBounds::EmptyBound);
+		}
+	}
+	void* mappedData = nullptr;
+	ThrowIfFailed(mResetBuffer->Map(0, nullptr, &mappedData));
+	memcpy(mappedData, values, sizeof(values));
+	mResetBuffer->Unmap(0, nullptr);
+
+	for (auto& readback : mReadbackBuffers)
+	{
+		ThrowIfFailed(md3dDevice->CreateCommittedResource(
+			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+			D3D12_HEAP_FLAG_NONE,
+			&CD3DX12_RESOURCE_DESC::Buffer(byteSize),
+			D3D12_RESOURCE_STATE_COPY_DEST,
+			nullptr,
+			IID_PPV_ARGS(&readback)));
+	}
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+// Bounds of the visible depth samples, as reduced from the depth buffer.
+struct DepthBounds
+{
+	DepthBounds();
+
+	// What the mins start at, and negated the maxes: FLT_MAX, as in DepthReduce.hlsl.
+	static const float EmptyBound;
+
+	// View space depth of the nearest sample.
+	float MinDepth;
+	// Eye distance of the farthest sample; the shader picks cascades by eye distance.
+	float MaxDistance;
+	// Light view space box of the samples that sample each cascade.
+	DirectX::XMFLOAT3 LightMin[MaxShadowCascades];
+	DirectX::XMFLOAT3 LightMax[MaxShadowCascades];
+
+	// Nothing but sky was visible.
+	bool Empty()const;
+	// No sample falls into the cascade.
+	bool Empty(UINT cascade)const;
+};
+
+///<summary>
+/// Sample distribution shadow maps: reduces the depth buffer to the depth range
+/// of the visible samples and the light space box of the samples in each cascade,
+/// so the cascades can be fitted to what is on screen instead of the whole view
+/// frustum.  The reduction runs on the GPU and is read back a few frames later,
+/// one readback buffer per frame resource.  The static functions are the CPU
+/// reference of the reduction and the fitting math.
+///</summary>
+class SampleDistribution
+{
+public:
+	// Size of the bounds buffer in uints: the depth range, then a min/max box per cascade.
+	static const UINT BoundsCount = 2 + 6 * MaxShadowCascades;
+
+	SampleDistribution(ID3D12Device* device, UINT framesInFlight);
+	SampleDistribution(const SampleDistribution& rhs) = delete;
+	SampleDistribution& operator=(const SampleDistribution& rhs) = delete;
+	~SampleDistribution() = default;
+
+	void BuildDescriptors(
+		ID3D12Resource* depthStencilBuffer,
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv);
+
+	// The depth buffer is recreated on resize.
+	void RebuildDescriptors(ID3D12Resource* depthStencilBuffer);
+
+	///<summary>
+	/// Reduces the depth buffer and copies the bounds to the readback buffer of
+	/// frameIndex.  The caller binds the compute root signature (CBV b0, SRV table
+	/// t0, UAV u0) and leaves the depth buffer readable by non-pixel shaders.
+	///</summary>
+	void Reduce(ID3D12GraphicsCommandList* cmdList, ID3D12PipelineState* pso, UINT frameIndex,
+		D3D12_GPU_VIRTUAL_ADDRESS constants, UINT width, UINT height);
+
+	///<summary>
+	/// Bounds of the last Reduce recorded for frameIndex, which the GPU must have
+	/// finished.  Each reduction is handed out once; returns false if there is none.
+	///</summary>
+	bool ReadBounds(UINT frameIndex, DepthBounds& bounds);
+
+	///<summary>
+	/// CPU reference of DepthReduce.hlsl.  depth holds width*height depth buffer
+	/// values; invProj maps NDC to view space and viewToLight view to light space
+	/// (not transposed).  A sample within blendBand of a split also counts for the
+	/// next cascade, as the shader blends the two there.
+	///</summary>
+	static DepthBounds ReduceOnCpu(const float* depth, UINT width, UINT height,
+		const DirectX::XMFLOAT4X4& invProj, const DirectX::XMFLOAT4X4& viewToLight,
+		const float* splits, UINT cascadeCount, float blendBand);
+
+	// Practical split scheme over [nearZ, farZ]: lambda blends uniform (0) and logarithmic (1) splits.
+	static void FitSplits(float nearZ, float farZ, UINT count, float lambda, float* splits);
+
+	///<summary>
+	/// Shrinks a cascade's light space box to the samples in it, never growing it.
+	/// The side towards the light is kept, so casters in front of the samples still
+	/// land in the map.  The result is square and centred on whole texels of a
+	/// resolution-sized tile.  Returns false, leaving the box alone, if the cascade
+	/// holds no samples.
+	///</summary>
+	static bool FitCascadeBox(const DepthBounds& bounds, UINT cascade, UINT resolution,
+		DirectX::XMFLOAT3& boxMin, DirectX::XMFLOAT3& boxMax);
+
+	// Maps floats to uints of the same order, so atomics can take their min and max.
+	static UINT FloatToOrderedUint(float f);
+	static float OrderedUintToFloat(UINT u);
+
+private:
+	void BuildResources();
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+
+	ID3D12Resource* mDepthStencilBuffer = nullptr;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhDepthMapCpuSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhDepthMapGpuSrv;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mBoundsBuffer;
+	// Empty bounds copied over mBoundsBuffer before every reduction.
+	Microsoft::WRL::ComPtr<ID3D12Resource> mResetBuffer;
+	std::vector<Microsoft::WRL::ComPtr<ID3D12Resource>> mReadbackBuffers;
+	std::vector<bool> mReadbackPending;
+};
@@ -0,0 +1,149 @@
+#include "SceneEditQueue.h"
+
+using namespace DirectX;
+
+SceneEditQueue::SceneEditQueue()
+{
+	mStub.Next.store(nullptr, std::memory_order_relaxed);
+	mHead.store(&mStub, std::memory_order_relaxed);
+	mTail = &mStub;
+	mNextInstanceId.store(0, std::memory_order_relaxed);
+}
+
+SceneEditQueue::~SceneEditQueue()
+{
+	SceneEdit edit;
+	while (TryPop(edit))
+	{
+	}
+}
+
+void SceneEditQueue::Push(const SceneEdit& edit)
+{
+	Node* node = new Node();
+	node->Edit = edit;
+	PushNode(node);
+}
+
+void SceneEditQueue::PushNode(Node* node)
+{
+	node->Next.store(nullptr, std::memory_order_relaxed);
+
+	// Between the exchange and the store below the list is briefly broken.
+	// The consumer treats that as empty instead of waiting for us.
+	Node* prev = mHead.exchange(node, std::memory_order_acq_rel);
+	prev->Next.store(node, std::memory_order_release);
+}
+
+UINT SceneEditQueue::ReserveInstanceIds(UINT count)
+{
+	return mNextInstanceId.fetch_add(count, std::memory_order_relaxed);
+}
+
+void SceneEditQueue::SetInstanceTransform(UINT itemIndex, UINT instanceId, FXMMATRIX world)
+{
+	SceneEdit edit;
+	edit.Type = SceneEditType::SetInstanceTransform;
+	edit.ItemIndex = itemIndex;
+	edit.InstanceId = instanceId;
+	XMStoreFloat4x4(&edit.World, world);
+	Push(edit);
+}
+
+void SceneEditQueue::SetInstanceMaterial(UINT itemIndex, UINT instanceId, UINT materialIndex)
+{
+	SceneEdit edit;
+	edit.Type = SceneEditType::SetInstanceMaterial;
+	edit.ItemIndex = itemIndex;
+	edit.InstanceId = instanceId;
+	edit.MaterialIndex = materialIndex;
+	Push(edit);
+}
+
+UINT SceneEditQueue::SpawnInstance(UINT itemIndex, FXMMATRIX world, UINT materialIndex)
+{
+	SceneEdit edit;
+	edit.Type = SceneEditType::SpawnInstance;
+	edit.ItemIndex = itemIndex;
+	edit.InstanceId = ReserveInstanceIds(1);
+	edit.MaterialIndex = materialIndex;
+	XMStoreFloat4x4(&edit.World, world);
+	Push(edit);
+	return edit.InstanceId;
+}
+
+void SceneEditQueue::RemoveInstance(UINT itemIndex, UINT instanceId)
+{
+	SceneEdit edit;
+	edit.Type = SceneEditType::RemoveInstance;
+	edit.ItemIndex = itemIndex;
+	edit.InstanceId = instanceId;
+	Push(edit);
+}
+
+void SceneEditQueue::SetMaterial(UINT materialIndex, const XMFLOAT4& diffuseAlbedo,
+	const XMFLOAT3& fresnelR0, float roughness)
+{
+	SceneEdit edit;
+	edit.Type = SceneEditType::SetMaterial;
+	edit.MaterialIndex = materialIndex;
+	edit.DiffuseAlbedo = diffuseAlbedo;
+	edit.FresnelR0 = fresnelR0;
+	edit.Roughness = roughness;
+	Push(edit);
+}
+
+bool SceneEditQueue::TryPop(SceneEdit& edit)
+{
+	Node* tail = mTail;
+	Node* next = tail->Next.load(std::memory_order_acquire);
+
+	// Skip the stub.
+	if (tail == &mStub)
+	{
+		if (next == nullptr)
+			return false;
+		mTail = next;
+		tail = next;
+		next = next->Next.load(std::memory_order_acquire);
+	}
+
+	if (next != nullptr)
+	{
+		mTail = next;
+		edit = tail->Edit;
+		delete tail;
+		return true;
+	}
+
+	// tail is the last node we can see.  If it is not the head, a producer has
+	// swapped in a newer node but not linked it yet.
+	if (tail != mHead.load(std::memory_order_acquire))
+		return false;
+
+	// Put the stub back behind tail so tail can be unlinked.
+	PushNode(&mStub);
+
+	next = tail->Next.load(std::memory_order_acquire);
+	if (next != nullptr)
+	{
+		mTail = next;
+		edit = tail->Edit;
+		delete tail;
+		return true;
+	}
+
+	return false;
+}
+
+UINT SceneEditQueue::Drain(std::vector<SceneEdit>& edits, UINT maxCount)
+{
+	UINT count = 0;
+	SceneEdit edit;
+	while (count < maxCount && TryPop(edit))
+	{
+		edits.push_back(edit);
+		count++;
+	}
+	return count;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "Common/d3dUtil.h"
+#include <atomic>
+
+enum class SceneEditType : int
+{
+	SetInstanceTransform = 0,
+	SetInstanceMaterial,
+	SpawnInstance,
+	RemoveInstance,
+	SetMaterial
+};
+
+// One change to the scene.  ItemIndex is RenderItem::itemIndex, InstanceId an id
+// from SceneEditQueue::ReserveInstanceIds and MaterialIndex is Material::MatCBIndex;
+// only the fields used by Type are read.
+struct SceneEdit
+{
+	SceneEditType Type = SceneEditType::SetInstanceTransform;
+	UINT ItemIndex = 0;
+	UINT InstanceId = 0;
+	UINT MaterialIndex = 0;
+
+	DirectX::XMFLOAT4X4 World = MathHelper::Identity4x4();
+	DirectX::XMFLOAT4X4 TexTransform = MathHelper::Identity4x4();
+
+	DirectX::XMFLOAT4 DiffuseAlbedo = { 1.0f, 1.0f, 1.0f, 1.0f };
+	DirectX::XMFLOAT3 FresnelR0 = { 0.01f, 0.01f, 0.01f };
+	float Roughness = 0.25f;
+};
+
+///<summary>
+/// Unbounded multi-producer/single-consumer queue of scene edits (Vyukov's
+/// intrusive MPSC queue).  Any thread may push; pushing is one atomic exchange
+/// and never waits for the renderer.  Only the render thread may pop.
+///</summary>
+class SceneEditQueue
+{
+public:
+	SceneEditQueue();
+	SceneEditQueue(const SceneEditQueue& rhs) = delete;
+	SceneEditQueue& operator=(const SceneEditQueue& rhs) = delete;
+	~SceneEditQueue();
+
+	// Producer side, callable from any thread.
+	void Push(const SceneEdit& edit);
+
+	// Instances are named by id, which stays the same however the renderer moves
+	// them around.  Returns the first of count consecutive new ids.  Ids are never
+	// reused, so edits naming a removed instance cannot hit a newer one.
+	UINT ReserveInstanceIds(UINT count);
+
+	void SetInstanceTransform(UINT itemIndex, UINT instanceId, DirectX::FXMMATRIX world);
+	void SetInstanceMaterial(UINT itemIndex, UINT instanceId, UINT materialIndex);
+	// Returns the id of the new instance, which later edits can name right away.
+	UINT SpawnInstance(UINT itemIndex, DirectX::FXMMATRIX world, UINT materialIndex);
+	void RemoveInstance(UINT itemIndex, UINT instanceId);
+	void SetMaterial(UINT materialIndex, const DirectX::XMFLOAT4& diffuseAlbedo,
+		const DirectX::XMFLOAT3& fresnelR0, float roughness);
+
+	// Consumer side, render thread only.  Returns false when the queue is empty
+	// or a producer is halfway through a push; the edit shows up on a later call.
+	bool TryPop(SceneEdit& edit);
+
+	// Pops up to maxCount edits in push order and appends them to edits.
+	UINT Drain(std::vector<SceneEdit>& edits, UINT maxCount);
+
+private:
+	struct Node
+	{
+		std::atomic<Node*> Next;
+		SceneEdit Edit;
+	};
+
+	void PushNode(Node* node);
+
+private:
+	// Producers swap themselves in at the head; the consumer walks from the tail.
+	std::atomic<Node*> mHead;
+	Node* mTail = nullptr;
+	Node mStub;
+
+	std::atomic<UINT> mNextInstanceId;
+};
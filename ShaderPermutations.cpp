@@ -0,0 +1,85 @@
+#include "ShaderPermutations.h"
+
+void ShaderFeatures::Merge(const ShaderFeatures& other)
+{
+	AlphaTest = AlphaTest || other.AlphaTest;
+	NormalMap = NormalMap || other.NormalMap;
+}
+
+ShaderPermutations::ShaderPermutations(ID3D12Device* device)
+	: md3dDevice(device)
+{
+}
+
+void ShaderPermutations::AddPipeline(const std::string& name, const D3D12_GRAPHICS_PIPELINE_STATE_DESC& desc,
+	const std::wstring& filename, const std::string& psName, UINT featureMask)
+{
+	Pipeline& pipeline = mPipelines[name];
+	pipeline.Desc = desc;
+	pipeline.Filename = filename;
+	pipeline.PsName = psName;
+	pipeline.FeatureMask = featureMask;
+	pipeline.Variants.clear();
+	pipeline.Shaders.clear();
+}
+
+ID3D12PipelineState* ShaderPermutations::Pso(const std::string& name, const ShaderFeatures& features)
+{
+	Pipeline& pipeline = mPipelines.at(name);
+	UINT key = Key(features, pipeline.FeatureMask);
+
+	auto variant = pipeline.Variants.find(key);
+	if (variant != pipeline.Variants.end())
+		return variant->second.Get();
+
+	// Only the switches the pipeline reads are defined; the shaders keep their
+	// defaults for the rest.
+	std::vector<std::pair<std::string, std::string>> defines;
+	if (pipeline.FeatureMask & ShaderFeatureLights)
+		defines.push_back({ "NUM_DIR_LIGHTS", std::to_string(features.DirLightCount) });
+	if (pipeline.FeatureMask & ShaderFeatureShadowFilter)
+		defines.push_back({ "SHADOW_FILTER", std::to_string(features.ShadowFilter) });
+	if ((pipeline.FeatureMask & ShaderFeatureAlphaTest) && features.AlphaTest)
+		defines.push_back({ "ALPHA_TEST", "1" });
+	if (pipeline.FeatureMask & ShaderFeatureNormalMap)
+		defines.push_back({ "NORMAL_MAP", features.NormalMap ? "1" : "0" });
+
+	std::vector<D3D_SHADER_MACRO> macros;
+	for (const auto& define : defines)
+		macros.push_back({ define.first.c_str(), define.second.c_str() });
+	macros.push_back({ NULL, NULL });
+
+	auto& ps = pipeline.Shaders[key];
+	ps = d3dUtil::CompileShader(pipeline.Filename, macros.data(), pipeline.PsName, "ps_5_1");
+
+	D3D12_GRAPHICS_PIPELINE_STATE_DESC desc = pipeline.Desc;
+	desc.PS =
+	{
+		reinterpret_cast<BYTE*>(ps->GetBufferPointer()),
+		ps->GetBufferSize()
+	};
+
+	auto& pso = pipeline.Variants[key];
+	ThrowIfFailed(md3dDevice->CreateGraphicsPipelineState(&desc, IID_PPV_ARGS(&pso)));
+	mVariantCount++;
+	return pso.Get();
+}
+
+UINT ShaderPermutations::VariantCount()const
+{
+	return mVariantCount;
+}
+
+UINT ShaderPermutations::Key(const ShaderFeatures& features, UINT featureMask)
+{
+	UINT key = 0;
+	if (featureMask & ShaderFeatureLights)
+		key |= std::min<UINT>(features.DirLightCount, 0xff);
+	if (featureMask & ShaderFeatureShadowFilter)
+		key |= (features.ShadowFilter & 0xf) << 8;
+	if ((featureMask & ShaderFeatureAlphaTest) && features.AlphaTest)
+		key |= 1 << 12;
+	if ((featureMask & ShaderFeatureNormalMap) && features.NormalMap)
+		key |= 1 << 13;
+	return key;
+}
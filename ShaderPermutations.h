@@ -0,0 +1,76 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+// Compile-time switches the lighting and geometry shaders can be specialized on.
+struct ShaderFeatures
+{
+	// Directional lights the shading loop runs over, NUM_DIR_LIGHTS.
+	UINT DirLightCount = 0;
+	// ShadowFilter of the main light's cascades, SHADOW_FILTER.
+	UINT ShadowFilter = 0;
+	// Clip texels whose albedo alpha is below 0.1, ALPHA_TEST.
+	bool AlphaTest = false;
+	// Perturb the normal with the material's normal map, NORMAL_MAP.
+	bool NormalMap = false;
+
+	// Adds the material switches of other, so one variant serves both.
+	void Merge(const ShaderFeatures& other);
+};
+
+// Which of the ShaderFeatures a pipeline's pixel shader reads.
+enum ShaderFeatureMask : UINT
+{
+	ShaderFeatureLights = 1 << 0,
+	ShaderFeatureShadowFilter = 1 << 1,
+	ShaderFeatureAlphaTest = 1 << 2,
+	ShaderFeatureNormalMap = 1 << 3,
+	ShaderFeatureAll = 0xf
+};
+
+///<summary>
+/// Pipeline states whose pixel shader is compiled once per set of ShaderFeatures,
+/// so light loops run a constant count and unused paths are compiled out.
+/// Variants are compiled and created the first time they are asked for and kept
+/// for the lifetime of the object; features a pipeline does not read are ignored,
+/// so they do not multiply its variants.
+///</summary>
+class ShaderPermutations
+{
+public:
+	ShaderPermutations(ID3D12Device* device);
+	ShaderPermutations(const ShaderPermutations& rhs) = delete;
+	ShaderPermutations& operator=(const ShaderPermutations& rhs) = delete;
+	~ShaderPermutations() = default;
+
+	///<summary>
+	/// Registers pipeline name as desc with its PS replaced by entry point psName of
+	/// filename.  Everything desc points to (root signature, input layout, VS
+	/// bytecode) must outlive this object.
+	///</summary>
+	void AddPipeline(const std::string& name, const D3D12_GRAPHICS_PIPELINE_STATE_DESC& desc,
+		const std::wstring& filename, const std::string& psName, UINT featureMask);
+
+	// The variant of pipeline name for features, built on first use.
+	ID3D12PipelineState* Pso(const std::string& name, const ShaderFeatures& features);
+
+	// Variants built so far, over all pipelines.
+	UINT VariantCount()const;
+
+private:
+	static UINT Key(const ShaderFeatures& features, UINT featureMask);
+
+private:
+	struct Pipeline
+	{
+		D3D12_GRAPHICS_PIPELINE_STATE_DESC Desc;
+		std::wstring Filename;
+		std::string PsName;
+		UINT FeatureMask = 0;
+		std::unordered_map<UINT, Microsoft::WRL::ComPtr<ID3D12PipelineState>> Variants;
+		std::unordered_map<UINT, Microsoft::WRL::ComPtr<ID3DBlob>> Shaders;
+	};
+
+	ID3D12Device* md3dDevice = nullptr;
+	std::unordered_map<std::string, Pipeline> mPipelines;
+	UINT mVariantCount = 0;
+};
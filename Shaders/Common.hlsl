@@ -15,17 +15,47 @@
     #define NUM_SPOT_LIGHTS 0
 #endif
 
+// 0 skips the normal map fetch for materials on the flat default normal map.
+#ifndef NORMAL_MAP
+    #define NORMAL_MAP 1
+#endif
+
 // Include structures and functions for lighting.
 #include "PBR.hlsl"
 #include "GBuffer.hlsl"
 #define N_SAMPLE 16
+// Must match MaxShadowCascades in d3dUtil.h.
+#define MaxShadowCascades 4
+// Must match MaxShadowedLights in d3dUtil.h.
+#define MaxShadowedLights 8
+// Light slot ShadowScheduler gives the first spot light, after all the directional
+// lights however few of them NUM_DIR_LIGHTS specializes on.  Must match
+// DirLightCount in CRYCHIC.h.
+#define ShadowedLightBase 3
+// Must match d3dUtil.h and VirtualShadowPages.
+#define VirtualShadowLevels 6
+#define VirtualShadowPagesPerLevel 64
+#define VirtualPageValid 0x80000000
+// Must match the froxel grid in d3dUtil.h.
+#define ClusterCountX 16
+#define ClusterCountY 8
+#define ClusterCountZ 24
+
+// Must match ShadowFilter in CRYCHIC.h.
+#define ShadowFilterPcf 0
+#define ShadowFilterEvsm 1
+// Warp exponents; must match Evsm.hlsl.
+#define EvsmPositiveExponent 5.0f
+#define EvsmNegativeExponent 5.0f
 
 struct InstanceData
 {
     float4x4 World;
     float4x4 TexTransform;
     uint MaterialIndex;
-    uint InstPad0;
+    // Bit lod * MaxShadowCascades + i is set when the instance casts into shadow
+    // cascade i with caster LOD lod.
+    uint CascadeMask;
     uint InstPad1;
     uint InstPad2;
 };
@@ -43,19 +73,30 @@ struct MaterialData
 };
 
 TextureCube gCubeMap : register(t0);
-Texture2D gShadowMap[12] : register(t1);
-Texture2D gSsaoMap[5]   : register(t13);
-Texture2D gBuffer[4] : register(t18);
+// Shadow atlas; each cascade samples its own tile, see gShadowTileBounds.
+Texture2D gShadowMap : register(t1);
+// [3] is the depth buffer, which the deferred path rebuilds positions from.
+Texture2D gSsaoMap[5]   : register(t2);
+Texture2D gBuffer[2] : register(t7);
+// Prefiltered EVSM moments at half the atlas resolution, same tile layout.
+Texture2D gEvsmMap : register(t9);
 // An array of textures, which is only supported in shader model 5.1+. 
 // Unlike Texture2DArray, the textures in this array can be different sizes and formats, 
 // making it more flexible than texture arrays.
-Texture2D gTextureMaps[10] : register(t22);
+Texture2D gTextureMaps[10] : register(t10);
 
 
 // Put in space1, so the texture array does not overlap with these resources.  
 // The texture array will occupy registers t0, t1, ..., t3 in space0. 
 StructuredBuffer<InstanceData> gInstanceData : register(t0, space1);
 StructuredBuffer<MaterialData> gMaterialData : register(t1, space1);
+// Virtual shadow map page table, see VirtualShadowPages::BuildPageTable.
+StructuredBuffer<uint> gVirtualPageTable : register(t2, space1);
+// Clustered point and spot lights, each froxel's (offset, count) run of
+// gClusterLightIndices, and the indices; see ClusteredLights.
+StructuredBuffer<Light> gClusterLights : register(t3, space1);
+StructuredBuffer<uint2> gClusters : register(t4, space1);
+StructuredBuffer<uint> gClusterLightIndices : register(t5, space1);
 
 
 SamplerState gsamPointWrap        : register(s0);
@@ -78,7 +119,7 @@ SamplerComparisonState gsamShadow : register(s6);
 //	uint gObjPad2;
 //};
 
-// Constant data that varies per material.
+// Constant data of the view being drawn: the camera or a shadow view.
 cbuffer cbPass : register(b0)
 {
     float4x4 gView;
@@ -88,24 +129,87 @@ cbuffer cbPass : register(b0)
     float4x4 gViewProj;
     float4x4 gInvViewProj;
     float4x4 gViewProjTex;
-    float4x4 gShadowTransforms[12];
     float3 gEyePosW;
     float cbPerObjectPad1;
     float2 gRenderTargetSize;
     float2 gInvRenderTargetSize;
     float gNearZ;
     float gFarZ;
+};
+
+// Constant data shared by every view of the frame.
+cbuffer cbFrame : register(b2)
+{
+    float4x4 gShadowTransforms[MaxShadowCascades];
+    float4 gShadowTileBounds[MaxShadowCascades];
+    // Distance from the eye at which each cascade ends.
+    float4 gCascadeSplits;
+    uint gCascadeCount;
+    float gCascadeBlendBand;
+    // ShadowFilterPcf or ShadowFilterEvsm.
+    uint gShadowFilter;
+    // The main light samples the virtual shadow map instead of the cascades.
+    uint gVirtualShadows;
+    float4x4 gCascadeViewProj[MaxShadowCascades];
+    float4x4 gLightShadowTransforms[MaxShadowedLights];
+    float4 gLightShadowTileBounds[MaxShadowedLights];
+    // Shadow slot + 1 of each light, 0 if it is unshadowed.
+    uint4 gLightShadowSlots[MaxLights / 4];
+    float4x4 gVirtualShadowView;
+    // Per level the page table window origin in pages (xy) and 1 / page world size (z).
+    float4 gVirtualLevels[VirtualShadowLevels];
+    // Pixel footprint per unit distance over the texel size of level 0.
+    float gVirtualLodScale;
+    float gVirtualDepthNear;
+    float gVirtualInvDepthRange;
+    float gVirtualPageSize;
     float gTotalTime;
     float gDeltaTime;
+    float gFramePad0;
+    float gFramePad1;
+    // Scales SkyAmbient.
     float4 gAmbientLight;
+    // Sky irradiance over pi as L2 spherical harmonics, one rgb coefficient per entry.
+    float4 gAmbientSH[9];
 
-    // Indices [0, NUM_DIR_LIGHTS) are directional lights;
-    // indices [NUM_DIR_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHTS) are point lights;
-    // indices [NUM_DIR_LIGHTS+NUM_POINT_LIGHTS, NUM_DIR_LIGHTS+NUM_POINT_LIGHT+NUM_SPOT_LIGHTS)
-    // are spot lights for a maximum of MaxLights per object.
+    // Directional lights only, the first NUM_DIR_LIGHTS of them used; point and
+    // spot lights are in gClusterLights.
     Light gLights[MaxLights];
+    // The froxel slice of a view depth is log2(viewZ) * gClusterZScale + gClusterZBias.
+    float gClusterZScale;
+    float gClusterZBias;
+    uint gClusterLightCount;
+    uint gClusterPad0;
 };
 
+//---------------------------------------------------------------------------------------
+// Light the sky reflects off a white Lambertian surface facing unitNormalW.
+//---------------------------------------------------------------------------------------
+float3 SkyAmbient(float3 unitNormalW)
+{
+    float3 n = unitNormalW;
+    float3 sh = gAmbientSH[0].rgb * 0.282095f
+        + gAmbientSH[1].rgb * (0.488603f * n.y)
+        + gAmbientSH[2].rgb * (0.488603f * n.z)
+        + gAmbientSH[3].rgb * (0.488603f * n.x)
+        + gAmbientSH[4].rgb * (1.092548f * n.x * n.y)
+        + gAmbientSH[5].rgb * (1.092548f * n.y * n.z)
+        + gAmbientSH[6].rgb * (0.315392f * (3.0f * n.z * n.z - 1.0f))
+        + gAmbientSH[7].rgb * (1.092548f * n.x * n.z)
+        + gAmbientSH[8].rgb * (0.546274f * (n.x * n.x - n.y * n.y));
+    return max(sh, 0.0f);
+}
+
+//---------------------------------------------------------------------------------------
+// Sky seen along r, from a smaller mip the rougher the surface.
+//---------------------------------------------------------------------------------------
+float3 SkyReflection(float3 r, float roughness)
+{
+    uint width, height, mipCount;
+    gCubeMap.GetDimensions(0, width, height, mipCount);
+    return gCubeMap.SampleLevel(gsamLinearWrap, r, roughness * (mipCount - 1)).rgb;
+}
+
 //---------------------------------------------------------------------------------------
 // Transforms a normal map sample to world space.
 //---------------------------------------------------------------------------------------
@@ -132,6 +236,14 @@ float3 NormalSampleToWorldSpace(float3 normalMapSample, float3 unitNormalW, floa
 //---------------------------------------------------------------------------------------
 //#define SMAP_SIZE = (2048.0f)
 //#define SMAP_DX = (1.0f / SMAP_SIZE)
+
+// Keeps a PCF tap inside the atlas tile of a cascade, so filtering near the
+// tile edge never reads a neighbouring cascade.
+float2 ClampToShadowTile(uint index, float2 uv)
+{
+    return clamp(uv, gShadowTileBounds[index].xy, gShadowTileBounds[index].zw);
+}
+
 float CalcShadowFactor(float4 shadowPosH)
 {
     // Complete projection by doing division by w.
@@ -141,7 +253,7 @@ float CalcShadowFactor(float4 shadowPosH)
     float depth = shadowPosH.z;
 
     uint width, height, numMips;
-    gShadowMap[0].GetDimensions(0, width, height, numMips);
+    gShadowMap.GetDimensions(0, width, height, numMips);
 
     // Texel size.
     float dx = 1.0f / (float)width;
@@ -157,8 +269,8 @@ float CalcShadowFactor(float4 shadowPosH)
     [unroll]
     for(int i = 0; i < 9; ++i)
     {
-        percentLit += gShadowMap[0].SampleCmpLevelZero(gsamShadow,
-            shadowPosH.xy + offsets[i], depth).r;
+        percentLit += gShadowMap.SampleCmpLevelZero(gsamShadow,
+            ClampToShadowTile(0, shadowPosH.xy + offsets[i]), depth).r;
     }
     
     return percentLit / 9.0f;
@@ -191,7 +303,7 @@ float CalcCascadeShadowFactor3X3(uint index, float4 shadowPosH)
     float depth = shadowPosH.z;
 
     uint width, height, numMips;
-    gShadowMap[index].GetDimensions(0, width, height, numMips);
+    gShadowMap.GetDimensions(0, width, height, numMips);
 
     // Texel size.
     float dx = 1.0f / (float) width;
@@ -206,8 +318,8 @@ float CalcCascadeShadowFactor3X3(uint index, float4 shadowPosH)
     [unroll]
     for (int i = 0; i < 9; ++i)
     {
-        percentLit += gShadowMap[index].SampleCmpLevelZero(gsamShadow,
-            shadowPosH.xy + offsets[i], depth).r;
+        percentLit += gShadowMap.SampleCmpLevelZero(gsamShadow,
+            ClampToShadowTile(index, shadowPosH.xy + offsets[i]), depth).r;
     }
     return percentLit / 9.0f;
 }
@@ -221,7 +333,7 @@ float CalcCascadeShadowFactor5X5(uint index, float4 shadowPosH)
     float depth = shadowPosH.z;
 
     uint width, height, numMips;
-    gShadowMap[index].GetDimensions(0, width, height, numMips);
+    gShadowMap.GetDimensions(0, width, height, numMips);
 
     // Texel size.
     float dx = 1.0f / (float)width;
@@ -253,8 +365,8 @@ float CalcCascadeShadowFactor5X5(uint index, float4 shadowPosH)
     [unroll]
     for (int i = 0; i < 25; ++i)
     {
-        percentLit += gShadowMap[index].SampleCmpLevelZero(gsamShadow,
-            shadowPosH.xy + offsets_25[i], depth).r;
+        percentLit += gShadowMap.SampleCmpLevelZero(gsamShadow,
+            ClampToShadowTile(index, shadowPosH.xy + offsets_25[i]), depth).r;
     }
     return percentLit / 25.0f;
 
@@ -269,7 +381,7 @@ float CalcCascadeShadowFactorWithPoisson(uint index, float4 shadowPosH)
     float depth = shadowPosH.z;
 
     uint width, height, numMips;
-    gShadowMap[index].GetDimensions(0, width, height, numMips);
+    gShadowMap.GetDimensions(0, width, height, numMips);
 
     // Texel size.
     float dx = 1.0f / (float) width;
@@ -309,9 +421,229 @@ float CalcCascadeShadowFactorWithPoisson(uint index, float4 shadowPosH)
     {
         float2 p = mul(poissonDisk[i], rotation_matrix);
         float2 offset = float2(p * search_radius);
-        percentLit += gShadowMap[index].SampleCmpLevelZero(gsamShadow,
-            shadowPosH.xy + offset, depth).r;
+        percentLit += gShadowMap.SampleCmpLevelZero(gsamShadow,
+            ClampToShadowTile(index, shadowPosH.xy + offset), depth).r;
     }
     return percentLit / N_SAMPLE;
 
+}
+
+//---------------------------------------------------------------------------------------
+// Upper bound on the fraction of light reaching depth t, from the mean and mean square
+// of the occluder depths (Chebyshev).  The tail below lightBleedReduction is cut off
+// to hide the light bleeding where occluders overlap.
+//---------------------------------------------------------------------------------------
+float ChebyshevUpperBound(float2 moments, float t, float minVariance)
+{
+    const float lightBleedReduction = 0.3f;
+
+    float variance = max(moments.y - moments.x * moments.x, minVariance);
+    float d = t - moments.x;
+    float pMax = variance / (variance + d * d);
+    pMax = saturate((pMax - lightBleedReduction) / (1.0f - lightBleedReduction));
+
+    return t <= moments.x ? 1.0f : pMax;
+}
+
+float CalcCascadeShadowFactorEvsm(uint index, float4 shadowPosH)
+{
+    // Complete projection by doing division by w.
+    shadowPosH.xyz /= shadowPosH.w;
+
+    uint width, height, numMips;
+    gEvsmMap.GetDimensions(0, width, height, numMips);
+
+    // The tile bounds are inset half an atlas texel, a quarter of a moments texel;
+    // inset another quarter so the bilinear footprint stays inside the tile.
+    float4 bounds = gShadowTileBounds[index];
+    float inset = 0.25f / (float)width;
+    float2 uv = clamp(shadowPosH.xy, bounds.xy + inset, bounds.zw - inset);
+
+    float4 moments = gEvsmMap.SampleLevel(gsamLinearClamp, uv, 0.0f);
+
+    float depth = 2.0f * shadowPosH.z - 1.0f;
+    float2 warpedDepth = float2(exp(EvsmPositiveExponent * depth), -exp(-EvsmNegativeExponent * depth));
+
+    // The warp stretches depth unevenly, so scale the variance floor with its slope.
+    float2 depthScale = 0.0001f * float2(EvsmPositiveExponent, EvsmNegativeExponent) * warpedDepth;
+    float2 minVariance = depthScale * depthScale;
+
+    float posLit = ChebyshevUpperBound(moments.xy, warpedDepth.x, minVariance.x);
+    float negLit = ChebyshevUpperBound(moments.zw, warpedDepth.y, minVariance.y);
+    return min(posLit, negLit);
+}
+
+float CalcCascadeShadowFactor(uint index, float4 shadowPosH)
+{
+    // Specialized variants fix the filter at compile time, see ShaderPermutations.
+#ifdef SHADOW_FILTER
+    if (SHADOW_FILTER == ShadowFilterEvsm)
+#else
+    if (gShadowFilter == ShadowFilterEvsm)
+#endif
+        return CalcCascadeShadowFactorEvsm(index, shadowPosH);
+
+    return CalcCascadeShadowFactorWithPoisson(index, shadowPosH);
+}
+
+//---------------------------------------------------------------------------------------
+// Shadow factor of a spot light from its tile of the atlas, 3x3 PCF.  Lights the
+// ShadowScheduler gave no slot this frame are unshadowed.
+//---------------------------------------------------------------------------------------
+float CalcLightShadowFactor(uint lightIndex, float3 posW)
+{
+    uint slot = gLightShadowSlots[lightIndex / 4][lightIndex % 4];
+    if (slot == 0)
+        return 1.0f;
+    slot -= 1;
+
+    float4 shadowPosH = mul(float4(posW, 1.0f), gLightShadowTransforms[slot]);
+
+    // Behind the light or outside its frustum the spot cone is dark anyway.
+    if (shadowPosH.w <= 0.0f)
+        return 1.0f;
+    shadowPosH.xyz /= shadowPosH.w;
+
+    float4 bounds = gLightShadowTileBounds[slot];
+    if (any(shadowPosH.xy < bounds.xy) || any(shadowPosH.xy > bounds.zw) || shadowPosH.z > 1.0f)
+        return 1.0f;
+
+    uint width, height, numMips;
+    gShadowMap.GetDimensions(0, width, height, numMips);
+    float dx = 1.0f / (float)width;
+
+    float percentLit = 0.0f;
+    [unroll]
+    for (int y = -1; y <= 1; ++y)
+    {
+        [unroll]
+        for (int x = -1; x <= 1; ++x)
+        {
+            float2 uv = clamp(shadowPosH.xy + float2(x, y) * dx, bounds.xy, bounds.zw);
+            percentLit += gShadowMap.SampleCmpLevelZero(gsamShadow, uv, shadowPosH.z).r;
+        }
+    }
+    return percentLit / 9.0f;
+}
+
+//---------------------------------------------------------------------------------------
+// Froxel of the pixel at posH (SV_POSITION) with view depth viewZ; mirrors
+// ClusteredLights::ClusterIndex.
+//---------------------------------------------------------------------------------------
+uint ClusterIndex(float2 posH, float viewZ)
+{
+    uint x = min((uint)(posH.x * gInvRenderTargetSize.x * ClusterCountX), ClusterCountX - 1);
+    uint y = min((uint)(posH.y * gInvRenderTargetSize.y * ClusterCountY), ClusterCountY - 1);
+    uint z = (uint)clamp(log2(viewZ) * gClusterZScale + gClusterZBias, 0.0f, ClusterCountZ - 1.0f);
+    return (z * ClusterCountY + y) * ClusterCountX + x;
+}
+
+//---------------------------------------------------------------------------------------
+// Point and spot lights of the pixel's froxel.  The first clustered lights are the
+// spot lights ShadowScheduler knows as ShadowedLightBase + i; the rest are unshadowed.
+//---------------------------------------------------------------------------------------
+float3 ClusteredLighting(Material mat, float3 normal, float3 v, float3 posW, float2 posH)
+{
+    float viewZ = mul(float4(posW, 1.0f), gView).z;
+    uint2 cluster = gClusters[ClusterIndex(posH, viewZ)];
+
+    float3 result = 0.0f;
+    for (uint i = 0; i < cluster.y; ++i)
+    {
+        uint lightIndex = gClusterLightIndices[cluster.x + i];
+        uint shadowIndex = ShadowedLightBase + lightIndex;
+        float shadowFactor = shadowIndex < MaxLights ? CalcLightShadowFactor(shadowIndex, posW) : 1.0f;
+        result += shadowFactor * PBRPunctualLight(gClusterLights[lightIndex], mat, normal, v, posW);
+    }
+    return result;
+}
+
+//---------------------------------------------------------------------------------------
+// Shadow factor of the main light from the virtual shadow map.  Starts at the level
+// the marking pass requested for posW and falls back to coarser levels while its
+// page is unmapped or waits to be rendered.  3x3 PCF kept inside the page.
+//---------------------------------------------------------------------------------------
+float CalcVirtualShadowFactor(float3 posW)
+{
+    float3 posL = mul(float4(posW, 1.0f), gVirtualShadowView).xyz;
+    float depth = (posL.z - gVirtualDepthNear) * gVirtualInvDepthRange;
+
+    uint width, height, numMips;
+    gShadowMap.GetDimensions(0, width, height, numMips);
+    float2 invAtlasSize = 1.0f / float2(width, height);
+
+    // Same level choice as VirtualShadowMark.hlsl.
+    float footprint = length(gEyePosW - posW) * gVirtualLodScale;
+    uint level = footprint <= 1.0f ? 0 : min((uint)ceil(log2(footprint)), VirtualShadowLevels - 1);
+    for (; level < VirtualShadowLevels; ++level)
+    {
+        float2 pageCoord = float2(posL.x, -posL.y) * gVirtualLevels[level].z - gVirtualLevels[level].xy;
+        if (any(pageCoord < 0.0f) || any(pageCoord >= VirtualShadowPagesPerLevel))
+            continue;
+
+        uint2 page = (uint2)pageCoord;
+        uint entry = gVirtualPageTable[(level * VirtualShadowPagesPerLevel + page.y) * VirtualShadowPagesPerLevel + page.x];
+        if ((entry & VirtualPageValid) == 0)
+            continue;
+
+        // Half a texel in from the page edges, so the outer taps do not reach the next page.
+        float2 pageMin = float2(entry & 0x7fff, (entry >> 15) & 0xffff) * gVirtualPageSize;
+        float2 minUv = (pageMin + 0.5f) * invAtlasSize;
+        float2 maxUv = (pageMin + gVirtualPageSize - 0.5f) * invAtlasSize;
+        float2 uv = (pageMin + frac(pageCoord) * gVirtualPageSize) * invAtlasSize;
+
+        float percentLit = 0.0f;
+        [unroll]
+        for (int y = -1; y <= 1; ++y)
+        {
+            [unroll]
+            for (int x = -1; x <= 1; ++x)
+            {
+                float2 tapUv = clamp(uv + float2(x, y) * invAtlasSize, minUv, maxUv);
+                percentLit += gShadowMap.SampleCmpLevelZero(gsamShadow, tapUv, depth).r;
+            }
+        }
+        return percentLit / 9.0f;
+    }
+
+    // Past the coarsest window, or no page rendered yet.
+    return 1.0f;
+}
+
+//---------------------------------------------------------------------------------------
+// Picks the cascade covering posW from gCascadeSplits, and blends it with the next
+// cascade within gCascadeBlendBand of the split so the seam does not show.
+//---------------------------------------------------------------------------------------
+float CalcCascadedShadowFactor(float3 posW)
+{
+    float distance = length(gEyePosW - posW);
+    for (uint j = 0; j < gCascadeCount; j++)
+    {
+        float split = gCascadeSplits[j];
+        if (distance >= split)
+            continue;
+
+        float4 shadowPosH = mul(float4(posW, 1.0f), gShadowTransforms[j]);
+        float shadowFactor = CalcCascadeShadowFactor(j, shadowPosH);
+        if (j + 1 < gCascadeCount && split - distance < gCascadeBlendBand)
+        {
+            float4 shadowPosHNextLevel = mul(float4(posW, 1.0f), gShadowTransforms[j + 1]);
+            float shadowFactorNextLevel = CalcCascadeShadowFactor(j + 1, shadowPosHNextLevel);
+            shadowFactor = 0.5f * (shadowFactor + shadowFactorNextLevel);
+        }
+        return shadowFactor;
+    }
+
+    // Past the last cascade nothing is shadowed.
+    return 1.0f;
+}
+
+// Shadow factor of the main light, from whichever of the cascades or the virtual
+// shadow map is in use.
+float CalcMainLightShadowFactor(float3 posW)
+{
+    if (gVirtualShadows != 0)
+        return CalcVirtualShadowFactor(posW);
+
+    return CalcCascadedShadowFactor(posW);
 }
\ No newline at end of file
@@ -2,7 +2,8 @@
 // Default.hlsl by Frank Luna (C) 2015 All Rights Reserved.
 //***************************************************************************************
 
-// Defaults for number of lights.
+// Defaults for number of lights; must match DirLightCount in CRYCHIC.h.  Spot
+// lights come from the clustered light lists.
 #ifndef NUM_DIR_LIGHTS
     #define NUM_DIR_LIGHTS 3
 #endif
@@ -97,11 +98,14 @@ float4 PS(VertexOut pin) : SV_Target
 	// Interpolating normal can unnormalize it, so renormalize it.
     pin.NormalW = normalize(pin.NormalW);
 	
+#if NORMAL_MAP
     float4 normalMapSample = gTextureMaps[normalMapIndex].Sample(gsamAnisotropicWrap, pin.TexC);
 	float3 bumpedNormalW = NormalSampleToWorldSpace(normalMapSample.rgb, pin.NormalW, pin.TangentW);
-
-	// Uncomment to turn off normal mapping.
-    //bumpedNormalW = pin.NormalW;
+#else
+    // What the flat default normal map holds.
+    float4 normalMapSample = float4(0.5f, 0.5f, 1.0f, 1.0f);
+    float3 bumpedNormalW = pin.NormalW;
+#endif
 
     // Vector from point being lit to eye. 
     float3 toEyeW = normalize(gEyePosW - pin.PosW);
@@ -111,42 +115,16 @@ float4 PS(VertexOut pin) : SV_Target
     float ambientAccess = gSsaoMap[0].Sample(gsamLinearClamp, pin.SsaoPosH.xy, 0.0f).r;
 
     // Light terms.
-    float4 ambient = ambientAccess*gAmbientLight*diffuseAlbedo;
+    float4 ambient = ambientAccess*gAmbientLight*float4(SkyAmbient(bumpedNormalW), 1.0f)*diffuseAlbedo;
 
-    // Only the first light casts a shadow.
+    // The first light casts cascaded shadows; ClusteredLighting shadows the spot lights.
     float3 shadowFactors[MaxLights];// = float3(1.0f, 1.0f, 1.0f);
     for (int i = 0; i < MaxLights; i++)
     {
         shadowFactors[i] = 1.0f;
     }
 
-    //int i = 0;
-    float radius[4]={30.0f, 50.0f, 80.0f,100.0f};
-    int j = 0;
-    for (j = 0; j < 4; j++)
-    {
-        float distance = length(gEyePosW - pin.PosW);
-        float shadowFactor, shadowFactorNextLevel;
-       float4 shadowPosH, shadowPosHNextLevel;
-       if(j < 3 && distance < radius[j] && abs(distance - radius[j]) < 10.0f)
-       {
-            
-            shadowPosH = mul(float4(pin.PosW, 1.0f), gShadowTransforms[j]);
-            shadowPosHNextLevel = mul(float4(pin.PosW, 1.0f), gShadowTransforms[j + 1]);
-
-            shadowFactor = CalcCascadeShadowFactorWithPoisson(j, shadowPosH);
-            shadowFactorNextLevel = CalcCascadeShadowFactorWithPoisson(j + 1, shadowPosHNextLevel);
-            shadowFactors[0] = 0.5 * (shadowFactor + shadowFactorNextLevel);
-            break;
-       }    
-       else if(distance < radius[j])
-       {
-            shadowPosH = mul(float4(pin.PosW, 1.0f), gShadowTransforms[j]);
-            shadowFactor = CalcCascadeShadowFactorWithPoisson(j, shadowPosH);
-            shadowFactors[0] = shadowFactor;
-            break;   
-       }
-    }
+    shadowFactors[0] = CalcMainLightShadowFactor(pin.PosW);
     //shadowFactors[0] = CalcShadowFactor(pin.ShadowPosH);
     
     // Area DEBUG
@@ -163,6 +141,7 @@ float4 PS(VertexOut pin) : SV_Target
     //float4 directLight = ComputeLighting(gLights, mat, pin.PosW, bumpedNormalW, toEyeW, shadowFactors);
     // PBRShading
     float4 directLight = PBRShading(gLights, mat, bumpedNormalW, toEyeW, pin.PosW, shadowFactors);
+    directLight.rgb += ClusteredLighting(mat, bumpedNormalW, toEyeW, pin.PosW, pin.PosH.xy);
 
     directLight /= (directLight + 1.0f);
     directLight = pow(directLight, 1.0f / 2.2f);
@@ -174,9 +153,9 @@ float4 PS(VertexOut pin) : SV_Target
     //return litColor;
 	// Add in specular reflections.
     float3 r = reflect(-toEyeW, bumpedNormalW);
-    float4 reflectionColor = gCubeMap.Sample(gsamLinearWrap, r);
+    float3 reflectionColor = SkyReflection(r, roughness);
     float3 fresnelFactor = SchlickFresnel(fresnelR0, bumpedNormalW, r);
-    litColor.rgb += shininess * fresnelFactor * reflectionColor.rgb;
+    litColor.rgb += shininess * fresnelFactor * reflectionColor;
 	
     // Common convention to take alpha from diffuse albedo.
     litColor.a = diffuseAlbedo.a;
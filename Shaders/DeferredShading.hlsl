@@ -1,8 +1,19 @@
+// Same lights as Default.hlsl, so light indices match the forward path.
+#ifndef NUM_DIR_LIGHTS
+	#define NUM_DIR_LIGHTS 3
+#endif
+#define NUM_POINT_LIGHTS 0
+#define NUM_SPOT_LIGHTS 0
+
 #include "Common.hlsl"
 
-struct VertexIn
+// One triangle covering the screen; the stencil the geometry pass wrote keeps
+// the lighting to pixels it covered.
+static const float2 gTexCoords[3] =
 {
-	float3 PosL : POSITION;
+	float2(0.0f, 0.0f),
+	float2(2.0f, 0.0f),
+	float2(0.0f, 2.0f)
 };
 
 struct VertexOut
@@ -10,24 +21,23 @@ struct VertexOut
 	float4 PosH : SV_POSITION;
 };
 
-VertexOut VS(VertexIn vin, uint instanceID : SV_InstanceID)
+VertexOut VS(uint vid : SV_VertexID)
 {
 	VertexOut vout;
-	InstanceData instanceData = gInstanceData[instanceID];
-	float4x4 gWorld = instanceData.World;
-	float4 posW = mul(float4(vin.PosL, 1.0f), gWorld);
-	vout.PosH = mul(posW, gViewProj);
+	float2 texC = gTexCoords[vid];
+	vout.PosH = float4(2.0f * texC.x - 1.0f, 1.0f - 2.0f * texC.y, 0.0f, 1.0f);
 	return vout;
 }
 
 float4 PS(VertexOut pin) : SV_Target
 {
+	// One texel per pixel, so load rather than filter.
+	int3 texel = int3(pin.PosH.xy, 0);
 	float2 screenUV = pin.PosH.xy * gInvRenderTargetSize;
-	float4 gBuffer0 = gBuffer[0].Sample(gsamAnisotropicWrap, screenUV);
-	float4 gBuffer1 = gBuffer[1].Sample(gsamAnisotropicWrap, screenUV);
-	float4 gBuffer2 = gBuffer[2].Sample(gsamAnisotropicWrap, screenUV);
-	float4 gBuffer3 = gBuffer[3].Sample(gsamAnisotropicWrap, screenUV);
-	GBufferDesc gBufferDesc = DecodeGBuffer(gBuffer0, gBuffer1, gBuffer2, gBuffer3);
+	float depth = gSsaoMap[3].Load(texel).r;
+	float4 gBuffer0 = gBuffer[0].Load(texel);
+	float4 gBuffer1 = gBuffer[1].Load(texel);
+	GBufferDesc gBufferDesc = DecodeGBuffer(gBuffer0, gBuffer1, DepthToPositionW(screenUV, depth, gInvViewProj));
 	float3 posW = gBufferDesc.pos;
 	float3 view = normalize(gEyePosW - posW);
 	float metalness = gBufferDesc.metalness;
@@ -41,7 +51,7 @@ float4 PS(VertexOut pin) : SV_Target
 	ssaoPosH /= ssaoPosH.w;
 	float ambientAccess = gSsaoMap[0].Sample(gsamLinearClamp, ssaoPosH.xy, 0.0f).r;
 
-	float4 ambient = ambientAccess * gAmbientLight * diffuseAlbedo;
+	float4 ambient = ambientAccess * gAmbientLight * float4(SkyAmbient(normalW.xyz), 1.0f) * diffuseAlbedo;
 
 	float3 shadowFactors[MaxLights];
 	[unroll]
@@ -50,30 +60,7 @@ float4 PS(VertexOut pin) : SV_Target
 		shadowFactors[i] = 1.0f;
 	}
 
-	float radius[4] = { 30.0f, 50.0f, 80.0f, 100.0f };
-	int j = 0;
-	for (j = 0; j < 4; j++)
-	{
-		float distance = length(gEyePosW - posW);
-		float shadowFactor, shadowFactorNextLevel;
-		float4 shadowPosH, shadowPosHNextLevel;
-		if (j < 3 && distance < radius[j] && abs(distance - radius[j] < 5.0f))
-		{
-			shadowPosH = mul(float4(posW, 1.0f), gShadowTransforms[j]);
-			shadowPosHNextLevel = mul(float4(posW, 1.0f), gShadowTransforms[j + 1]);
-			shadowFactor = CalcCascadeShadowFactorWithPoisson(j, shadowPosH);
-			shadowFactorNextLevel = CalcCascadeShadowFactorWithPoisson(j + 1, shadowPosHNextLevel);
-			shadowFactors[0] = 0.5f * (shadowFactor + shadowFactorNextLevel);
-			break;
-		}
-		else if(distance < radius[j])
-		{
-			shadowPosH = mul(float4(posW, 1.0f), gShadowTransforms[j]);
-			shadowFactor = CalcCascadeShadowFactorWithPoisson(j, shadowPosH);
-			shadowFactors[0] = shadowFactor;
-			break;
-		}
-	}
+	shadowFactors[0] = CalcMainLightShadowFactor(posW);
 
 	 // Area DEBUG
     //if(j == 0)return float4(1.0f, 0.0f, 0.0f, 1.0f);
@@ -86,15 +73,16 @@ float4 PS(VertexOut pin) : SV_Target
 
 	// PBR
 	float4 directLight = PBRShading(gLights, mat, normalW.xyz, view, posW, shadowFactors);
+	directLight.rgb += ClusteredLighting(mat, normalW.xyz, view, posW, pin.PosH.xy);
 	directLight /= (directLight + 1.0f);
 	directLight = pow(directLight, 1.0f / 2.2f);
 
 	float4 litColor = directLight + ambient;
 	//return litColor;
 	float3 r = reflect(-view, normalW.xyz);
-	float4 reflectionColor = gCubeMap.Sample(gsamLinearWrap, r);
+	float3 reflectionColor = SkyReflection(r, roughness);
 	float3 fresnelFactor = SchlickFresnel(fresnelR0, normalW.xyz, r);
-	litColor.rgb += shininess * fresnelFactor * reflectionColor.xyz;
+	litColor.rgb += shininess * fresnelFactor * reflectionColor;
 
 	litColor.a = diffuseAlbedo.a;
 	return litColor;
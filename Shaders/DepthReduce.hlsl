@@ -0,0 +1,101 @@
+//=============================================================================
+// DepthReduce.hlsl
+//
+// Reduces the depth buffer to the depth range of the visible samples and the
+// light space box of the samples in each cascade, so the cascades can be
+// fitted to what is on screen.  SampleDistribution::ReduceOnCpu mirrors it.
+//=============================================================================
+
+#define MaxShadowCascades 4
+#define BoundsCount (2 + 6 * MaxShadowCascades)
+// FLT_MAX, as DepthBounds::EmptyBound and the reset buffer on the CPU.
+#define EmptyBound 3.402823466e+38f
+
+cbuffer cbDepthReduce : register(b0)
+{
+    float4x4 gInvProj;
+    float4x4 gViewToLight;
+    // Eye distance at which each cascade ends.
+    float4 gCascadeSplits;
+    uint gCascadeCount;
+    float gCascadeBlendBand;
+    uint2 gDepthMapSize;
+};
+
+Texture2D gDepthMap : register(t0);
+
+// [0] min view depth, [1] max eye distance, then per cascade the min and max
+// xyz in light space, all as order preserving uints so atomics can compare them.
+RWStructuredBuffer<uint> gBounds : register(u0);
+
+groupshared uint gGroupBounds[BoundsCount];
+
+uint FloatToOrderedUint(float f)
+{
+    uint u = asuint(f);
+    return (u & 0x80000000) ? ~u : (u | 0x80000000);
+}
+
+bool IsMaxBound(uint index)
+{
+    return index == 1 || (index >= 2 && (index - 2) % 6 >= 3);
+}
+
+void GrowCascadeBox(uint cascade, float3 posL)
+{
+    uint box = 2 + 6 * cascade;
+    InterlockedMin(gGroupBounds[box + 0], FloatToOrderedUint(posL.x));
+    InterlockedMin(gGroupBounds[box + 1], FloatToOrderedUint(posL.y));
+    InterlockedMin(gGroupBounds[box + 2], FloatToOrderedUint(posL.z));
+    InterlockedMax(gGroupBounds[box + 3], FloatToOrderedUint(posL.x));
+    InterlockedMax(gGroupBounds[box + 4], FloatToOrderedUint(posL.y));
+    InterlockedMax(gGroupBounds[box + 5], FloatToOrderedUint(posL.z));
+}
+
+[numthreads(16, 16, 1)]
+void CS(uint3 dispatchThreadID : SV_DispatchThreadID, uint groupIndex : SV_GroupIndex)
+{
+    // Mins start at the largest value and maxes at the smallest.
+    if (groupIndex < BoundsCount)
+        gGroupBounds[groupIndex] = FloatToOrderedUint(IsMaxBound(groupIndex) ? -EmptyBound : EmptyBound);
+    GroupMemoryBarrierWithGroupSync();
+
+    float depth = 1.0f;
+    if (all(dispatchThreadID.xy < gDepthMapSize))
+        depth = gDepthMap.Load(int3(dispatchThreadID.xy, 0)).r;
+
+    // Far plane means nothing was drawn there.
+    if (depth < 1.0f)
+    {
+        float2 uv = (dispatchThreadID.xy + 0.5f) / gDepthMapSize;
+        float4 posV = mul(float4(2.0f * uv.x - 1.0f, 1.0f - 2.0f * uv.y, depth, 1.0f), gInvProj);
+        posV /= posV.w;
+
+        float distance = length(posV.xyz);
+        InterlockedMin(gGroupBounds[0], FloatToOrderedUint(posV.z));
+        InterlockedMax(gGroupBounds[1], FloatToOrderedUint(distance));
+
+        // Same cascade choice as CalcCascadedShadowFactor, including the blend band.
+        uint cascade = 0;
+        while (cascade < gCascadeCount && distance >= gCascadeSplits[cascade])
+            cascade++;
+
+        if (cascade < gCascadeCount)
+        {
+            float3 posL = mul(posV, gViewToLight).xyz;
+            GrowCascadeBox(cascade, posL);
+            if (cascade + 1 < gCascadeCount && gCascadeSplits[cascade] - distance < gCascadeBlendBand)
+                GrowCascadeBox(cascade + 1, posL);
+        }
+    }
+    GroupMemoryBarrierWithGroupSync();
+
+    // One global atomic per bound and group.
+    if (groupIndex < BoundsCount)
+    {
+        if (IsMaxBound(groupIndex))
+            InterlockedMax(gBounds[groupIndex], gGroupBounds[groupIndex]);
+        else
+            InterlockedMin(gBounds[groupIndex], gGroupBounds[groupIndex]);
+    }
+}
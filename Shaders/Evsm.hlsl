@@ -0,0 +1,77 @@
+//=============================================================================
+// Prefilters the shadow atlas into exponential variance moments.  ConvertPS
+// warps the atlas depths at half resolution, averaging each 2x2 block, and
+// BlurPS blurs the moments one axis at a time (HORIZONTAL_BLUR picks the axis).
+// Each draw covers one tile, and the blur clamps its taps to the tile so
+// neighbouring cascades never bleed into each other.
+//=============================================================================
+
+// Warp exponents; must match Common.hlsl.  exp(5.54)^2 is the largest a 16 bit
+// float moment can hold.
+#define EvsmPositiveExponent 5.0f
+#define EvsmNegativeExponent 5.0f
+
+cbuffer cbTile : register(b0)
+{
+    // Inclusive texel rectangle of the tile in the moments map.
+    uint2 gTileMin;
+    uint2 gTileMax;
+};
+
+Texture2D gInputMap : register(t0);
+
+// Triangle covering the whole viewport.
+static const float2 gTexCoords[3] =
+{
+    float2(0.0f, 0.0f),
+    float2(2.0f, 0.0f),
+    float2(0.0f, 2.0f)
+};
+
+static const float gBlurWeights[5] = { 0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f };
+
+float4 VS(uint vid : SV_VertexID) : SV_POSITION
+{
+    float2 texC = gTexCoords[vid];
+    return float4(2.0f * texC.x - 1.0f, 1.0f - 2.0f * texC.y, 0.0f, 1.0f);
+}
+
+float4 WarpDepth(float depth)
+{
+    // Warp from [-1,1] so both exponentials keep precision across the range.
+    depth = 2.0f * depth - 1.0f;
+    float pos = exp(EvsmPositiveExponent * depth);
+    float neg = -exp(-EvsmNegativeExponent * depth);
+    return float4(pos, pos * pos, neg, neg * neg);
+}
+
+float4 ConvertPS(float4 posH : SV_POSITION) : SV_Target
+{
+    int2 texel = int2(posH.xy) * 2;
+
+    float4 moments = WarpDepth(gInputMap.Load(int3(texel, 0)).r);
+    moments += WarpDepth(gInputMap.Load(int3(texel + int2(1, 0), 0)).r);
+    moments += WarpDepth(gInputMap.Load(int3(texel + int2(0, 1), 0)).r);
+    moments += WarpDepth(gInputMap.Load(int3(texel + int2(1, 1), 0)).r);
+    return 0.25f * moments;
+}
+
+float4 BlurPS(float4 posH : SV_POSITION) : SV_Target
+{
+#ifdef HORIZONTAL_BLUR
+    int2 step = int2(1, 0);
+#else
+    int2 step = int2(0, 1);
+#endif
+
+    int2 texel = int2(posH.xy);
+
+    float4 moments = 0.0f;
+    [unroll]
+    for (int i = -2; i <= 2; ++i)
+    {
+        int2 tap = clamp(texel + i * step, int2(gTileMin), int2(gTileMax));
+        moments += gBlurWeights[i + 2] * gInputMap.Load(int3(tap, 0));
+    }
+    return moments;
+}
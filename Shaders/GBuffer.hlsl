@@ -1,9 +1,13 @@
+// Two targets, 8 bytes per pixel; the position comes from the depth buffer.
+// DeferredShading::EncodeGBuffer and DecodeGBuffer are the CPU reference.
+#include "Octahedral.hlsl"
+
 struct GBuffer
 {
+	// Albedo (rgb) and metalness (a), R8G8B8A8_UNORM.
 	float4 GBuffer0 : SV_Target0;
+	// Octahedral normal (rg) and roughness (b), R10G10B10A2_UNORM.
 	float4 GBuffer1 : SV_Target1;
-	float4 GBuffer2 : SV_Target2;
-	float4 GBuffer3 : SV_Target3;
 };
 
 struct GBufferDesc
@@ -19,25 +23,31 @@ struct GBufferDesc
 //---------------------------------------------------------------------------------------
 // Transfer PBR information to GBuffer
 //---------------------------------------------------------------------------------------
-GBuffer EncodePBRToGBuffer(float3 pos, float metalness, float3 albedo, float roughness,
-						   float3 normal)
+GBuffer EncodePBRToGBuffer(float metalness, float3 albedo, float roughness, float3 normal)
 {
 	GBuffer gout;
-	gout.GBuffer0 = float4(pos, metalness);
-	gout.GBuffer1 = float4(albedo, roughness);
-	gout.GBuffer2 = float4(normal, 1.0f);
-	gout.GBuffer3 = 0.0f;
+	gout.GBuffer0 = float4(albedo, metalness);
+	gout.GBuffer1 = float4(OctEncode(normal) * 0.5f + 0.5f, roughness, 0.0f);
 	return gout;
 }
 
-GBufferDesc DecodeGBuffer(float4 gBuffer0, float4 gBuffer1, float4 gBuffer2,
-						  float4 gBuffer3)
+//---------------------------------------------------------------------------------------
+// World position of the depth buffer value at screenUV.
+//---------------------------------------------------------------------------------------
+float3 DepthToPositionW(float2 screenUV, float depth, float4x4 invViewProj)
+{
+	float4 posW = mul(float4(2.0f * screenUV.x - 1.0f, 1.0f - 2.0f * screenUV.y, depth, 1.0f), invViewProj);
+	return posW.xyz / posW.w;
+}
+
+GBufferDesc DecodeGBuffer(float4 gBuffer0, float4 gBuffer1, float3 pos)
 {
 	GBufferDesc desc;
-	desc.pos = gBuffer0.xyz;
+	desc.pos = pos;
 	desc.metalness = gBuffer0.w;
-	desc.albedo = gBuffer1.xyz;
-	desc.roughness = gBuffer1.w;
-	desc.normal = normalize(gBuffer2.xyz);
+	desc.albedo = gBuffer0.xyz;
+	desc.ao = 1.0f;
+	desc.normal = OctDecode(gBuffer1.xy * 2.0f - 1.0f);
+	desc.roughness = gBuffer1.z;
 	return desc;
-}
\ No newline at end of file
+}
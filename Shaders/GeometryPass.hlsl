@@ -57,10 +57,14 @@ GBuffer PS(VertexOut pin)
 #endif
 	pin.NormalW = normalize(pin.NormalW);
 
+#if NORMAL_MAP
 	float4 normalMapSample = gTextureMaps[normalMapIndex].Sample(gsamAnisotropicWrap, pin.TexC);
 	float3 bumpedNormalW = NormalSampleToWorldSpace(normalMapSample.rgb, pin.NormalW, pin.TangentW);
+#else
+	float3 bumpedNormalW = pin.NormalW;
+#endif
 
 	//pin.SsaoPosH /= pin.SsaoPosH.w;
 	//float ambientAccess = gSsaoMap[0].Sample(gsamAnisotropicWrap, pin.SsaoPosH.xy, 0.0f).r;
-	return EncodePBRToGBuffer(pin.PosW, metalness, diffuseAlbedo.rgb, roughness, bumpedNormalW);
+	return EncodePBRToGBuffer(metalness, diffuseAlbedo.rgb, roughness, bumpedNormalW);
 }
@@ -0,0 +1,19 @@
+// Octahedral normal encoding shared by the G-buffer and the SSAO passes.
+// DeferredShading::OctEncode and OctDecode are the CPU reference.
+
+//---------------------------------------------------------------------------------------
+// Octahedral mapping of a unit vector to [-1,1]^2.
+//---------------------------------------------------------------------------------------
+float2 OctEncode(float3 n)
+{
+	n /= abs(n.x) + abs(n.y) + abs(n.z);
+	return n.z >= 0.0f ? n.xy : (1.0f - abs(n.yx)) * (n.xy >= 0.0f ? 1.0f : -1.0f);
+}
+
+float3 OctDecode(float2 e)
+{
+	float3 n = float3(e, 1.0f - abs(e.x) - abs(e.y));
+	if (n.z < 0.0f)
+		n.xy = (1.0f - abs(n.yx)) * (n.xy >= 0.0f ? 1.0f : -1.0f);
+	return normalize(n);
+}
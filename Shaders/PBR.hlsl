@@ -87,6 +87,26 @@ PBRDesc GetPBRDesc(Material mat, float3 normal, float3 view, float3 lightDir, fl
 	return pbrDesc;
 }
 
+//---------------------------------------------------------------------------------------
+// A spot light, or a point light when its SpotPower is 0.
+//---------------------------------------------------------------------------------------
+float3 PBRPunctualLight(Light light, Material mat, float3 normal, float3 v, float3 pos)
+{
+	float3 spotDirection = -light.Direction;
+	float3 l = light.Position - pos;
+	float d = length(l);
+	if (d > light.FalloffEnd)
+		return 0.0f;
+	l /= d;
+	PBRDesc pbrDesc = GetPBRDesc(mat, normal, v, l, pos);
+	float3 brdf = GetBRDF(pbrDesc);
+	float nDotl = pbrDesc.nDotl;
+	float3 lightStrength = light.Strength * nDotl;
+	float att = CalcAttenuation(d, light.FalloffStart, light.FalloffEnd);
+	att *= pow(max(dot(spotDirection, l), 0.001f), light.SpotPower);
+	lightStrength *= att;
+	return brdf * lightStrength;
+}
 
 float4 PBRShading(Light gLights[MaxLights], Material mat, float3 normal, float3 v, float3 pos,
 					float3 shadowFactor[MaxLights])
@@ -105,45 +125,5 @@ float4 PBRShading(Light gLights[MaxLights], Material mat, float3 normal, float3
 		result += pow(shadowFactor[i], 5.0f) * brdf * irradiance;
 	}
 #endif
-	
-#if (NUM_POINT_LIGHTS > 0)
-	for(i = NUM_DIR_LIGHTS; i < NUM_DIR_LIGHTS + NUM_POINT_LIGHTS; ++i)
-	{
-		float3 l = gLights[i].Position - pos;
-		float d = length(l);
-		l /= d;
-		PBRDesc pbrDesc = GetPBRDesc(mat, normal, v, l, pos);
-		float3 brdf = GetBRDF(pbrDesc);
-		float nDotl = pbr.nDotl;
-		float3 lightStrength = gLights[i].Strength * nDotl;
-		float att = CalcAttenuation(d, gLights[i].FalloffStart, gLights[i].FalloffEnd);
-		lightStrength *= att;
-
-		//result += shadowFactor[i] * brdf * lightStrength;
-	}
-#endif
-
-#if (NUM_SPOT_LIGHTS > 0)
-    for(i = NUM_DIR_LIGHTS + NUM_POINT_LIGHTS; i < NUM_DIR_LIGHTS + NUM_POINT_LIGHTS + NUM_SPOT_LIGHTS; ++i)
-	{
-		float3 spotDirection = -gLights[i].Direction;
-		float3 l = gLights[i].Position - pos;
-		float d = length(l);
-		l /= d;
-		if (d > gLights[i].FalloffEnd)
-		{
-			result += 0.0f;
-			continue;
-		}
-		PBRDesc pbrDesc = GetPBRDesc(mat, normal, v, l, pos);
-		float3 brdf = GetBRDF(pbrDesc);
-		float nDotl = pbrDesc.nDotl;
-		float3 lightStrength = gLights[i].Strength * nDotl;
-		float att = CalcAttenuation(d, gLights[i].FalloffStart, gLights[i].FalloffEnd);
-		att *= pow(max(dot(spotDirection, l), 0.001f), gLights[i].SpotPower);
-		lightStrength *= att;
-		//result += shadowFactor[i] * brdf * lightStrength;
-	}
-#endif
 	return float4(result, 0.0f);
 }
\ No newline at end of file
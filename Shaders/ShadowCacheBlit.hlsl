@@ -0,0 +1,26 @@
+//=============================================================================
+// Copies the cached static caster depth into the shadow atlas.  The cache has
+// the same layout as the atlas, so SV_Position addresses it directly and the
+// viewport and scissor decide which texels are copied.
+//=============================================================================
+
+Texture2D gShadowCache : register(t0);
+
+// Triangle covering the whole viewport.
+static const float2 gTexCoords[3] =
+{
+    float2(0.0f, 0.0f),
+    float2(2.0f, 0.0f),
+    float2(0.0f, 2.0f)
+};
+
+float4 VS(uint vid : SV_VertexID) : SV_POSITION
+{
+    float2 texC = gTexCoords[vid];
+    return float4(2.0f * texC.x - 1.0f, 1.0f - 2.0f * texC.y, 0.0f, 1.0f);
+}
+
+float PS(float4 posH : SV_POSITION) : SV_Depth
+{
+    return gShadowCache.Load(int3(posH.xy, 0)).r;
+}
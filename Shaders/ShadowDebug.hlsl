@@ -32,7 +32,7 @@ VertexOut VS(VertexIn vin)
 float4 PS(VertexOut pin) : SV_Target
 {
     //return float4(gBuffer[0].Sample(gsamLinearWrap, pin.TexC).rrr, 1.0f);
-    return gShadowMap[3].Sample(gsamLinearWrap, pin.TexC);
+    return gShadowMap.Sample(gsamLinearWrap, pin.TexC);
 }
 
 
@@ -5,44 +5,90 @@
 // Include common HLSL code.
 #include "Common.hlsl"
 
+#ifdef SINGLE_PASS_CASCADES
+// Cascades drawn by this submission, one bit per cascade, and the caster LOD of
+// the mesh it draws.
+cbuffer cbRootConstants : register(b1)
+{
+	uint gCascadeDrawMask;
+	uint gCasterLod;
+};
+#endif
+
+// DEPTH_ONLY reads the position stream alone and has no pixel shader; only
+// alpha tested casters need the texture coordinates.
 struct VertexIn
 {
 	float3 PosL    : POSITION;
+#ifndef DEPTH_ONLY
 	float2 TexC    : TEXCOORD;
+#endif
 };
 
 struct VertexOut
 {
 	float4 PosH    : SV_POSITION;
+#ifndef DEPTH_ONLY
 	float2 TexC    : TEXCOORD;
 	nointerpolation uint MatIndex : MATINDEX;
+#endif
+#ifdef SINGLE_PASS_CASCADES
+	uint Cascade : SV_ViewportArrayIndex;
+#endif
 };
 
 VertexOut VS(VertexIn vin, uint instanceID : SV_instanceID)
 {
 	VertexOut vout = (VertexOut)0.0f;
 
+#ifdef SINGLE_PASS_CASCADES
+	// Every instance is drawn once per cascade; the viewport of each cascade maps
+	// it onto its atlas tile.
+	uint cascade = instanceID % gCascadeCount;
+	instanceID /= gCascadeCount;
+	vout.Cascade = cascade;
+#endif
+
 	InstanceData instanceData = gInstanceData[instanceID];
+#ifdef SINGLE_PASS_CASCADES
+	// Put the whole instance outside the clip volume when it casts nothing into the
+	// cascade, does so with another LOD, or the cascade is not drawn this time, so
+	// the rasterizer drops it.
+	uint lodMask = instanceData.CascadeMask >> (gCasterLod * MaxShadowCascades);
+	if ((lodMask & gCascadeDrawMask & (1u << cascade)) == 0)
+	{
+		vout.PosH = float4(0.0f, 0.0f, -1.0f, 1.0f);
+		return vout;
+	}
+#endif
 	float4x4 gWorld = instanceData.World;
-	float4x4 gTexTransform = instanceData.TexTransform;
-	uint gMaterialIndex = instanceData.MaterialIndex;
-	vout.MatIndex = gMaterialIndex;
 
-	MaterialData matData = gMaterialData[gMaterialIndex];
-	
     // Transform to world space.
     float4 posW = mul(float4(vin.PosL, 1.0f), gWorld);
 
     // Transform to homogeneous clip space.
+#ifdef SINGLE_PASS_CASCADES
+    vout.PosH = mul(posW, gCascadeViewProj[cascade]);
+#else
     vout.PosH = mul(posW, gViewProj);
-	
+#endif
+
+#ifndef DEPTH_ONLY
+	float4x4 gTexTransform = instanceData.TexTransform;
+	uint gMaterialIndex = instanceData.MaterialIndex;
+	vout.MatIndex = gMaterialIndex;
+
+	MaterialData matData = gMaterialData[gMaterialIndex];
+
 	// Output vertex attributes for interpolation across triangle.
 	float4 texC = mul(float4(vin.TexC, 0.0f, 1.0f), gTexTransform);
 	vout.TexC = mul(texC, matData.MatTransform).xy;
-	
+#endif
+
     return vout;
 }
 
+#ifndef DEPTH_ONLY
 // This is only used for alpha cut out geometry, so that shadows 
 // show up correctly.  Geometry that does not need to sample a
 // texture can use a NULL pixel shader for depth pass.
@@ -63,5 +109,4 @@ void PS(VertexOut pin)
     clip(diffuseAlbedo.a - 0.1f);
 #endif
 }
-
-
+#endif
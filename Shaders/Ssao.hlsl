@@ -2,6 +2,8 @@
 // Ssao.hlsl by Frank Luna (C) 2015 All Rights Reserved.
 //=============================================================================
 
+#include "Octahedral.hlsl"
+
 cbuffer cbSsao : register(b0)
 {
     float4x4 gProj;
@@ -19,6 +21,19 @@ cbuffer cbSsao : register(b0)
     float    gOcclusionFadeStart;
     float    gOcclusionFadeEnd;
     float    gSurfaceEpsilon;
+
+    // Temporal accumulation, see SsaoCompute.hlsl.
+    float4x4 gInvView;
+    float4x4 gPrevViewProjTex;
+    // Offset vectors taken per pixel, starting at gSampleOffset.
+    uint     gSampleCount;
+    uint     gSampleOffset;
+    // Weight of this frame's samples against the history; 1 drops the history.
+    float    gTemporalAlpha;
+    // Shifts the random vectors every frame.
+    float    gNoiseOffset;
+    // gNormalMap is the G-buffer's: octahedral world normal in rg.
+    uint     gNormalsFromGBuffer;
 };
 
 cbuffer cbRootConstants : register(b1)
@@ -36,7 +51,16 @@ SamplerState gsamLinearClamp : register(s1);
 SamplerState gsamDepthMap : register(s2);
 SamplerState gsamLinearWrap : register(s3);
 
-static const int gSampleCount = 14;
+static const uint gOffsetVectorCount = 14;
+
+// View space normal at texC, from either normal map layout.
+float3 NormalAt(float2 texC)
+{
+    float4 s = gNormalMap.SampleLevel(gsamPointClamp, texC, 0.0f);
+    if (gNormalsFromGBuffer)
+        return normalize(mul((float3x3)gInvView, OctDecode(s.xy * 2.0f - 1.0f)));
+    return normalize(s.xyz);
+}
  
 static const float2 gTexCoords[6] =
 {
@@ -114,7 +138,9 @@ float NdcDepthToViewDepth(float z_ndc)
     return viewZ;
 }
  
-float4 PS(VertexOut pin) : SV_Target
+// Ambient accessibility of the ambient map texel at texC; posV is the view space
+// point on the near plane the texel's ray passes through.
+float AmbientAccess(float2 texC, float3 posV)
 {
 	// p -- the point we are computing the ambient occlusion for.
 	// n -- normal vector at p.
@@ -122,30 +148,31 @@ float4 PS(VertexOut pin) : SV_Target
 	// r -- a potential occluder that might occlude p.
 
 	// Get viewspace normal and z-coord of this pixel.  
-    float3 n = normalize(gNormalMap.SampleLevel(gsamPointClamp, pin.TexC, 0.0f).xyz);
-    float pz = gDepthMap.SampleLevel(gsamDepthMap, pin.TexC, 0.0f).r;
+    float3 n = NormalAt(texC);
+    float pz = gDepthMap.SampleLevel(gsamDepthMap, texC, 0.0f).r;
     pz = NdcDepthToViewDepth(pz);
 
 	//
 	// Reconstruct full view space position (x,y,z).
-	// Find t such that p = t*pin.PosV.
-	// p.z = t*pin.PosV.z
-	// t = p.z / pin.PosV.z
+	// Find t such that p = t*posV.
+	// p.z = t*posV.z
+	// t = p.z / posV.z
 	//
-	float3 p = (pz/pin.PosV.z)*pin.PosV;
+	float3 p = (pz/posV.z)*posV;
 	
 	// Extract random vector and map from [0,1] --> [-1, +1].
-	float3 randVec = 2.0f*gRandomVecMap.SampleLevel(gsamLinearWrap, 4.0f*pin.TexC, 0.0f).rgb - 1.0f;
+	float3 randVec = 2.0f*gRandomVecMap.SampleLevel(gsamLinearWrap, 4.0f*texC + gNoiseOffset, 0.0f).rgb - 1.0f;
 
 	float occlusionSum = 0.0f;
 	
 	// Sample neighboring points about p in the hemisphere oriented by n.
-	for(int i = 0; i < gSampleCount; ++i)
+	for(uint i = 0; i < gSampleCount; ++i)
 	{
 		// Are offset vectors are fixed and uniformly distributed (so that our offset vectors
 		// do not clump in the same direction).  If we reflect them about a random vector
-		// then we get a random uniform distribution of offset vectors.
-		float3 offset = reflect(gOffsetVectors[i].xyz, randVec);
+		// then we get a random uniform distribution of offset vectors.  The temporal
+		// mode takes a different run of them, about a different vector, every frame.
+		float3 offset = reflect(gOffsetVectors[(gSampleOffset + i) % gOffsetVectorCount].xyz, randVec);
 	
 		// Flip offset vector if it is behind the plane defined by (p, n).
 		float flip = sign( dot(offset, n) );
@@ -197,3 +224,8 @@ float4 PS(VertexOut pin) : SV_Target
 	// Sharpen the contrast of the SSAO map to make the SSAO affect more dramatic.
 	return saturate(pow(access, 6.0f));
 }
+
+float4 PS(VertexOut pin) : SV_Target
+{
+    return AmbientAccess(pin.TexC, pin.PosV);
+}
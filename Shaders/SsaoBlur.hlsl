@@ -9,6 +9,8 @@
 // in the cache.
 //=============================================================================
 
+#include "Octahedral.hlsl"
+
 cbuffer cbSsao : register(b0)
 {
     float4x4 gProj;
@@ -27,7 +29,14 @@ cbuffer cbSsao : register(b0)
     float gOcclusionFadeEnd;
     float gSurfaceEpsilon;
 
-    
+    float4x4 gInvView;
+    float4x4 gPrevViewProjTex;
+    uint  gSampleCount;
+    uint  gSampleOffset;
+    float gTemporalAlpha;
+    float gNoiseOffset;
+    // gNormalMap is the G-buffer's: octahedral world normal in rg.
+    uint  gNormalsFromGBuffer;
 };
 
 cbuffer cbRootConstants : register(b1)
@@ -46,6 +55,15 @@ SamplerState gsamDepthMap : register(s2);
 SamplerState gsamLinearWrap : register(s3);
 
 static const int gBlurRadius = 5;
+
+// Only compared with each other, so the G-buffer's world space normals do as they are.
+float3 NormalAt(float2 texC)
+{
+    float4 s = gNormalMap.SampleLevel(gsamPointClamp, texC, 0.0f);
+    if (gNormalsFromGBuffer)
+        return OctDecode(s.xy * 2.0f - 1.0f);
+    return s.xyz;
+}
  
 static const float2 gTexCoords[6] =
 {
@@ -106,7 +124,7 @@ float4 PS(VertexOut pin) : SV_Target
 	float4 color      = blurWeights[gBlurRadius] * gInputMap.SampleLevel(gsamPointClamp, pin.TexC, 0.0);
 	float totalWeight = blurWeights[gBlurRadius];
 	 
-    float3 centerNormal = gNormalMap.SampleLevel(gsamPointClamp, pin.TexC, 0.0f).xyz;
+    float3 centerNormal = NormalAt(pin.TexC);
     float  centerDepth = NdcDepthToViewDepth(
         gDepthMap.SampleLevel(gsamDepthMap, pin.TexC, 0.0f).r);
 
@@ -118,7 +136,7 @@ float4 PS(VertexOut pin) : SV_Target
 
 		float2 tex = pin.TexC + i*texOffset;
 
-		float3 neighborNormal = gNormalMap.SampleLevel(gsamPointClamp, tex, 0.0f).xyz;
+		float3 neighborNormal = NormalAt(tex);
         float  neighborDepth  = NdcDepthToViewDepth(
             gDepthMap.SampleLevel(gsamDepthMap, tex, 0.0f).r);
 
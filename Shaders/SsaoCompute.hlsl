@@ -0,0 +1,297 @@
+//=============================================================================
+// SsaoCompute.hlsl
+//
+// Compute shader versions of Ssao.hlsl and SsaoBlur.hlsl.  The blur caches a
+// tile of the ambient map together with the normals and view depths its edge
+// test needs in groupshared memory, and runs the horizontal and the vertical
+// pass over the tile in one dispatch, so each texel and its neighbourhood is
+// fetched once per blur instead of once per tap.
+//
+// The temporal mode takes a few samples per frame and blends them into the
+// previous frames' result, reprojected with the previous view-projection.
+//
+// GtaoCS is the ground truth AO alternative to SsaoCS, built once per GtaoTier
+// with its GTAO_SLICES and GTAO_STEPS.
+//=============================================================================
+
+#include "Ssao.hlsl"
+
+Texture2D gInputMap : register(t3);
+// Accumulated ambient (x), view depth (y) and octahedral world normal (zw) of the
+// previous frame.
+Texture2D gHistoryMap : register(t4);
+
+RWTexture2D<float> gOutputMap : register(u0);
+RWTexture2D<float4> gHistoryOutputMap : register(u1);
+
+#define TileSize 16
+#define BlurRadius 5
+#define ApronSize (TileSize + 2 * BlurRadius)
+
+#ifndef GTAO_SLICES
+    #define GTAO_SLICES 2
+#endif
+
+#ifndef GTAO_STEPS
+    #define GTAO_STEPS 2
+#endif
+
+static const float gPi = 3.14159265f;
+
+[numthreads(TileSize, TileSize, 1)]
+void SsaoCS(uint3 dispatchThreadID : SV_DispatchThreadID)
+{
+    if (any(dispatchThreadID.xy >= (uint2)gRenderTargetSize))
+        return;
+
+    float2 texC = (dispatchThreadID.xy + 0.5f) * gInvRenderTargetSize;
+
+    // Same near plane point the vertex shader of Ssao.hlsl interpolates.
+    float4 ph = mul(float4(2.0f * texC.x - 1.0f, 1.0f - 2.0f * texC.y, 0.0f, 1.0f), gInvProj);
+
+    gOutputMap[dispatchThreadID.xy] = AmbientAccess(texC, ph.xyz / ph.w);
+}
+
+// View space point the depth map holds at texC.
+float3 ViewPositionAt(float2 texC)
+{
+    float pz = NdcDepthToViewDepth(gDepthMap.SampleLevel(gsamPointClamp, texC, 0.0f).r);
+    float4 ph = mul(float4(2.0f * texC.x - 1.0f, 1.0f - 2.0f * texC.y, 0.0f, 1.0f), gInvProj);
+    float3 posV = ph.xyz / ph.w;
+    return (pz / posV.z) * posV;
+}
+
+// Cosine of the horizon angle a depth sample raises, fading to lowCos with distance.
+float HorizonCos(float3 p, float3 viewV, float2 texC, float lowCos)
+{
+    if (any(texC <= 0.0f) || any(texC >= 1.0f))
+        return lowCos;
+
+    float3 delta = ViewPositionAt(texC) - p;
+    float dist = length(delta);
+    float weight = saturate((gOcclusionFadeEnd - dist) / (gOcclusionFadeEnd - gOcclusionFadeStart));
+    return lerp(lowCos, dot(delta, viewV) / dist, weight);
+}
+
+// Cosine weighted visibility of the hemisphere above the pixel at texC, from the
+// horizons of GTAO_SLICES slices.  jitter in [0,1) rotates the slices (x) and
+// moves the steps (y).  Gtao::ComputeOnCpu is the CPU reference.
+float GroundTruthAccess(float2 texC, float2 jitter)
+{
+    float3 p = ViewPositionAt(texC);
+    float3 n = NormalAt(texC);
+    float3 viewV = normalize(-p);
+
+    // Search radius in texture space at this depth.
+    float2 radiusTex = gOcclusionRadius * 0.5f * float2(gProj[0][0], gProj[1][1]) / p.z;
+
+    float visibility = 0.0f;
+
+    [unroll]
+    for (int slice = 0; slice < GTAO_SLICES; ++slice)
+    {
+        float phi = (slice + jitter.x) * gPi / GTAO_SLICES;
+        float3 directionV = float3(cos(phi), sin(phi), 0.0f);
+        // Texture v runs down the screen.
+        float2 omega = float2(directionV.x, -directionV.y) * radiusTex;
+
+        // Angle of the normal projected into the slice plane, from the view vector.
+        float3 orthoDirectionV = directionV - dot(directionV, viewV) * viewV;
+        float3 axisV = normalize(cross(directionV, viewV));
+        float3 projNormalV = n - axisV * dot(n, axisV);
+        float projNormalLength = length(projNormalV);
+        float cosNorm = saturate(dot(projNormalV, viewV) / projNormalLength);
+        float normalAngle = (dot(orthoDirectionV, projNormalV) >= 0.0f ? 1.0f : -1.0f) * acos(cosNorm);
+
+        // Both horizons start at the tangent plane.
+        float lowCos0 = cos(normalAngle + 0.5f * gPi);
+        float lowCos1 = cos(normalAngle - 0.5f * gPi);
+        float horizonCos0 = lowCos0;
+        float horizonCos1 = lowCos1;
+
+        [unroll]
+        for (int step = 0; step < GTAO_STEPS; ++step)
+        {
+            // Quadratic spacing puts more of the samples near the pixel.
+            float s = (step + jitter.y) / GTAO_STEPS;
+            float2 offset = s * s * omega;
+
+            horizonCos0 = max(horizonCos0, HorizonCos(p, viewV, texC + offset, lowCos0));
+            horizonCos1 = max(horizonCos1, HorizonCos(p, viewV, texC - offset, lowCos1));
+        }
+
+        // Clamp the horizons to the hemisphere around the normal and integrate the arc between.
+        float h0 = -acos(clamp(horizonCos1, -1.0f, 1.0f));
+        float h1 = acos(clamp(horizonCos0, -1.0f, 1.0f));
+        h0 = normalAngle + max(h0 - normalAngle, -0.5f * gPi);
+        h1 = normalAngle + min(h1 - normalAngle, 0.5f * gPi);
+
+        float sinNorm = sin(normalAngle);
+        float arc0 = (cosNorm + 2.0f * h0 * sinNorm - cos(2.0f * h0 - normalAngle)) / 4.0f;
+        float arc1 = (cosNorm + 2.0f * h1 * sinNorm - cos(2.0f * h1 - normalAngle)) / 4.0f;
+        visibility += projNormalLength * (arc0 + arc1);
+    }
+
+    return saturate(visibility / GTAO_SLICES);
+}
+
+[numthreads(TileSize, TileSize, 1)]
+void GtaoCS(uint3 dispatchThreadID : SV_DispatchThreadID)
+{
+    if (any(dispatchThreadID.xy >= (uint2)gRenderTargetSize))
+        return;
+
+    float2 texC = (dispatchThreadID.xy + 0.5f) * gInvRenderTargetSize;
+
+    // The temporal mode shifts the noise every frame like the hemisphere samples.
+    float2 jitter = gRandomVecMap.SampleLevel(gsamLinearWrap, 4.0f * texC + gNoiseOffset, 0.0f).rg;
+
+    gOutputMap[dispatchThreadID.xy] = GroundTruthAccess(texC, jitter);
+}
+
+[numthreads(TileSize, TileSize, 1)]
+void TemporalCS(uint3 dispatchThreadID : SV_DispatchThreadID)
+{
+    if (any(dispatchThreadID.xy >= (uint2)gRenderTargetSize))
+        return;
+
+    float2 texC = (dispatchThreadID.xy + 0.5f) * gInvRenderTargetSize;
+    float ambient = gInputMap[dispatchThreadID.xy].r;
+
+    // Rebuild this texel's surface point and normal as AmbientAccess does.
+    float3 n = NormalAt(texC);
+    float pz = NdcDepthToViewDepth(gDepthMap.SampleLevel(gsamDepthMap, texC, 0.0f).r);
+    float4 ph = mul(float4(2.0f * texC.x - 1.0f, 1.0f - 2.0f * texC.y, 0.0f, 1.0f), gInvProj);
+    float3 posV = ph.xyz / ph.w;
+    float3 p = (pz / posV.z) * posV;
+
+    float4 posW = mul(float4(p, 1.0f), gInvView);
+    float3 normalW = normalize(mul(n, (float3x3)gInvView));
+
+    // Where the point was last frame; w is its view depth then.
+    float4 prevTexC = mul(posW, gPrevViewProjTex);
+    prevTexC.xy /= prevTexC.w;
+
+    float alpha = 1.0f;
+    float history = ambient;
+    if (gTemporalAlpha < 1.0f && all(prevTexC.xy > 0.0f) && all(prevTexC.xy < 1.0f))
+    {
+        float4 prev = gHistoryMap.SampleLevel(gsamPointClamp, prevTexC.xy, 0.0f);
+
+        // The history belongs to another surface when the point was hidden behind
+        // something last frame or the surface there faces elsewhere.
+        if (abs(prev.y - prevTexC.w) <= 0.05f * prevTexC.w && dot(OctDecode(prev.zw), normalW) >= 0.9f)
+        {
+            alpha = gTemporalAlpha;
+            history = prev.x;
+        }
+    }
+
+    ambient = lerp(history, ambient, alpha);
+    gOutputMap[dispatchThreadID.xy] = ambient;
+    gHistoryOutputMap[dispatchThreadID.xy] = float4(ambient, pz, OctEncode(normalW));
+}
+
+// The tile plus BlurRadius texels on every side.
+groupshared float gApronAmbient[ApronSize * ApronSize];
+// Normal (xyz) and view depth (w).
+groupshared float4 gApronNormalDepth[ApronSize * ApronSize];
+// Horizontally blurred ambient of the tile's columns over all apron rows.
+groupshared float gHorzAmbient[TileSize * ApronSize];
+
+// Weight of the neighbour, 0 across a discontinuity, same test as SsaoBlur.hlsl.
+float BlurWeight(float4 center, float4 neighbor, float weight)
+{
+    return dot(neighbor.xyz, center.xyz) >= 0.8f && abs(neighbor.w - center.w) <= 0.2f ? weight : 0.0f;
+}
+
+[numthreads(TileSize, TileSize, 1)]
+void BlurCS(uint3 groupID : SV_GroupID, uint3 groupThreadID : SV_GroupThreadID, uint groupIndex : SV_GroupIndex)
+{
+    // unpack into float array.
+    float blurWeights[12] =
+    {
+        gBlurWeights[0].x, gBlurWeights[0].y, gBlurWeights[0].z, gBlurWeights[0].w,
+        gBlurWeights[1].x, gBlurWeights[1].y, gBlurWeights[1].z, gBlurWeights[1].w,
+        gBlurWeights[2].x, gBlurWeights[2].y, gBlurWeights[2].z, gBlurWeights[2].w,
+    };
+
+    int2 mapSize = (int2)gRenderTargetSize;
+    int2 tileOrigin = (int2)groupID.xy * TileSize - BlurRadius;
+
+    //
+    // Cache the apron.  Texels past the map edge repeat the edge, as the clamp
+    // sampler does for the pixel shader blur.
+    //
+
+    for (uint i = groupIndex; i < ApronSize * ApronSize; i += TileSize * TileSize)
+    {
+        int2 texel = clamp(tileOrigin + int2(i % ApronSize, i / ApronSize), 0, mapSize - 1);
+        float2 texC = (texel + 0.5f) * gInvRenderTargetSize;
+
+        gApronAmbient[i] = gInputMap[texel].r;
+        gApronNormalDepth[i] = float4(
+            NormalAt(texC),
+            NdcDepthToViewDepth(gDepthMap.SampleLevel(gsamDepthMap, texC, 0.0f).r));
+    }
+
+    GroupMemoryBarrierWithGroupSync();
+
+    //
+    // Horizontal pass over every apron row, so the vertical pass has all its taps.
+    //
+
+    for (uint j = groupIndex; j < TileSize * ApronSize; j += TileSize * TileSize)
+    {
+        uint row = j / TileSize;
+        uint center = row * ApronSize + j % TileSize + BlurRadius;
+        float4 centerNormalDepth = gApronNormalDepth[center];
+
+        // The center value always contributes to the sum.
+        float ambient = blurWeights[BlurRadius] * gApronAmbient[center];
+        float totalWeight = blurWeights[BlurRadius];
+
+        [unroll]
+        for (int k = -BlurRadius; k <= BlurRadius; ++k)
+        {
+            if (k == 0)
+                continue;
+
+            float weight = BlurWeight(centerNormalDepth, gApronNormalDepth[center + k], blurWeights[k + BlurRadius]);
+            ambient += weight * gApronAmbient[center + k];
+            totalWeight += weight;
+        }
+
+        gHorzAmbient[j] = ambient / totalWeight;
+    }
+
+    GroupMemoryBarrierWithGroupSync();
+
+    //
+    // Vertical pass over the tile.
+    //
+
+    int2 texel = tileOrigin + BlurRadius + (int2)groupThreadID.xy;
+    if (any(texel >= mapSize))
+        return;
+
+    uint center = (groupThreadID.y + BlurRadius) * ApronSize + groupThreadID.x + BlurRadius;
+    float4 centerNormalDepth = gApronNormalDepth[center];
+
+    float ambient = blurWeights[BlurRadius] * gHorzAmbient[(groupThreadID.y + BlurRadius) * TileSize + groupThreadID.x];
+    float totalWeight = blurWeights[BlurRadius];
+
+    [unroll]
+    for (int k = -BlurRadius; k <= BlurRadius; ++k)
+    {
+        if (k == 0)
+            continue;
+
+        float weight = BlurWeight(centerNormalDepth, gApronNormalDepth[center + k * ApronSize], blurWeights[k + BlurRadius]);
+        ambient += weight * gHorzAmbient[(groupThreadID.y + BlurRadius + k) * TileSize + groupThreadID.x];
+        totalWeight += weight;
+    }
+
+    // Compensate for discarded samples by making total weights sum to 1.
+    gOutputMap[texel] = ambient / totalWeight;
+}
@@ -0,0 +1,65 @@
+//=============================================================================
+// VirtualShadowMark.hlsl
+//
+// Marks the virtual shadow map pages the visible samples need, one bit per page
+// table entry, with the same page choice as CalcVirtualShadowFactor.
+// VirtualShadowPages::MarkPagesOnCpu mirrors it.
+//=============================================================================
+
+// Must match d3dUtil.h.
+#define VirtualShadowLevels 6
+#define VirtualShadowPagesPerLevel 64
+
+cbuffer cbVirtualShadowMark : register(b0)
+{
+    float4x4 gInvViewProj;
+    float4x4 gLightView;
+    // Per level the window origin in pages (xy) and 1 / page world size (z).
+    float4 gLevels[VirtualShadowLevels];
+    float3 gEyePosW;
+    // Pixel footprint per unit distance over the texel size of level 0.
+    float gLodScale;
+    uint2 gDepthMapSize;
+    uint2 gMarkPad;
+};
+
+Texture2D gDepthMap : register(t0);
+
+// One bit per page table entry.
+RWStructuredBuffer<uint> gRequests : register(u0);
+
+[numthreads(16, 16, 1)]
+void CS(uint3 dispatchThreadID : SV_DispatchThreadID)
+{
+    if (any(dispatchThreadID.xy >= gDepthMapSize))
+        return;
+
+    // Far plane means nothing was drawn there.
+    float depth = gDepthMap.Load(int3(dispatchThreadID.xy, 0)).r;
+    if (depth >= 1.0f)
+        return;
+
+    float2 uv = (dispatchThreadID.xy + 0.5f) / gDepthMapSize;
+    float4 posW = mul(float4(2.0f * uv.x - 1.0f, 1.0f - 2.0f * uv.y, depth, 1.0f), gInvViewProj);
+    posW /= posW.w;
+
+    float distance = length(posW.xyz - gEyePosW);
+    float3 posL = mul(posW, gLightView).xyz;
+
+    float footprint = distance * gLodScale;
+    uint level = footprint <= 1.0f ? 0 : min((uint)ceil(log2(footprint)), VirtualShadowLevels - 1);
+    for (; level < VirtualShadowLevels; ++level)
+    {
+        int2 page = (int2)floor(float2(posL.x, -posL.y) * gLevels[level].z) - (int2)gLevels[level].xy;
+        if (any(page < 0) || any(page >= VirtualShadowPagesPerLevel))
+            continue;
+
+        uint entry = (level * VirtualShadowPagesPerLevel + page.y) * VirtualShadowPagesPerLevel + page.x;
+        uint bit = 1u << (entry % 32);
+
+        // Neighbouring samples mostly want the same page; skip the atomic once it is set.
+        if ((gRequests[entry / 32] & bit) == 0)
+            InterlockedOr(gRequests[entry / 32], bit);
+        return;
+    }
+}
@@ -5,44 +5,38 @@
 // Include common HLSL code.
 #include "Common.hlsl"
 
-struct VertexIn
+// One triangle covering the screen.
+static const float2 gTexCoords[3] =
 {
-	float3 PosL    : POSITION;
-	float3 NormalL : NORMAL;
-	float2 TexC    : TEXCOORD;
+	float2(0.0f, 0.0f),
+	float2(2.0f, 0.0f),
+	float2(0.0f, 2.0f)
 };
 
 struct VertexOut
 {
 	float4 PosH : SV_POSITION;
-    float3 PosL : POSITION;
+	float3 DirW : POSITION;
 };
  
-VertexOut VS(VertexIn vin, uint instanceID : SV_InstanceID)
+VertexOut VS(uint vid : SV_VertexID)
 {
 	VertexOut vout;
 
-	// Use local vertex position as cubemap lookup vector.
-	vout.PosL = vin.PosL;
-	
-	InstanceData instanceData = gInstanceData[instanceID];
-	float4x4 gWorld = instanceData.World;
-	float4x4 gTexTransform = instanceData.TexTransform;
-
-	// Transform to world space.
-	float4 posW = mul(float4(vin.PosL, 1.0f), gWorld);
-
-	// Always center sky about camera.
-	posW.xyz += gEyePosW;
+	// z = 1 keeps the sky on the far plane, so it only fills pixels nothing else covered.
+	float2 texC = gTexCoords[vid];
+	vout.PosH = float4(2.0f * texC.x - 1.0f, 1.0f - 2.0f * texC.y, 1.0f, 1.0f);
 
-	// Set z = w so that z/w = 1 (i.e., skydome always on far plane).
-	vout.PosH = mul(posW, gViewProj).xyww;
+	// The far plane point behind the pixel, seen from the eye, is the cubemap lookup vector.
+	// Points of a plane map affinely, so the direction interpolates linearly.
+	float4 posW = mul(vout.PosH, gInvViewProj);
+	vout.DirW = posW.xyz / posW.w - gEyePosW;
 	
 	return vout;
 }
 
 float4 PS(VertexOut pin) : SV_Target
 {
-	return gCubeMap.Sample(gsamLinearWrap, pin.PosL);
+	return gCubeMap.Sample(gsamLinearWrap, pin.DirW);
 }
 
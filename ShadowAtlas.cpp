@@ -0,0 +1,147 @@
+#include "ShadowAtlas.h"
+
+ShadowAtlas::ShadowAtlas(UINT atlasSize, UINT minTileSize)
+{
+	assert(atlasSize > 0 && (atlasSize & (atlasSize - 1)) == 0);
+	assert(minTileSize > 0 && minTileSize <= atlasSize);
+
+	mSize = atlasSize;
+	mMinTileSize = minTileSize;
+
+	UINT levels = 1;
+	while ((mSize >> levels) >= mMinTileSize)
+		levels++;
+	mFreeTiles.resize(levels);
+
+	Clear();
+}
+
+UINT ShadowAtlas::SizeForBudget(UINT64 budgetBytes, UINT bytesPerTexel, UINT maxSize)
+{
+	UINT size = 1;
+	while (size * 2 <= maxSize && (UINT64)size * 2 * size * 2 * bytesPerTexel <= budgetBytes)
+		size *= 2;
+	return size;
+}
+
+UINT ShadowAtlas::Size()const
+{
+	return mSize;
+}
+
+UINT ShadowAtlas::MinTileSize()const
+{
+	return mMinTileSize;
+}
+
+bool ShadowAtlas::Allocate(UINT size, ShadowAtlasTile& tile)
+{
+	UINT level = LevelForSize(size);
+	for (;;)
+	{
+		if (AllocateExact(level, tile))
+		{
+			mAllocatedTexels += (UINT64)tile.Size * tile.Size;
+			return true;
+		}
+		if (level + 1 >= (UINT)mFreeTiles.size())
+			return false;
+		level++;
+	}
+}
+
+bool ShadowAtlas::AllocateExact(UINT level, ShadowAtlasTile& tile)
+{
+	// Find the smallest free tile at least as big as requested.
+	int from = (int)level;
+	while (from >= 0 && mFreeTiles[from].empty())
+		from--;
+	if (from < 0)
+		return false;
+
+	ShadowAtlasTile t = mFreeTiles[from].back();
+	mFreeTiles[from].pop_back();
+
+	// Split it down, keeping the top-left quarter and freeing the other three.
+	for (UINT l = (UINT)from + 1; l <= level; ++l)
+	{
+		UINT half = SizeForLevel(l);
+		mFreeTiles[l].push_back({ t.X + half, t.Y, half });
+		mFreeTiles[l].push_back({ t.X, t.Y + half, half });
+		mFreeTiles[l].push_back({ t.X + half, t.Y + half, half });
+		t.Size = half;
+	}
+
+	tile = t;
+	return true;
+}
+
+void ShadowAtlas::Free(const ShadowAtlasTile& tile)
+{
+	mAllocatedTexels -= (UINT64)tile.Size * tile.Size;
+
+	UINT level = LevelForSize(tile.Size);
+	ShadowAtlasTile t = tile;
+	for (;;)
+	{
+		auto& freeList = mFreeTiles[level];
+		if (level == 0)
+		{
+			freeList.push_back(t);
+			return;
+		}
+
+		// Merge with the three siblings if they are all free.
+		UINT parentSize = SizeForLevel(level - 1);
+		UINT px = t.X - t.X % parentSize;
+		UINT py = t.Y - t.Y % parentSize;
+
+		std::vector<size_t> siblings;
+		for (size_t i = 0; i < freeList.size(); ++i)
+		{
+			const auto& f = freeList[i];
+			if (f.X - f.X % parentSize == px && f.Y - f.Y % parentSize == py)
+				siblings.push_back(i);
+		}
+
+		if (siblings.size() < 3)
+		{
+			freeList.push_back(t);
+			return;
+		}
+
+		// Erase from the back so the indices stay valid.
+		for (auto it = siblings.rbegin(); it != siblings.rend(); ++it)
+			freeList.erase(freeList.begin() + *it);
+
+		t = { px, py, parentSize };
+		level--;
+	}
+}
+
+void ShadowAtlas::Clear()
+{
+	for (auto& freeList : mFreeTiles)
+		freeList.clear();
+	mFreeTiles[0].push_back({ 0, 0, mSize });
+	mAllocatedTexels = 0;
+}
+
+UINT64 ShadowAtlas::AllocatedTexels()const
+{
+	return mAllocatedTexels;
+}
+
+UINT ShadowAtlas::LevelForSize(UINT size)const
+{
+	// Round up to the next tile size, clamped to [mMinTileSize, mSize].
+	UINT level = (UINT)mFreeTiles.size() - 1;
+	while (level > 0 && SizeForLevel(level) < size)
+		level--;
+	return level;
+}
+
+UINT ShadowAtlas::SizeForLevel(UINT level)const
+{
+	return mSize >> level;
+}
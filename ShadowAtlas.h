@@ -0,0 +1,57 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+// Square region of the shadow atlas, in texels.
+struct ShadowAtlasTile
+{
+	UINT X = 0;
+	UINT Y = 0;
+	UINT Size = 0;
+};
+
+///<summary>
+/// Carves a square power-of-two atlas into power-of-two square tiles with a
+/// quadtree buddy allocator.  Freed tiles merge back with their three siblings,
+/// so tiles of any size can be reallocated as lights and cascades come and go.
+/// Pure bookkeeping; the texture itself is owned by ShadowMap.
+///</summary>
+class ShadowAtlas
+{
+public:
+	ShadowAtlas(UINT atlasSize, UINT minTileSize);
+	ShadowAtlas(const ShadowAtlas& rhs) = delete;
+	ShadowAtlas& operator=(const ShadowAtlas& rhs) = delete;
+	~ShadowAtlas() = default;
+
+	// Largest power-of-two square atlas of bytesPerTexel texels within budgetBytes.
+	static UINT SizeForBudget(UINT64 budgetBytes, UINT bytesPerTexel, UINT maxSize);
+
+	UINT Size()const;
+	UINT MinTileSize()const;
+
+	///<summary>
+	/// Allocates a tile of size texels (rounded up to a power of two).  When no
+	/// tile that big is free, halves the request down to the minimum tile size, so
+	/// callers get lower resolution instead of nothing.  Returns false only if even
+	/// the minimum size does not fit.
+	///</summary>
+	bool Allocate(UINT size, ShadowAtlasTile& tile);
+	void Free(const ShadowAtlasTile& tile);
+	void Clear();
+
+	// Texels currently handed out.
+	UINT64 AllocatedTexels()const;
+
+private:
+	bool AllocateExact(UINT level, ShadowAtlasTile& tile);
+	UINT LevelForSize(UINT size)const;
+	UINT SizeForLevel(UINT level)const;
+
+private:
+	UINT mSize = 0;
+	UINT mMinTileSize = 0;
+	UINT64 mAllocatedTexels = 0;
+
+	// mFreeTiles[level] holds free tiles of mSize >> level texels.
+	std::vector<std::vector<ShadowAtlasTile>> mFreeTiles;
+};
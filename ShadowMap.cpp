@@ -1,12 +1,30 @@
 #include "ShadowMap.h"
 
-ShadowMap::ShadowMap(ID3D12Device* device, UINT width, UINT height)
+using namespace DirectX;
+
+ShadowMap::ShadowMap(ID3D12Device* device, UINT64 memoryBudget, UINT minTileSize)
 {
 	md3dDevice = device;
-	mWidth = width;
-	mHeight = height;
-	mViewport = { 0.0f, 0.0f, (float)width, (float)height, 0.0f, 1.0f };
-	mScissorRect = { 0, 0, (int)width, (int)height };
+	mMemoryBudget = memoryBudget;
+
+	// R24G8 is 4 bytes a texel and there are two textures (atlas and static cache), but
+	// the driver may pad the allocation, so check the real size and halve until it fits.
+	UINT size = ShadowAtlas::SizeForBudget(memoryBudget, 2 * 4, D3D12_REQ_TEXTURE2D_U_OR_V_DIMENSION);
+	for (;;)
+	{
+		D3D12_RESOURCE_DESC texDesc = ResourceDesc(size);
+		D3D12_RESOURCE_ALLOCATION_INFO info = md3dDevice->GetResourceAllocationInfo(0, 1, &texDesc);
+		if (2 * info.SizeInBytes <= memoryBudget || size <= minTileSize)
+		{
+			mMemoryUsage = 2 * info.SizeInBytes;
+			break;
+		}
+		size /= 2;
+	}
+
+	mWidth = size;
+	mHeight = size;
+	mAtlas = std::make_unique<ShadowAtlas>(size, std::min<UINT>(minTileSize, size));
 	BuildResource();
 }
 
@@ -20,59 +38,111 @@ UINT ShadowMap::Height() const
 	return mHeight;
 }
 
-ID3D12Resource* ShadowMap::Resource(int index)
+UINT64 ShadowMap::MemoryUsage() const
 {
-	return mShadowMap[index].Get();
+	return mMemoryUsage;
 }
 
-CD3DX12_GPU_DESCRIPTOR_HANDLE ShadowMap::Srv(int index) const
+ID3D12Resource* ShadowMap::Resource()
 {
-	return mhGpuSrv[index];
+	return mShadowMap.Get();
 }
 
-CD3DX12_CPU_DESCRIPTOR_HANDLE ShadowMap::Dsv(int index) const
+CD3DX12_GPU_DESCRIPTOR_HANDLE ShadowMap::Srv() const
 {
-	return mhCpuDsv[index];
+	return mhGpuSrv;
 }
 
-D3D12_VIEWPORT ShadowMap::Viewport() const
+CD3DX12_CPU_DESCRIPTOR_HANDLE ShadowMap::Dsv() const
 {
-	return mViewport;
+	return mhCpuDsv;
 }
 
-D3D12_RECT ShadowMap::ScissorRect() const
+ID3D12Resource* ShadowMap::CacheResource()
 {
-	return mScissorRect;
+	return mStaticCache.Get();
 }
 
-void ShadowMap::BuildDescriptors(CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv, 
-	CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv, 
-	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDsv)
+CD3DX12_GPU_DESCRIPTOR_HANDLE ShadowMap::CacheSrv() const
 {
-	UINT mDsvDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_DSV);
-	UINT mCbvSrvUavDescriptorSize = md3dDevice->GetDescriptorHandleIncrementSize(D3D12_DESCRIPTOR_HEAP_TYPE_CBV_SRV_UAV);
+	return mhCacheGpuSrv;
+}
 
-	for (size_t i = 0; i < 4 + 6 + 2; i++)
-	{
-		mhCpuSrv[i] = CD3DX12_CPU_DESCRIPTOR_HANDLE(hCpuSrv, i, mCbvSrvUavDescriptorSize);
-		mhGpuSrv[i] = CD3DX12_GPU_DESCRIPTOR_HANDLE(hGpuSrv, i, mCbvSrvUavDescriptorSize);
-		mhCpuDsv[i] = CD3DX12_CPU_DESCRIPTOR_HANDLE(hCpuDsv, i, mDsvDescriptorSize);
-	}
-	//mhCpuSrv = hCpuSrv;
-	//mhGpuSrv = hGpuSrv;
-	//mhCpuDsv = hCpuDsv;
-	BuildDescriptors();
+CD3DX12_CPU_DESCRIPTOR_HANDLE ShadowMap::CacheDsv() const
+{
+	return mhCacheCpuDsv;
 }
 
-void ShadowMap::OnResize(UINT newWidth, UINT newHeight)
+bool ShadowMap::AllocateTile(UINT size, ShadowAtlasTile& tile)
 {
-	if ((mWidth != newWidth) || (mHeight != newHeight))
-	{
-		mWidth = newWidth;
-		mHeight = newHeight;
-		BuildResource();
-		BuildDescriptors();
-	}
+	return mAtlas->Allocate(size, tile);
+}
+
+void ShadowMap::FreeTile(const ShadowAtlasTile& tile)
+{
+	mAtlas->Free(tile);
+}
+
+void ShadowMap::ClearTiles()
+{
+	mAtlas->Clear();
+}
+
+ShadowAtlasTile ShadowMap::WholeAtlas() const
+{
+	ShadowAtlasTile tile;
+	tile.Size = mWidth;
+	return tile;
+}
+
+D3D12_VIEWPORT ShadowMap::Viewport(const ShadowAtlasTile& tile) const
+{
+	return { (float)tile.X, (float)tile.Y, (float)tile.Size, (float)tile.Size, 0.0f, 1.0f };
+}
+
+D3D12_RECT ShadowMap::ScissorRect(const ShadowAtlasTile& tile) const
+{
+	return { (LONG)tile.X, (LONG)tile.Y, (LONG)(tile.X + tile.Size), (LONG)(tile.Y + tile.Size) };
+}
+
+XMMATRIX ShadowMap::TileTransform(const ShadowAtlasTile& tile) const
+{
+	float scale = (float)tile.Size / mWidth;
+	float offsetU = (float)tile.X / mWidth;
+	float offsetV = (float)tile.Y / mHeight;
+
+	return XMMATRIX(
+		scale, 0.0f, 0.0f, 0.0f,
+		0.0f, scale, 0.0f, 0.0f,
+		0.0f, 0.0f, 1.0f, 0.0f,
+		offsetU, offsetV, 0.0f, 1.0f);
+}
+
+XMFLOAT4 ShadowMap::TileUvBounds(const ShadowAtlasTile& tile) const
+{
+	// Half a texel in from the edge, so the 2x2 comparison footprint stays inside.
+	float halfTexel = 0.5f / mWidth;
+	return XMFLOAT4(
+		(float)tile.X / mWidth + halfTexel,
+		(float)tile.Y / mHeight + halfTexel,
+		(float)(tile.X + tile.Size) / mWidth - halfTexel,
+		(float)(tile.Y + tile.Size) / mHeight - halfTexel);
+}
+
+void ShadowMap::BuildDescriptors(CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv,
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDsv,
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCacheCpuSrv,
+	CD3DX12_GPU_DESCRIPTOR_HANDLE hCacheGpuSrv,
+	CD3DX12_CPU_DESCRIPTOR_HANDLE hCacheCpuDsv)
+{
+	mhCpuSrv = hCpuSrv;
+	mhGpuSrv = hGpuSrv;
+	mhCpuDsv = hCpuDsv;
+	mhCacheCpuSrv = hCacheCpuSrv;
+	mhCacheGpuSrv = hCacheGpuSrv;
+	mhCacheCpuDsv = hCacheCpuDsv;
+	BuildDescriptors();
 }
 
 void ShadowMap::BuildDescriptors()
@@ -86,51 +156,58 @@ void ShadowMap::BuildDescriptors()
 	srvDesc.Texture2D.MipLevels = 1;
 	srvDesc.Texture2D.ResourceMinLODClamp = 0.0f;
 	srvDesc.Texture2D.PlaneSlice = 0;
-	//md3dDevice->CreateShaderResourceView(mShadowMap.Get(), &srvDesc, mhCpuSrv);
+	md3dDevice->CreateShaderResourceView(mShadowMap.Get(), &srvDesc, mhCpuSrv);
+	md3dDevice->CreateShaderResourceView(mStaticCache.Get(), &srvDesc, mhCacheCpuSrv);
 
 	D3D12_DEPTH_STENCIL_VIEW_DESC dsvDesc = {};
 	dsvDesc.Flags = D3D12_DSV_FLAG_NONE;
 	dsvDesc.ViewDimension = D3D12_DSV_DIMENSION_TEXTURE2D;
 	dsvDesc.Format = DXGI_FORMAT_D24_UNORM_S8_UINT;
 	dsvDesc.Texture2D.MipSlice = 0;
-	//md3dDevice->CreateDepthStencilView(mShadowMap.Get(), &dsvDesc, mhCpuDsv);
-	for (size_t i = 0; i < 4 + 6 + 2; i++)
-	{
-		md3dDevice->CreateShaderResourceView(mShadowMap[i].Get(), &srvDesc, mhCpuSrv[i]);
-		md3dDevice->CreateDepthStencilView(mShadowMap[i].Get(), &dsvDesc, mhCpuDsv[i]);
-	}
+	md3dDevice->CreateDepthStencilView(mShadowMap.Get(), &dsvDesc, mhCpuDsv);
+	md3dDevice->CreateDepthStencilView(mStaticCache.Get(), &dsvDesc, mhCacheCpuDsv);
 }
 
-void ShadowMap::BuildResource()
+D3D12_RESOURCE_DESC ShadowMap::ResourceDesc(UINT size) const
 {
 	D3D12_RESOURCE_DESC texDesc;
 	ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
 	texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
 	texDesc.Alignment = 0;
-	texDesc.Width = mWidth;
-	texDesc.Height = mHeight;
-	texDesc.DepthOrArraySize = 4 + 6 + 2;
+	texDesc.Width = size;
+	texDesc.Height = size;
+	texDesc.DepthOrArraySize = 1;
 	texDesc.MipLevels = 1;
 	texDesc.Format = mFormat;
 	texDesc.SampleDesc.Count = 1;
 	texDesc.SampleDesc.Quality = 0;
 	texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
 	texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_DEPTH_STENCIL;
+	return texDesc;
+}
+
+void ShadowMap::BuildResource()
+{
+	D3D12_RESOURCE_DESC texDesc = ResourceDesc(mWidth);
 
 	D3D12_CLEAR_VALUE optClear;
 	optClear.Format = DXGI_FORMAT_D24_UNORM_S8_UINT;
 	optClear.DepthStencil.Depth = 1.0f;
 	optClear.DepthStencil.Stencil = 0;
 
-	for (size_t i = 0; i < 12; i++)
-	{
-		ThrowIfFailed(md3dDevice->CreateCommittedResource(
-				&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
-				D3D12_HEAP_FLAG_NONE,
-				&texDesc,
-				D3D12_RESOURCE_STATE_GENERIC_READ,
-				&optClear,
-				IID_PPV_ARGS(&mShadowMap[i])));
-	}
-	
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&texDesc,
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		&optClear,
+		IID_PPV_ARGS(&mShadowMap)));
+
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&texDesc,
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		&optClear,
+		IID_PPV_ARGS(&mStaticCache)));
 }
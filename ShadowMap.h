@@ -1,48 +1,84 @@
 #pragma once
 #include "Common/d3dUtil.h"
+#include "ShadowAtlas.h"
 
-class ShadowMap 
+///<summary>
+/// A single depth texture used as a shadow atlas.  Cascades and shadowed lights
+/// each get a square tile of it; the atlas is sized to fit a memory budget, and
+/// the tile rectangles feed the viewports, scissors and shadow transforms.
+/// A second texture with the same layout caches the static casters of each tile
+/// between frames; the budget covers both, but not the EVSM moments (EvsmMap),
+/// which only exist while that filter is in use.
+///</summary>
+class ShadowMap
 {
 public:
-	ShadowMap(ID3D12Device* device, UINT Width, UINT height);
+	ShadowMap(ID3D12Device* device, UINT64 memoryBudget, UINT minTileSize);
 	ShadowMap(const ShadowMap& rhs) = delete;
 	ShadowMap& operator=(const ShadowMap& rhs) = delete;
 	~ShadowMap() = default;
 
 	UINT Width() const;
 	UINT Height() const;
-	ID3D12Resource* Resource(int index);
-	CD3DX12_GPU_DESCRIPTOR_HANDLE Srv(int index)const;
-	CD3DX12_CPU_DESCRIPTOR_HANDLE Dsv(int index)const;
+	// Bytes the atlas and its cache take on the GPU, never more than the budget.
+	UINT64 MemoryUsage() const;
+	ID3D12Resource* Resource();
+	CD3DX12_GPU_DESCRIPTOR_HANDLE Srv()const;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE Dsv()const;
 
-	D3D12_VIEWPORT Viewport()const;
-	D3D12_RECT ScissorRect()const;
+	// Static caster cache, laid out like the atlas.
+	ID3D12Resource* CacheResource();
+	CD3DX12_GPU_DESCRIPTOR_HANDLE CacheSrv()const;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE CacheDsv()const;
+
+	// Tile management, see ShadowAtlas::Allocate.
+	bool AllocateTile(UINT size, ShadowAtlasTile& tile);
+	void FreeTile(const ShadowAtlasTile& tile);
+	void ClearTiles();
+
+	// Tile covering the whole atlas.
+	ShadowAtlasTile WholeAtlas()const;
+	D3D12_VIEWPORT Viewport(const ShadowAtlasTile& tile)const;
+	D3D12_RECT ScissorRect(const ShadowAtlasTile& tile)const;
+
+	// Maps [0,1]^2 shadow texture coordinates into the tile; append it to a shadow transform.
+	DirectX::XMMATRIX TileTransform(const ShadowAtlasTile& tile)const;
+	// (minU, minV, maxU, maxV) that keeps a bilinear comparison tap inside the tile.
+	DirectX::XMFLOAT4 TileUvBounds(const ShadowAtlasTile& tile)const;
 
 	void BuildDescriptors(
 		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
 		CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv,
-		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDsv);
-
-	void OnResize(UINT newWidth, UINT newHeight);
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuDsv,
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCacheCpuSrv,
+		CD3DX12_GPU_DESCRIPTOR_HANDLE hCacheGpuSrv,
+		CD3DX12_CPU_DESCRIPTOR_HANDLE hCacheCpuDsv);
 
 private:
 	void BuildDescriptors();
 	void BuildResource();
+	D3D12_RESOURCE_DESC ResourceDesc(UINT size)const;
 
 private:
 
 	ID3D12Device* md3dDevice = nullptr;
 
-	D3D12_VIEWPORT mViewport;
-	D3D12_RECT mScissorRect;
-
+	UINT64 mMemoryBudget = 0;
+	UINT64 mMemoryUsage = 0;
 	UINT mWidth = 0;
 	UINT mHeight = 0;
 	DXGI_FORMAT mFormat = DXGI_FORMAT_R24G8_TYPELESS;
 
-	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuSrv[12];
-	CD3DX12_GPU_DESCRIPTOR_HANDLE mhGpuSrv[12];
-	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuDsv[12];
+	std::unique_ptr<ShadowAtlas> mAtlas;
+
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhGpuSrv;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCpuDsv;
+
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCacheCpuSrv;
+	CD3DX12_GPU_DESCRIPTOR_HANDLE mhCacheGpuSrv;
+	CD3DX12_CPU_DESCRIPTOR_HANDLE mhCacheCpuDsv;
 
-	Microsoft::WRL::ComPtr<ID3D12Resource> mShadowMap[12];
-};
\ No newline at end of file
+	Microsoft::WRL::ComPtr<ID3D12Resource> mShadowMap;
+	Microsoft::WRL::ComPtr<ID3D12Resource> mStaticCache;
+};
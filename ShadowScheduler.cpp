@@ -0,0 +1,244 @@
+#include "ShadowScheduler.h"
+
+using namespace DirectX;
+
+static UINT NextPowerOfTwo(UINT x)
+{
+	UINT p = 1;
+	while (p < x)
+		p *= 2;
+	return p;
+}
+
+const ShadowSchedulerBudget& ShadowScheduler::GetBudget()const
+{
+	return mBudget;
+}
+
+void ShadowScheduler::SetBudget(const ShadowSchedulerBudget& budget)
+{
+	assert(budget.MinTileSize > 0 && budget.MinTileSize <= budget.MaxTileSize);
+	assert(budget.MaxRefreshInterval >= 1);
+	mBudget = budget;
+}
+
+void ShadowScheduler::Schedule(const std::vector<ShadowCandidate>& candidates, const ShadowSchedulerView& view,
+	ShadowMap& shadowMap)
+{
+	//
+	// Rank the visible lights by brightness times screen coverage.
+	//
+
+	struct Ranked
+	{
+		const ShadowCandidate* Candidate;
+		float Priority;
+		UINT Size;
+	};
+	std::vector<Ranked> ranked;
+	for (const auto& c : candidates)
+	{
+		if (c.Intensity <= 0.0f || !view.Frustum.Intersects(c.Bounds))
+			continue;
+
+		float coverage = ScreenCoverage(c.Bounds, view.EyePosW, view.TanHalfFovY);
+		float priority = c.Intensity * coverage * coverage;
+		if (priority <= 0.0f)
+			continue;
+
+		// About one shadow texel per pixel the light covers.
+		UINT size = NextPowerOfTwo((UINT)(coverage * view.ScreenHeight));
+		size = std::min<UINT>(std::max<UINT>(size, mBudget.MinTileSize), mBudget.MaxTileSize);
+		ranked.push_back({ &c, priority, size });
+	}
+	std::stable_sort(ranked.begin(), ranked.end(), [](const Ranked& a, const Ranked& b)
+	{
+		return a.Priority > b.Priority;
+	});
+	if (ranked.size() > MaxShadowedLights)
+		ranked.resize(MaxShadowedLights);
+
+	auto findSlot = [this](UINT lightIndex) -> ShadowSlot*
+	{
+		for (auto& slot : mSlots)
+		{
+			if (slot.LightIndex == lightIndex)
+				return &slot;
+		}
+		return nullptr;
+	};
+
+	// Coverage drifts as the camera moves; a tile only shrinks once it is two steps
+	// too big, so a light near the threshold does not bounce between sizes.
+	for (auto& r : ranked)
+	{
+		ShadowSlot* slot = findSlot(r.Candidate->LightIndex);
+		if (slot != nullptr && slot->Valid && slot->Tile.Size == 2 * r.Size)
+			r.Size = slot->Tile.Size;
+	}
+
+	// Halve the lowest ranked tiles first until they fit the texel budget, then drop
+	// lights from the bottom.
+	UINT64 texels = 0;
+	for (const auto& r : ranked)
+		texels += (UINT64)r.Size * r.Size;
+	for (int i = (int)ranked.size() - 1; texels > mBudget.MaxTexels && i >= 0; )
+	{
+		if (ranked[i].Size > mBudget.MinTileSize)
+		{
+			texels -= 3 * (UINT64)ranked[i].Size * ranked[i].Size / 4;
+			ranked[i].Size /= 2;
+		}
+		else
+		{
+			i--;
+		}
+	}
+	while (texels > mBudget.MaxTexels && !ranked.empty())
+	{
+		texels -= (UINT64)ranked.back().Size * ranked.back().Size;
+		ranked.pop_back();
+	}
+
+	//
+	// Move tiles: lights that dropped out or changed size give theirs back first.
+	//
+
+	std::vector<ShadowSlot> slots;
+	std::vector<bool> needsTile;
+	for (const auto& r : ranked)
+	{
+		ShadowSlot* old = findSlot(r.Candidate->LightIndex);
+		if (old != nullptr && old->Tile.Size == r.Size)
+		{
+			slots.push_back(*old);
+			needsTile.push_back(false);
+			old->Tile.Size = 0;
+		}
+		else
+		{
+			ShadowSlot slot;
+			slot.LightIndex = r.Candidate->LightIndex;
+			slot.Tile.Size = r.Size;
+			slots.push_back(slot);
+			needsTile.push_back(true);
+		}
+		slots.back().Bounds = r.Candidate->Bounds;
+		slots.back().Priority = r.Priority;
+	}
+	for (const auto& old : mSlots)
+	{
+		if (old.Tile.Size != 0)
+			shadowMap.FreeTile(old.Tile);
+	}
+
+	// Lights get tiles best ranked first; one the atlas has no room for goes unshadowed.
+	std::vector<ShadowSlot> placed;
+	for (size_t i = 0; i < slots.size(); ++i)
+	{
+		if (needsTile[i] && !shadowMap.AllocateTile(slots[i].Tile.Size, slots[i].Tile))
+			continue;
+		placed.push_back(slots[i]);
+	}
+	mSlots = std::move(placed);
+
+	//
+	// Pick the slots to render this frame.
+	//
+
+	std::vector<UINT> due;
+	for (UINT i = 0; i < (UINT)mSlots.size(); ++i)
+	{
+		auto& slot = mSlots[i];
+		const ShadowCandidate* c = nullptr;
+		for (const auto& r : ranked)
+		{
+			if (r.Candidate->LightIndex == slot.LightIndex)
+				c = r.Candidate;
+		}
+
+		// The best ranked light refreshes every frame, the next every other frame, the
+		// next two every fourth and so on.
+		slot.RefreshInterval = std::min<UINT>(NextPowerOfTwo(i + 1), mBudget.MaxRefreshInterval);
+		slot.Refresh = false;
+		slot.Dirty = slot.Dirty || !MathHelper::NearEqual(c->View, slot.View) || !MathHelper::NearEqual(c->Proj, slot.Proj);
+
+		if (!slot.Valid || (slot.Dirty && slot.Age + 1 >= slot.RefreshInterval))
+			due.push_back(i);
+	}
+
+	// New tiles first, as they cannot be sampled until drawn; then the most overdue.
+	std::stable_sort(due.begin(), due.end(), [this](UINT a, UINT b)
+	{
+		const auto& sa = mSlots[a];
+		const auto& sb = mSlots[b];
+		if (sa.Valid != sb.Valid)
+			return !sa.Valid;
+		return sa.Priority * (sa.Age + 1) > sb.Priority * (sb.Age + 1);
+	});
+	if (due.size() > mBudget.MaxViewsPerFrame)
+		due.resize(mBudget.MaxViewsPerFrame);
+
+	for (auto& slot : mSlots)
+		slot.Age++;
+
+	mRefreshCount = (UINT)due.size();
+	for (UINT i : due)
+	{
+		auto& slot = mSlots[i];
+		for (const auto& r : ranked)
+		{
+			if (r.Candidate->LightIndex != slot.LightIndex)
+				continue;
+			slot.View = r.Candidate->View;
+			slot.Proj = r.Candidate->Proj;
+		}
+		slot.Refresh = true;
+		slot.Valid = true;
+		slot.Dirty = false;
+		slot.Age = 0;
+	}
+}
+
+void ShadowScheduler::Invalidate(const BoundingBox& worldBounds)
+{
+	for (auto& slot : mSlots)
+	{
+		if (slot.Bounds.Intersects(worldBounds))
+			slot.Dirty = true;
+	}
+}
+
+void ShadowScheduler::InvalidateAll()
+{
+	for (auto& slot : mSlots)
+		slot.Dirty = true;
+}
+
+void ShadowScheduler::Reset()
+{
+	mSlots.clear();
+	mRefreshCount = 0;
+}
+
+const std::vector<ShadowSlot>& ShadowScheduler::Slots()const
+{
+	return mSlots;
+}
+
+UINT ShadowScheduler::RefreshCount()const
+{
+	return mRefreshCount;
+}
+
+float ShadowScheduler::ScreenCoverage(const BoundingSphere& bounds, const XMFLOAT3& eyePosW, float tanHalfFovY)
+{
+	float dx = bounds.Center.x - eyePosW.x;
+	float dy = bounds.Center.y - eyePosW.y;
+	float dz = bounds.Center.z - eyePosW.z;
+	float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+	if (distance <= bounds.Radius)
+		return 1.0f;
+
+	return std::min<float>(bounds.Radius / (distance * tanHalfFovY), 1.0f);
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "Common/d3dUtil.h"
+#include "ShadowMap.h"
+
+// A shadow casting light competing for a slot this frame.
+struct ShadowCandidate
+{
+	// Index of the light in FrameConstants::Lights.
+	UINT LightIndex = 0;
+	// Sphere the light reaches.
+	DirectX::BoundingSphere Bounds;
+	// Peak brightness; brighter lights rank higher.
+	float Intensity = 0.0f;
+	// Where the light would render its shadow from this frame (not transposed).
+	DirectX::XMFLOAT4X4 View = MathHelper::Identity4x4();
+	DirectX::XMFLOAT4X4 Proj = MathHelper::Identity4x4();
+};
+
+// Camera the lights are ranked for, in world space.
+struct ShadowSchedulerView
+{
+	DirectX::BoundingFrustum Frustum;
+	DirectX::XMFLOAT3 EyePosW = { 0.0f, 0.0f, 0.0f };
+	float TanHalfFovY = 1.0f;
+	UINT ScreenHeight = 1;
+};
+
+struct ShadowSchedulerBudget
+{
+	// Light shadow views re-rendered per frame, however many lights there are.
+	UINT MaxViewsPerFrame = 2;
+	// Atlas texels the light tiles may take together.
+	UINT64 MaxTexels = 2048ull * 2048;
+	UINT MinTileSize = 256;
+	UINT MaxTileSize = 1024;
+	// Frames the lowest ranked lights may lag behind their casters.
+	UINT MaxRefreshInterval = 8;
+};
+
+// A light that owns an atlas tile.
+struct ShadowSlot
+{
+	UINT LightIndex = 0;
+	DirectX::BoundingSphere Bounds;
+	ShadowAtlasTile Tile;
+	float Priority = 0.0f;
+	UINT RefreshInterval = 1;
+	// Frames since the tile was last rendered.
+	UINT Age = 0;
+	// The tile holds the light's depth, rendered with View and Proj.
+	bool Valid = false;
+	// The light or a caster it reaches moved since the tile was rendered.
+	bool Dirty = false;
+	// Render the tile this frame.
+	bool Refresh = false;
+	DirectX::XMFLOAT4X4 View = MathHelper::Identity4x4();
+	DirectX::XMFLOAT4X4 Proj = MathHelper::Identity4x4();
+};
+
+///<summary>
+/// Decides which of many shadow casting lights get shadows and how often they are
+/// redrawn.  Lights are ranked by brightness times the share of the screen they
+/// cover; the best MaxShadowedLights get an atlas tile sized to that share within
+/// a texel budget.  Higher ranks refresh every frame, lower ones every few frames,
+/// and at most MaxViewsPerFrame tiles are redrawn per frame, the most overdue first,
+/// so adding lights adds no shadow passes beyond the budget.
+///</summary>
+class ShadowScheduler
+{
+public:
+	ShadowScheduler() = default;
+	ShadowScheduler(const ShadowScheduler& rhs) = delete;
+	ShadowScheduler& operator=(const ShadowScheduler& rhs) = delete;
+	~ShadowScheduler() = default;
+
+	const ShadowSchedulerBudget& GetBudget()const;
+	void SetBudget(const ShadowSchedulerBudget& budget);
+
+	///<summary>
+	/// Ranks the candidates for this frame, moves atlas tiles between lights and
+	/// marks the slots to render.  Slots that refresh take the candidate's View and
+	/// Proj; the others keep the ones their tile was rendered with.
+	///</summary>
+	void Schedule(const std::vector<ShadowCandidate>& candidates, const ShadowSchedulerView& view,
+		ShadowMap& shadowMap);
+
+	// Marks the lights reaching into worldBounds for re-rendering.
+	void Invalidate(const DirectX::BoundingBox& worldBounds);
+	void InvalidateAll();
+
+	// Forgets every slot without freeing its tile, for when the atlas was cleared.
+	void Reset();
+
+	// At most MaxShadowedLights slots, best ranked first.
+	const std::vector<ShadowSlot>& Slots()const;
+	// Slots rendered by the last Schedule().
+	UINT RefreshCount()const;
+
+	// Share of the screen height the sphere covers, 1 when the eye is inside it.
+	static float ScreenCoverage(const DirectX::BoundingSphere& bounds, const DirectX::XMFLOAT3& eyePosW,
+		float tanHalfFovY);
+
+private:
+	ShadowSchedulerBudget mBudget;
+	std::vector<ShadowSlot> mSlots;
+	UINT mRefreshCount = 0;
+};
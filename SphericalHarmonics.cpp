@@ -0,0 +1,435 @@
+#include "SphericalHarmonics.h"
+#include <thread>
+
+using namespace DirectX;
+using namespace DirectX::PackedVector;
+
+// Cosine lobe over pi for bands 0, 1 and 2 (pi, 2pi/3, pi/4 before the division).
+static const float BandScale[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+
+// Mips past this size add nothing an L2 projection can see.
+static const UINT MaxProjectedSize = 256;
+
+static const UINT CacheMagic = 0x20394853; // "SH9 "
+static const UINT CacheVersion = 1;
+
+// Block layouts of the cube maps ProjectCubeMap reads.
+enum class CubeLayout { Rgba8, Bgra8, Bc1, Bc2, Bc3 };
+
+// Sizes of DDS_HEADER, which follows the "DDS " magic, and DDS_HEADER_DXT10.
+static const size_t DdsHeaderSize = 124;
+static const size_t DdsDx10HeaderSize = 20;
+
+static UINT ReadUInt(const std::vector<char>& file, size_t offset)
+{
+	UINT value = 0;
+	memcpy(&value, &file[offset], sizeof(value));
+	return value;
+}
+
+static UINT MakeFourCC(char a, char b, char c, char d)
+{
+	return (UINT)(BYTE)a | ((UINT)(BYTE)b << 8) | ((UINT)(BYTE)c << 16) | ((UINT)(BYTE)d << 24);
+}
+
+static size_t MipBytes(CubeLayout layout, UINT size)
+{
+	UINT blocks = std::max<UINT>(1, (size + 3) / 4);
+	switch (layout)
+	{
+	case CubeLayout::Bc1: return (size_t)blocks * blocks * 8;
+	case CubeLayout::Bc2:
+	case CubeLayout::Bc3: return (size_t)blocks * blocks * 16;
+	default: return (size_t)size * size * 4;
+	}
+}
+
+static UINT Expand565(UINT c)
+{
+	UINT r = ((c >> 11) & 31) * 255 / 31;
+	UINT g = ((c >> 5) & 63) * 255 / 63;
+	UINT b = (c & 31) * 255 / 31;
+	return r | (g << 8) | (b << 16) | 0xff000000;
+}
+
+static UINT Lerp8(UINT a, UINT b, UINT wa, UINT wb, UINT d)
+{
+	UINT result = 0;
+	for (UINT shift = 0; shift < 24; shift += 8)
+		result |= ((((a >> shift) & 0xff) * wa + ((b >> shift) & 0xff) * wb) / d) << shift;
+	return result | 0xff000000;
+}
+
+// Decodes the colour half of a BC1-BC3 block into a 4x4 block of RGBA8 texels.
+static void DecodeColorBlock(const BYTE* block, bool bc1, UINT* texels, UINT pitch)
+{
+	UINT c0 = block[0] | (block[1] << 8);
+	UINT c1 = block[2] | (block[3] << 8);
+	UINT palette[4] = { Expand565(c0), Expand565(c1) };
+	if (c0 > c1 || !bc1)
+	{
+		palette[2] = Lerp8(palette[0], palette[1], 2, 1, 3);
+		palette[3] = Lerp8(palette[0], palette[1], 1, 2, 3);
+	}
+	else
+	{
+		palette[2] = Lerp8(palette[0], palette[1], 1, 1, 2);
+		palette[3] = 0;
+	}
+
+	UINT indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((UINT)block[7] << 24);
+	for (UINT y = 0; y < 4; ++y)
+		for (UINT x = 0; x < 4; ++x)
+			texels[y * pitch + x] = palette[(indices >> (2 * (4 * y + x))) & 3];
+}
+
+// Decodes one face's mip of size*size texels at data into RGBA8 texels.
+static void DecodeFace(CubeLayout layout, const BYTE* data, UINT size, UINT* texels)
+{
+	if (layout == CubeLayout::Rgba8 || layout == CubeLayout::Bgra8)
+	{
+		memcpy(texels, data, (size_t)size * size * 4);
+		if (layout == CubeLayout::Bgra8)
+		{
+			for (size_t i = 0; i < (size_t)size * size; ++i)
+			{
+				UINT c = texels[i];
+				texels[i] = (c & 0xff00ff00) | ((c >> 16) & 0xff) | ((c & 0xff) << 16);
+			}
+		}
+		return;
+	}
+
+	// The colour half of BC2 and BC3 blocks follows 8 bytes of alpha.
+	size_t blockBytes = layout == CubeLayout::Bc1 ? 8 : 16;
+	size_t colorOffset = layout == CubeLayout::Bc1 ? 0 : 8;
+	UINT blocks = size / 4;
+	for (UINT by = 0; by < blocks; ++by)
+	{
+		for (UINT bx = 0; bx < blocks; ++bx)
+		{
+			const BYTE* block = data + ((size_t)by * blocks + bx) * blockBytes + colorOffset;
+			DecodeColorBlock(block, layout == CubeLayout::Bc1, texels + (size_t)4 * by * size + 4 * bx, size);
+		}
+	}
+}
+
+// Sums of the basis functions times r, g and b, and of the texel weights,
+// over rows [firstRow, lastRow) of the six faces laid end to end.
+static void ProjectRows(const std::vector<UINT>& texels, UINT size, bool srgb,
+	UINT firstRow, UINT lastRow, float* sums)
+{
+	XMVECTOR accR[9], accG[9], accB[9];
+	for (UINT i = 0; i < 9; ++i)
+		accR[i] = accG[i] = accB[i] = XMVectorZero();
+	XMVECTOR accWeight = XMVectorZero();
+
+	const XMVECTOR one = XMVectorReplicate(1.0f);
+	const XMVECTOR texelScale = XMVectorReplicate(2.0f / size);
+	const XMVECTOR laneOffset = XMVectorSet(0.5f, 1.5f, 2.5f, 3.5f);
+
+	for (UINT row = firstRow; row < lastRow; ++row)
+	{
+		UINT face = row / size;
+		UINT y = row % size;
+		XMVECTOR v = XMVectorReplicate((y + 0.5f) * 2.0f / size - 1.0f);
+		const UINT* rowTexels = &texels[(size_t)row * size];
+
+		for (UINT x = 0; x < size; x += 4)
+		{
+			XMVECTOR u = (XMVectorReplicate((float)x) + laneOffset) * texelScale - one;
+
+			// Face directions in D3D's cube map order, +X -X +Y -Y +Z -Z.
+			XMVECTOR dx, dy, dz;
+			switch (face)
+			{
+			case 0: dx = one; dy = -v; dz = -u; break;
+			case 1: dx = -one; dy = -v; dz = u; break;
+			case 2: dx = u; dy = one; dz = v; break;
+			case 3: dx = u; dy = -one; dz = -v; break;
+			case 4: dx = u; dy = -v; dz = one; break;
+			default: dx = -u; dy = -v; dz = -one; break;
+			}
+
+			// A texel spans a solid angle proportional to 1 / (1 + u^2 + v^2)^(3/2).
+			XMVECTOR invLength = XMVectorReciprocalSqrt(one + u * u + v * v);
+			XMVECTOR weight = invLength * invLength * invLength;
+			dx *= invLength;
+			dy *= invLength;
+			dz *= invLength;
+
+			XMVECTOR basis[9];
+			basis[0] = XMVectorReplicate(0.282095f);
+			basis[1] = 0.488603f * dy;
+			basis[2] = 0.488603f * dz;
+			basis[3] = 0.488603f * dx;
+			basis[4] = 1.092548f * dx * dy;
+			basis[5] = 1.092548f * dy * dz;
+			basis[6] = 0.315392f * (3.0f * dz * dz - one);
+			basis[7] = 1.092548f * dx * dz;
+			basis[8] = 0.546274f * (dx * dx - dy * dy);
+
+			// Four RGBA texels, transposed to a vector each of r, g and b.
+			XMVECTOR c[4];
+			for (UINT lane = 0; lane < 4; ++lane)
+			{
+				XMUBYTEN4 texel(rowTexels[x + lane]);
+				c[lane] = XMLoadUByteN4(&texel);
+				if (srgb)
+					c[lane] = XMColorSRGBToRGB(c[lane]);
+			}
+			XMMATRIX rgba = XMMatrixTranspose(XMMATRIX(c[0], c[1], c[2], c[3]));
+			XMVECTOR r = rgba.r[0] * weight;
+			XMVECTOR g = rgba.r[1] * weight;
+			XMVECTOR b = rgba.r[2] * weight;
+
+			for (UINT i = 0; i < 9; ++i)
+			{
+				accR[i] = XMVectorMultiplyAdd(basis[i], r, accR[i]);
+				accG[i] = XMVectorMultiplyAdd(basis[i], g, accG[i]);
+				accB[i] = XMVectorMultiplyAdd(basis[i], b, accB[i]);
+			}
+			accWeight += weight;
+		}
+	}
+
+	// Sum the lanes.
+	for (UINT i = 0; i < 9; ++i)
+	{
+		sums[3 * i + 0] = XMVectorGetX(XMVectorSum(accR[i]));
+		sums[3 * i + 1] = XMVectorGetX(XMVectorSum(accG[i]));
+		sums[3 * i + 2] = XMVectorGetX(XMVectorSum(accB[i]));
+	}
+	sums[27] = XMVectorGetX(XMVectorSum(accWeight));
+}
+
+// Size and last write time of filename, or false if it cannot be found.
+static bool FileStamp(const std::wstring& filename, UINT64& size, UINT64& writeTime)
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if (!GetFileAttributesExW(filename.c_str(), GetFileExInfoStandard, &attributes))
+		return false;
+	size = ((UINT64)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+	writeTime = ((UINT64)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+	return true;
+}
+
+bool SphericalHarmonics::LoadSkyIrradiance(const std::wstring& ddsFile, const std::wstring& cacheFile, SH9& sh)
+{
+	UINT64 size = 0, writeTime = 0;
+	if (!FileStamp(ddsFile, size, writeTime))
+		return false;
+
+	// The cache holds the magic, version, the source's size and write time, then
+	// nine rgb coefficients.
+	std::ifstream cacheIn(cacheFile, std::ios::binary);
+	if (cacheIn)
+	{
+		UINT magic = 0, version = 0;
+		UINT64 cachedSize = 0, cachedTime = 0;
+		float coefficients[27];
+		cacheIn.read((char*)&magic, sizeof(magic));
+		cacheIn.read((char*)&version, sizeof(version));
+		cacheIn.read((char*)&cachedSize, sizeof(cachedSize));
+		cacheIn.read((char*)&cachedTime, sizeof(cachedTime));
+		cacheIn.read((char*)coefficients, sizeof(coefficients));
+		if (cacheIn && magic == CacheMagic && version == CacheVersion &&
+			cachedSize == size && cachedTime == writeTime)
+		{
+			for (UINT i = 0; i < 9; ++i)
+				sh.C[i] = XMFLOAT4(coefficients[3 * i], coefficients[3 * i + 1], coefficients[3 * i + 2], 0.0f);
+			return true;
+		}
+	}
+	cacheIn.close();
+
+	SH9 projected;
+	if (!ProjectCubeMap(ddsFile, projected))
+		return false;
+	sh = projected;
+
+	// A cache that cannot be written only costs the next run a projection.
+	std::ofstream cacheOut(cacheFile, std::ios::binary | std::ios::trunc);
+	if (cacheOut)
+	{
+		float coefficients[27];
+		for (UINT i = 0; i < 9; ++i)
+		{
+			coefficients[3 * i + 0] = sh.C[i].x;
+			coefficients[3 * i + 1] = sh.C[i].y;
+			coefficients[3 * i + 2] = sh.C[i].z;
+		}
+		cacheOut.write((const char*)&CacheMagic, sizeof(CacheMagic));
+		cacheOut.write((const char*)&CacheVersion, sizeof(CacheVersion));
+		cacheOut.write((const char*)&size, sizeof(size));
+		cacheOut.write((const char*)&writeTime, sizeof(writeTime));
+		cacheOut.write((const char*)coefficients, sizeof(coefficients));
+	}
+	return true;
+}
+
+bool SphericalHarmonics::ProjectCubeMap(const std::wstring& ddsFile, SH9& sh)
+{
+	std::ifstream fin(ddsFile, std::ios::binary | std::ios::ate);
+	if (!fin)
+		return false;
+	std::vector<char> file((size_t)fin.tellg());
+	fin.seekg(0, std::ios::beg);
+	fin.read(file.data(), file.size());
+	fin.close();
+
+	if (file.size() < 4 + DdsHeaderSize || ReadUInt(file, 0) != MakeFourCC('D', 'D', 'S', ' '))
+		return false;
+
+	// DDS_HEADER fields, counted from the magic.
+	UINT height = ReadUInt(file, 12);
+	UINT width = ReadUInt(file, 16);
+	UINT mipCount = std::max<UINT>(1, ReadUInt(file, 28));
+	UINT pixelFlags = ReadUInt(file, 80);
+	UINT fourCC = ReadUInt(file, 84);
+	UINT bitCount = ReadUInt(file, 88);
+	UINT redMask = ReadUInt(file, 92);
+	UINT caps2 = ReadUInt(file, 112);
+	size_t dataOffset = 4 + DdsHeaderSize;
+
+	const UINT DDSCAPS2_CUBEMAP_ALLFACES = 0xfe00;
+	const UINT DDPF_FOURCC = 0x4;
+	const UINT DDPF_RGB = 0x40;
+	const UINT D3D11_RESOURCE_MISC_TEXTURECUBE = 0x4;
+
+	CubeLayout layout;
+	bool srgb = false;
+	bool cube = (caps2 & DDSCAPS2_CUBEMAP_ALLFACES) == DDSCAPS2_CUBEMAP_ALLFACES;
+	if ((pixelFlags & DDPF_FOURCC) && fourCC == MakeFourCC('D', 'X', '1', '0'))
+	{
+		if (file.size() < dataOffset + DdsDx10HeaderSize)
+			return false;
+		DXGI_FORMAT format = (DXGI_FORMAT)ReadUInt(file, dataOffset);
+		UINT miscFlag = ReadUInt(file, dataOffset + 8);
+		UINT arraySize = ReadUInt(file, dataOffset + 12);
+		cube = (miscFlag & D3D11_RESOURCE_MISC_TEXTURECUBE) && arraySize == 1;
+		dataOffset += DdsDx10HeaderSize;
+
+		switch (format)
+		{
+		case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB: srgb = true; // fall through
+		case DXGI_FORMAT_R8G8B8A8_UNORM: layout = CubeLayout::Rgba8; break;
+		case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB: srgb = true; // fall through
+		case DXGI_FORMAT_B8G8R8A8_UNORM: layout = CubeLayout::Bgra8; break;
+		case DXGI_FORMAT_BC1_UNORM_SRGB: srgb = true; // fall through
+		case DXGI_FORMAT_BC1_UNORM: layout = CubeLayout::Bc1; break;
+		case DXGI_FORMAT_BC2_UNORM_SRGB: srgb = true; // fall through
+		case DXGI_FORMAT_BC2_UNORM: layout = CubeLayout::Bc2; break;
+		case DXGI_FORMAT_BC3_UNORM_SRGB: srgb = true; // fall through
+		case DXGI_FORMAT_BC3_UNORM: layout = CubeLayout::Bc3; break;
+		default: return false;
+		}
+	}
+	else if (pixelFlags & DDPF_FOURCC)
+	{
+		if (fourCC == MakeFourCC('D', 'X', 'T', '1'))
+			layout = CubeLayout::Bc1;
+		else if (fourCC == MakeFourCC('D', 'X', 'T', '2') || fourCC == MakeFourCC('D', 'X', 'T', '3'))
+			layout = CubeLayout::Bc2;
+		else if (fourCC == MakeFourCC('D', 'X', 'T', '4') || fourCC == MakeFourCC('D', 'X', 'T', '5'))
+			layout = CubeLayout::Bc3;
+		else
+			return false;
+	}
+	else if ((pixelFlags & DDPF_RGB) && bitCount == 32)
+	{
+		layout = redMask == 0x000000ff ? CubeLayout::Rgba8 : CubeLayout::Bgra8;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (!cube || width != height || width < 4)
+		return false;
+
+	// The first mip no larger than MaxProjectedSize, kept at four texels or more
+	// for whole SIMD groups and blocks.
+	UINT level = 0;
+	while (level + 1 < mipCount && (width >> level) > MaxProjectedSize && (width >> (level + 1)) >= 4)
+		++level;
+	UINT size = width >> level;
+	if (size % 4 != 0)
+		return false;
+
+	size_t faceBytes = 0, levelOffset = 0;
+	for (UINT m = 0; m < mipCount; ++m)
+	{
+		if (m == level)
+			levelOffset = faceBytes;
+		faceBytes += MipBytes(layout, std::max<UINT>(1, width >> m));
+	}
+	if (file.size() < dataOffset + 6 * faceBytes)
+		return false;
+
+	std::vector<UINT> texels((size_t)6 * size * size);
+	for (UINT face = 0; face < 6; ++face)
+	{
+		const BYTE* data = (const BYTE*)file.data() + dataOffset + face * faceBytes + levelOffset;
+		DecodeFace(layout, data, size, &texels[(size_t)face * size * size]);
+	}
+
+	// Each thread sums a band of rows; the bands are added up afterwards.
+	UINT rowCount = 6 * size;
+	UINT threadCount = std::min<UINT>(std::max<UINT>(1, std::thread::hardware_concurrency()), rowCount);
+	std::vector<float> sums(threadCount * 28);
+	std::vector<std::thread> threads;
+	for (UINT t = 0; t < threadCount; ++t)
+	{
+		UINT firstRow = rowCount * t / threadCount;
+		UINT lastRow = rowCount * (t + 1) / threadCount;
+		threads.emplace_back(ProjectRows, std::cref(texels), size, srgb, firstRow, lastRow, &sums[t * 28]);
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	float total[28] = {};
+	for (UINT t = 0; t < threadCount; ++t)
+		for (UINT i = 0; i < 28; ++i)
+			total[i] += sums[t * 28 + i];
+
+	// The weights cover the sphere, so they are normalized to 4pi.
+	float scale = 4.0f * XM_PI / total[27];
+	for (UINT i = 0; i < 9; ++i)
+	{
+		float s = scale * BandScale[i];
+		sh.C[i] = XMFLOAT4(total[3 * i] * s, total[3 * i + 1] * s, total[3 * i + 2] * s, 0.0f);
+	}
+	return true;
+}
+
+SH9 SphericalHarmonics::Constant(const XMFLOAT3& color)
+{
+	SH9 sh = {};
+	sh.C[0] = XMFLOAT4(color.x / 0.282095f, color.y / 0.282095f, color.z / 0.282095f, 0.0f);
+	return sh;
+}
+
+XMFLOAT3 SphericalHarmonics::Evaluate(const SH9& sh, const XMFLOAT3& dir)
+{
+	float basis[9] =
+	{
+		0.282095f,
+		0.488603f * dir.y,
+		0.488603f * dir.z,
+		0.488603f * dir.x,
+		1.092548f * dir.x * dir.y,
+		1.092548f * dir.y * dir.z,
+		0.315392f * (3.0f * dir.z * dir.z - 1.0f),
+		1.092548f * dir.x * dir.z,
+		0.546274f * (dir.x * dir.x - dir.y * dir.y)
+	};
+
+	XMVECTOR sum = XMVectorZero();
+	for (UINT i = 0; i < 9; ++i)
+		sum = XMVectorMultiplyAdd(XMLoadFloat4(&sh.C[i]), XMVectorReplicate(basis[i]), sum);
+
+	XMFLOAT3 result;
+	XMStoreFloat3(&result, XMVectorMax(sum, XMVectorZero()));
+	return result;
+}
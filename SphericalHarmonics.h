@@ -0,0 +1,39 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+// L2 spherical harmonics of an RGB function: coefficient i in C[i].xyz, in the order
+// Y00, Y1-1, Y10, Y11, Y2-2, Y2-1, Y20, Y21, Y22.  w is unused, so it uploads as float4s.
+struct SH9
+{
+	DirectX::XMFLOAT4 C[9];
+};
+
+///<summary>
+/// Diffuse sky lighting as L2 spherical harmonics.  ProjectCubeMap integrates a DDS
+/// cube map against the nine basis functions on the CPU, four texels at a time and
+/// a band of rows per thread, and folds in the clamped cosine lobe: evaluated at a
+/// normal the result is the irradiance over pi, the light a white Lambertian surface
+/// reflects.  LoadSkyIrradiance caches projections on disk, keyed on the size and
+/// write time of the cube map.
+///</summary>
+class SphericalHarmonics
+{
+public:
+	///<summary>
+	/// Reads the projection of ddsFile from cacheFile, or projects it and writes the
+	/// cache.  Returns false, leaving sh alone, if the cube map cannot be projected.
+	///</summary>
+	static bool LoadSkyIrradiance(const std::wstring& ddsFile, const std::wstring& cacheFile, SH9& sh);
+
+	///<summary>
+	/// Projects the cube map in ddsFile from its first mip no larger than 256 texels.
+	/// Takes 8-bit RGBA/BGRA and BC1-BC3 maps; false for anything else.
+	///</summary>
+	static bool ProjectCubeMap(const std::wstring& ddsFile, SH9& sh);
+
+	// Evaluates to color in every direction.
+	static SH9 Constant(const DirectX::XMFLOAT3& color);
+
+	// sh in unit direction dir, as SkyAmbient in Common.hlsl.
+	static DirectX::XMFLOAT3 Evaluate(const SH9& sh, const DirectX::XMFLOAT3& dir);
+};
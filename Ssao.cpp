@@ -69,7 +69,7 @@ std::vector<float> Ssao::CalcGaussWeights(float sigma)
 
 ID3D12Resource* Ssao::NormalMap()
 {
-    return mNormalMap.Get();
+    return mNormalMap;
 }
 
 ID3D12Resource* Ssao::AmbientMap()
@@ -97,6 +97,8 @@ void Ssao::BuildDescriptors(
     CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
     CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv,
     CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuRtv,
+    CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuUav,
+    CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuUav,
     UINT cbvSrvUavDescriptorSize,
     UINT rtvDescriptorSize)
 {
@@ -119,6 +121,22 @@ void Ssao::BuildDescriptors(
     mhAmbientMap0CpuRtv = hCpuRtv.Offset(1, rtvDescriptorSize);
     mhAmbientMap1CpuRtv = hCpuRtv.Offset(1, rtvDescriptorSize);
 
+    // And for 6 contiguous descriptors of the compute path: the ambient map Uavs,
+    // then the history map Srvs and Uavs.
+    mhAmbientMap0CpuUav = hCpuUav;
+    mhAmbientMap1CpuUav = hCpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapCpuSrvs[0] = hCpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapCpuSrvs[1] = hCpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapCpuUavs[0] = hCpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapCpuUavs[1] = hCpuUav.Offset(1, cbvSrvUavDescriptorSize);
+
+    mhAmbientMap0GpuUav = hGpuUav;
+    mhAmbientMap1GpuUav = hGpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapGpuSrvs[0] = hGpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapGpuSrvs[1] = hGpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapGpuUavs[0] = hGpuUav.Offset(1, cbvSrvUavDescriptorSize);
+    mhHistoryMapGpuUavs[1] = hGpuUav.Offset(1, cbvSrvUavDescriptorSize);
+
     //  Create the descriptors
     RebuildDescriptors(depthStencilBuffer);
 }
@@ -128,10 +146,10 @@ void Ssao::RebuildDescriptors(ID3D12Resource* depthStencilBuffer)
     D3D12_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
     srvDesc.Shader4ComponentMapping = D3D12_DEFAULT_SHADER_4_COMPONENT_MAPPING;
     srvDesc.ViewDimension = D3D12_SRV_DIMENSION_TEXTURE2D;
-    srvDesc.Format = NormalMapFormat;
+    srvDesc.Format = mNormalMapFormat;
     srvDesc.Texture2D.MostDetailedMip = 0;
     srvDesc.Texture2D.MipLevels = 1;
-    md3dDevice->CreateShaderResourceView(mNormalMap.Get(), &srvDesc, mhNormalMapCpuSrv);
+    md3dDevice->CreateShaderResourceView(mNormalMap, &srvDesc, mhNormalMapCpuSrv);
 
     srvDesc.Format = DXGI_FORMAT_R24_UNORM_X8_TYPELESS;
     md3dDevice->CreateShaderResourceView(depthStencilBuffer, &srvDesc, mhDepthMapCpuSrv);
@@ -148,11 +166,40 @@ void Ssao::RebuildDescriptors(ID3D12Resource* depthStencilBuffer)
     rtvDesc.Format = NormalMapFormat;
     rtvDesc.Texture2D.MipSlice = 0;
     rtvDesc.Texture2D.PlaneSlice = 0;
-    md3dDevice->CreateRenderTargetView(mNormalMap.Get(), &rtvDesc, mhNormalMapCpuRtv);
+    // The G-buffer renders its own normals.
+    if (!mNormalsFromGBuffer)
+        md3dDevice->CreateRenderTargetView(mNormalMap, &rtvDesc, mhNormalMapCpuRtv);
 
     rtvDesc.Format = AmbientMapFormat;
     md3dDevice->CreateRenderTargetView(mAmbientMap0.Get(), &rtvDesc, mhAmbientMap0CpuRtv);
     md3dDevice->CreateRenderTargetView(mAmbientMap1.Get(), &rtvDesc, mhAmbientMap1CpuRtv);
+
+    D3D12_UNORDERED_ACCESS_VIEW_DESC uavDesc = {};
+    uavDesc.ViewDimension = D3D12_UAV_DIMENSION_TEXTURE2D;
+    uavDesc.Format = AmbientMapFormat;
+    uavDesc.Texture2D.MipSlice = 0;
+    md3dDevice->CreateUnorderedAccessView(mAmbientMap0.Get(), nullptr, &uavDesc, mhAmbientMap0CpuUav);
+    md3dDevice->CreateUnorderedAccessView(mAmbientMap1.Get(), nullptr, &uavDesc, mhAmbientMap1CpuUav);
+
+    srvDesc.Format = HistoryMapFormat;
+    uavDesc.Format = HistoryMapFormat;
+    for (int i = 0; i < 2; ++i)
+    {
+        md3dDevice->CreateShaderResourceView(mHistoryMaps[i].Get(), &srvDesc, mhHistoryMapCpuSrvs[i]);
+        md3dDevice->CreateUnorderedAccessView(mHistoryMaps[i].Get(), nullptr, &uavDesc, mhHistoryMapCpuUavs[i]);
+    }
+}
+
+void Ssao::SetNormalMap(ID3D12Resource* normalMap, DXGI_FORMAT format, bool fromGBuffer)
+{
+    mNormalMap = normalMap;
+    mNormalMapFormat = format;
+    mNormalsFromGBuffer = fromGBuffer;
+}
+
+bool Ssao::NormalsFromGBuffer()const
+{
+    return mNormalsFromGBuffer;
 }
 
 void Ssao::SetPSOs(ID3D12PipelineState* ssaoPso, ID3D12PipelineState* ssaoBlurPso)
@@ -161,6 +208,12 @@ void Ssao::SetPSOs(ID3D12PipelineState* ssaoPso, ID3D12PipelineState* ssaoBlurPs
     mBlurPso = ssaoBlurPso;
 }
 
+void Ssao::SetComputePSOs(ID3D12PipelineState* ssaoBlurPso, ID3D12PipelineState* temporalPso)
+{
+    mBlurComputePso = ssaoBlurPso;
+    mTemporalPso = temporalPso;
+}
+
 void Ssao::OnResize(UINT newWidth, UINT newHeight)
 {
     if (mRenderTargetWidth != newWidth || mRenderTargetHeight != newHeight)
@@ -187,14 +240,20 @@ void Ssao::ComputeSsao(
     FrameResource* currFrame,
     int blurCount)
 {
+    // Only the compute path keeps a history.
+    mHistoryValid = false;
+
     cmdList->RSSetViewports(1, &mViewport);
     cmdList->RSSetScissorRects(1, &mScissorRect);
 
     // We compute the initial SSAO to AmbientMap0.
 
+    mBarriers.ResetCounters();
+
     // Change to RENDER_TARGET.
-    cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mAmbientMap0.Get(),
-        D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET));
+    mBarriers.Transition(mAmbientMap0.Get(),
+        D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET);
+    mBarriers.Flush(cmdList);
 
     float clearValue[] = { 1.0f, 1.0f, 1.0f, 1.0f };
     cmdList->ClearRenderTargetView(mhAmbientMap0CpuRtv, clearValue, 0, nullptr);
@@ -222,10 +281,111 @@ void Ssao::ComputeSsao(
     cmdList->DrawInstanced(6, 1, 0, 0);
 
     // Change back to GENERIC_READ so we can read the texture in a shader.
-    cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mAmbientMap0.Get(),
-        D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ));
+    mBarriers.Transition(mAmbientMap0.Get(),
+        D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ);
 
     BlurAmbientMap(cmdList, currFrame, blurCount);
+
+    mBarriers.Flush(cmdList);
+}
+
+void Ssao::DispatchSsao(
+    ID3D12GraphicsCommandList* cmdList,
+    FrameResource* currFrame,
+    ID3D12PipelineState* aoPso,
+    int blurCount,
+    bool temporal)
+{
+    // The temporal pass and each blur ping-pong once, so start on the map that leaves
+    // the result in AmbientMap0.
+    ID3D12Resource* maps[2] = { mAmbientMap0.Get(), mAmbientMap1.Get() };
+    CD3DX12_GPU_DESCRIPTOR_HANDLE srvs[2] = { mhAmbientMap0GpuSrv, mhAmbientMap1GpuSrv };
+    CD3DX12_GPU_DESCRIPTOR_HANDLE uavs[2] = { mhAmbientMap0GpuUav, mhAmbientMap1GpuUav };
+    int output = (blurCount + (temporal ? 1 : 0)) % 2;
+
+    // 16x16 threads per group, see SsaoCompute.hlsl.
+    UINT groupsX = (SsaoMapWidth() + 15) / 16;
+    UINT groupsY = (SsaoMapHeight() + 15) / 16;
+
+    mBarriers.ResetCounters();
+
+    mBarriers.Transition(maps[output],
+        D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+    mBarriers.Flush(cmdList);
+
+    // Bind the constant buffer for this pass.
+    auto ssaoCBAddress = currFrame->SsaoCB->Resource()->GetGPUVirtualAddress();
+    cmdList->SetComputeRootConstantBufferView(0, ssaoCBAddress);
+
+    // Bind the normal, depth and random vector maps.
+    cmdList->SetComputeRootDescriptorTable(1, mhNormalMapGpuSrv);
+
+    cmdList->SetPipelineState(aoPso);
+    cmdList->SetComputeRootDescriptorTable(3, uavs[output]);
+    cmdList->Dispatch(groupsX, groupsY, 1);
+
+    mBarriers.Transition(maps[output],
+        D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_GENERIC_READ);
+
+    if (temporal)
+    {
+        int input = output;
+        output = 1 - input;
+        ID3D12Resource* history = mHistoryMaps[1 - mHistoryIndex].Get();
+
+        mBarriers.Transition(maps[output],
+            D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        mBarriers.Transition(history,
+            D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        mBarriers.Flush(cmdList);
+
+        // The constant buffer drops a history that is not valid, so it is bound regardless.
+        cmdList->SetPipelineState(mTemporalPso);
+        cmdList->SetComputeRootDescriptorTable(2, srvs[input]);
+        cmdList->SetComputeRootDescriptorTable(3, uavs[output]);
+        cmdList->SetComputeRootDescriptorTable(4, mhHistoryMapGpuSrvs[mHistoryIndex]);
+        cmdList->SetComputeRootDescriptorTable(5, mhHistoryMapGpuUavs[1 - mHistoryIndex]);
+        cmdList->Dispatch(groupsX, groupsY, 1);
+
+        mBarriers.Transition(maps[output],
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_GENERIC_READ);
+        mBarriers.Transition(history,
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_GENERIC_READ);
+
+        mHistoryIndex = 1 - mHistoryIndex;
+    }
+    mHistoryValid = temporal;
+
+    cmdList->SetPipelineState(mBlurComputePso);
+    for (int i = 0; i < blurCount; ++i)
+    {
+        int input = output;
+        output = 1 - input;
+
+        // Flushed together with the input's transition back to GENERIC_READ.
+        mBarriers.Transition(maps[output],
+            D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_UNORDERED_ACCESS);
+        mBarriers.Flush(cmdList);
+
+        cmdList->SetComputeRootDescriptorTable(2, srvs[input]);
+        cmdList->SetComputeRootDescriptorTable(3, uavs[output]);
+        cmdList->Dispatch(groupsX, groupsY, 1);
+
+        mBarriers.Transition(maps[output],
+            D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_GENERIC_READ);
+    }
+
+    mBarriers.Flush(cmdList);
+}
+
+bool Ssao::HistoryValid()const
+{
+    return mHistoryValid;
+}
+
+UINT Ssao::BarrierCallCount()const
+{
+    return mBarriers.CallCount();
 }
 
 void Ssao::BlurAmbientMap(ID3D12GraphicsCommandList* cmdList, FrameResource* currFrame, int blurCount)
@@ -265,8 +425,10 @@ void Ssao::BlurAmbientMap(ID3D12GraphicsCommandList* cmdList, bool horzBlur)
         cmdList->SetGraphicsRoot32BitConstant(1, 0, 0);
     }
 
-    cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(output,
-        D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET));
+    // Flushed together with the input's transition back to GENERIC_READ.
+    mBarriers.Transition(output,
+        D3D12_RESOURCE_STATE_GENERIC_READ, D3D12_RESOURCE_STATE_RENDER_TARGET);
+    mBarriers.Flush(cmdList);
 
     float clearValue[] = { 1.0f, 1.0f, 1.0f, 1.0f };
     cmdList->ClearRenderTargetView(outputRtv, clearValue, 0, nullptr);
@@ -288,49 +450,39 @@ void Ssao::BlurAmbientMap(ID3D12GraphicsCommandList* cmdList, bool horzBlur)
     cmdList->IASetPrimitiveTopology(D3D_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
     cmdList->DrawInstanced(6, 1, 0, 0);
 
-    cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(output,
-        D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ));
+    mBarriers.Transition(output,
+        D3D12_RESOURCE_STATE_RENDER_TARGET, D3D12_RESOURCE_STATE_GENERIC_READ);
 }
 
 void Ssao::BuildResources()
 {
     // Free the old resources if they exist.
-    mNormalMap = nullptr;
     mAmbientMap0 = nullptr;
     mAmbientMap1 = nullptr;
+    mHistoryMaps[0] = nullptr;
+    mHistoryMaps[1] = nullptr;
+    mHistoryValid = false;
 
     D3D12_RESOURCE_DESC texDesc;
     ZeroMemory(&texDesc, sizeof(D3D12_RESOURCE_DESC));
     texDesc.Dimension = D3D12_RESOURCE_DIMENSION_TEXTURE2D;
     texDesc.Alignment = 0;
-    texDesc.Width = mRenderTargetWidth;
-    texDesc.Height = mRenderTargetHeight;
     texDesc.DepthOrArraySize = 1;
     texDesc.MipLevels = 1;
-    texDesc.Format = Ssao::NormalMapFormat;
     texDesc.SampleDesc.Count = 1;
     texDesc.SampleDesc.Quality = 0;
     texDesc.Layout = D3D12_TEXTURE_LAYOUT_UNKNOWN;
-    texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET;
-
 
-    float normalClearColor[] = { 0.0f, 0.0f, 1.0f, 0.0f };
-    CD3DX12_CLEAR_VALUE optClear(NormalMapFormat, normalClearColor);
-    ThrowIfFailed(md3dDevice->CreateCommittedResource(
-        &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
-        D3D12_HEAP_FLAG_NONE,
-        &texDesc,
-        D3D12_RESOURCE_STATE_GENERIC_READ,
-        &optClear,
-        IID_PPV_ARGS(&mNormalMap)));
-
-    // Ambient occlusion maps are at half resolution.
+    // Ambient occlusion maps are at half resolution; the normal map is the render
+    // graph's, see SetNormalMap.
     texDesc.Width = mRenderTargetWidth / 2;
     texDesc.Height = mRenderTargetHeight / 2;
     texDesc.Format = Ssao::AmbientMapFormat;
+    // Rendered by the pixel shader path, written as UAVs by the compute path.
+    texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_RENDER_TARGET | D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
 
     float ambientClearColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-    optClear = CD3DX12_CLEAR_VALUE(AmbientMapFormat, ambientClearColor);
+    CD3DX12_CLEAR_VALUE optClear(AmbientMapFormat, ambientClearColor);
 
     ThrowIfFailed(md3dDevice->CreateCommittedResource(
         &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
@@ -347,6 +499,21 @@ void Ssao::BuildResources()
         D3D12_RESOURCE_STATE_GENERIC_READ,
         &optClear,
         IID_PPV_ARGS(&mAmbientMap1)));
+
+    // The history is only written by the temporal compute pass.
+    texDesc.Format = Ssao::HistoryMapFormat;
+    texDesc.Flags = D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        ThrowIfFailed(md3dDevice->CreateCommittedResource(
+            &CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+            D3D12_HEAP_FLAG_NONE,
+            &texDesc,
+            D3D12_RESOURCE_STATE_GENERIC_READ,
+            nullptr,
+            IID_PPV_ARGS(&mHistoryMaps[i])));
+    }
 }
 
 void Ssao::BuildRandomVectorTexture(ID3D12GraphicsCommandList* cmdList)
@@ -5,6 +5,7 @@
 
 #include "Common/d3dUtil.h"
 #include "FrameResource.h"
+#include "BarrierBatcher.h"
 
 
 class Ssao
@@ -20,6 +21,8 @@ public:
 
     static const DXGI_FORMAT AmbientMapFormat = DXGI_FORMAT_R16_UNORM;
     static const DXGI_FORMAT NormalMapFormat = DXGI_FORMAT_R16G16B16A16_FLOAT;
+    // Ambient, view depth and octahedral world normal of the temporal mode.
+    static const DXGI_FORMAT HistoryMapFormat = DXGI_FORMAT_R16G16B16A16_FLOAT;
 
     static const int MaxBlurRadius = 5;
 
@@ -42,12 +45,25 @@ public:
         CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuSrv,
         CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuSrv,
         CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuRtv,
+        CD3DX12_CPU_DESCRIPTOR_HANDLE hCpuUav,
+        CD3DX12_GPU_DESCRIPTOR_HANDLE hGpuUav,
         UINT cbvSrvUavDescriptorSize,
         UINT rtvDescriptorSize);
 
     void RebuildDescriptors(ID3D12Resource* depthStencilBuffer);
 
+    ///<summary>
+    /// Reads normals from normalMap, a render graph texture of format.  With
+    /// fromGBuffer its rg hold an octahedral world space normal as the G-buffer
+    /// stores it; otherwise it is the view space normal map of the normal and depth
+    /// prepass, NormalMapFormat, which NormalMapRtv renders to.  Takes effect at the
+    /// next RebuildDescriptors.
+    ///</summary>
+    void SetNormalMap(ID3D12Resource* normalMap, DXGI_FORMAT format, bool fromGBuffer);
+    bool NormalsFromGBuffer()const;
+
     void SetPSOs(ID3D12PipelineState* ssaoPso, ID3D12PipelineState* ssaoBlurPso);
+    void SetComputePSOs(ID3D12PipelineState* ssaoBlurPso, ID3D12PipelineState* temporalPso);
 
     ///<summary>
     /// Call when the backbuffer is resized.  
@@ -65,6 +81,26 @@ public:
         FrameResource* currFrame,
         int blurCount);
 
+    ///<summary>
+    /// Compute shader version of ComputeSsao: one dispatch of aoPso, SsaoCS or one of
+    /// the GtaoCS tiers, for the ambient map and one per blur, each blur running both
+    /// directions over tiles cached in groupshared memory.  temporal blends the
+    /// ambient map into the history before the blur.  The caller binds the compute
+    /// root signature (CBV b0, SRV tables t0-t2, t3 and t4, UAV tables u0 and u1)
+    /// and leaves the normal and depth maps readable by non-pixel shaders.
+    ///</summary>
+    void DispatchSsao(
+        ID3D12GraphicsCommandList* cmdList,
+        FrameResource* currFrame,
+        ID3D12PipelineState* aoPso,
+        int blurCount,
+        bool temporal);
+
+    // The last DispatchSsao() left a history the next temporal one can reproject.
+    bool HistoryValid()const;
+
+    // ResourceBarrier calls made by the last ComputeSsao().
+    UINT BarrierCallCount()const;
 
 private:
 
@@ -89,12 +125,20 @@ private:
 
     ID3D12PipelineState* mSsaoPso = nullptr;
     ID3D12PipelineState* mBlurPso = nullptr;
+    ID3D12PipelineState* mBlurComputePso = nullptr;
+    ID3D12PipelineState* mTemporalPso = nullptr;
 
     Microsoft::WRL::ComPtr<ID3D12Resource> mRandomVectorMap;
     Microsoft::WRL::ComPtr<ID3D12Resource> mRandomVectorMapUploadBuffer;
-    Microsoft::WRL::ComPtr<ID3D12Resource> mNormalMap;
+    // Owned by the render graph, see SetNormalMap.
+    ID3D12Resource* mNormalMap = nullptr;
+    DXGI_FORMAT mNormalMapFormat = NormalMapFormat;
+    bool mNormalsFromGBuffer = false;
     Microsoft::WRL::ComPtr<ID3D12Resource> mAmbientMap0;
     Microsoft::WRL::ComPtr<ID3D12Resource> mAmbientMap1;
+    // Ping-ponged every temporal frame: one holds the last frame's history, the other
+    // takes this frame's.
+    Microsoft::WRL::ComPtr<ID3D12Resource> mHistoryMaps[2];
 
     CD3DX12_CPU_DESCRIPTOR_HANDLE mhNormalMapCpuSrv;
     CD3DX12_GPU_DESCRIPTOR_HANDLE mhNormalMapGpuSrv;
@@ -115,6 +159,21 @@ private:
     CD3DX12_GPU_DESCRIPTOR_HANDLE mhAmbientMap1GpuSrv;
     CD3DX12_CPU_DESCRIPTOR_HANDLE mhAmbientMap1CpuRtv;
 
+    // Written by the compute path.
+    CD3DX12_CPU_DESCRIPTOR_HANDLE mhAmbientMap0CpuUav;
+    CD3DX12_GPU_DESCRIPTOR_HANDLE mhAmbientMap0GpuUav;
+    CD3DX12_CPU_DESCRIPTOR_HANDLE mhAmbientMap1CpuUav;
+    CD3DX12_GPU_DESCRIPTOR_HANDLE mhAmbientMap1GpuUav;
+
+    CD3DX12_CPU_DESCRIPTOR_HANDLE mhHistoryMapCpuSrvs[2];
+    CD3DX12_GPU_DESCRIPTOR_HANDLE mhHistoryMapGpuSrvs[2];
+    CD3DX12_CPU_DESCRIPTOR_HANDLE mhHistoryMapCpuUavs[2];
+    CD3DX12_GPU_DESCRIPTOR_HANDLE mhHistoryMapGpuUavs[2];
+
+    // History map holding the last frame's result.
+    int mHistoryIndex = 0;
+    bool mHistoryValid = false;
+
     UINT mRenderTargetWidth;
     UINT mRenderTargetHeight;
 
@@ -122,6 +181,10 @@ private:
 
     D3D12_VIEWPORT mViewport;
     D3D12_RECT mScissorRect;
+
+    // The blur passes ping-pong, so the barrier that releases one ambient map
+    // goes out in the same call as the one that acquires the other.
+    BarrierBatcher mBarriers;
 };
 
 #endif // SSAO_H
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include "Test.h"
+#include "ClusteredLights.h"
+
+using namespace DirectX;
+
+namespace
+{
+	const float NearZ = 1.0f;
+	const float FarZ = 1000.0f;
+
+	UINT Froxel(UINT x, UINT y, UINT z)
+	{
+		return (z * ClusterCountY + y) * ClusterCountX + x;
+	}
+
+	// A 90 degree, 2:1 projection, so tiles are square.
+	XMFLOAT4X4 Projection()
+	{
+		XMFLOAT4X4 proj;
+		XMStoreFloat4x4(&proj, XMMatrixPerspectiveFovLH(0.5f * XM_PI, 2.0f, NearZ, FarZ));
+		return proj;
+	}
+
+	// View depth where slice z starts, from the published log2 mapping.
+	float SliceDepth(const ClusteredLights& clusters, UINT z)
+	{
+		return exp2f((z - clusters.ZBias()) / clusters.ZScale());
+	}
+
+	// Whether a view space sphere reaches the view space box around the eight
+	// corners of a froxel, the bounds Build tests against.
+	bool Overlaps(const ClusteredLights& clusters, const XMFLOAT4X4& proj, UINT x, UINT y, UINT z,
+		const XMFLOAT3& c, float r)
+	{
+		float zn = SliceDepth(clusters, z);
+		float zf = SliceDepth(clusters, z + 1);
+		XMFLOAT3 boxMin(FLT_MAX, FLT_MAX, zn);
+		XMFLOAT3 boxMax(-FLT_MAX, -FLT_MAX, zf);
+		for (UINT corner = 0; corner < 8; ++corner)
+		{
+			float depth = corner & 4 ? zf : zn;
+			float ndcX = -1.0f + 2.0f * (x + (corner & 1)) / ClusterCountX;
+			float ndcY = 1.0f - 2.0f * (y + (corner >> 1 & 1)) / ClusterCountY;
+			float viewX = ndcX * depth / proj.m[0][0];
+			float viewY = ndcY * depth / proj.m[1][1];
+			boxMin.x = std::min(boxMin.x, viewX);
+			boxMax.x = std::max(boxMax.x, viewX);
+			boxMin.y = std::min(boxMin.y, viewY);
+			boxMax.y = std::max(boxMax.y, viewY);
+		}
+
+		float dx = std::max(std::max(boxMin.x - c.x, c.x - boxMax.x), 0.0f);
+		float dy = std::max(std::max(boxMin.y - c.y, c.y - boxMax.y), 0.0f);
+		float dz = std::max(std::max(boxMin.z - c.z, c.z - boxMax.z), 0.0f);
+		return dx * dx + dy * dy + dz * dz <= r * r;
+	}
+
+	Light PointLight(const XMFLOAT3& position, float radius)
+	{
+		Light light;
+		light.Position = position;
+		light.FalloffEnd = radius;
+		light.SpotPower = 0.0f;
+		return light;
+	}
+
+	// Froxels whose run holds light.
+	std::vector<UINT> FroxelsOf(const ClusteredLights& clusters, UINT light)
+	{
+		std::vector<UINT> froxels;
+		for (UINT i = 0; i < ClusteredLights::ClusterCount; ++i)
+		{
+			const ClusterRange& range = clusters.Clusters()[i];
+			for (UINT j = 0; j < range.Count; ++j)
+			{
+				if (clusters.LightIndices()[range.Offset + j] == light)
+					froxels.push_back(i);
+			}
+		}
+		return froxels;
+	}
+}
+
+TEST(ClusteredLightsSphereOnFroxelCorner)
+{
+	XMFLOAT4X4 proj = Projection();
+	ClusteredLights clusters;
+	clusters.SetProjection(proj, NearZ, FarZ);
+
+	// Centred where tiles (7, 3), (8, 3), (7, 4) and (8, 4) meet, on the start of
+	// slice 10, with a radius well inside all eight froxels around that point.
+	// The camera sits at (0, 0, -5) looking down +z.
+	float z = SliceDepth(clusters, 10);
+	XMFLOAT4X4 view;
+	XMStoreFloat4x4(&view, XMMatrixTranslation(0.0f, 0.0f, 5.0f));
+	std::vector<Light> lights = { PointLight(XMFLOAT3(0.0f, 0.0f, z - 5.0f), 0.05f * z) };
+	clusters.Build(lights, view);
+
+	CHECK(clusters.LightCount() == 1);
+	CHECK(clusters.DroppedIndexCount() == 0);
+	std::vector<UINT> expected =
+	{
+		Froxel(7, 3, 9), Froxel(8, 3, 9), Froxel(7, 4, 9), Froxel(8, 4, 9),
+		Froxel(7, 3, 10), Froxel(8, 3, 10), Froxel(7, 4, 10), Froxel(8, 4, 10),
+	};
+	CHECK(FroxelsOf(clusters, 0) == expected);
+	CHECK(clusters.LightIndices().size() == expected.size());
+}
+
+TEST(ClusteredLightsMatchesFroxelBounds)
+{
+	XMFLOAT4X4 proj = Projection();
+	ClusteredLights clusters;
+	clusters.SetProjection(proj, NearZ, FarZ);
+
+	// Spheres across tile and slice edges, partly off screen, crossing the near
+	// plane, and one entirely behind the camera, seen through the identity view.
+	std::vector<Light> lights =
+	{
+		PointLight(XMFLOAT3(0.3f, -0.2f, 4.0f), 1.5f),
+		PointLight(XMFLOAT3(-30.0f, 12.0f, 40.0f), 9.0f),
+		PointLight(XMFLOAT3(1.0f, 1.0f, 0.5f), 2.0f),
+		PointLight(XMFLOAT3(500.0f, 0.0f, 600.0f), 120.0f),
+		PointLight(XMFLOAT3(0.0f, 0.0f, -10.0f), 3.0f),
+	};
+	clusters.Build(lights, MathHelper::Identity4x4());
+	CHECK(clusters.DroppedIndexCount() == 0);
+
+	for (UINT i = 0; i < (UINT)lights.size(); ++i)
+	{
+		std::vector<UINT> expected;
+		for (UINT z = 0; z < ClusterCountZ; ++z)
+		{
+			for (UINT y = 0; y < ClusterCountY; ++y)
+			{
+				for (UINT x = 0; x < ClusterCountX; ++x)
+				{
+					if (Overlaps(clusters, proj, x, y, z, lights[i].Position, lights[i].FalloffEnd))
+						expected.push_back(Froxel(x, y, z));
+				}
+			}
+		}
+		CHECK(FroxelsOf(clusters, i) == expected);
+		CHECK(!expected.empty() || i == 4);
+	}
+}
+
+TEST(ClusteredLightsDropsIndicesPastTheList)
+{
+	ClusteredLights clusters;
+	clusters.SetProjection(Projection(), NearZ, FarZ);
+
+	// 100 lights that each reach every froxel: 100 * ClusterCount hits, more
+	// than the index list holds.  Runs are laid out froxel by froxel, so the
+	// first froxels keep all 100, one is cut short and the rest get nothing.
+	std::vector<Light> lights(100, PointLight(XMFLOAT3(0.0f, 0.0f, 500.0f), 1e5f));
+	clusters.Build(lights, MathHelper::Identity4x4());
+
+	const UINT full = MaxClusterLightIndices / 100;
+	const UINT rest = MaxClusterLightIndices % 100;
+	CHECK(clusters.DroppedIndexCount() == 100 * ClusteredLights::ClusterCount - MaxClusterLightIndices);
+	CHECK(clusters.LightIndices().size() == MaxClusterLightIndices);
+
+	const auto& ranges = clusters.Clusters();
+	CHECK(ranges[full - 1].Count == 100);
+	CHECK(ranges[full].Count == rest);
+	CHECK(ranges[full].Offset == 100 * full);
+	CHECK(ranges[full + 1].Count == 0);
+	CHECK(ranges[full + 1].Offset == MaxClusterLightIndices);
+
+	// The froxel cut short keeps the first lights.
+	for (UINT j = 0; j < rest; ++j)
+		CHECK(clusters.LightIndices()[ranges[full].Offset + j] == j);
+
+	// With room again nothing is dropped.
+	lights.resize(10);
+	clusters.Build(lights, MathHelper::Identity4x4());
+	CHECK(clusters.DroppedIndexCount() == 0);
+	CHECK(clusters.LightIndices().size() == 10 * ClusteredLights::ClusterCount);
+}
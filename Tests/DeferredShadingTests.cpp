@@ -0,0 +1,137 @@
+#include "Test.h"
+#include "DeferredShading.h"
+
+using namespace DirectX;
+
+namespace
+{
+	// Unit directions spread evenly over the sphere on a Fibonacci spiral, so
+	// every octant and both hemispheres of the octahedral map are covered.
+	std::vector<XMFLOAT3> SphereDirections(UINT count)
+	{
+		std::vector<XMFLOAT3> directions;
+		const float goldenAngle = XM_PI * (3.0f - sqrtf(5.0f));
+		for (UINT i = 0; i < count; ++i)
+		{
+			float z = 1.0f - 2.0f * (i + 0.5f) / count;
+			float r = sqrtf(1.0f - z * z);
+			directions.push_back(XMFLOAT3(r * cosf(i * goldenAngle), r * sinf(i * goldenAngle), z));
+		}
+		return directions;
+	}
+
+	float AngleBetween(const XMFLOAT3& a, const XMFLOAT3& b)
+	{
+		float cosAngle = XMVectorGetX(XMVector3Dot(XMLoadFloat3(&a), XMLoadFloat3(&b)));
+		return acosf(MathHelper::Clamp(cosAngle, -1.0f, 1.0f));
+	}
+}
+
+TEST(DeferredShadingOctahedralRoundTrip)
+{
+	// Unquantized the mapping is exact up to float rounding.
+	for (const XMFLOAT3& n : SphereDirections(1000))
+	{
+		XMFLOAT2 e = DeferredShading::OctEncode(n);
+		CHECK(fabsf(e.x) <= 1.0f && fabsf(e.y) <= 1.0f);
+		CHECK(AngleBetween(DeferredShading::OctDecode(e), n) < 1e-3f);
+	}
+
+	// The poles land on the centre and the corners of the square.
+	XMFLOAT2 up = DeferredShading::OctEncode(XMFLOAT3(0.0f, 0.0f, 1.0f));
+	XMFLOAT2 down = DeferredShading::OctEncode(XMFLOAT3(0.0f, 0.0f, -1.0f));
+	CHECK(up.x == 0.0f && up.y == 0.0f);
+	CHECK(fabsf(down.x) == 1.0f && fabsf(down.y) == 1.0f);
+	CHECK_NEAR(DeferredShading::OctDecode(down).z, -1.0f, 1e-6f);
+}
+
+TEST(DeferredShadingGBufferNormalError)
+{
+	// 10 bits per axis of the octahedral square: a step of 2/1023, which costs
+	// at most about a quarter of a degree where the map stretches most.
+	float maxError = 0.0f;
+	for (const XMFLOAT3& n : SphereDirections(10000))
+	{
+		GBufferSample sample = {};
+		sample.NormalW = n;
+		GBufferSample decoded = DeferredShading::DecodeGBuffer(DeferredShading::EncodeGBuffer(sample));
+		CHECK_NEAR(XMVectorGetX(XMVector3Length(XMLoadFloat3(&decoded.NormalW))), 1.0f, 1e-5f);
+		maxError = std::max(maxError, AngleBetween(decoded.NormalW, n));
+	}
+	CHECK(maxError < XMConvertToRadians(0.25f));
+}
+
+TEST(DeferredShadingGBufferAlbedoAndMaterial)
+{
+	// Albedo and metalness keep 8 bits, roughness 10, each rounded to the
+	// nearest step; values outside [0, 1] clamp as the UNORM targets do.
+	for (UINT i = 0; i <= 1000; ++i)
+	{
+		float x = i / 1000.0f;
+		GBufferSample sample = {};
+		sample.Albedo = XMFLOAT3(x, 1.0f - x, 0.5f * x);
+		sample.Metalness = 1.0f - x;
+		sample.NormalW = XMFLOAT3(0.0f, 1.0f, 0.0f);
+		sample.Roughness = x;
+
+		GBufferSample decoded = DeferredShading::DecodeGBuffer(DeferredShading::EncodeGBuffer(sample));
+		CHECK_NEAR(decoded.Albedo.x, sample.Albedo.x, 0.5f / 255.0f + 1e-6f);
+		CHECK_NEAR(decoded.Albedo.y, sample.Albedo.y, 0.5f / 255.0f + 1e-6f);
+		CHECK_NEAR(decoded.Albedo.z, sample.Albedo.z, 0.5f / 255.0f + 1e-6f);
+		CHECK_NEAR(decoded.Metalness, sample.Metalness, 0.5f / 255.0f + 1e-6f);
+		CHECK_NEAR(decoded.Roughness, sample.Roughness, 0.5f / 1023.0f + 1e-6f);
+	}
+
+	// Exact steps survive unchanged.
+	GBufferSample sample = {};
+	sample.Albedo = XMFLOAT3(0.0f, 128.0f / 255.0f, 1.0f);
+	sample.Metalness = 1.0f;
+	sample.NormalW = XMFLOAT3(0.0f, 0.0f, 1.0f);
+	sample.Roughness = 512.0f / 1023.0f;
+	GBufferTexel texel = DeferredShading::EncodeGBuffer(sample);
+	CHECK(texel.Texel0 == (0x00u | 0x80u << 8 | 0xffu << 16 | 0xffu << 24));
+	CHECK(texel.Texel1 >> 20 == 512);
+	GBufferSample decoded = DeferredShading::DecodeGBuffer(texel);
+	CHECK(decoded.Albedo.y == sample.Albedo.y);
+	CHECK(decoded.Roughness == sample.Roughness);
+
+	sample.Albedo = XMFLOAT3(-0.5f, 2.0f, 0.0f);
+	decoded = DeferredShading::DecodeGBuffer(DeferredShading::EncodeGBuffer(sample));
+	CHECK(decoded.Albedo.x == 0.0f);
+	CHECK(decoded.Albedo.y == 1.0f);
+}
+
+TEST(DeferredShadingReconstructPosition)
+{
+	// Project known world points with a camera looking at the origin, then
+	// rebuild them from the depth value and texture coordinates alone.
+	XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(3.0f, 4.0f, -10.0f, 1.0f),
+		XMVectorZero(), XMVectorSet(0.0f, 1.0f, 0.0f, 0.0f));
+	XMMATRIX proj = XMMatrixPerspectiveFovLH(0.25f * XM_PI, 16.0f / 9.0f, 1.0f, 1000.0f);
+	XMMATRIX viewProj = XMMatrixMultiply(view, proj);
+	XMFLOAT4X4 invViewProj;
+	XMStoreFloat4x4(&invViewProj, XMMatrixInverse(nullptr, viewProj));
+
+	const XMFLOAT3 points[] =
+	{
+		XMFLOAT3(0.0f, 0.0f, 0.0f),
+		XMFLOAT3(1.0f, -2.0f, 3.0f),
+		XMFLOAT3(-2.5f, 1.5f, -4.0f),
+		XMFLOAT3(-5.0f, -7.0f, 20.0f),
+	};
+	for (const XMFLOAT3& p : points)
+	{
+		XMVECTOR clip = XMVector4Transform(XMVectorSet(p.x, p.y, p.z, 1.0f), viewProj);
+		float w = XMVectorGetW(clip);
+		float u = 0.5f * XMVectorGetX(clip) / w + 0.5f;
+		float v = 0.5f - 0.5f * XMVectorGetY(clip) / w;
+		CHECK(u > 0.0f && u < 1.0f && v > 0.0f && v < 1.0f);
+
+		// Depth precision falls with distance, and so does the accuracy.
+		XMFLOAT3 rebuilt = DeferredShading::ReconstructPosition(XMVectorGetZ(clip) / w, u, v, invViewProj);
+		float tolerance = 1e-4f * w * w;
+		CHECK_NEAR(rebuilt.x, p.x, tolerance);
+		CHECK_NEAR(rebuilt.y, p.y, tolerance);
+		CHECK_NEAR(rebuilt.z, p.z, tolerance);
+	}
+}
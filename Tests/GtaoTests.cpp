@@ -0,0 +1,211 @@
+#include "Test.h"
+#include "Gtao.h"
+#include <cstdio>
+#include <random>
+
+using namespace DirectX;
+
+namespace
+{
+	const UINT Size = 64;
+
+	// A square buffer seen through a 45 degree projection, camera at the origin
+	// looking down +z.  Each texel holds the point of a height field z(tx, ty)
+	// along its view ray, where (tx, ty) is the ray's slope, and the normal from
+	// the neighbouring points.
+	struct Scene
+	{
+		XMFLOAT4X4 Proj;
+		std::vector<float> Depth;
+		std::vector<XMFLOAT3> Normals;
+
+		template<typename Height>
+		explicit Scene(Height height) : Depth(Size * Size), Normals(Size * Size)
+		{
+			XMStoreFloat4x4(&Proj, XMMatrixPerspectiveFovLH(0.25f * XM_PI, 1.0f, 1.0f, 100.0f));
+
+			auto pointAt = [&](float x, float y)
+			{
+				float tx = (2.0f * (x + 0.5f) / Size - 1.0f) / Proj.m[0][0];
+				float ty = (1.0f - 2.0f * (y + 0.5f) / Size) / Proj.m[1][1];
+				float z = height(tx, ty);
+				return XMVectorSet(tx * z, ty * z, z, 0.0f);
+			};
+
+			for (UINT y = 0; y < Size; ++y)
+			{
+				for (UINT x = 0; x < Size; ++x)
+				{
+					float z = XMVectorGetZ(pointAt((float)x, (float)y));
+					Depth[y * Size + x] = Proj.m[2][2] + Proj.m[3][2] / z;
+
+					XMVECTOR dx = pointAt(x + 0.5f, (float)y) - pointAt(x - 0.5f, (float)y);
+					XMVECTOR dy = pointAt((float)x, y - 0.5f) - pointAt((float)x, y + 0.5f);
+					XMStoreFloat3(&Normals[y * Size + x], XMVector3Normalize(XMVector3Cross(dy, dx)));
+				}
+			}
+		}
+
+		std::vector<float> Ambient(UINT slices, UINT stepsPerSide) const
+		{
+			std::vector<float> ambient(Size * Size);
+			Gtao::ComputeOnCpu(Depth.data(), Normals.data(), Size, Size, Proj, GtaoFalloff(),
+				slices, stepsPerSide, ambient.data());
+			return ambient;
+		}
+
+		// The hemisphere sampling of Ssao.hlsl with the constants UpdateSsaoCB sets.
+		std::vector<float> HemisphereAmbient(UINT sampleCount) const;
+	};
+
+	// Ssao::BuildOffsetVectors' cube corners and face centres, alternating
+	// opposite sides, with lengths in [0.25, 1] from a fixed seed.
+	struct HemisphereSamples
+	{
+		XMFLOAT4 Offsets[14];
+		static const UINT RandomSize = 16;
+		XMFLOAT3 RandomVectors[RandomSize * RandomSize];
+
+		HemisphereSamples()
+		{
+			const XMFLOAT4 directions[14] =
+			{
+				{ +1.0f, +1.0f, +1.0f, 0.0f }, { -1.0f, -1.0f, -1.0f, 0.0f },
+				{ -1.0f, +1.0f, +1.0f, 0.0f }, { +1.0f, -1.0f, -1.0f, 0.0f },
+				{ +1.0f, +1.0f, -1.0f, 0.0f }, { -1.0f, -1.0f, +1.0f, 0.0f },
+				{ -1.0f, +1.0f, -1.0f, 0.0f }, { +1.0f, -1.0f, +1.0f, 0.0f },
+				{ -1.0f, 0.0f, 0.0f, 0.0f }, { +1.0f, 0.0f, 0.0f, 0.0f },
+				{ 0.0f, -1.0f, 0.0f, 0.0f }, { 0.0f, +1.0f, 0.0f, 0.0f },
+				{ 0.0f, 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, +1.0f, 0.0f }
+			};
+
+			std::mt19937 random(43);
+			std::uniform_real_distribution<float> length(0.25f, 1.0f);
+			for (int i = 0; i < 14; ++i)
+				XMStoreFloat4(&Offsets[i], length(random) * XMVector3Normalize(XMLoadFloat4(&directions[i])));
+
+			// BuildRandomVectorTexture's texels mapped from [0, 1] to [-1, 1].
+			std::uniform_real_distribution<float> component(-1.0f, 1.0f);
+			for (XMFLOAT3& v : RandomVectors)
+				v = XMFLOAT3(component(random), component(random), component(random));
+		}
+	};
+
+	std::vector<float> Scene::HemisphereAmbient(UINT sampleCount) const
+	{
+		static const HemisphereSamples samples;
+		std::vector<float> ambient(Size * Size);
+		Gtao::ComputeHemisphereOnCpu(Depth.data(), Normals.data(), Size, Size, Proj, GtaoFalloff(), 0.05f,
+			samples.Offsets, sampleCount, samples.RandomVectors, HemisphereSamples::RandomSize, ambient.data());
+		return ambient;
+	}
+
+	float Mean(const std::vector<float>& values)
+	{
+		float sum = 0.0f;
+		for (float value : values)
+			sum += value;
+		return sum / values.size();
+	}
+
+	float MeanAbsDifference(const std::vector<float>& a, const std::vector<float>& b)
+	{
+		float sum = 0.0f;
+		for (size_t i = 0; i < a.size(); ++i)
+			sum += fabsf(a[i] - b[i]);
+		return sum / a.size();
+	}
+
+	// The reference the tiers approximate: enough slices and steps that more
+	// change nothing visible.
+	const UINT ReferenceSlices = 32;
+	const UINT ReferenceSteps = 16;
+}
+
+TEST(GtaoFlatPlaneIsUnoccluded)
+{
+	// Off the centre the plane is seen at an angle, which costs a slice through
+	// the tilt a little of its arc, but nothing rises above the tangent plane.
+	Scene plane([](float, float) { return 4.0f; });
+	for (UINT tier = 0; tier < (UINT)GtaoTier::Count; ++tier)
+	{
+		GtaoTierDesc desc = Gtao::TierDesc((GtaoTier)tier);
+		for (float ambient : plane.Ambient(desc.Slices, desc.StepsPerSide))
+			CHECK(ambient >= 0.9f);
+	}
+
+	for (float ambient : plane.Ambient(ReferenceSlices, ReferenceSteps))
+		CHECK(ambient >= 0.98f);
+}
+
+TEST(GtaoTiersApproachManySliceReference)
+{
+	// A round pit 1.5 deep into a plane 4 in front of the camera, and a V shaped
+	// valley along y: walls |x| + z = 4 at 45 degrees, meeting 4 in front of it.
+	Scene pit([](float tx, float ty) { return 4.0f + 1.5f * expf(-(tx * tx + ty * ty) / 0.02f); });
+	Scene valley([](float tx, float) { return 4.0f / (1.0f + fabsf(tx)); });
+	const Scene* scenes[] = { &pit, &valley };
+
+	for (const Scene* scene : scenes)
+	{
+		std::vector<float> reference = scene->Ambient(ReferenceSlices, ReferenceSteps);
+
+		// The reference has converged and sees the occlusion.
+		CHECK(MeanAbsDifference(reference, scene->Ambient(2 * ReferenceSlices, 2 * ReferenceSteps)) < 0.01f);
+		CHECK(Mean(reference) < 0.95f);
+		CHECK(*std::min_element(reference.begin(), reference.end()) < 0.7f);
+
+		// A single slice misses what lies across it, so Low is only close on
+		// average.  Medium is not always closer: on the valley its two diagonal
+		// slices do worse than Low's one.
+		float error[(UINT)GtaoTier::Count];
+		for (UINT tier = 0; tier < (UINT)GtaoTier::Count; ++tier)
+		{
+			GtaoTierDesc desc = Gtao::TierDesc((GtaoTier)tier);
+			error[tier] = MeanAbsDifference(scene->Ambient(desc.Slices, desc.StepsPerSide), reference);
+			CHECK(error[tier] < 0.1f);
+		}
+		CHECK(error[(UINT)GtaoTier::High] < 0.03f);
+		CHECK(error[(UINT)GtaoTier::High] < error[(UINT)GtaoTier::Low]);
+	}
+}
+
+TEST(GtaoAndHemisphereSsaoErrorPerSample)
+{
+	// Both techniques against the many-slice reference, with their depth samples
+	// per pixel as the cost: 2 * Slices * StepsPerSide for GTAO, SampleCount for
+	// the hemisphere.  The hemisphere weights each sample by how far it rises above
+	// the tangent plane instead of integrating the visible arc.
+	Scene pit([](float tx, float ty) { return 4.0f + 1.5f * expf(-(tx * tx + ty * ty) / 0.02f); });
+	Scene valley([](float tx, float) { return 4.0f / (1.0f + fabsf(tx)); });
+	const Scene* scenes[] = { &pit, &valley };
+	const char* names[] = { "pit", "valley" };
+
+	for (int s = 0; s < 2; ++s)
+	{
+		std::vector<float> reference = scenes[s]->Ambient(ReferenceSlices, ReferenceSteps);
+
+		float gtaoError[(UINT)GtaoTier::Count];
+		for (UINT tier = 0; tier < (UINT)GtaoTier::Count; ++tier)
+		{
+			GtaoTierDesc desc = Gtao::TierDesc((GtaoTier)tier);
+			gtaoError[tier] = MeanAbsDifference(scenes[s]->Ambient(desc.Slices, desc.StepsPerSide), reference);
+			std::printf("     %-6s GTAO tier %u: %2u samples/pixel, mean error %.3f\n", names[s], tier,
+				2 * desc.Slices * desc.StepsPerSide, gtaoError[tier]);
+		}
+
+		const UINT hemisphereCounts[] = { 4, 8, 14 };
+		float hemisphereError[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			hemisphereError[i] = MeanAbsDifference(scenes[s]->HemisphereAmbient(hemisphereCounts[i]), reference);
+			std::printf("     %-6s hemisphere:  %2u samples/pixel, mean error %.3f\n", names[s],
+				hemisphereCounts[i], hemisphereError[i]);
+		}
+
+		// More samples hardly help the hemisphere, its error is the weighting and
+		// not noise.  Low and Medium beat it at their own cost, High at any.
+		for (UINT tier = 0; tier < (UINT)GtaoTier::Count; ++tier)
+			CHECK(gtaoError[tier] < hemisphereError[tier]);
+	}
+}
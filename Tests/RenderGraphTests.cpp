@@ -0,0 +1,196 @@
+#include "Test.h"
+#include "RenderGraph.h"
+
+// The graphs are compiled without a device, so transient sizes are the estimate
+// of RenderGraph::AllocationInfo: width * height * bytes per pixel, rounded up
+// to 64KB.  A 512x512 R8G8B8A8 target takes exactly 1MB.
+
+namespace
+{
+	const UINT64 MB = 1024 * 1024;
+
+	RGTextureDesc TargetDesc(UINT size)
+	{
+		RGTextureDesc desc;
+		desc.Width = size;
+		desc.Height = size;
+		desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+		return desc;
+	}
+
+	// scene -> (unused) -> compose -> backBuffer, with a shadow map imported in
+	// GENERIC_READ and read by compose.
+	struct ComposeGraph
+	{
+		RGResourceHandle BackBuffer;
+		RGResourceHandle ShadowMap;
+		RGResourceHandle Scene;
+		RGResourceHandle Unused;
+
+		explicit ComposeGraph(RenderGraph& graph)
+		{
+			BackBuffer = graph.ImportResource("backBuffer", nullptr, D3D12_RESOURCE_STATE_PRESENT);
+			ShadowMap = graph.ImportResource("shadowMap", nullptr, D3D12_RESOURCE_STATE_GENERIC_READ);
+			Scene = graph.CreateTexture("scene", TargetDesc(512));
+			Unused = graph.CreateTexture("unused", TargetDesc(512));
+			graph.MarkOutput(BackBuffer);
+
+			graph.AddPass("drawScene", nullptr)
+				.Write(Scene, D3D12_RESOURCE_STATE_RENDER_TARGET);
+			graph.AddPass("drawUnused", nullptr)
+				.Write(Unused, D3D12_RESOURCE_STATE_RENDER_TARGET);
+			graph.AddPass("compose", nullptr)
+				.Read(Scene, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+				.Read(ShadowMap, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+				.Write(BackBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+			graph.Compile();
+		}
+	};
+}
+
+TEST(RenderGraphCullsPassesOutsideOutputs)
+{
+	RenderGraph graph(nullptr, 3);
+	ComposeGraph g(graph);
+
+	CHECK(!graph.IsPassCulled("drawScene"));
+	CHECK(graph.IsPassCulled("drawUnused"));
+	CHECK(!graph.IsPassCulled("compose"));
+	CHECK(graph.GetStats().PassCount == 3);
+	CHECK(graph.GetStats().CulledPassCount == 1);
+
+	// A side effect keeps a pass alive even though nothing reads what it writes.
+	graph.Reset();
+	RGResourceHandle backBuffer = graph.ImportResource("backBuffer", nullptr, D3D12_RESOURCE_STATE_PRESENT);
+	RGResourceHandle readback = graph.CreateTexture("readback", TargetDesc(256));
+	graph.MarkOutput(backBuffer);
+	graph.AddPass("capture", nullptr)
+		.Write(readback, D3D12_RESOURCE_STATE_RENDER_TARGET)
+		.SideEffect();
+	graph.AddPass("present", nullptr)
+		.Write(backBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.Compile();
+
+	CHECK(!graph.IsPassCulled("capture"));
+	CHECK(!graph.IsPassCulled("present"));
+	CHECK(graph.GetStats().CulledPassCount == 0);
+}
+
+TEST(RenderGraphKeepsDeclarationOrder)
+{
+	RenderGraph graph(nullptr, 3);
+	ComposeGraph g(graph);
+
+	std::string dump = graph.Dump();
+	size_t scene = dump.find("pass drawScene\n");
+	size_t unused = dump.find("pass drawUnused culled\n");
+	size_t compose = dump.find("pass compose\n");
+	size_t end = dump.find("end\n");
+	CHECK(scene != std::string::npos);
+	CHECK(unused != std::string::npos);
+	CHECK(compose != std::string::npos);
+	CHECK(scene < unused && unused < compose && compose < end);
+
+	// Compiling again gives the same schedule.
+	graph.Compile();
+	CHECK(graph.Dump() == dump);
+}
+
+TEST(RenderGraphTransitions)
+{
+	RenderGraph graph(nullptr, 3);
+	ComposeGraph g(graph);
+	const auto& stats = graph.GetStats();
+
+	// scene starts in RENDER_TARGET, its first use, so drawScene needs no barrier.
+	// compose: scene RENDER_TARGET -> PIXEL_SHADER_RESOURCE right after drawScene, and
+	// backBuffer PRESENT -> RENDER_TARGET, split from the start of the frame since
+	// drawScene runs in between.  The shadow map stays in GENERIC_READ, which covers
+	// the pixel shader read.  At the end both go back home.
+	CHECK(stats.TransitionCount == 4);
+	CHECK(stats.SplitBarrierCount == 1);
+
+	std::string dump = graph.Dump();
+	std::ostringstream expected;
+	expected << std::hex
+		<< "  begin backBuffer 0x" << D3D12_RESOURCE_STATE_PRESENT << " -> 0x" << D3D12_RESOURCE_STATE_RENDER_TARGET << "\n"
+		<< "pass drawScene\n"
+		<< "pass drawUnused culled\n"
+		<< "pass compose\n"
+		<< "  scene 0x" << D3D12_RESOURCE_STATE_RENDER_TARGET << " -> 0x" << D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE << "\n"
+		<< "  end backBuffer 0x" << D3D12_RESOURCE_STATE_PRESENT << " -> 0x" << D3D12_RESOURCE_STATE_RENDER_TARGET << "\n"
+		<< "end\n"
+		<< "  backBuffer 0x" << D3D12_RESOURCE_STATE_RENDER_TARGET << " -> 0x" << D3D12_RESOURCE_STATE_PRESENT << "\n"
+		<< "  scene 0x" << D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE << " -> 0x" << D3D12_RESOURCE_STATE_RENDER_TARGET << "\n";
+	CHECK(dump.compare(0, expected.str().size(), expected.str()) == 0);
+	CHECK(dump.find("shadowMap") == std::string::npos);
+}
+
+TEST(RenderGraphAliasesDisjointLifetimes)
+{
+	// a -> b -> c -> backBuffer: a and c are never alive at the same time, so c
+	// reuses a's memory while b needs its own.
+	RenderGraph graph(nullptr, 3);
+	RGResourceHandle backBuffer = graph.ImportResource("backBuffer", nullptr, D3D12_RESOURCE_STATE_PRESENT);
+	RGResourceHandle a = graph.CreateTexture("a", TargetDesc(512));
+	RGResourceHandle b = graph.CreateTexture("b", TargetDesc(512));
+	RGResourceHandle c = graph.CreateTexture("c", TargetDesc(512));
+	graph.MarkOutput(backBuffer);
+
+	graph.AddPass("drawA", nullptr)
+		.Write(a, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.AddPass("drawB", nullptr)
+		.Read(a, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+		.Write(b, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.AddPass("drawC", nullptr)
+		.Read(b, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+		.Write(c, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.AddPass("compose", nullptr)
+		.Read(c, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+		.Write(backBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.Compile();
+
+	const auto& stats = graph.GetStats();
+	CHECK(graph.TransientOffset(a) == 0);
+	CHECK(graph.TransientOffset(b) == 1 * MB);
+	CHECK(graph.TransientOffset(c) == 0);
+	CHECK(stats.TransientUnaliasedSize == 3 * MB);
+	CHECK(stats.TransientHeapSize == 2 * MB);
+
+	// a and c share memory, so both are re-initialized on first use; c takes over from a.
+	CHECK(stats.AliasingBarrierCount == 2);
+	std::string dump = graph.Dump();
+	CHECK(dump.find("pass drawA\n  alias * -> a\n") != std::string::npos);
+	CHECK(dump.find("pass drawC\n  alias a -> c\n") != std::string::npos);
+	CHECK(dump.find("-> b\n") == std::string::npos);
+}
+
+TEST(RenderGraphPlacesBiggestFirst)
+{
+	// small and big overlap in time.  big is placed first at offset 0 although it is
+	// declared second; culled passes allocate nothing.
+	RenderGraph graph(nullptr, 3);
+	RGResourceHandle backBuffer = graph.ImportResource("backBuffer", nullptr, D3D12_RESOURCE_STATE_PRESENT);
+	RGResourceHandle smallTarget = graph.CreateTexture("small", TargetDesc(256));
+	RGResourceHandle bigTarget = graph.CreateTexture("big", TargetDesc(1024));
+	RGResourceHandle unused = graph.CreateTexture("unused", TargetDesc(1024));
+	graph.MarkOutput(backBuffer);
+
+	graph.AddPass("draw", nullptr)
+		.Write(smallTarget, D3D12_RESOURCE_STATE_RENDER_TARGET)
+		.Write(bigTarget, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.AddPass("drawUnused", nullptr)
+		.Write(unused, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.AddPass("compose", nullptr)
+		.Read(smallTarget, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+		.Read(bigTarget, D3D12_RESOURCE_STATE_PIXEL_SHADER_RESOURCE)
+		.Write(backBuffer, D3D12_RESOURCE_STATE_RENDER_TARGET);
+	graph.Compile();
+
+	const auto& stats = graph.GetStats();
+	CHECK(graph.TransientOffset(bigTarget) == 0);
+	CHECK(graph.TransientOffset(smallTarget) == 4 * MB);
+	CHECK(stats.TransientHeapSize == 4 * MB + 256 * 1024);
+	CHECK(stats.TransientUnaliasedSize == stats.TransientHeapSize);
+	CHECK(stats.AliasingBarrierCount == 0);
+}
@@ -0,0 +1,162 @@
+#include "Test.h"
+#include "SampleDistribution.h"
+
+using namespace DirectX;
+
+namespace
+{
+	// A 2x2 depth buffer reduced with identity matrices, so view and light space
+	// positions are the NDC ones: pixel centres at x, y = +-0.5 and z = depth.
+	//   (-0.5,  0.5, 0.2)  distance 0.735
+	//   sky
+	//   (-0.5, -0.5, 0.6)  distance 0.927
+	//   ( 0.5, -0.5, 0.9)  distance 1.145
+	const float Depth[4] = { 0.2f, 1.0f, 0.6f, 0.9f };
+
+	DepthBounds Reduce(const float* depth, const float* splits, UINT cascadeCount, float blendBand)
+	{
+		XMFLOAT4X4 identity = MathHelper::Identity4x4();
+		return SampleDistribution::ReduceOnCpu(depth, 2, 2, identity, identity,
+			splits, cascadeCount, blendBand);
+	}
+
+	void CheckFloat3(const XMFLOAT3& v, float x, float y, float z)
+	{
+		CHECK_NEAR(v.x, x, 1e-5f);
+		CHECK_NEAR(v.y, y, 1e-5f);
+		CHECK_NEAR(v.z, z, 1e-5f);
+	}
+}
+
+TEST(SampleDistributionOrderedUintsKeepOrder)
+{
+	const float values[] = { -DepthBounds::EmptyBound, -1.0f, -0.0f, 0.0f, 0.5f, 1.0f, DepthBounds::EmptyBound };
+	for (size_t i = 0; i < _countof(values); ++i)
+	{
+		UINT u = SampleDistribution::FloatToOrderedUint(values[i]);
+		CHECK(SampleDistribution::OrderedUintToFloat(u) == values[i]);
+		if (i > 0)
+			CHECK(SampleDistribution::FloatToOrderedUint(values[i - 1]) <= u);
+	}
+}
+
+TEST(SampleDistributionReduceOnCpu)
+{
+	const float splits[2] = { 0.8f, 2.0f };
+	DepthBounds bounds = Reduce(Depth, splits, 2, 0.1f);
+
+	CHECK(!bounds.Empty());
+	CHECK_NEAR(bounds.MinDepth, 0.2f, 1e-5f);
+	CHECK_NEAR(bounds.MaxDistance, sqrtf(0.5f + 0.81f), 1e-5f);
+
+	// The first sample is within the blend band of the first split, so it also
+	// counts for the second cascade.
+	CHECK(!bounds.Empty(0));
+	CheckFloat3(bounds.LightMin[0], -0.5f, 0.5f, 0.2f);
+	CheckFloat3(bounds.LightMax[0], -0.5f, 0.5f, 0.2f);
+	CHECK(!bounds.Empty(1));
+	CheckFloat3(bounds.LightMin[1], -0.5f, -0.5f, 0.2f);
+	CheckFloat3(bounds.LightMax[1], 0.5f, 0.5f, 0.9f);
+	CHECK(bounds.Empty(2));
+	CHECK(bounds.Empty(3));
+
+	// Past the last split a sample still widens the depth range but no cascade box.
+	const float shortSplits[2] = { 0.8f, 1.0f };
+	bounds = Reduce(Depth, shortSplits, 2, 0.0f);
+	CHECK_NEAR(bounds.MaxDistance, sqrtf(0.5f + 0.81f), 1e-5f);
+	CheckFloat3(bounds.LightMin[0], -0.5f, 0.5f, 0.2f);
+	CheckFloat3(bounds.LightMin[1], -0.5f, -0.5f, 0.6f);
+	CheckFloat3(bounds.LightMax[1], -0.5f, -0.5f, 0.6f);
+}
+
+TEST(SampleDistributionReduceOnCpuSkyOnly)
+{
+	const float sky[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	const float splits[2] = { 0.8f, 2.0f };
+	DepthBounds bounds = Reduce(sky, splits, 2, 0.1f);
+
+	// Untouched bounds keep the sentinel the GPU reset buffer starts with.
+	CHECK(bounds.Empty());
+	CHECK(bounds.Empty(0));
+	CHECK(bounds.Empty(1));
+	CHECK(bounds.MinDepth == DepthBounds::EmptyBound);
+	CHECK(bounds.MaxDistance == -DepthBounds::EmptyBound);
+	CHECK(bounds.LightMin[0].x == DepthBounds::EmptyBound);
+	CHECK(bounds.LightMax[0].x == -DepthBounds::EmptyBound);
+}
+
+TEST(SampleDistributionFitSplits)
+{
+	float splits[4];
+	SampleDistribution::FitSplits(1.0f, 100.0f, 4, 0.0f, splits);
+	CHECK_NEAR(splits[0], 25.75f, 1e-4f);
+	CHECK_NEAR(splits[1], 50.5f, 1e-4f);
+	CHECK_NEAR(splits[2], 75.25f, 1e-4f);
+	CHECK_NEAR(splits[3], 100.0f, 1e-4f);
+
+	SampleDistribution::FitSplits(1.0f, 100.0f, 4, 1.0f, splits);
+	CHECK_NEAR(splits[0], sqrtf(10.0f), 1e-4f);
+	CHECK_NEAR(splits[1], 10.0f, 1e-4f);
+	CHECK_NEAR(splits[2], 10.0f * sqrtf(10.0f), 1e-3f);
+	CHECK_NEAR(splits[3], 100.0f, 1e-3f);
+
+	// Blends lie between the two schemes and always end at the far plane.
+	float uniform[4], logarithmic[4];
+	SampleDistribution::FitSplits(1.0f, 100.0f, 4, 0.0f, uniform);
+	SampleDistribution::FitSplits(1.0f, 100.0f, 4, 1.0f, logarithmic);
+	SampleDistribution::FitSplits(1.0f, 100.0f, 4, 0.5f, splits);
+	for (int i = 0; i < 4; ++i)
+	{
+		CHECK(splits[i] >= logarithmic[i] - 1e-4f && splits[i] <= uniform[i] + 1e-4f);
+		if (i > 0)
+			CHECK(splits[i] > splits[i - 1]);
+	}
+	CHECK_NEAR(splits[3], 100.0f, 1e-3f);
+}
+
+TEST(SampleDistributionFitCascadeBox)
+{
+	DepthBounds bounds;
+	bounds.LightMin[0] = XMFLOAT3(-0.97f, -2.0f, 3.0f);
+	bounds.LightMax[0] = XMFLOAT3(1.03f, 2.0f, 5.0f);
+
+	// Two texels of padding at 100 texels over 20 units is 0.4, giving a 2.8 x 4.8
+	// rectangle, made square on its longer side.
+	XMFLOAT3 boxMin(-10.0f, -10.0f, 0.0f);
+	XMFLOAT3 boxMax(10.0f, 10.0f, 20.0f);
+	CHECK(SampleDistribution::FitCascadeBox(bounds, 0, 100, boxMin, boxMax));
+	CHECK_NEAR(boxMax.x - boxMin.x, 4.8f, 1e-4f);
+	CHECK_NEAR(boxMax.y - boxMin.y, 4.8f, 1e-4f);
+
+	// The side towards the light stays; the far side shrinks to the samples.
+	CHECK(boxMin.z == 0.0f);
+	CHECK_NEAR(boxMax.z, 5.4f, 1e-4f);
+
+	// Centred on a whole texel, so it holds still while the samples do.
+	float texel = 4.8f / 100;
+	float centerX = 0.5f * (boxMin.x + boxMax.x) / texel;
+	float centerY = 0.5f * (boxMin.y + boxMax.y) / texel;
+	CHECK_NEAR(centerX, roundf(centerX), 1e-3f);
+	CHECK_NEAR(centerY, roundf(centerY), 1e-3f);
+
+	// Every sample stays inside.
+	CHECK(boxMin.x <= bounds.LightMin[0].x && boxMax.x >= bounds.LightMax[0].x);
+	CHECK(boxMin.y <= bounds.LightMin[0].y && boxMax.y >= bounds.LightMax[0].y);
+}
+
+TEST(SampleDistributionFitCascadeBoxKeepsBoxWithoutSamples)
+{
+	DepthBounds bounds;
+	bounds.LightMin[0] = XMFLOAT3(50.0f, 50.0f, 3.0f);
+	bounds.LightMax[0] = XMFLOAT3(60.0f, 60.0f, 5.0f);
+
+	// Cascade 1 saw no samples; cascade 0 only saw samples outside its box.
+	for (UINT cascade = 0; cascade < 2; ++cascade)
+	{
+		XMFLOAT3 boxMin(-10.0f, -10.0f, 0.0f);
+		XMFLOAT3 boxMax(10.0f, 10.0f, 20.0f);
+		CHECK(!SampleDistribution::FitCascadeBox(bounds, cascade, 100, boxMin, boxMax));
+		CheckFloat3(boxMin, -10.0f, -10.0f, 0.0f);
+		CheckFloat3(boxMax, 10.0f, 10.0f, 20.0f);
+	}
+}
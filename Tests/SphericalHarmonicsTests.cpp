@@ -0,0 +1,94 @@
+#include "Test.h"
+#include "SphericalHarmonics.h"
+
+using namespace DirectX;
+
+namespace
+{
+	const std::wstring CubeFile = L"SphericalHarmonicsTests.dds";
+
+	// Writes six size*size faces without mips, every texel the same 32-bit
+	// texel, with a legacy DDS header whose red mask picks RGBA or BGRA.  Unless
+	// cube is set the header leaves out the cube map caps.
+	void WriteConstantCube(UINT size, UINT texel, UINT redMask, bool cube)
+	{
+		UINT header[32] = {};
+		header[0] = 0x20534444; // "DDS "
+		header[1] = 124;
+		header[2] = 0x1 | 0x2 | 0x4 | 0x1000; // caps, height, width, pixel format
+		header[3] = size;
+		header[4] = size;
+		header[5] = size * 4;
+		header[7] = 1;
+		header[19] = 32;
+		header[20] = 0x40 | 0x1; // RGB, alpha pixels
+		header[22] = 32;
+		header[23] = redMask;
+		header[24] = 0x0000ff00;
+		header[25] = redMask ^ 0x00ff00ff;
+		header[26] = 0xff000000;
+		header[27] = 0x1000 | 0x8; // texture, complex
+		header[28] = cube ? 0x200 | 0xfc00 : 0; // cube map, all faces
+
+		std::vector<UINT> texels(6 * size * size, texel);
+		std::ofstream fout(CubeFile, std::ios::binary | std::ios::trunc);
+		fout.write((const char*)header, sizeof(header));
+		fout.write((const char*)texels.data(), texels.size() * sizeof(UINT));
+	}
+
+	// The face centres and a few directions between them.
+	std::vector<XMFLOAT3> Directions()
+	{
+		std::vector<XMFLOAT3> directions =
+		{
+			XMFLOAT3(1.0f, 0.0f, 0.0f), XMFLOAT3(-1.0f, 0.0f, 0.0f),
+			XMFLOAT3(0.0f, 1.0f, 0.0f), XMFLOAT3(0.0f, -1.0f, 0.0f),
+			XMFLOAT3(0.0f, 0.0f, 1.0f), XMFLOAT3(0.0f, 0.0f, -1.0f),
+		};
+		const float c = 1.0f / sqrtf(3.0f);
+		directions.push_back(XMFLOAT3(c, c, c));
+		directions.push_back(XMFLOAT3(-c, c, -c));
+		directions.push_back(XMFLOAT3(c, -c, -c));
+		directions.push_back(XMFLOAT3(0.6f, 0.0f, -0.8f));
+		return directions;
+	}
+
+	void CheckColor(const XMFLOAT3& color, float r, float g, float b, float eps)
+	{
+		CHECK_NEAR(color.x, r, eps);
+		CHECK_NEAR(color.y, g, eps);
+		CHECK_NEAR(color.z, b, eps);
+	}
+}
+
+TEST(SphericalHarmonicsConstant)
+{
+	SH9 sh = SphericalHarmonics::Constant(XMFLOAT3(0.4f, 0.4f, 0.6f));
+	for (const XMFLOAT3& dir : Directions())
+		CheckColor(SphericalHarmonics::Evaluate(sh, dir), 0.4f, 0.4f, 0.6f, 1e-5f);
+}
+
+TEST(SphericalHarmonicsProjectConstantCubeMap)
+{
+	// A uniform sky of radiance L gives irradiance pi * L everywhere, so the
+	// projection evaluates back to L in every direction and its higher bands
+	// vanish.  Both channel orders decode to the same colour.
+	const float r = 51 / 255.0f, g = 128 / 255.0f, b = 204 / 255.0f;
+	const UINT redMasks[2] = { 0x000000ff, 0x00ff0000 };
+	const UINT texels[2] = { 0xff000000 | 204 << 16 | 128 << 8 | 51, 0xff000000 | 51 << 16 | 128 << 8 | 204 };
+	for (UINT i = 0; i < 2; ++i)
+	{
+		WriteConstantCube(16, texels[i], redMasks[i], true);
+		SH9 sh = {};
+		CHECK(SphericalHarmonics::ProjectCubeMap(CubeFile, sh));
+		for (const XMFLOAT3& dir : Directions())
+			CheckColor(SphericalHarmonics::Evaluate(sh, dir), r, g, b, 1e-4f);
+		for (UINT j = 1; j < 9; ++j)
+			CheckColor(XMFLOAT3(sh.C[j].x, sh.C[j].y, sh.C[j].z), 0.0f, 0.0f, 0.0f, 1e-4f);
+	}
+
+	WriteConstantCube(16, texels[0], redMasks[0], false);
+	SH9 sh = {};
+	CHECK(!SphericalHarmonics::ProjectCubeMap(CubeFile, sh));
+	_wremove(CubeFile.c_str());
+}
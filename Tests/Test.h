@@ -0,0 +1,45 @@
+#pragma once
+#include <cmath>
+#include <string>
+#include <vector>
+
+///<summary>
+/// Minimal test registry for the CPU-side parts of the renderer.  TEST(Name)
+/// defines and registers a test; CHECK and CHECK_NEAR record a failure and let
+/// the test go on.  TestMain.cpp runs every registered test.
+///</summary>
+namespace Test
+{
+	struct Case
+	{
+		const char* Name;
+		void (*Run)();
+	};
+
+	std::vector<Case>& Registry();
+	void Fail(const char* file, int line, const std::string& what);
+
+	struct Registrar
+	{
+		Registrar(const char* name, void (*run)())
+		{
+			Registry().push_back({ name, run });
+		}
+	};
+}
+
+#define TEST(name) \
+	static void Test_##name(); \
+	static Test::Registrar TestRegistrar_##name(#name, Test_##name); \
+	static void Test_##name()
+
+#define CHECK(cond) \
+	do { if (!(cond)) Test::Fail(__FILE__, __LINE__, #cond); } while (0)
+
+#define CHECK_NEAR(a, b, eps) \
+	do { \
+		double checkA = (double)(a), checkB = (double)(b); \
+		if (!(std::fabs(checkA - checkB) <= (double)(eps))) \
+			Test::Fail(__FILE__, __LINE__, std::string(#a " ~ " #b ": ") + \
+				std::to_string(checkA) + " vs " + std::to_string(checkB)); \
+	} while (0)
@@ -0,0 +1,47 @@
+#include "Test.h"
+#include <cstdio>
+
+namespace
+{
+	int gFailures = 0;
+}
+
+std::vector<Test::Case>& Test::Registry()
+{
+	static std::vector<Case> cases;
+	return cases;
+}
+
+void Test::Fail(const char* file, int line, const std::string& what)
+{
+	std::printf("  %s(%d): %s\n", file, line, what.c_str());
+	gFailures++;
+}
+
+// Runs every test, or only those whose name contains argv[1].
+int main(int argc, char** argv)
+{
+	int run = 0;
+	int failed = 0;
+	for (const auto& test : Test::Registry())
+	{
+		if (argc > 1 && std::string(test.Name).find(argv[1]) == std::string::npos)
+			continue;
+
+		int before = gFailures;
+		test.Run();
+		run++;
+		if (gFailures != before)
+		{
+			failed++;
+			std::printf("FAIL %s\n", test.Name);
+		}
+		else
+		{
+			std::printf("ok   %s\n", test.Name);
+		}
+	}
+
+	std::printf("%d of %d tests passed\n", run - failed, run);
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,200 @@
+#include "Test.h"
+#include "VirtualShadowPages.h"
+
+using namespace DirectX;
+
+namespace
+{
+	// Level 0 pages are one unit wide; the windows are centred on the origin, so
+	// the page at (0, 0) of every level sits at entry (32, 32) of its window.
+	const float Extent = (float)VirtualShadowPages::PagesPerLevel;
+	const UINT EntriesPerLevel = VirtualShadowPages::PagesPerLevel * VirtualShadowPages::PagesPerLevel;
+
+	UINT Entry(UINT level, UINT x, UINT y)
+	{
+		return (level * VirtualShadowPages::PagesPerLevel + y) * VirtualShadowPages::PagesPerLevel + x;
+	}
+
+	std::vector<UINT> RequestBits(std::initializer_list<UINT> entries)
+	{
+		std::vector<UINT> bits(VirtualShadowPages::RequestWordCount, 0);
+		for (UINT entry : entries)
+			bits[entry / 32] |= 1u << (entry % 32);
+		return bits;
+	}
+
+	UINT CountBits(const std::vector<UINT>& bits)
+	{
+		UINT count = 0;
+		for (UINT word : bits)
+		{
+			for (; word != 0; word &= word - 1)
+				count++;
+		}
+		return count;
+	}
+
+	void Request(VirtualShadowPages& pages, std::initializer_list<UINT> entries)
+	{
+		std::vector<UINT> bits = RequestBits(entries);
+		pages.Request(bits.data(), pages.Levels());
+	}
+
+	// Physical page holding a window entry, or -1.
+	int PhysicalPageOf(const VirtualShadowPages& pages, UINT entry)
+	{
+		UINT level = entry / EntriesPerLevel;
+		const VirtualShadowLevel& window = pages.Levels()[level];
+		XMINT2 coord(window.Origin.x + (int)(entry % VirtualShadowPages::PagesPerLevel),
+			window.Origin.y + (int)(entry / VirtualShadowPages::PagesPerLevel % VirtualShadowPages::PagesPerLevel));
+
+		const auto& physical = pages.PhysicalPages();
+		for (UINT i = 0; i < (UINT)physical.size(); ++i)
+		{
+			if (physical[i].Mapped && physical[i].Level == level &&
+				physical[i].Coord.x == coord.x && physical[i].Coord.y == coord.y)
+				return (int)i;
+		}
+		return -1;
+	}
+
+	UINT MappedCount(const VirtualShadowPages& pages)
+	{
+		UINT count = 0;
+		for (const auto& page : pages.PhysicalPages())
+			count += page.Mapped ? 1 : 0;
+		return count;
+	}
+}
+
+TEST(VirtualShadowPagesFindPage)
+{
+	VirtualShadowPages pages;
+	pages.SetClipmap(Extent, XMFLOAT3(0.0f, 0.0f, 0.0f));
+	const VirtualShadowLevel* levels = pages.Levels();
+	CHECK(levels[0].PageWorldSize == 1.0f);
+	CHECK(levels[1].PageWorldSize == 2.0f);
+	CHECK(levels[0].Origin.x == -32 && levels[0].Origin.y == -32);
+
+	// Rows run along -y.
+	UINT entry = 0;
+	CHECK(VirtualShadowPages::FindPage(XMFLOAT3(0.5f, 0.5f, 0.0f), 0.0f, 1.0f, levels, entry));
+	CHECK(entry == Entry(0, 32, 31));
+
+	// Far from the eye the footprint picks a coarser level.
+	CHECK(VirtualShadowPages::FindPage(XMFLOAT3(0.5f, -0.5f, 0.0f), 3.0f, 1.0f, levels, entry));
+	CHECK(entry == Entry(2, 32, 32));
+
+	// Past the window of level 0 the next level that holds the point is used.
+	CHECK(VirtualShadowPages::FindPage(XMFLOAT3(40.0f, 0.0f, 0.0f), 0.0f, 1.0f, levels, entry));
+	CHECK(entry == Entry(1, 52, 32));
+
+	CHECK(!VirtualShadowPages::FindPage(XMFLOAT3(1e6f, 0.0f, 0.0f), 0.0f, 1.0f, levels, entry));
+}
+
+TEST(VirtualShadowPagesMarkPagesOnCpu)
+{
+	VirtualShadowPages pages;
+	pages.SetClipmap(Extent, XMFLOAT3(0.0f, 0.0f, 0.0f));
+
+	// With identity matrices the samples of a 2x2 buffer sit at x, y = +-0.5 and
+	// z = depth, seen from the origin:
+	//   (-0.5,  0.5, 0.2)  distance 0.73, level 0
+	//   sky
+	//   (-0.5, -0.5, 0.6)  distance 0.93, level 0
+	//   ( 0.5, -0.5, 0.9)  distance 1.14, level 1
+	const float depth[4] = { 0.2f, 1.0f, 0.6f, 0.9f };
+	XMFLOAT4X4 identity = MathHelper::Identity4x4();
+	std::vector<UINT> bits(VirtualShadowPages::RequestWordCount, 0);
+	VirtualShadowPages::MarkPagesOnCpu(depth, 2, 2, identity, identity,
+		XMFLOAT3(0.0f, 0.0f, 0.0f), 1.0f, pages.Levels(), bits.data());
+
+	CHECK(bits == RequestBits({ Entry(0, 31, 31), Entry(0, 31, 32), Entry(1, 32, 32) }));
+	CHECK(CountBits(bits) == 3);
+
+	pages.Request(bits.data(), pages.Levels());
+	CHECK(pages.RequestedPageCount() == 3);
+}
+
+TEST(VirtualShadowPagesMapsAndRendersRequests)
+{
+	VirtualShadowPages pages;
+	pages.Reset(2);
+	pages.SetClipmap(Extent, XMFLOAT3(0.0f, 0.0f, 0.0f));
+	CHECK(pages.PhysicalPageCount() == 4);
+
+	const UINT a = Entry(0, 31, 31);
+	const UINT b = Entry(0, 31, 32);
+	const UINT coarse = Entry(1, 32, 32);
+	Request(pages, { a, b, coarse });
+
+	// The budget takes new pages coarse ones first.
+	pages.Update(1);
+	CHECK(MappedCount(pages) == 3);
+	CHECK(pages.PagesToRender().size() == 1);
+	CHECK(pages.PagesToRender()[0] == (UINT)PhysicalPageOf(pages, coarse));
+
+	pages.Update(8);
+	CHECK(pages.PagesToRender().size() == 2);
+	pages.Update(8);
+	CHECK(pages.PagesToRender().empty());
+
+	// A caster over a's page makes only that one render again.  a covers
+	// x in [-1, 0] and y in [0, 1] of light view space.
+	pages.Invalidate(BoundingBox(XMFLOAT3(-0.5f, 0.5f, 0.0f), XMFLOAT3(0.1f, 0.1f, 1.0f)));
+	CHECK(pages.PhysicalPages()[PhysicalPageOf(pages, a)].Dirty);
+	pages.Update(8);
+	CHECK(pages.PagesToRender().size() == 1);
+	CHECK(pages.PagesToRender()[0] == (UINT)PhysicalPageOf(pages, a));
+
+	std::vector<UINT> table(VirtualShadowPages::PageTableSize);
+	pages.BuildPageTable(XMUINT2(10, 20), table.data());
+	XMUINT2 physical = pages.PhysicalPageCoord(PhysicalPageOf(pages, b));
+	CHECK(table[b] == (VirtualShadowPages::PageValid | (10 + physical.x) | (20 + physical.y) << 15));
+	CHECK((table[Entry(0, 0, 0)] & VirtualShadowPages::PageValid) == 0);
+}
+
+TEST(VirtualShadowPagesEvictsLeastRecentlyRequested)
+{
+	VirtualShadowPages pages;
+	pages.Reset(2);
+	pages.SetClipmap(Extent, XMFLOAT3(0.0f, 0.0f, 0.0f));
+
+	// Pages land in request order within a level, coarse levels first.
+	const UINT a = Entry(0, 31, 31);
+	const UINT b = Entry(0, 31, 32);
+	const UINT coarse = Entry(1, 32, 32);
+	Request(pages, { a, b, coarse });
+	pages.Update(8);
+	CHECK(PhysicalPageOf(pages, coarse) == 0);
+	CHECK(PhysicalPageOf(pages, a) == 1);
+	CHECK(PhysicalPageOf(pages, b) == 2);
+
+	// Three new pages take the free one, then the pages requested longest ago.
+	// b keeps its depth, so asking for it again costs no render.
+	const UINT c = Entry(0, 10, 10);
+	const UINT d = Entry(0, 11, 10);
+	const UINT e = Entry(0, 12, 10);
+	Request(pages, { c, d, e });
+	pages.Update(8);
+	CHECK(PhysicalPageOf(pages, c) == 3);
+	CHECK(PhysicalPageOf(pages, d) == 0);
+	CHECK(PhysicalPageOf(pages, e) == 1);
+	CHECK(PhysicalPageOf(pages, b) == 2);
+	CHECK(PhysicalPageOf(pages, a) < 0);
+	CHECK(PhysicalPageOf(pages, coarse) < 0);
+
+	Request(pages, { b });
+	pages.Update(8);
+	CHECK(pages.PagesToRender().empty());
+
+	// Pages requested in the same frame are never taken from each other; the
+	// request the pool cannot hold stays unmapped.
+	const UINT f = Entry(0, 13, 10);
+	Request(pages, { b, c, d, e, f });
+	pages.Update(8);
+	CHECK(pages.RequestedPageCount() == 5);
+	CHECK(MappedCount(pages) == 4);
+	CHECK(PhysicalPageOf(pages, f) < 0);
+	CHECK(pages.PagesToRender().empty());
+}
@@ -0,0 +1,93 @@
+#include "VirtualShadowMap.h"
+
+using namespace DirectX;
+using Microsoft::WRL::ComPtr;
+
+VirtualShadowMap::VirtualShadowMap(ID3D12Device* device, UINT framesInFlight)
+{
+	md3dDevice = device;
+	mReadbackBuffers.resize(framesInFlight);
+	mReadbackPending.resize(framesInFlight, false);
+
+	BuildResources();
+}
+
+void VirtualShadowMap::MarkPages(ID3D12GraphicsCommandList* cmdList, ID3D12PipelineState* pso, UINT frameIndex,
+	D3D12_GPU_VIRTUAL_ADDRESS constants, CD3DX12_GPU_DESCRIPTOR_HANDLE depthMapSrv,
+	UINT width, UINT height)
+{
+	const UINT64 byteSize = VirtualShadowPages::RequestWordCount * sizeof(UINT);
+
+	// Buffers decay to COMMON after every ExecuteCommandLists and are promoted to
+	// COPY_DEST by the copy, so only the UAV and copy source states need barriers.
+	cmdList->CopyBufferRegion(mRequestBuffer.Get(), 0, mResetBuffer.Get(), 0, byteSize);
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mRequestBuffer.Get(),
+		D3D12_RESOURCE_STATE_COPY_DEST, D3D12_RESOURCE_STATE_UNORDERED_ACCESS));
+
+	cmdList->SetPipelineState(pso);
+	cmdList->SetComputeRootConstantBufferView(0, constants);
+	cmdList->SetComputeRootDescriptorTable(1, depthMapSrv);
+	cmdList->SetComputeRootUnorderedAccessView(2, mRequestBuffer->GetGPUVirtualAddress());
+
+	// 16x16 threads per group, see VirtualShadowMark.hlsl.
+	cmdList->Dispatch((width + 15) / 16, (height + 15) / 16, 1);
+
+	cmdList->ResourceBarrier(1, &CD3DX12_RESOURCE_BARRIER::Transition(mRequestBuffer.Get(),
+		D3D12_RESOURCE_STATE_UNORDERED_ACCESS, D3D12_RESOURCE_STATE_COPY_SOURCE));
+	cmdList->CopyBufferRegion(mReadbackBuffers[frameIndex].Get(), 0, mRequestBuffer.Get(), 0, byteSize);
+
+	mReadbackPending[frameIndex] = true;
+}
+
+bool VirtualShadowMap::ReadRequests(UINT frameIndex, UINT* requestBits)
+{
+	if (!mReadbackPending[frameIndex])
+		return false;
+	mReadbackPending[frameIndex] = false;
+
+	const SIZE_T byteSize = VirtualShadowPages::RequestWordCount * sizeof(UINT);
+	D3D12_RANGE readRange = { 0, byteSize };
+	void* mappedData = nullptr;
+	ThrowIfFailed(mReadbackBuffers[frameIndex]->Map(0, &readRange, &mappedData));
+	memcpy(requestBits, mappedData, byteSize);
+	D3D12_RANGE writeRange = { 0, 0 };
+	mReadbackBuffers[frameIndex]->Unmap(0, &writeRange);
+	return true;
+}
+
+void VirtualShadowMap::BuildResources()
+{
+	const UINT64 byteSize = VirtualShadowPages::RequestWordCount * sizeof(UINT);
+
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_DEFAULT),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(byteSize, D3D12_RESOURCE_FLAG_ALLOW_UNORDERED_ACCESS),
+		D3D12_RESOURCE_STATE_COMMON,
+		nullptr,
+		IID_PPV_ARGS(&mRequestBuffer)));
+
+	ThrowIfFailed(md3dDevice->CreateCommittedResource(
+		&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_UPLOAD),
+		D3D12_HEAP_FLAG_NONE,
+		&CD3DX12_RESOURCE_DESC::Buffer(byteSize),
+		D3D12_RESOURCE_STATE_GENERIC_READ,
+		nullptr,
+		IID_PPV_ARGS(&mResetBuffer)));
+
+	void* mappedData = nullptr;
+	ThrowIfFailed(mResetBuffer->Map(0, nullptr, &mappedData));
+	memset(mappedData, 0, (size_t)byteSize);
+	mResetBuffer->Unmap(0, nullptr);
+
+	for (auto& readback : mReadbackBuffers)
+	{
+		ThrowIfFailed(md3dDevice->CreateCommittedResource(
+			&CD3DX12_HEAP_PROPERTIES(D3D12_HEAP_TYPE_READBACK),
+			D3D12_HEAP_FLAG_NONE,
+			&CD3DX12_RESOURCE_DESC::Buffer(byteSize),
+			D3D12_RESOURCE_STATE_COPY_DEST,
+			nullptr,
+			IID_PPV_ARGS(&readback)));
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "Common/d3dUtil.h"
+#include "VirtualShadowPages.h"
+
+///<summary>
+/// GPU side of the virtual shadow map's page requests: a compute pass over the
+/// depth buffer sets a bit for every page a visible sample needs, and the bits
+/// are read back a few frames later, one readback buffer per frame resource.
+/// VirtualShadowPages::MarkPagesOnCpu is the CPU reference of the pass.
+///</summary>
+class VirtualShadowMap
+{
+public:
+	VirtualShadowMap(ID3D12Device* device, UINT framesInFlight);
+	VirtualShadowMap(const VirtualShadowMap& rhs) = delete;
+	VirtualShadowMap& operator=(const VirtualShadowMap& rhs) = delete;
+	~VirtualShadowMap() = default;
+
+	///<summary>
+	/// Marks the pages the depth buffer needs and copies the request bits to the
+	/// readback buffer of frameIndex.  The caller binds the compute root signature
+	/// (CBV b0, SRV table t0, UAV u0) and leaves the depth buffer readable by
+	/// non-pixel shaders.
+	///</summary>
+	void MarkPages(ID3D12GraphicsCommandList* cmdList, ID3D12PipelineState* pso, UINT frameIndex,
+		D3D12_GPU_VIRTUAL_ADDRESS constants, CD3DX12_GPU_DESCRIPTOR_HANDLE depthMapSrv,
+		UINT width, UINT height);
+
+	///<summary>
+	/// Request bits of the last MarkPages recorded for frameIndex, which the GPU must
+	/// have finished.  Each marking is handed out once; returns false if there is none.
+	///</summary>
+	bool ReadRequests(UINT frameIndex, UINT* requestBits);
+
+private:
+	void BuildResources();
+
+private:
+	ID3D12Device* md3dDevice = nullptr;
+
+	Microsoft::WRL::ComPtr<ID3D12Resource> mRequestBuffer;
+	// Zeros copied over mRequestBuffer before every marking.
+	Microsoft::WRL::ComPtr<ID3D12Resource> mResetBuffer;
+	std::vector<Microsoft::WRL::ComPtr<ID3D12Resource>> mReadbackBuffers;
+	std::vector<bool> mReadbackPending;
+};
@@ -0,0 +1,330 @@
+#include "VirtualShadowPages.h"
+
+using namespace DirectX;
+
+void VirtualShadowPages::Reset(UINT poolPagesPerSide)
+{
+	mPoolPagesPerSide = poolPagesPerSide;
+	mPages.assign(poolPagesPerSide * poolPagesPerSide, VirtualShadowPage());
+	mMapping.clear();
+	mRequested.clear();
+	mPagesToRender.clear();
+}
+
+UINT VirtualShadowPages::PhysicalPageCount()const
+{
+	return (UINT)mPages.size();
+}
+
+const std::vector<VirtualShadowPage>& VirtualShadowPages::PhysicalPages()const
+{
+	return mPages;
+}
+
+XMUINT2 VirtualShadowPages::PhysicalPageCoord(UINT physical)const
+{
+	return XMUINT2(physical % mPoolPagesPerSide, physical / mPoolPagesPerSide);
+}
+
+void VirtualShadowPages::SetClipmap(float extent, const XMFLOAT3& eyePosL)
+{
+	if (extent != mExtent)
+	{
+		mExtent = extent;
+		Reset(mPoolPagesPerSide);
+	}
+
+	for (UINT i = 0; i < VirtualShadowLevels; ++i)
+	{
+		float pageWorldSize = extent * (float)(1u << i) / PagesPerLevel;
+		int centerX = (int)floorf(eyePosL.x / pageWorldSize);
+		int centerY = (int)floorf(-eyePosL.y / pageWorldSize);
+
+		mLevels[i].Origin = XMINT2(centerX - (int)PagesPerLevel / 2, centerY - (int)PagesPerLevel / 2);
+		mLevels[i].PageWorldSize = pageWorldSize;
+	}
+}
+
+const VirtualShadowLevel* VirtualShadowPages::Levels()const
+{
+	return mLevels;
+}
+
+void VirtualShadowPages::Request(const UINT* requestBits, const VirtualShadowLevel* levels)
+{
+	mRequested.clear();
+	for (UINT word = 0; word < RequestWordCount; ++word)
+	{
+		UINT bits = requestBits[word];
+		for (UINT bit = 0; bits != 0; ++bit, bits >>= 1)
+		{
+			if ((bits & 1) == 0)
+				continue;
+
+			UINT entry = 32 * word + bit;
+			UINT level = entry / (PagesPerLevel * PagesPerLevel);
+			UINT x = entry % PagesPerLevel;
+			UINT y = entry / PagesPerLevel % PagesPerLevel;
+			XMINT2 coord(levels[level].Origin.x + (int)x, levels[level].Origin.y + (int)y);
+			mRequested.push_back(PageKey(level, coord));
+		}
+	}
+}
+
+UINT VirtualShadowPages::RequestedPageCount()const
+{
+	return (UINT)mRequested.size();
+}
+
+void VirtualShadowPages::Update(UINT maxRenders)
+{
+	mFrame++;
+	mPagesToRender.clear();
+
+	// Requests come back a few frames late; pages the windows have since moved off
+	// cannot be drawn or sampled, so they wait until they are requested again.
+	std::vector<UINT64> missing;
+	for (UINT64 key : mRequested)
+	{
+		if (!InWindow((UINT)(key >> 48), PageCoord(key)))
+			continue;
+
+		auto it = mMapping.find(key);
+		if (it != mMapping.end())
+			mPages[it->second].LastRequested = mFrame;
+		else
+			missing.push_back(key);
+	}
+
+	// The level sits in the top bits of the key.
+	std::stable_sort(missing.begin(), missing.end(), [](UINT64 a, UINT64 b)
+	{
+		return (a >> 48) > (b >> 48);
+	});
+
+	// Free pages go first, then the ones requested longest ago.  Pages requested this
+	// frame are never taken, so requests the pool cannot hold do not thrash it.
+	std::vector<UINT> victims;
+	for (UINT i = 0; i < (UINT)mPages.size(); ++i)
+	{
+		if (!mPages[i].Mapped || mPages[i].LastRequested < mFrame)
+			victims.push_back(i);
+	}
+	std::stable_sort(victims.begin(), victims.end(), [this](UINT a, UINT b)
+	{
+		const auto& pa = mPages[a];
+		const auto& pb = mPages[b];
+		if (pa.Mapped != pb.Mapped)
+			return !pa.Mapped;
+		return pa.LastRequested < pb.LastRequested;
+	});
+
+	size_t next = 0;
+	for (UINT64 key : missing)
+	{
+		if (next == victims.size())
+			break;
+
+		UINT physical = victims[next++];
+		Unmap(physical);
+
+		auto& page = mPages[physical];
+		page.Mapped = true;
+		page.Level = (UINT)(key >> 48);
+		page.Coord = PageCoord(key);
+		page.Rendered = false;
+		page.Dirty = false;
+		page.LastRequested = mFrame;
+		mMapping[key] = physical;
+	}
+
+	for (UINT i = 0; i < (UINT)mPages.size(); ++i)
+	{
+		const auto& page = mPages[i];
+		if (page.Mapped && page.LastRequested == mFrame && (!page.Rendered || page.Dirty) &&
+			InWindow(page.Level, page.Coord))
+			mPagesToRender.push_back(i);
+	}
+
+	// Unrendered pages cannot be sampled at all, dirty ones are only out of date.
+	std::stable_sort(mPagesToRender.begin(), mPagesToRender.end(), [this](UINT a, UINT b)
+	{
+		const auto& pa = mPages[a];
+		const auto& pb = mPages[b];
+		if (pa.Rendered != pb.Rendered)
+			return !pa.Rendered;
+		return pa.Level > pb.Level;
+	});
+	if (mPagesToRender.size() > maxRenders)
+		mPagesToRender.resize(maxRenders);
+
+	for (UINT i : mPagesToRender)
+	{
+		mPages[i].Rendered = true;
+		mPages[i].Dirty = false;
+	}
+}
+
+const std::vector<UINT>& VirtualShadowPages::PagesToRender()const
+{
+	return mPagesToRender;
+}
+
+void VirtualShadowPages::Invalidate(const BoundingBox& boundsL)
+{
+	// Depth along the light does not matter: a caster anywhere over a page shadows it.
+	float minX = boundsL.Center.x - boundsL.Extents.x;
+	float maxX = boundsL.Center.x + boundsL.Extents.x;
+	float minY = boundsL.Center.y - boundsL.Extents.y;
+	float maxY = boundsL.Center.y + boundsL.Extents.y;
+
+	for (auto& page : mPages)
+	{
+		if (!page.Mapped || !page.Rendered)
+			continue;
+
+		XMFLOAT4 rect = PageBounds(page.Level, page.Coord);
+		if (rect.x < maxX && minX < rect.z && rect.y < maxY && minY < rect.w)
+			page.Dirty = true;
+	}
+}
+
+void VirtualShadowPages::InvalidateAll()
+{
+	for (auto& page : mPages)
+		page.Dirty = page.Mapped && page.Rendered;
+}
+
+void VirtualShadowPages::BuildPageTable(const XMUINT2& poolOrigin, UINT* table)const
+{
+	std::fill(table, table + PageTableSize, 0u);
+	for (UINT i = 0; i < (UINT)mPages.size(); ++i)
+	{
+		const auto& page = mPages[i];
+		if (!page.Mapped || !page.Rendered)
+			continue;
+
+		if (!InWindow(page.Level, page.Coord))
+			continue;
+
+		int x = page.Coord.x - mLevels[page.Level].Origin.x;
+		int y = page.Coord.y - mLevels[page.Level].Origin.y;
+		XMUINT2 physical = PhysicalPageCoord(i);
+		table[(page.Level * PagesPerLevel + y) * PagesPerLevel + x] =
+			PageValid | (poolOrigin.x + physical.x) | (poolOrigin.y + physical.y) << 15;
+	}
+}
+
+XMFLOAT4 VirtualShadowPages::PageBounds(UINT level, const XMINT2& coord)const
+{
+	// Page rows run along -y.
+	float size = mLevels[level].PageWorldSize;
+	return XMFLOAT4(
+		coord.x * size,
+		-(coord.y + 1) * size,
+		(coord.x + 1) * size,
+		-coord.y * size);
+}
+
+UINT VirtualShadowPages::SelectLevel(float distance, float lodScale)
+{
+	float footprint = distance * lodScale;
+	if (footprint <= 1.0f)
+		return 0;
+
+	return std::min<UINT>((UINT)ceilf(log2f(footprint)), VirtualShadowLevels - 1);
+}
+
+bool VirtualShadowPages::FindPage(const XMFLOAT3& posL, float distance, float lodScale,
+	const VirtualShadowLevel* levels, UINT& entry)
+{
+	for (UINT level = SelectLevel(distance, lodScale); level < VirtualShadowLevels; ++level)
+	{
+		// Multiplies by the reciprocal like the shaders, so both pick the same page.
+		float invPageWorldSize = 1.0f / levels[level].PageWorldSize;
+		int x = (int)floorf(posL.x * invPageWorldSize) - levels[level].Origin.x;
+		int y = (int)floorf(-posL.y * invPageWorldSize) - levels[level].Origin.y;
+		if (x < 0 || y < 0 || x >= (int)PagesPerLevel || y >= (int)PagesPerLevel)
+			continue;
+
+		entry = (level * PagesPerLevel + y) * PagesPerLevel + x;
+		return true;
+	}
+	return false;
+}
+
+// Row vector times matrix, as mul(v, M) in the shaders with M not transposed.
+static void TransformPoint(const float v[4], const XMFLOAT4X4& m, float out[4])
+{
+	for (int c = 0; c < 4; ++c)
+		out[c] = v[0] * m.m[0][c] + v[1] * m.m[1][c] + v[2] * m.m[2][c] + v[3] * m.m[3][c];
+}
+
+void VirtualShadowPages::MarkPagesOnCpu(const float* depth, UINT width, UINT height,
+	const XMFLOAT4X4& invViewProj, const XMFLOAT4X4& lightView,
+	const XMFLOAT3& eyePosW, float lodScale, const VirtualShadowLevel* levels,
+	UINT* requestBits)
+{
+	for (UINT y = 0; y < height; ++y)
+	{
+		for (UINT x = 0; x < width; ++x)
+		{
+			// Far plane means nothing was drawn there.
+			float d = depth[y * width + x];
+			if (d >= 1.0f)
+				continue;
+
+			float u = (x + 0.5f) / width;
+			float v = (y + 0.5f) / height;
+			float ndc[4] = { 2.0f * u - 1.0f, 1.0f - 2.0f * v, d, 1.0f };
+			float posW[4];
+			TransformPoint(ndc, invViewProj, posW);
+			posW[0] /= posW[3];
+			posW[1] /= posW[3];
+			posW[2] /= posW[3];
+			posW[3] = 1.0f;
+
+			float dx = posW[0] - eyePosW.x;
+			float dy = posW[1] - eyePosW.y;
+			float dz = posW[2] - eyePosW.z;
+			float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+
+			float posL[4];
+			TransformPoint(posW, lightView, posL);
+
+			UINT entry;
+			if (FindPage(XMFLOAT3(posL[0], posL[1], posL[2]), distance, lodScale, levels, entry))
+				requestBits[entry / 32] |= 1u << (entry % 32);
+		}
+	}
+}
+
+UINT64 VirtualShadowPages::PageKey(UINT level, const XMINT2& coord)
+{
+	// 24 bits of each coordinate, which PageCoord sign extends back.
+	return (UINT64)level << 48 | (UINT64)((UINT)coord.x & 0xffffff) << 24 | (UINT64)((UINT)coord.y & 0xffffff);
+}
+
+XMINT2 VirtualShadowPages::PageCoord(UINT64 key)
+{
+	int x = (int)((key >> 24) & 0xffffff);
+	int y = (int)(key & 0xffffff);
+	return XMINT2(x >= 0x800000 ? x - 0x1000000 : x, y >= 0x800000 ? y - 0x1000000 : y);
+}
+
+bool VirtualShadowPages::InWindow(UINT level, const XMINT2& coord)const
+{
+	int x = coord.x - mLevels[level].Origin.x;
+	int y = coord.y - mLevels[level].Origin.y;
+	return x >= 0 && y >= 0 && x < (int)PagesPerLevel && y < (int)PagesPerLevel;
+}
+
+void VirtualShadowPages::Unmap(UINT physical)
+{
+	auto& page = mPages[physical];
+	if (page.Mapped)
+		mMapping.erase(PageKey(page.Level, page.Coord));
+	page.Mapped = false;
+	page.Rendered = false;
+	page.Dirty = false;
+}
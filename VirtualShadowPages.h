@@ -0,0 +1,148 @@
+#pragma once
+#include "Common/d3dUtil.h"
+
+// Page table window of one clipmap level.
+struct VirtualShadowLevel
+{
+	// Page at the top left of the window.  Pages are counted from the light view
+	// origin in pages of this level, x along light space +x and y along -y, so they
+	// run the same way as texture coordinates.
+	DirectX::XMINT2 Origin = { 0, 0 };
+	// World size of one page of this level.
+	float PageWorldSize = 1.0f;
+};
+
+// A physical page of the pool and the virtual page it holds, if any.
+struct VirtualShadowPage
+{
+	bool Mapped = false;
+	UINT Level = 0;
+	// Virtual page, counted from the light view origin like VirtualShadowLevel::Origin.
+	DirectX::XMINT2 Coord = { 0, 0 };
+	// The page holds depth rendered for Coord and may be sampled.
+	bool Rendered = false;
+	// A caster over the page moved since it was rendered.
+	bool Dirty = false;
+	// Update() call that last found the page requested.
+	UINT64 LastRequested = 0;
+};
+
+///<summary>
+/// Page bookkeeping of a virtual shadow map: a clipmap of VirtualShadowLevels
+/// levels, each a window of VirtualShadowPagesPerLevel^2 pages around the camera,
+/// with every level twice the extent of the one before.  Only pages the visible
+/// samples request are given one of the physical pages of the pool, and a page is
+/// re-rendered only when it is new or a caster over it moved.  Pages no longer
+/// requested keep their depth until their physical page is needed elsewhere.
+/// Pure bookkeeping; the pool lives in a tile of the shadow atlas.
+///</summary>
+class VirtualShadowPages
+{
+public:
+	// Texels along each side of a page.
+	static const UINT PageSize = 128;
+	static const UINT PagesPerLevel = VirtualShadowPagesPerLevel;
+	// Entries of the page table: the windows of all levels one after another, row by row.
+	static const UINT PageTableSize = VirtualShadowLevels * PagesPerLevel * PagesPerLevel;
+	// Request bits come 32 to a uint, one per page table entry.
+	static const UINT RequestWordCount = PageTableSize / 32;
+	// Set in the page table entries of rendered pages.  The low bits hold the
+	// physical page in pages of the atlas, as x | y << 15.
+	static const UINT PageValid = 0x80000000;
+
+	VirtualShadowPages() = default;
+	VirtualShadowPages(const VirtualShadowPages& rhs) = delete;
+	VirtualShadowPages& operator=(const VirtualShadowPages& rhs) = delete;
+	~VirtualShadowPages() = default;
+
+	// Gives the pool poolPagesPerSide^2 physical pages and forgets every mapping.
+	void Reset(UINT poolPagesPerSide);
+	UINT PhysicalPageCount()const;
+	const std::vector<VirtualShadowPage>& PhysicalPages()const;
+	// Position of a physical page in the pool, in pages.
+	DirectX::XMUINT2 PhysicalPageCoord(UINT physical)const;
+
+	///<summary>
+	/// Level 0 spans extent world units; each further level doubles it.  Centres
+	/// every window on eyePosL, the eye in light view space, snapped to whole pages
+	/// so pages keep their depth while the camera moves.  A new extent changes every
+	/// page, so it drops all mappings.
+	///</summary>
+	void SetClipmap(float extent, const DirectX::XMFLOAT3& eyePosL);
+	const VirtualShadowLevel* Levels()const;
+
+	///<summary>
+	/// Replaces the requested pages with the ones set in requestBits, one bit per
+	/// page table entry of the windows in levels, which are the ones the requests
+	/// were marked with.
+	///</summary>
+	void Request(const UINT* requestBits, const VirtualShadowLevel* levels);
+	UINT RequestedPageCount()const;
+
+	///<summary>
+	/// Maps the requested pages that have no physical page, coarse levels first as
+	/// the finer ones fall back to them, taking free pages and then the ones
+	/// requested longest ago.  Requests the pool has no room for stay unmapped.
+	/// Then picks up to maxRenders requested pages that are new or dirty to render
+	/// this frame, new and coarse ones first, and treats them as rendered.
+	///</summary>
+	void Update(UINT maxRenders);
+	// Physical pages picked by the last Update().
+	const std::vector<UINT>& PagesToRender()const;
+
+	// Marks the pages under a light view space box as dirty.
+	void Invalidate(const DirectX::BoundingBox& boundsL);
+	void InvalidateAll();
+
+	// Fills the PageTableSize entries of the current windows; poolOrigin is the pool's
+	// top left in pages of the atlas.
+	void BuildPageTable(const DirectX::XMUINT2& poolOrigin, UINT* table)const;
+
+	// Light view space rectangle of a virtual page as (minX, minY, maxX, maxY).
+	DirectX::XMFLOAT4 PageBounds(UINT level, const DirectX::XMINT2& coord)const;
+
+	///<summary>
+	/// Level whose texels are no bigger than the pixel footprint at distance from
+	/// the eye.  lodScale is the footprint per unit distance divided by the texel
+	/// size of level 0.
+	///</summary>
+	static UINT SelectLevel(float distance, float lodScale);
+
+	///<summary>
+	/// Page table entry a light view space point samples: the level SelectLevel
+	/// picks, or the first coarser one whose window holds the point.  Returns false
+	/// past the last window.  Mirrors CalcVirtualShadowFactor and VirtualShadowMark.hlsl.
+	///</summary>
+	static bool FindPage(const DirectX::XMFLOAT3& posL, float distance, float lodScale,
+		const VirtualShadowLevel* levels, UINT& entry);
+
+	///<summary>
+	/// CPU reference of VirtualShadowMark.hlsl.  depth holds width*height depth
+	/// buffer values; invViewProj maps NDC to world space and lightView world to
+	/// light view space (neither transposed).  Sets the bit of every page a sample
+	/// needs in requestBits, which holds RequestWordCount uints.
+	///</summary>
+	static void MarkPagesOnCpu(const float* depth, UINT width, UINT height,
+		const DirectX::XMFLOAT4X4& invViewProj, const DirectX::XMFLOAT4X4& lightView,
+		const DirectX::XMFLOAT3& eyePosW, float lodScale, const VirtualShadowLevel* levels,
+		UINT* requestBits);
+
+private:
+	static UINT64 PageKey(UINT level, const DirectX::XMINT2& coord);
+	static DirectX::XMINT2 PageCoord(UINT64 key);
+	// The virtual page lies in the current window of its level.
+	bool InWindow(UINT level, const DirectX::XMINT2& coord)const;
+	void Unmap(UINT physical);
+
+private:
+	UINT mPoolPagesPerSide = 0;
+	float mExtent = 0.0f;
+	VirtualShadowLevel mLevels[VirtualShadowLevels];
+
+	std::vector<VirtualShadowPage> mPages;
+	// Physical page of each mapped virtual page.
+	std::unordered_map<UINT64, UINT> mMapping;
+	std::vector<UINT64> mRequested;
+	std::vector<UINT> mPagesToRender;
+	UINT64 mFrame = 0;
+};